@@ -100,6 +100,31 @@ def run_pair_filter():
     args = sys.argv[1:] if len(sys.argv) > 1 else []
     run_script('4_pair_and_filter_clones.py', args)
 
+def run_cohort_overlap():
+    """Entry point for pairtcr-cohort-overlap command"""
+    args = sys.argv[1:] if len(sys.argv) > 1 else []
+    run_script('cohort_overlap', args)
+
+def run_clonedb():
+    """Entry point for pairtcr-clonedb command"""
+    args = sys.argv[1:] if len(sys.argv) > 1 else []
+    run_script('clonedb', args)
+
+def run_quicklook():
+    """Entry point for pairtcr-quicklook command"""
+    args = sys.argv[1:] if len(sys.argv) > 1 else []
+    run_script('quicklook', args)
+
+def run_vjassign():
+    """Entry point for pairtcr-vjassign command"""
+    args = sys.argv[1:] if len(sys.argv) > 1 else []
+    run_script('vjassign', args)
+
+def run_umi_hopping():
+    """Entry point for pairtcr-umi-hopping command"""
+    args = sys.argv[1:] if len(sys.argv) > 1 else []
+    run_script('umi_hopping', args)
+
 def main():
     """Main entry point for pairtcr command"""
     parser = argparse.ArgumentParser(
@@ -111,6 +136,11 @@ Available commands:
   pairtcr-preprocess    Preprocess and trim FASTQ files  
   pairtcr-umi-pairs     Create UMI pairs
   pairtcr-pair-filter   Pair and filter clones
+  pairtcr-cohort-overlap  Clone sharing across many samples (C, built with make)
+  pairtcr-clonedb       Index and query CDR3 pairs across runs (C, built with make)
+  pairtcr-quicklook     Paired CDR3 estimate without MiXCR (C, built with make)
+  pairtcr-vjassign      Native V/J and CDR3 assignment in MiXCR export format (C, built with make)
+  pairtcr-umi-hopping   Index hopping between samples' UMI indexes (C, built with make)
 
 Examples:
   pairtcr --version
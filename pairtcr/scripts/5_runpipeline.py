@@ -14,6 +14,10 @@ DEFAULT_INPUT_DIR = "raw"
 DEFAULT_PREFIX = "TCR_TSO_18"
 DEFAULT_READ_LIMIT = 100000
 DEFAULT_THREADS = 90
+DEFAULT_ABORT_AFTER = 200000
+
+# Exit status of the C preprocessor when its early-abort rule judges the library failed
+EXIT_LIBRARY_FAILED = 3
 
 # Detect MiXCR JAR in scripts directory by default
 DEFAULT_MIXCR_JAR = os.path.join("scripts", "mixcr.jar")
@@ -50,7 +54,10 @@ def get_scripts_directory():
     return "scripts"
 
 class PipelineRunner:
-    def __init__(self, input_dir, output_root, prefix, read_limit, threads, mixcr_jar, force_restart=False, use_c_version=True):
+    def __init__(self, input_dir, output_root, prefix, read_limit, threads, mixcr_jar, force_restart=False, use_c_version=True,
+                 abort_below=0, abort_after=DEFAULT_ABORT_AFTER, chain_reference=None,
+                 quick_look_reference=None, native_vj_reference=None, dedup=False,
+                 min_family_size=1, chimera_ratio=0, optical_distance=0, merge_overlaps=False):
         self.input_dir = input_dir
         self.output_root = output_root
         self.prefix = prefix
@@ -59,6 +66,17 @@ class PipelineRunner:
         self.mixcr_jar = mixcr_jar
         self.force_restart = force_restart
         self.use_c_version = use_c_version
+        self.abort_below = abort_below
+        self.abort_after = abort_after
+        self.chain_reference = chain_reference
+        self.quick_look_reference = quick_look_reference
+        self.native_vj_reference = native_vj_reference
+        self.dedup = dedup
+        self.min_family_size = min_family_size
+        self.chimera_ratio = chimera_ratio
+        self.optical_distance = optical_distance
+        self.merge_overlaps = merge_overlaps
+        self.library_failed = False
         
         # Get the correct scripts directory
         self.scripts_dir = get_scripts_directory()
@@ -69,11 +87,17 @@ class PipelineRunner:
         self.matched_fastq_output = os.path.join(output_root, "matched_fastq_output")
         self.step3_output = os.path.join(output_root, "3_run_mixcr_and_export_output")
         self.step4_output = os.path.join(output_root, "4_pair_and_filter_clones_output")
+        self.quicklook_output = os.path.join(output_root, "quicklook_output")
         self.logs_output = os.path.join(output_root, "logs")
         
         # Define key output files
         self.umi_pairs_file = os.path.join(self.step2_output, "umi_pairs.tsv")
+        self.family_sizes_file = os.path.join(self.step2_output, "umi_pairs_family_sizes.tsv")
+        self.optical_dups_file = os.path.join(self.step1_output, f"{self.prefix}.optical_dups.tsv")
+        self.abort_report = os.path.join(self.step1_output, f"{self.prefix}.abort.json")
         self.final_output = os.path.join(self.step4_output, "final_paired_clones_filtered.tsv")
+        self.diversity_report = os.path.join(self.step4_output, "final_paired_clones_filtered_diversity.tsv")
+        self.quicklook_file = os.path.join(self.quicklook_output, f"{self.prefix}.quicklook.tsv")
         
         # Setup logging
         self.setup_logging()
@@ -82,7 +106,7 @@ class PipelineRunner:
         self.step_markers = {
             'step1': os.path.join(self.step1_output, f"{self.prefix}_TRA_1.fq.gz"),
             'step2': self.umi_pairs_file,
-            'step2.5': os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_TRA_matched_1.fq.gz"),
+            'step2.5': os.path.join(self.matched_fastq_output, f"{self.prefix}_matched.done"),
             'step3': os.path.join(self.step3_output, "TRA_alignments_export_with_headers.tsv"),
             'step4': self.final_output
         }
@@ -104,7 +128,8 @@ class PipelineRunner:
             'step2': os.path.join(self.logs_output, f"step2_umi_pairs_{timestamp}.log"),
             'step2.5': os.path.join(self.logs_output, f"step2.5_matched_fastq_{timestamp}.log"),
             'step3': os.path.join(self.logs_output, f"step3_mixcr_{timestamp}.log"),
-            'step4': os.path.join(self.logs_output, f"step4_pair_filter_{timestamp}.log")
+            'step4': os.path.join(self.logs_output, f"step4_pair_filter_{timestamp}.log"),
+            'quicklook': os.path.join(self.logs_output, f"quicklook_{timestamp}.log")
         }
         
         # Configure main logger
@@ -126,6 +151,10 @@ class PipelineRunner:
             return False
         
         marker_file = self.step_markers[step_key]
+        # An early abort still writes the step 1 outputs, marker included
+        if step_key == 'step1' and os.path.exists(self.abort_report):
+            self.logger.info(f"Step step1 not completed. The library failed the early-abort check: {self.abort_report}")
+            return False
         completed = os.path.exists(marker_file) and os.path.getsize(marker_file) > 0
         
         if completed:
@@ -156,7 +185,8 @@ class PipelineRunner:
             self.step2_output,
             self.matched_fastq_output,
             self.step3_output,
-            self.step4_output
+            self.step4_output,
+            self.quicklook_output
         ]
         
         for cleanup_dir in cleanup_dirs:
@@ -171,8 +201,9 @@ class PipelineRunner:
         
         self.logger.info("Cleanup completed")
 
-    def run_command(self, cmd, step_name, shell=False, step_key=None, show_progress=True):
-        """Run a command and handle errors."""
+    def run_command(self, cmd, step_name, shell=False, step_key=None, show_progress=True, abort_code=None):
+        """Run a command and handle errors. abort_code is a return code meaning the
+        input is unusable rather than that the step broke; it returns False."""
         self.logger.info(f"Starting {step_name}")
         self.logger.info(f"Command: {' '.join(cmd) if isinstance(cmd, list) else cmd}")
         
@@ -201,7 +232,6 @@ class PipelineRunner:
                 # Show output on console (for progress bars) and also log to file
                 if log_file:
                     # Use tee-like behavior: show on console and save to log
-                    import subprocess
                     if shell:
                         process = subprocess.Popen(cmd, shell=True, stdout=subprocess.PIPE, 
                                                  stderr=subprocess.STDOUT, universal_newlines=True)
@@ -238,6 +268,14 @@ class PipelineRunner:
             print(f"{step_name} completed successfully.")
             return True
         except subprocess.CalledProcessError as e:
+            if abort_code is not None and e.returncode == abort_code:
+                self.library_failed = True
+                warn_msg = f"{step_name} aborted early: the library looks failed (return code {e.returncode})"
+                self.logger.warning(warn_msg)
+                print(f"Warning: {warn_msg}")
+                if log_file:
+                    print(f"Check log file for details: {log_file}")
+                return False
             error_msg = f"{step_name} failed with return code {e.returncode}"
             self.logger.error(error_msg)
             self.logger.error(f"Command that failed: {' '.join(cmd) if isinstance(cmd, list) else cmd}")
@@ -258,6 +296,8 @@ class PipelineRunner:
         if self.check_step_completion('step1'):
             print(f"Step 1: Preprocess and Trim ({version_info}) - SKIPPED (already completed)")
             return True
+        if os.path.exists(self.abort_report):
+            os.remove(self.abort_report)
         
         if self.use_c_version:
             # Use C version
@@ -267,13 +307,21 @@ class PipelineRunner:
                 print("Please compile the C version first by running 'make' in the scripts directory")
                 return False
             
+            # The C preprocessor splits the shared --threads budget between its
+            # inflate and worker stages after a short calibration run
             cmd = [
                 c_executable,
                 self.input_dir,
                 "-n", str(self.read_limit),
                 "-o", self.prefix,
-                "-d", self.step1_output
+                "-d", self.step1_output,
+                "--threads", str(self.threads),
+                "--autotune"
             ]
+            if self.abort_below > 0:
+                cmd += ["--abort-below", str(self.abort_below), "--abort-after", str(self.abort_after)]
+            if self.optical_distance > 0:
+                cmd += ["--optical-dups", str(self.optical_distance)]
             step_name = "Step 1: Preprocess and Trim (C version)"
         else:
             # Use Python version
@@ -286,8 +334,12 @@ class PipelineRunner:
                 "-d", self.step1_output
             ]
             step_name = "Step 1: Preprocess and Trim (Python version)"
+            if self.abort_below > 0:
+                self.logger.warning("--abort-below is only supported by the C preprocessor; ignored")
+            if self.optical_distance > 0:
+                self.logger.warning("--optical-dups is only supported by the C preprocessor; ignored")
         
-        return self.run_command(cmd, step_name, step_key='step1')
+        return self.run_command(cmd, step_name, step_key='step1', abort_code=EXIT_LIBRARY_FAILED)
 
     def step2_create_umi_pairs(self):
         """Step 2: Create UMI pairs."""
@@ -305,9 +357,30 @@ class PipelineRunner:
             "python3", script_path,
             "-i", self.step1_output,
             "-p", self.prefix,
-            "-o", self.umi_pairs_file
+            "-o", self.umi_pairs_file,
+            "--min-family-size", str(self.min_family_size)
         ]
-        return self.run_command(cmd, "Step 2: Create UMI Pairs", step_key='step2')
+        if self.optical_distance > 0:
+            if os.path.exists(self.optical_dups_file):
+                cmd += ["--optical-dups", self.optical_dups_file]
+            else:
+                self.logger.warning(f"No optical duplicate table at {self.optical_dups_file}; "
+                                    "step 1 ran without --optical-dups")
+        if not self.run_command(cmd, "Step 2: Create UMI Pairs", step_key='step2'):
+            return False
+        self._log_family_sizes()
+        return True
+
+    def _log_family_sizes(self):
+        """Copy the step 2 family-size histogram into the main pipeline log."""
+        if not os.path.exists(self.family_sizes_file):
+            return
+        self.logger.info(f"UMI family sizes (min family size {self.min_family_size}):")
+        with open(self.family_sizes_file) as f:
+            next(f, None)
+            for line in f:
+                chain, size, umis, reads = line.rstrip('\n').split('\t')
+                self.logger.info(f"  {chain} family size {size}: {umis} UMIs, {reads} reads")
 
     def step2_5_create_matched_fastq(self):
         """Step 2.5: Create matched FASTQ files from UMI pairs."""
@@ -359,8 +432,12 @@ class PipelineRunner:
         tra_r1_out = os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_TRA_matched_1.fq.gz")
         tra_r2_out = os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_TRA_matched_2.fq.gz")
         
-        self._filter_fastq_by_read_ids(tra_r1_in, tra_r1_out, tra_read_ids, "TRA R1")
-        self._filter_fastq_by_read_ids(tra_r2_in, tra_r2_out, tra_read_ids, "TRA R2")
+        if self.chain_reference:
+            if not self._run_chain_filter("TRA", tra_read_ids, tra_r1_in, tra_r2_in, tra_r1_out, tra_r2_out):
+                return False
+        else:
+            self._filter_fastq_by_read_ids(tra_r1_in, tra_r1_out, tra_read_ids, "TRA R1")
+            self._filter_fastq_by_read_ids(tra_r2_in, tra_r2_out, tra_read_ids, "TRA R2")
         
         # Process TRB files
         trb_r1_in = os.path.join(self.step1_output, f"{self.prefix}_TRB_1.fq.gz")
@@ -368,8 +445,32 @@ class PipelineRunner:
         trb_r1_out = os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_TRB_matched_1.fq.gz")
         trb_r2_out = os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_TRB_matched_2.fq.gz")
         
-        self._filter_fastq_by_read_ids(trb_r1_in, trb_r1_out, trb_read_ids, "TRB R1")
-        self._filter_fastq_by_read_ids(trb_r2_in, trb_r2_out, trb_read_ids, "TRB R2")
+        if self.chain_reference:
+            if not self._run_chain_filter("TRB", trb_read_ids, trb_r1_in, trb_r2_in, trb_r1_out, trb_r2_out):
+                return False
+        else:
+            self._filter_fastq_by_read_ids(trb_r1_in, trb_r1_out, trb_read_ids, "TRB R1")
+            self._filter_fastq_by_read_ids(trb_r2_in, trb_r2_out, trb_read_ids, "TRB R2")
+        
+        for chain in ("TRA", "TRB"):
+            if self.dedup:
+                if not self._run_dedup(chain):
+                    return False
+            elif os.path.exists(self._dups_file(chain)):
+                # Left by an earlier --dedup run; step 4 would add its copies a second time
+                os.remove(self._dups_file(chain))
+        
+        for chain in ("TRA", "TRB"):
+            if self.merge_overlaps:
+                if not self._run_merge(chain):
+                    return False
+            elif os.path.exists(self._merged_file(chain)):
+                # Left by an earlier --merge-overlaps run; its pairs are back in the matched files
+                os.remove(self._merged_file(chain))
+        
+        # Written last: the matched files exist before dedup and merging have run
+        with open(self.step_markers['step2.5'], 'w') as f:
+            f.write(f"dedup={int(self.dedup)}\tmerge_overlaps={int(self.merge_overlaps)}\n")
         
         print("Step 2.5: Create Matched FASTQ Files completed successfully.")
         step_logger.info("Step 2.5: Create Matched FASTQ Files completed successfully.")
@@ -381,6 +482,118 @@ class PipelineRunner:
         
         return True
 
+    def _run_chain_filter(self, chain, target_read_ids, r1_in, r2_in, r1_out, r2_out):
+        """Extract the matched reads with the C chain filter, which also drops
+        pairs whose reference k-mers belong to the other chain."""
+        c_executable = os.path.join(self.scripts_dir, "chain_filter")
+        if not os.path.exists(c_executable):
+            print(f"Error: chain_filter executable not found at {c_executable}")
+            print("Please compile it first by running 'make' in the scripts directory")
+            return False
+        
+        ids_file = os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_{chain}_read_ids.txt")
+        with open(ids_file, 'w') as f:
+            for read_id in target_read_ids:
+                f.write(f"{read_id}\n")
+        
+        rejected = os.path.join(self.matched_fastq_output, f"{self.prefix}_cross_chain_{chain}")
+        cmd = [
+            c_executable,
+            "--reference", self.chain_reference,
+            "--chain", chain,
+            "--ids", ids_file,
+            "--rejected", rejected,
+            r1_in, r2_in, r1_out, r2_out
+        ]
+        return self.run_command(cmd, f"Step 2.5: Chain filter ({chain})")
+
+    def _run_dedup(self, chain):
+        """Collapse exact duplicate read pairs in the matched FASTQ so step 3 aligns
+        each distinct pair once; step 4 restores the copies from the members table."""
+        c_executable = os.path.join(self.scripts_dir, "dedup_pairs")
+        if not os.path.exists(c_executable):
+            print(f"Error: dedup_pairs executable not found at {c_executable}")
+            print("Please compile it first by running 'make' in the scripts directory")
+            return False
+        
+        matched = [os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_{chain}_matched_{m}.fq.gz")
+                   for m in (1, 2)]
+        collapsed = [os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_{chain}_dedup_{m}.fq.gz")
+                     for m in (1, 2)]
+        cmd = [
+            c_executable,
+            "--members", self._dups_file(chain),
+            matched[0], matched[1], collapsed[0], collapsed[1]
+        ]
+        if not self.run_command(cmd, f"Step 2.5: Collapse duplicate read pairs ({chain})"):
+            return False
+        for src, dst in zip(collapsed, matched):
+            os.replace(src, dst)
+        return True
+
+    def _dups_file(self, chain):
+        return os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_{chain}.dups.tsv")
+
+    def _run_merge(self, chain):
+        """Merge overlapping mates of short inserts into single reads; the pairs left
+        unmerged replace the matched FASTQ and step 3 aligns the merged reads separately."""
+        c_executable = os.path.join(self.scripts_dir, "merge_pairs")
+        if not os.path.exists(c_executable):
+            print(f"Error: merge_pairs executable not found at {c_executable}")
+            print("Please compile it first by running 'make' in the scripts directory")
+            return False
+        
+        matched = [os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_{chain}_matched_{m}.fq.gz")
+                   for m in (1, 2)]
+        unmerged = [os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_{chain}_unmerged_{m}.fq.gz")
+                    for m in (1, 2)]
+        cmd = [c_executable, matched[0], matched[1], self._merged_file(chain), unmerged[0], unmerged[1]]
+        if not self.run_command(cmd, f"Step 2.5: Merge overlapping mates ({chain})"):
+            return False
+        for src, dst in zip(unmerged, matched):
+            os.replace(src, dst)
+        return True
+
+    def _merged_file(self, chain):
+        return os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_{chain}_merged.fq.gz")
+
+    def _has_merged_reads(self, chain):
+        import gzip
+        path = self._merged_file(chain)
+        if not self.merge_overlaps or not os.path.exists(path):
+            return False
+        with gzip.open(path, 'rt') as f:
+            return f.readline() != ''
+
+    def _mixcr_merged_section(self):
+        """MiXCR commands for the overlap-merged reads of each chain, single-end, with
+        their alignments appended to the chain's export."""
+        section = ""
+        for chain in ("TRA", "TRB"):
+            if not self._has_merged_reads(chain):
+                continue
+            section += f"""
+# --------------------- {chain} merged reads ---------------------
+echo "[MiXCR] {chain} overlap-merged reads"
+$MIXCR_CALL analyze amplicon \
+  -s hsa \
+  --starting-material RNA \
+  --5-end no-v-primers \
+  --3-end j-primers \
+  --adapters no-adapters \
+  --report "$OUTPUT_DIR/{chain}_merged_analyze.report.log" \
+  -t $THREADS \
+  --align "-OsaveOriginalReads=true" \
+  "{self._merged_file(chain)}" \
+  "$OUTPUT_DIR/{chain}_merged.vdjca"
+
+$MIXCR_CALL exportAlignments -f -descrsR1 -vGene -jGene -nFeature CDR3 -aaFeature CDR3 \
+  "$OUTPUT_DIR/{chain}_merged.vdjca" \
+  "$OUTPUT_DIR/{chain}_merged_alignments_export.tsv"
+tail -n +2 "$OUTPUT_DIR/{chain}_merged_alignments_export.tsv" >> "$OUTPUT_DIR/{chain}_alignments_export_partial.tsv"
+"""
+        return section
+
     def _filter_fastq_by_read_ids(self, input_file, output_file, target_read_ids, file_desc):
         """Filter FASTQ file to keep only reads with IDs in target_read_ids."""
         import re
@@ -440,6 +653,9 @@ class PipelineRunner:
             print("Step 3: Run MiXCR - SKIPPED (already completed)")
             return True
         
+        if self.native_vj_reference:
+            return self._run_native_vj()
+        
         # Determine how to call MiXCR (jar vs executable)
         if str(self.mixcr_jar).endswith('.jar'):
             mixcr_call = f"java -jar \"{self.mixcr_jar}\""
@@ -531,12 +747,15 @@ $MIXCR_CALL assemble \
 echo "[MiXCR] Export alignments"
 $MIXCR_CALL exportAlignments -f -descrsR1 -vGene -jGene -nFeature CDR3 -aaFeature CDR3 \
   "$OUTPUT_DIR/TRA.vdjca" \
-  "$OUTPUT_DIR/TRA_alignments_export_with_headers.tsv"
+  "$OUTPUT_DIR/TRA_alignments_export_partial.tsv"
 
 $MIXCR_CALL exportAlignments -f -descrsR1 -vGene -jGene -nFeature CDR3 -aaFeature CDR3 \
   "$OUTPUT_DIR/TRB.vdjca" \
-  "$OUTPUT_DIR/TRB_alignments_export_with_headers.tsv"
-
+  "$OUTPUT_DIR/TRB_alignments_export_partial.tsv"
+{self._mixcr_merged_section()}
+# The TRA export is the step 3 completion marker: move it into place last
+mv "$OUTPUT_DIR/TRB_alignments_export_partial.tsv" "$OUTPUT_DIR/TRB_alignments_export_with_headers.tsv"
+mv "$OUTPUT_DIR/TRA_alignments_export_partial.tsv" "$OUTPUT_DIR/TRA_alignments_export_with_headers.tsv"
 echo "--- MiXCR Analysis and Export Steps Completed ---"
 """
         
@@ -557,6 +776,42 @@ echo "--- MiXCR Analysis and Export Steps Completed ---"
             if os.path.exists(script_path):
                 os.remove(script_path)
 
+    def _run_native_vj(self):
+        """Step 3 without MiXCR: the C V/J assigner writes the alignment exports step 4 reads."""
+        c_executable = os.path.join(self.scripts_dir, "vjassign")
+        if not os.path.exists(c_executable):
+            print(f"Error: vjassign executable not found at {c_executable}")
+            print("Please compile it first by running 'make' in the scripts directory")
+            return False
+        
+        os.makedirs(self.step3_output, exist_ok=True)
+        partial = {chain: os.path.join(self.step3_output, f"{chain}_alignments_export_partial.tsv")
+                   for chain in ("TRA", "TRB")}
+        for chain in ("TRB", "TRA"):
+            cmd = [
+                c_executable,
+                "--reference", self.native_vj_reference,
+                "--chain", chain,
+                "--threads", str(self.threads),
+                os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_{chain}_matched_1.fq.gz"),
+                os.path.join(self.matched_fastq_output, f"{self.prefix}_matched_{chain}_matched_2.fq.gz"),
+                partial[chain]
+            ]
+            if not self.run_command(cmd, f"Step 3: Native V/J Assignment ({chain})"):
+                return False
+            if self._has_merged_reads(chain):
+                merged_export = os.path.join(self.step3_output, f"{chain}_merged_alignments_export.tsv")
+                cmd = cmd[:-3] + [self._merged_file(chain), "-", merged_export]
+                if not self.run_command(cmd, f"Step 3: Native V/J Assignment ({chain} merged reads)"):
+                    return False
+                with open(merged_export) as src, open(partial[chain], 'a') as dst:
+                    next(src, None)
+                    shutil.copyfileobj(src, dst)
+        # TRA last: its export is the step 3 completion marker
+        for chain in ("TRB", "TRA"):
+            os.replace(partial[chain], os.path.join(self.step3_output, f"{chain}_alignments_export_with_headers.tsv"))
+        return True
+
     def step4_pair_and_filter(self):
         """Step 4: Pair and filter clones."""
         self.logger.info("="*50)
@@ -577,10 +832,77 @@ echo "--- MiXCR Analysis and Export Steps Completed ---"
             "--umi-pairs", self.umi_pairs_file,
             "--tra-export", tra_export,
             "--trb-export", trb_export,
-            "-o", self.final_output
+            "-o", self.final_output,
+            "--threads", str(self.threads)
         ]
+        if self.dedup:
+            for chain in ("TRA", "TRB"):
+                if os.path.exists(self._dups_file(chain)):
+                    cmd += [f"--{chain.lower()}-dups", self._dups_file(chain)]
+                else:
+                    self.logger.warning(f"No {chain} members table: step 2.5 ran without --dedup")
+        if self.chimera_ratio > 0:
+            cmd += ["--chimera-ratio", str(self.chimera_ratio)]
+        # Step 4 writes no report for an empty result; drop one from an earlier run
+        if os.path.exists(self.diversity_report):
+            os.remove(self.diversity_report)
         return self.run_command(cmd, "Step 4: Pair and Filter Clones", step_key='step4')
 
+    def step_quick_look(self):
+        """Quick look: paired clonotype estimate from the step 1 reads, without MiXCR."""
+        self.logger.info("="*50)
+        self.logger.info("QUICK LOOK: Starting paired CDR3 estimate")
+        self.logger.info("="*50)
+        
+        c_executable = os.path.join(self.scripts_dir, "quicklook")
+        if not os.path.exists(c_executable):
+            print(f"Error: quicklook executable not found at {c_executable}")
+            print("Please compile it first by running 'make' in the scripts directory")
+            return False
+        
+        os.makedirs(self.quicklook_output, exist_ok=True)
+        cmd = [
+            c_executable,
+            "--reference", self.quick_look_reference,
+            "--threads", str(self.threads),
+            "-o", os.path.join(self.quicklook_output, self.prefix)
+        ]
+        for chain in ("TRA", "TRB"):
+            for mate in (1, 2):
+                cmd.append(os.path.join(self.step1_output, f"{self.prefix}_{chain}_{mate}.fq.gz"))
+        return self.run_command(cmd, "Quick Look: Paired CDR3 Estimate", step_key='quicklook')
+
+    def run_quick_look(self):
+        """Run step 1 (reusing finished step 1 output) and the quick look instead of steps 2-4."""
+        if self.force_restart:
+            print("\nForce restart requested. Cleaning up all previous results...")
+            self.logger.info("Force restart requested")
+            self.cleanup_incomplete_run()
+        
+        if not self.step1_preprocess_and_trim():
+            if self.library_failed:
+                msg = f"Library failed the step 1 early-abort check; skipping the quick look. Report: {self.abort_report}"
+                self.logger.error(msg)
+                print(f"\n{msg}")
+                sys.exit(EXIT_LIBRARY_FAILED)
+            error_msg = "Step 1 (Preprocess and Trim) failed"
+            self.logger.error(error_msg)
+            print(f"Error: {error_msg}")
+            sys.exit(1)
+        
+        if not self.step_quick_look():
+            error_msg = "Quick look failed"
+            self.logger.error(error_msg)
+            print(f"Error: {error_msg}")
+            sys.exit(1)
+        
+        print("\n" + "="*60)
+        print("QUICK LOOK COMPLETED")
+        print("="*60)
+        print(f"Paired clonotype estimate: {self.quicklook_file}")
+        print("Run without --quick-look for the full MiXCR-based result")
+        self.logger.info(f"Quick look completed. Paired clonotype estimate: {self.quicklook_file}")
+
     def run_pipeline(self):
         """Run the complete pipeline."""
         print("="*60)
@@ -617,8 +939,13 @@ echo "--- MiXCR Analysis and Export Steps Completed ---"
             print(f"Error: {error_msg}")
             sys.exit(1)
         
+        if self.quick_look_reference:
+            os.makedirs(self.output_root, exist_ok=True)
+            self.run_quick_look()
+            return
+        
         # Resolve MiXCR location: accept jar path or fallback to 'mixcr' executable in PATH
-        if not os.path.exists(self.mixcr_jar):
+        if not self.native_vj_reference and not os.path.exists(self.mixcr_jar):
             # Try environment variable first
             env_mixcr = os.environ.get("MIXCR_JAR")
             if env_mixcr and os.path.exists(env_mixcr):
@@ -667,7 +994,11 @@ echo "--- MiXCR Analysis and Export Steps Completed ---"
         
         try:
             # Run all pipeline steps
-            self.step1_preprocess_and_trim()
+            if not self.step1_preprocess_and_trim() and self.library_failed:
+                msg = f"Library failed the step 1 early-abort check; skipping steps 2-4. Report: {self.abort_report}"
+                self.logger.error(msg)
+                print(f"\n{msg}")
+                sys.exit(EXIT_LIBRARY_FAILED)
             self.step2_create_umi_pairs()
             self.step2_5_create_matched_fastq()
             self.step3_run_mixcr()
@@ -695,6 +1026,9 @@ echo "--- MiXCR Analysis and Export Steps Completed ---"
             print(f"  Step 4 outputs: {self.step4_output}")
             print(f"  Logs directory: {self.logs_output}")
             print(f"  Final result: {self.final_output}")
+            print(f"  Family sizes: {self.family_sizes_file}")
+            if os.path.exists(self.diversity_report):
+                print(f"  Diversity report: {self.diversity_report}")
             
             # Log output summary
             self.logger.info("Output Summary:")
@@ -705,6 +1039,9 @@ echo "--- MiXCR Analysis and Export Steps Completed ---"
             self.logger.info(f"  Step 4 outputs: {self.step4_output}")
             self.logger.info(f"  Logs directory: {self.logs_output}")
             self.logger.info(f"  Final result: {self.final_output}")
+            self.logger.info(f"  Family sizes: {self.family_sizes_file}")
+            if os.path.exists(self.diversity_report):
+                self.logger.info(f"  Diversity report: {self.diversity_report}")
             
             # Print log files summary
             print("\nLog Files:")
@@ -740,7 +1077,7 @@ def main():
     parser.add_argument("-n", "--read-limit", type=int, default=DEFAULT_READ_LIMIT,
                         help="Maximum number of read pairs to process")
     parser.add_argument("-t", "--threads", type=int, default=DEFAULT_THREADS,
-                        help="Number of threads for MiXCR")
+                        help="Number of threads for MiXCR and the C preprocessor")
     parser.add_argument("--mixcr-jar", default=DEFAULT_MIXCR_JAR,
                         help="Path to MiXCR JAR file")
     parser.add_argument("--force", action="store_true",
@@ -748,6 +1085,45 @@ def main():
     parser.add_argument("--use-python", action="store_true",
                         help="Use Python version of preprocessor instead of faster C version")
     
+    parser.add_argument("--abort-below", type=float, default=0,
+                        help="Abort after step 1 if fewer than this percentage of read pairs are "
+                             "classified as TRA/TRB (C preprocessor only; 0 = off)")
+    parser.add_argument("--abort-after", type=int, default=DEFAULT_ABORT_AFTER,
+                        help="Read pairs step 1 processes before applying --abort-below")
+    
+    parser.add_argument("--chain-reference", default=None,
+                        help="FASTA of TRA/TRB V, J and C genes; step 2.5 then drops read pairs "
+                             "whose k-mers belong to the other chain before MiXCR (uses chain_filter)")
+    
+    parser.add_argument("--quick-look", metavar="FASTA", default=None,
+                        help="FASTA of TRA/TRB V and J genes; run step 1 and the native CDR3 quick look "
+                             "(uses quicklook) instead of MiXCR and steps 2-4")
+    
+    parser.add_argument("--native-vj", metavar="FASTA", default=None,
+                        help="FASTA of TRA/TRB V and J genes; step 3 assigns V/J and CDR3 with the C "
+                             "vjassign instead of MiXCR (faster, less annotation)")
+    
+    parser.add_argument("--optical-dups", type=int, default=0, metavar="PIXELS",
+                        help="Flag pairs within PIXELS of a pair with the same UMIs on the same tile as optical "
+                             "duplicates in step 1 (C preprocessor only; 100 unpatterned, 2500 patterned flow "
+                             "cells; 0 = off); step 2 leaves them out")
+    
+    parser.add_argument("--min-family-size", type=int, default=1,
+                        help="Step 2 only pairs UMIs seen in at least this many reads on both chains, "
+                             "so singleton families never reach step 2.5 and MiXCR (1 = keep all)")
+    
+    parser.add_argument("--chimera-ratio", type=float, default=0,
+                        help="Step 4 drops TRA-TRB pairs whose TRA or TRB clonotype has another partner with "
+                             "this many times more UMIs (PCR chimeras; listed in *_chimeras.tsv; 0 = off)")
+    
+    parser.add_argument("--dedup", action="store_true",
+                        help="Collapse exact duplicate read pairs after step 2.5 so step 3 aligns each "
+                             "distinct pair once; step 4 restores the copies (uses dedup_pairs)")
+    
+    parser.add_argument("--merge-overlaps", action="store_true",
+                        help="Merge overlapping mates of short inserts after step 2.5; step 3 aligns the "
+                             "merged reads single-end next to the unmerged pairs (uses merge_pairs)")
+    
     args = parser.parse_args()
     
     # Create pipeline runner and execute
@@ -759,7 +1135,17 @@ def main():
         threads=args.threads,
         mixcr_jar=args.mixcr_jar,
         force_restart=args.force,
-        use_c_version=not args.use_python  # Default to C version unless --use-python is specified
+        use_c_version=not args.use_python,  # Default to C version unless --use-python is specified
+        abort_below=args.abort_below,
+        abort_after=args.abort_after,
+        chain_reference=args.chain_reference,
+        quick_look_reference=args.quick_look,
+        native_vj_reference=args.native_vj,
+        dedup=args.dedup,
+        min_family_size=args.min_family_size,
+        chimera_ratio=args.chimera_ratio,
+        optical_distance=args.optical_dups,
+        merge_overlaps=args.merge_overlaps
     )
     
     pipeline.run_pipeline()
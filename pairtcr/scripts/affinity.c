@@ -0,0 +1,71 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+
+#include "affinity.h"
+
+// Parse a sysfs cpulist such as "0-3,8-11" into a CPU set
+static void parse_cpulist(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) break;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET((int)cpu, set);
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+}
+
+void numa_discover(numa_topology_t *topo) {
+    cpu_set_t allowed;
+    memset(topo, 0, sizeof(*topo));
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &allowed);
+    }
+
+    glob_t nodes;
+    if (glob("/sys/devices/system/node/node[0-9]*", 0, NULL, &nodes) == 0) {
+        for (size_t i = 0; i < nodes.gl_pathc && topo->count < MAX_NUMA_NODES; i++) {
+            char path[512], list[4096];
+            snprintf(path, sizeof(path), "%s/cpulist", nodes.gl_pathv[i]);
+            FILE *fp = fopen(path, "r");
+            if (!fp) continue;
+            if (!fgets(list, sizeof(list), fp)) list[0] = '\0';
+            fclose(fp);
+
+            cpu_set_t node_cpus;
+            parse_cpulist(list, &node_cpus);
+            CPU_AND(&node_cpus, &node_cpus, &allowed);
+            int n = CPU_COUNT(&node_cpus);
+            if (n == 0) continue;  // memory-only node or outside our cpuset
+
+            int k = topo->count++;
+            topo->node_ids[k] = atoi(strrchr(nodes.gl_pathv[i], '/') + 5);
+            topo->cpus[k] = node_cpus;
+            topo->cpu_count[k] = n;
+        }
+        globfree(&nodes);
+    }
+
+    if (topo->count == 0) {
+        topo->count = 1;
+        topo->node_ids[0] = 0;
+        topo->cpus[0] = allowed;
+        topo->cpu_count[0] = CPU_COUNT(&allowed);
+    }
+}
+
+int pin_thread_to_node(pthread_t thread, const numa_topology_t *topo, int node) {
+    return pthread_setaffinity_np(thread, sizeof(cpu_set_t), &topo->cpus[node]);
+}
@@ -0,0 +1,21 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <pthread.h>
+
+#define MAX_NUMA_NODES 16
+
+// NUMA nodes usable by this process, restricted to its CPU affinity mask
+typedef struct {
+    int count;
+    int node_ids[MAX_NUMA_NODES];
+    cpu_set_t cpus[MAX_NUMA_NODES];
+    int cpu_count[MAX_NUMA_NODES];
+} numa_topology_t;
+
+// Falls back to a single node holding every allowed CPU when sysfs has no topology
+void numa_discover(numa_topology_t *topo);
+int pin_thread_to_node(pthread_t thread, const numa_topology_t *topo, int node);
+
+#endif
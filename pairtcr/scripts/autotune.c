@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#include "autotune.h"
+#include "gz_members.h"
+#include "sample.h"
+
+#define CALIBRATION_BATCH 2048
+#define CALIBRATION_BATCHES 4
+#define TARGET_BATCH_US 25000.0     // worker time per batch that amortises queue hand-offs
+#define MIN_BATCH_SIZE 256
+#define MAX_BATCH_SIZE 65536
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int read_first_line(const char *path, char *buf, size_t size) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    char *ok = fgets(buf, (int)size, fp);
+    fclose(fp);
+    return ok ? 0 : -1;
+}
+
+// Directory of this process's cgroup v2 node, e.g. /sys/fs/cgroup/system.slice/job.scope
+static int cgroup_v2_dir(char *dir, size_t size) {
+    char line[1024];
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (!fp) return -1;
+    int found = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(dir, size, "/sys/fs/cgroup%s", line + 3);
+            found = 0;
+            break;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+// Read a cgroup control file from our own cgroup, falling back to the root of the mount
+static int read_cgroup_file(const char *v2_name, const char *v1_path, char *buf, size_t size) {
+    char dir[1100], path[1200];
+    if (cgroup_v2_dir(dir, sizeof(dir)) == 0) {
+        snprintf(path, sizeof(path), "%s/%s", dir, v2_name);
+        if (read_first_line(path, buf, size) == 0) return 0;
+    }
+    snprintf(path, sizeof(path), "/sys/fs/cgroup/%s", v2_name);
+    if (read_first_line(path, buf, size) == 0) return 0;
+    return read_first_line(v1_path, buf, size);
+}
+
+int detect_cpu_limit(void) {
+    cpu_set_t allowed;
+    int cpus = 1;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        cpus = CPU_COUNT(&allowed);
+    }
+
+    // cgroup v2 "cpu.max" holds "<quota> <period>" or "max <period>"
+    char buf[256];
+    long long quota = -1, period = 0;
+    if (read_cgroup_file("cpu.max", "/sys/fs/cgroup/cpu/cpu.cfs_quota_us", buf, sizeof(buf)) == 0) {
+        if (strncmp(buf, "max", 3) != 0) {
+            char *end;
+            quota = strtoll(buf, &end, 10);
+            if (*end == ' ') {
+                period = strtoll(end + 1, NULL, 10);
+            } else if (read_first_line("/sys/fs/cgroup/cpu/cpu.cfs_period_us", buf, sizeof(buf)) == 0) {
+                period = strtoll(buf, NULL, 10);
+            }
+        }
+    }
+    if (quota > 0 && period > 0) {
+        int quota_cpus = (int)((quota + period - 1) / period);
+        if (quota_cpus < cpus) cpus = quota_cpus;
+    }
+    return cpus > 0 ? cpus : 1;
+}
+
+long long detect_memory_limit(void) {
+    long long limit = -1;
+    char buf[256];
+
+    if (read_cgroup_file("memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes", buf, sizeof(buf)) == 0 &&
+        strncmp(buf, "max", 3) != 0) {
+        long long cg = strtoll(buf, NULL, 10);
+        // cgroup v1 reports "unlimited" as a huge page-aligned number
+        if (cg > 0 && cg < (1LL << 60)) limit = cg;
+    }
+
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (fp) {
+        char line[256];
+        while (fgets(line, sizeof(line), fp)) {
+            long long kb;
+            if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1) {
+                if (limit < 0 || kb * 1024 < limit) limit = kb * 1024;
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    return limit;
+}
+
+int autotune(preprocess_config_t *cfg, fastq_input_t *in, autotune_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    result->cpu_limit = detect_cpu_limit();
+    result->memory_limit = detect_memory_limit();
+
+    int budget = cfg->threads > 0 ? cfg->threads : result->cpu_limit;
+    if (budget > result->cpu_limit) budget = result->cpu_limit;
+    if (budget > MAX_THREADS) budget = MAX_THREADS;
+    result->thread_budget = budget;
+
+    // Calibrate on roughly 2% of a limited run, between one small batch and four full ones
+    long target = cfg->read_limit / 50;
+    if (target < 512) target = 512;
+    if (target > CALIBRATION_BATCH * CALIBRATION_BATCHES) target = CALIBRATION_BATCH * CALIBRATION_BATCHES;
+
+    batch_t *batch = batch_create(CALIBRATION_BATCH);
+    member_deflater_t deflater;
+    if (!batch || member_deflater_init(&deflater, Z_DEFAULT_COMPRESSION) != 0) {
+        batch_free(batch);
+        return -1;
+    }
+
+    // Calibrate on the plain stream whatever the sampling mode; the tuner needs stage costs per pair
+    fastq_input_t raw = *in;
+    raw.mode = SAMPLE_FIRST;
+    
+    double t_inflate[2] = {0, 0}, t_match = 0, t_deflate = 0, bytes = 0;
+    long pairs = 0;
+    while (pairs < target) {
+        double t0 = now_us();
+        int n = batch_fill_mate(batch, 0, &raw, target - pairs);
+        double t1 = now_us();
+        batch->count = n > 0 ? batch_fill_mate(batch, 1, &raw, n) : 0;
+        double t2 = now_us();
+        if (batch->count == 0) break;
+
+        process_batch(batch);
+        double t3 = now_us();
+        for (int s = 0; s < NUM_STREAMS; s++) {
+            size_t len;
+            if (batch->out[s].len > 0) member_deflate(&deflater, batch->out[s].data, batch->out[s].len, &len);
+            bytes += batch->out[s].len;
+        }
+        double t4 = now_us();
+
+        t_inflate[0] += t1 - t0;
+        t_inflate[1] += t2 - t1;
+        t_match += t3 - t2;
+        t_deflate += t4 - t3;
+        bytes += batch->arena_used;
+        pairs += batch->count;
+    }
+    member_deflater_free(&deflater);
+    batch_free(batch);
+
+    // The calibration pass is measurement only; the real run starts from the top
+    if (input_rewind(in) != 0) {
+        fprintf(stderr, "Error: cannot rewind input after calibration\n");
+        return -1;
+    }
+
+    result->calibration_pairs = pairs;
+    if (pairs == 0) {
+        cfg->threads = 1;
+        cfg->inflate_threads = 1;
+        return 0;
+    }
+    result->inflate_us[0] = t_inflate[0] / pairs;
+    result->inflate_us[1] = t_inflate[1] / pairs;
+    result->match_us = t_match / pairs;
+    result->deflate_us = t_deflate / pairs;
+    result->bytes_per_pair = bytes / pairs;
+
+    if (budget <= 1) {
+        cfg->threads = 1;
+        cfg->inflate_threads = 1;
+    } else {
+        // Matching and deflating run back to back on one batch while it is cache-hot,
+        // so workers are sized from their summed cost against the reader's rate
+        double worker_us = result->match_us + result->deflate_us;
+        double serial_read_us = result->inflate_us[0] + result->inflate_us[1];
+        double split_read_us = result->inflate_us[0] > result->inflate_us[1] ?
+                               result->inflate_us[0] : result->inflate_us[1];
+
+        // A second inflate thread pays off once the workers left over outpace one reader
+        int inflate = 1;
+        if (budget >= 3 && worker_us / (budget - 2) < serial_read_us) {
+            inflate = 2;
+        }
+        double read_us = inflate == 2 ? split_read_us : serial_read_us;
+        if (read_us <= 0) read_us = 0.01;
+
+        int workers = (int)(worker_us / read_us) + 1;
+        if (workers > budget - inflate) workers = budget - inflate;
+        if (workers < 1) workers = 1;
+        cfg->threads = workers;
+        cfg->inflate_threads = inflate;
+    }
+
+    long batch_size = (long)(TARGET_BATCH_US / (result->match_us + result->deflate_us + 1e-3));
+    if (batch_size < MIN_BATCH_SIZE * 4) batch_size = MIN_BATCH_SIZE * 4;
+    if (batch_size > MAX_BATCH_SIZE) batch_size = MAX_BATCH_SIZE;
+
+    // Keep the batch pool (workers + 2 batches per node, with room to grow) within a quarter of memory
+    if (result->memory_limit > 0) {
+        double pool = (cfg->threads + 2) * result->bytes_per_pair * 1.5;
+        long fit = (long)(result->memory_limit / 4 / pool);
+        if (batch_size > fit) batch_size = fit;
+    }
+    if (batch_size < MIN_BATCH_SIZE) batch_size = MIN_BATCH_SIZE;
+    cfg->batch_size = (int)(batch_size / MIN_BATCH_SIZE * MIN_BATCH_SIZE);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef BATCH_MATCH_H
+#define BATCH_MATCH_H
+
+#include "preprocess.h"
+
+// Reads are matched in blocks of this many lanes, one bit per read
+#define MATCH_LANES 64
+
+// Anchor offsets learned from the first batches of a run (--anchor-window).
+// The window spans offsets 0..hi on each strand, so a hit inside it is still
+// the first occurrence on that strand; only a read missing both windows pays
+// for the full scan. Strands with too few learned hits keep hi = -1.
+typedef struct {
+    long learn_batches;          // batches with seq below this feed the histogram; 0 = off
+    long learned;                // learning batches merged so far
+    int ready;
+    long hist[2][MAX_SEQ_LEN];   // anchor offsets seen on the forward and RC strand
+    int lo[2];                   // offsets holding the central 99% of learned hits
+    int hi[2];
+    long window_hits;            // reads resolved inside the window
+    long fallback_scans;         // reads that missed both windows
+    long fallback_hits;          // ... and then found the anchor outside them (drift)
+} anchor_window_t;
+
+void anchor_window_init(anchor_window_t *window, long learn_batches);
+void anchor_window_learn(anchor_window_t *window, long batch_seq, const anchor_hit_t *hits, int count);
+
+// Scalar reference for a single read; also the fallback for odd-length reads
+void find_anchor(const char *sequence, const char *anchor, anchor_hit_t *hit);
+
+// Find the anchor in every read of a batch: the first occurrence in the read,
+// or, when the read has none, the first occurrence in its reverse complement.
+// This is strstr-then-reverse-complement, evaluated 64 reads at a time when
+// they share a length. Reads with skip[i] set (skip may be NULL) get ANCHOR_NONE.
+// Once window is learned the search tries both strand windows before the full scan.
+void batch_find_anchor(const fastq_record_t *reads, int count, const char *anchor,
+                       const unsigned char *skip, anchor_window_t *window, anchor_hit_t *hits);
+
+#endif
@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bgzf.h"
+
+#define BGZF_MAX_BLOCK 65536
+#define BGZF_HEADER_READ 256
+
+// Where each block of a BGZF file starts, compressed and uncompressed
+typedef struct {
+    int fd;
+    long count;
+    off_t *offset;
+    uint32_t *csize;             // whole block, header and footer included
+    uint64_t *ustart;            // ustart[count] is the uncompressed file size
+} bgzf_index_t;
+
+// Inflated text of consecutive blocks, parsed line by line
+typedef struct {
+    const bgzf_index_t *idx;
+    z_stream zs;
+    unsigned char *cbuf;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t pos;
+    uint64_t start;              // uncompressed offset of buf[0]
+    long next_block;
+} bgzf_cursor_t;
+
+struct bgzf_stride {
+    bgzf_index_t idx[2];
+    bgzf_cursor_t cur[2];
+    double fraction;
+    uint64_t seed;
+    long next_block;             // next R1 block to draw
+    long block;                  // R1 block being read, -1 between blocks
+    int r2_placed;               // R2 cursor sits on a record boundary from the previous block
+    long blocks_sampled;
+    long blocks_unpaired;
+    long pairs_read;
+};
+
+// Block size from the BC subfield of a gzip header, or -1
+static long parse_block_header(const unsigned char *h, size_t n) {
+    if (n < 18 || h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || !(h[3] & 4)) return -1;
+    size_t xlen = h[10] | (size_t)h[11] << 8;
+    if (12 + xlen > n) return -1;
+    for (size_t p = 12; p + 4 <= 12 + xlen;) {
+        size_t slen = h[p + 2] | (size_t)h[p + 3] << 8;
+        if (h[p] == 'B' && h[p + 1] == 'C' && slen == 2 && p + 6 <= n) {
+            return (long)(h[p + 4] | (size_t)h[p + 5] << 8) + 1;
+        }
+        p += 4 + slen;
+    }
+    return -1;
+}
+
+int bgzf_detect(const char *path) {
+    unsigned char h[BGZF_HEADER_READ];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    ssize_t n = pread(fd, h, sizeof(h), 0);
+    close(fd);
+    return n > 0 && parse_block_header(h, (size_t)n) > 0;
+}
+
+// Walk the block headers, reading each header and its ISIZE footer
+static int index_build(bgzf_index_t *idx, const char *path) {
+    memset(idx, 0, sizeof(*idx));
+    idx->fd = open(path, O_RDONLY);
+    if (idx->fd < 0) return -1;
+
+    long cap = 1024;
+    idx->offset = malloc(cap * sizeof(off_t));
+    idx->csize = malloc(cap * sizeof(uint32_t));
+    idx->ustart = malloc((cap + 1) * sizeof(uint64_t));
+    if (!idx->offset || !idx->csize || !idx->ustart) return -1;
+
+    off_t off = 0;
+    uint64_t total = 0;
+    for (;;) {
+        unsigned char h[BGZF_HEADER_READ], foot[4];
+        ssize_t n = pread(idx->fd, h, sizeof(h), off);
+        if (n == 0) break;
+        long size = parse_block_header(h, n > 0 ? (size_t)n : 0);
+        if (size < 0 || pread(idx->fd, foot, 4, off + size - 4) != 4) {
+            fprintf(stderr, "Error: malformed BGZF block at offset %lld of %s\n", (long long)off, path);
+            return -1;
+        }
+        if (idx->count == cap) {
+            cap *= 2;
+            off_t *o = realloc(idx->offset, cap * sizeof(off_t));
+            if (o) idx->offset = o;
+            uint32_t *c = realloc(idx->csize, cap * sizeof(uint32_t));
+            if (c) idx->csize = c;
+            uint64_t *u = realloc(idx->ustart, (cap + 1) * sizeof(uint64_t));
+            if (u) idx->ustart = u;
+            if (!o || !c || !u) return -1;
+        }
+        idx->offset[idx->count] = off;
+        idx->csize[idx->count] = (uint32_t)size;
+        idx->ustart[idx->count] = total;
+        idx->count++;
+        total += foot[0] | (uint32_t)foot[1] << 8 | (uint32_t)foot[2] << 16 | (uint32_t)foot[3] << 24;
+        off += size;
+    }
+    idx->ustart[idx->count] = total;
+    return 0;
+}
+
+static void index_free(bgzf_index_t *idx) {
+    if (idx->fd >= 0) close(idx->fd);
+    free(idx->offset);
+    free(idx->csize);
+    free(idx->ustart);
+}
+
+// Block holding uncompressed offset pos
+static long index_find(const bgzf_index_t *idx, uint64_t pos) {
+    long lo = 0, hi = idx->count - 1;
+    while (lo < hi) {
+        long mid = (lo + hi + 1) / 2;
+        if (idx->ustart[mid] <= pos) lo = mid; else hi = mid - 1;
+    }
+    return lo;
+}
+
+static int cursor_init(bgzf_cursor_t *c, const bgzf_index_t *idx) {
+    memset(c, 0, sizeof(*c));
+    c->idx = idx;
+    c->cap = 4 * BGZF_MAX_BLOCK;
+    c->cbuf = malloc(BGZF_MAX_BLOCK);
+    c->buf = malloc(c->cap);
+    if (!c->cbuf || !c->buf) return -1;
+    return inflateInit2(&c->zs, 15 + 16) == Z_OK ? 0 : -1;
+}
+
+static void cursor_free(bgzf_cursor_t *c) {
+    inflateEnd(&c->zs);
+    free(c->cbuf);
+    free(c->buf);
+}
+
+static void cursor_seek(bgzf_cursor_t *c, long block) {
+    c->len = c->pos = 0;
+    c->start = c->idx->ustart[block];
+    c->next_block = block;
+}
+
+// Append the next block's text, dropping what has been parsed; 0 at end of file
+static int cursor_fill(bgzf_cursor_t *c) {
+    const bgzf_index_t *idx = c->idx;
+    if (c->next_block >= idx->count) return 0;
+
+    memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+    c->len -= c->pos;
+    c->start += c->pos;
+    c->pos = 0;
+    if (c->cap - c->len < BGZF_MAX_BLOCK) {
+        char *grown = realloc(c->buf, c->cap * 2);
+        if (!grown) return 0;
+        c->buf = grown;
+        c->cap *= 2;
+    }
+
+    long k = c->next_block++;
+    if (pread(idx->fd, c->cbuf, idx->csize[k], idx->offset[k]) != (ssize_t)idx->csize[k]) return 0;
+    inflateReset(&c->zs);
+    c->zs.next_in = c->cbuf;
+    c->zs.avail_in = idx->csize[k];
+    c->zs.next_out = (unsigned char *)c->buf + c->len;
+    c->zs.avail_out = BGZF_MAX_BLOCK;
+    if (inflate(&c->zs, Z_FINISH) != Z_STREAM_END) return 0;
+    c->len += BGZF_MAX_BLOCK - c->zs.avail_out;
+    return 1;
+}
+
+// Offsets of the ends of the next `lines` lines after pos, inflating as needed; returns how many were found
+static int cursor_lines(bgzf_cursor_t *c, int lines, size_t *end) {
+    for (;;) {
+        size_t p = c->pos;
+        int found = 0;
+        while (found < lines) {
+            char *nl = memchr(c->buf + p, '\n', c->len - p);
+            if (!nl) break;
+            end[found] = (size_t)(nl - c->buf);
+            p = end[found++] + 1;
+        }
+        if (found == lines || !cursor_fill(c)) return found;
+    }
+}
+
+// Move to the next record start: a line beginning '@' whose second following
+// line begins '+' (a quality line starting '@' is followed by a header, then bases)
+static int cursor_sync(bgzf_cursor_t *c, int skip_partial_line) {
+    size_t end[3];
+    if (skip_partial_line) {
+        if (cursor_lines(c, 1, end) < 1) return -1;
+        c->pos = end[0] + 1;
+    }
+    while (cursor_lines(c, 3, end) == 3) {
+        if (c->buf[c->pos] == '@' && c->buf[end[1] + 1] == '+') return 0;
+        c->pos = end[0] + 1;
+    }
+    return -1;
+}
+
+// Parse the record at pos in place; fields stay valid until the cursor inflates again
+static int cursor_record(bgzf_cursor_t *c, fastq_record_t *rec) {
+    size_t end[4];
+    if (cursor_lines(c, 4, end) < 4) return -1;
+    char **field[4] = {&rec->header, &rec->sequence, &rec->plus, &rec->quality};
+    size_t line = c->pos;
+    for (int f = 0; f < 4; f++) {
+        c->buf[end[f]] = '\0';
+        *field[f] = c->buf + line;
+        line = end[f] + 1;
+    }
+    c->pos = line;
+    return 0;
+}
+
+// Read name without '@', comment or a /1 /2 mate suffix
+static size_t base_id(const char *header, size_t len, const char **id) {
+    size_t n = 0;
+    *id = header + 1;
+    while (n + 1 < len && header[n + 1] != ' ' && header[n + 1] != '\t') n++;
+    if (n >= 2 && (*id)[n - 2] == '/' && ((*id)[n - 1] == '1' || (*id)[n - 1] == '2')) n -= 2;
+    return n;
+}
+
+// Whether the record at the cursor carries this read ID; the cursor does not move
+static int cursor_has_id(bgzf_cursor_t *c, const char *id, size_t id_len) {
+    size_t end[1];
+    if (cursor_lines(c, 1, end) < 1) return 0;
+    const char *other;
+    size_t other_len = base_id(c->buf + c->pos, end[0] - c->pos, &other);
+    return other_len == id_len && memcmp(other, id, id_len) == 0;
+}
+
+bgzf_stride_t *bgzf_stride_open(const char *r1_file, const char *r2_file, double fraction, uint64_t seed) {
+    bgzf_stride_t *st = calloc(1, sizeof(bgzf_stride_t));
+    if (!st) return NULL;
+    st->idx[0].fd = st->idx[1].fd = -1;
+    st->fraction = fraction;
+    st->seed = seed;
+    st->block = -1;
+    if (index_build(&st->idx[0], r1_file) != 0 || index_build(&st->idx[1], r2_file) != 0 ||
+        cursor_init(&st->cur[0], &st->idx[0]) != 0 || cursor_init(&st->cur[1], &st->idx[1]) != 0) {
+        bgzf_stride_close(st);
+        return NULL;
+    }
+    return st;
+}
+
+void bgzf_stride_rewind(bgzf_stride_t *st) {
+    st->next_block = 0;
+    st->block = -1;
+    st->r2_placed = 0;
+    st->blocks_sampled = st->blocks_unpaired = st->pairs_read = 0;
+}
+
+void bgzf_stride_close(bgzf_stride_t *st) {
+    if (!st) return;
+    for (int m = 0; m < 2; m++) {
+        if (st->cur[m].buf) cursor_free(&st->cur[m]);
+        index_free(&st->idx[m]);
+    }
+    free(st);
+}
+
+// Put the R2 cursor on the mate of R1's current record. R1 and R2 hold the same
+// reads in the same order, so the mate sits near the same fraction of R2; search
+// from one block before that point to two blocks after it.
+static int align_mate(bgzf_stride_t *st) {
+    bgzf_cursor_t *r1 = &st->cur[0], *r2 = &st->cur[1];
+    const bgzf_index_t *i1 = &st->idx[0], *i2 = &st->idx[1];
+    size_t end[1];
+    if (cursor_lines(r1, 1, end) < 1) return -1;
+    const char *id;
+    size_t id_len = base_id(r1->buf + r1->pos, end[0] - r1->pos, &id);
+
+    // Consecutive sampled blocks: R2 usually already sits on the mate
+    if (st->r2_placed && cursor_has_id(r2, id, id_len)) return 0;
+    st->r2_placed = 0;
+
+    double share = i1->ustart[i1->count] ? (double)(r1->start + r1->pos) / i1->ustart[i1->count] : 0;
+    long target = index_find(i2, (uint64_t)(share * i2->ustart[i2->count]));
+    long first = target > 0 ? target - 1 : 0;
+    long last = target + 2 < i2->count ? target + 2 : i2->count;
+
+    cursor_seek(r2, first);
+    if (cursor_sync(r2, first > 0) != 0) return -1;
+    fastq_record_t skipped;
+    while (r2->start + r2->pos <= i2->ustart[last]) {
+        if (cursor_has_id(r2, id, id_len)) {
+            st->r2_placed = 1;
+            return 0;
+        }
+        if (cursor_record(r2, &skipped) != 0) break;
+    }
+    return -1;
+}
+
+// Draw the next R1 block and position both cursors on its first record. A block
+// owns the records starting after its first byte and up to the first byte of the
+// next block, so a record is read once whichever blocks are drawn.
+static int start_block(bgzf_stride_t *st) {
+    const bgzf_index_t *i1 = &st->idx[0];
+    while (st->next_block < i1->count) {
+        long k = st->next_block++;
+        if (i1->ustart[k + 1] == i1->ustart[k] || sample_uniform(st->seed, (uint64_t)k) >= st->fraction) {
+            continue;
+        }
+        st->blocks_sampled++;
+
+        cursor_seek(&st->cur[0], k);
+        if (cursor_sync(&st->cur[0], k > 0) != 0 ||
+            st->cur[0].start + st->cur[0].pos > i1->ustart[k + 1]) {
+            continue;
+        }
+        if (align_mate(st) != 0) {
+            st->blocks_unpaired++;
+            continue;
+        }
+        st->block = k;
+        return 0;
+    }
+    return -1;
+}
+
+int bgzf_stride_fill(bgzf_stride_t *st, batch_t *batch, long max_pairs) {
+    bgzf_cursor_t *r1 = &st->cur[0], *r2 = &st->cur[1];
+    char *pos[2] = {batch->arena[0], batch->arena[1]};
+    int n = 0;
+
+    while (n < batch->capacity && n < max_pairs) {
+        if (st->block < 0 && start_block(st) != 0) break;
+
+        // Stop at the first record owned by the next block
+        const bgzf_index_t *i1 = &st->idx[0];
+        fastq_record_t rec[2];
+        if (r1->start + r1->pos > i1->ustart[st->block + 1] || cursor_record(r1, &rec[0]) != 0) {
+            st->block = -1;
+            continue;
+        }
+
+        const char *id, *mate_id;
+        size_t id_len = base_id(rec[0].header, strlen(rec[0].header), &id);
+        if (cursor_record(r2, &rec[1]) != 0 ||
+            base_id(rec[1].header, strlen(rec[1].header), &mate_id) != id_len ||
+            memcmp(id, mate_id, id_len) != 0) {
+            // Files disagree on read order here; give up on the rest of this block
+            st->blocks_unpaired++;
+            st->r2_placed = 0;
+            st->block = -1;
+            continue;
+        }
+
+        if (batch_copy_record(batch, 0, n, &pos[0], &rec[0]) != 0 ||
+            batch_copy_record(batch, 1, n, &pos[1], &rec[1]) != 0) {
+            fprintf(stderr, "\nError: out of memory reading batch\n");
+            exit(1);
+        }
+        n++;
+        st->pairs_read++;
+    }
+
+    batch->arena_used = (size_t)(pos[0] - batch->arena[0]) + (size_t)(pos[1] - batch->arena[1]);
+    batch->count = n;
+    return n;
+}
+
+void bgzf_stride_describe(const bgzf_stride_t *st, char *buf, size_t size) {
+    snprintf(buf, size, "BGZF block stride, fraction %g, seed %llu; inflated %ld of %ld R1 blocks, "
+             "%ld without an R2 match",
+             st->fraction, (unsigned long long)st->seed, st->blocks_sampled, st->idx[0].count,
+             st->blocks_unpaired);
+}
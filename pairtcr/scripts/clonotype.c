@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "clonotype.h"
+
+#define CLONE_MAX_FIELDS 256
+
+static const char *level_columns[4][6] = {
+    {"TRA_VGene", "TRA_JGene", "TRA_aCDR3", "TRB_VGene", "TRB_JGene", "TRB_aCDR3"},
+    {"TRA_VGene", "TRA_JGene", "TRA_aCDR3"},
+    {"TRB_VGene", "TRB_JGene", "TRB_aCDR3"},
+    {"TRA_aCDR3", "TRB_aCDR3"},
+};
+
+static int level_fields(clone_level_t level) {
+    switch (level) {
+        case CLONE_PAIRED: return 6;
+        case CLONE_CDR3: return 2;
+        default: return 3;
+    }
+}
+
+int clone_level_parse(const char *name, clone_level_t *level) {
+    if (strcmp(name, "paired") == 0) {
+        *level = CLONE_PAIRED;
+    } else if (strcmp(name, "TRA") == 0) {
+        *level = CLONE_TRA;
+    } else if (strcmp(name, "TRB") == 0) {
+        *level = CLONE_TRB;
+    } else if (strcmp(name, "cdr3") == 0) {
+        *level = CLONE_CDR3;
+    } else {
+        fprintf(stderr, "Error: clonotype level must be paired, TRA, TRB or cdr3, not '%s'\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+const char *clone_level_header(clone_level_t level) {
+    switch (level) {
+        case CLONE_TRA: return "TRA_VGene\tTRA_JGene\tTRA_aCDR3";
+        case CLONE_TRB: return "TRB_VGene\tTRB_JGene\tTRB_aCDR3";
+        case CLONE_CDR3: return "TRA_aCDR3\tTRB_aCDR3";
+        default: return "TRA_VGene\tTRA_JGene\tTRA_aCDR3\tTRB_VGene\tTRB_JGene\tTRB_aCDR3";
+    }
+}
+
+uint64_t clone_hash(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ULL;
+    }
+    // FNV leaves the low bits weak for short keys; the slot index uses them
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+int clone_dict_init(clone_dict_t *d, size_t expected) {
+    memset(d, 0, sizeof(*d));
+    size_t slots = 1024;
+    while (slots < 2 * expected) slots *= 2;
+    d->slots = calloc(slots, sizeof(uint32_t));
+    d->slot_mask = slots - 1;
+    return d->slots ? 0 : -1;
+}
+
+void clone_dict_free(clone_dict_t *d) {
+    free(d->entries);
+    free(d->slots);
+    free(d->arena);
+    memset(d, 0, sizeof(*d));
+}
+
+static int grow_slots(clone_dict_t *d) {
+    size_t slots = 2 * (d->slot_mask + 1);
+    uint32_t *grown = calloc(slots, sizeof(uint32_t));
+    if (!grown) return -1;
+    for (size_t id = 0; id < d->len; id++) {
+        size_t s = d->entries[id].hash & (slots - 1);
+        while (grown[s]) s = (s + 1) & (slots - 1);
+        grown[s] = (uint32_t)id + 1;
+    }
+    free(d->slots);
+    d->slots = grown;
+    d->slot_mask = slots - 1;
+    return 0;
+}
+
+int64_t clone_dict_find(const clone_dict_t *d, const char *key, size_t len, uint64_t hash) {
+    for (size_t s = hash & d->slot_mask; d->slots[s]; s = (s + 1) & d->slot_mask) {
+        const clone_entry_t *e = &d->entries[d->slots[s] - 1];
+        if (e->hash == hash && e->len == len && memcmp(d->arena + e->offset, key, len) == 0) {
+            return d->slots[s] - 1;
+        }
+    }
+    return -1;
+}
+
+int64_t clone_dict_intern(clone_dict_t *d, const char *key, size_t len, uint64_t hash) {
+    int64_t found = clone_dict_find(d, key, len, hash);
+    if (found >= 0) return found;
+
+    if (2 * (d->len + 1) > d->slot_mask + 1 && grow_slots(d) != 0) return -1;
+    if (d->len == d->cap) {
+        size_t cap = d->cap ? 2 * d->cap : 1024;
+        clone_entry_t *grown = realloc(d->entries, cap * sizeof(clone_entry_t));
+        if (!grown) return -1;
+        d->entries = grown;
+        d->cap = cap;
+    }
+    if (d->arena_len + len + 1 > d->arena_cap) {
+        size_t cap = d->arena_cap ? d->arena_cap : 64 * 1024;
+        while (cap < d->arena_len + len + 1) cap *= 2;
+        char *grown = realloc(d->arena, cap);
+        if (!grown) return -1;
+        d->arena = grown;
+        d->arena_cap = cap;
+    }
+
+    clone_entry_t *e = &d->entries[d->len];
+    e->hash = hash;
+    e->count = 0;
+    e->offset = d->arena_len;
+    e->len = (uint32_t)len;
+    memcpy(d->arena + d->arena_len, key, len);
+    d->arena[d->arena_len + len] = '\0';
+    d->arena_len += len + 1;
+
+    size_t s = hash & d->slot_mask;
+    while (d->slots[s]) s = (s + 1) & d->slot_mask;
+    d->slots[s] = (uint32_t)d->len + 1;
+    return (int64_t)d->len++;
+}
+
+// Split a line in place; returns the field count
+static int split_tabs(char *line, char **fields) {
+    int n = 0;
+    line[strcspn(line, "\r\n")] = '\0';
+    for (char *p = line; n < CLONE_MAX_FIELDS; p++) {
+        fields[n++] = p;
+        p = strchr(p, '\t');
+        if (!p) break;
+        *p = '\0';
+    }
+    return n;
+}
+
+static int missing_cdr3(const char *cdr3) {
+    return cdr3[0] == '\0' || strcmp(cdr3, "nan") == 0;
+}
+
+int clone_read_table(const char *path, clone_level_t level, clone_dict_t *d) {
+    gzFile fp = gzopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening clone table %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char *line = malloc(CLONE_MAX_LINE);
+    char *key = malloc(CLONE_MAX_LINE);
+    char *fields[CLONE_MAX_FIELDS];
+    int nkey = level_fields(level);
+    int column[6], count_column = -1, nfields = 0;
+    int status = -1;
+    long line_no = 0;
+    if (!line || !key) goto done;
+
+    if (!gzgets(fp, line, CLONE_MAX_LINE)) {
+        fprintf(stderr, "Error: clone table %s is empty\n", path);
+        goto done;
+    }
+    line_no++;
+    nfields = split_tabs(line, fields);
+    for (int k = 0; k < nkey; k++) {
+        column[k] = -1;
+        for (int f = 0; f < nfields; f++) {
+            if (strcmp(fields[f], level_columns[level][k]) == 0) column[k] = f;
+        }
+        if (column[k] < 0) {
+            fprintf(stderr, "Error: clone table %s has no %s column\n", path, level_columns[level][k]);
+            goto done;
+        }
+    }
+    for (int f = 0; f < nfields; f++) {
+        if (strcmp(fields[f], "count") == 0) count_column = f;
+    }
+
+    while (gzgets(fp, line, CLONE_MAX_LINE)) {
+        line_no++;
+        if (!strchr(line, '\n') && !gzeof(fp)) {
+            fprintf(stderr, "Error: line %ld of %s is longer than %d bytes\n", line_no, path, CLONE_MAX_LINE);
+            goto done;
+        }
+        int n = split_tabs(line, fields);
+        if (n == 1 && fields[0][0] == '\0') continue;
+        if (n < nfields) {
+            fprintf(stderr, "Error: line %ld of %s has %d of %d columns\n", line_no, path, n, nfields);
+            goto done;
+        }
+        int missing = 0;
+        for (int k = 0; k < nkey; k++) {
+            if (strstr(level_columns[level][k], "CDR3") && missing_cdr3(fields[column[k]])) missing = 1;
+        }
+        if (missing) continue;
+
+        size_t len = 0;
+        for (int k = 0; k < nkey; k++) {
+            size_t flen = strlen(fields[column[k]]);
+            if (k > 0) key[len++] = '\t';
+            memcpy(key + len, fields[column[k]], flen);
+            len += flen;
+        }
+        int64_t id = clone_dict_intern(d, key, len, clone_hash(key, len));
+        if (id < 0) {
+            fprintf(stderr, "Error: out of memory reading clone table %s\n", path);
+            goto done;
+        }
+        d->entries[id].count += count_column >= 0 ? strtoull(fields[count_column], NULL, 10) : 1;
+    }
+    status = 0;
+
+done:
+    free(line);
+    free(key);
+    gzclose(fp);
+    return status;
+}
@@ -0,0 +1,61 @@
+#ifndef CLONOTYPE_H
+#define CLONOTYPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CLONE_MAX_LINE (64 * 1024)
+
+// Which chains make up a clonotype key. A key is the V gene, J gene and
+// CDR3 amino acids of each chain, tab-joined in step 4 column order;
+// CLONE_CDR3 keys on the two CDR3s alone.
+typedef enum {
+    CLONE_PAIRED,
+    CLONE_TRA,
+    CLONE_TRB,
+    CLONE_CDR3
+} clone_level_t;
+
+int clone_level_parse(const char *name, clone_level_t *level);
+
+// Tab-joined step 4 column names of a key at this level
+const char *clone_level_header(clone_level_t level);
+
+typedef struct {
+    uint64_t hash;
+    uint64_t count;
+    size_t offset;               // into the arena, NUL-terminated
+    uint32_t len;
+} clone_entry_t;
+
+// Interned keys: entry ids are dense and in insertion order, so they can
+// index side arrays; the slots hold id + 1 with 0 for empty
+typedef struct {
+    clone_entry_t *entries;
+    size_t len;
+    size_t cap;
+    uint32_t *slots;
+    size_t slot_mask;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+} clone_dict_t;
+
+int clone_dict_init(clone_dict_t *d, size_t expected);
+void clone_dict_free(clone_dict_t *d);
+uint64_t clone_hash(const char *key, size_t len);
+
+// Id of the key, added with a zero count when new; -1 when out of memory
+int64_t clone_dict_intern(clone_dict_t *d, const char *key, size_t len, uint64_t hash);
+int64_t clone_dict_find(const clone_dict_t *d, const char *key, size_t len, uint64_t hash);
+
+static inline const char *clone_dict_key(const clone_dict_t *d, size_t id) {
+    return d->arena + d->entries[id].offset;
+}
+
+// Add the clonotypes of a step 4 table (plain or gzip) to the dictionary:
+// one per row, or weighted by a "count" column when the table has one.
+// Rows without a CDR3 in the level's chains are skipped.
+int clone_read_table(const char *path, clone_level_t level, clone_dict_t *d);
+
+#endif
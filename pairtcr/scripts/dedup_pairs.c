@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <errno.h>
+#include <zlib.h>
+
+#define FQ_MAX_LINE 4096
+#define DEDUP_INITIAL_SLOTS (1 << 16)
+
+// Collapse byte-identical (R1, R2) sequence pairs before alignment. The
+// first pair of each kind is written unchanged; every later copy goes to
+// the members table with the read it collapsed into and its own header,
+// so step 4 can give the copies the representative's alignment back.
+// Pairs are told apart by a 128-bit fingerprint of the two sequences, so
+// memory is per distinct pair and not per base.
+
+typedef struct {
+    char header[FQ_MAX_LINE];
+    char seq[FQ_MAX_LINE];
+    char plus[FQ_MAX_LINE];
+    char qual[FQ_MAX_LINE];
+} fastq_record_t;
+
+typedef struct {
+    uint64_t fp[2];
+    uint64_t count;
+    size_t id_offset;            // representative read ID in the ID arena
+} distinct_pair_t;
+
+typedef struct {
+    distinct_pair_t *pairs;
+    size_t len;
+    size_t cap;
+    uint32_t *slots;             // pair index + 1, 0 for empty
+    size_t slot_mask;
+    char *ids;
+    size_t ids_len;
+    size_t ids_cap;
+} dedup_table_t;
+
+void show_usage(const char *program_name);
+
+static int read_record(gzFile fp, fastq_record_t *r) {
+    if (!gzgets(fp, r->header, FQ_MAX_LINE)) return 0;
+    if (!gzgets(fp, r->seq, FQ_MAX_LINE) || !gzgets(fp, r->plus, FQ_MAX_LINE) ||
+        !gzgets(fp, r->qual, FQ_MAX_LINE)) return -1;
+    return 1;
+}
+
+static int write_record(gzFile fp, const fastq_record_t *r) {
+    return gzputs(fp, r->header) >= 0 && gzputs(fp, r->seq) >= 0 && gzputs(fp, r->plus) >= 0 &&
+           gzputs(fp, r->qual) >= 0 ? 0 : -1;
+}
+
+// Read ID as step 2 and step 4 see it: no '@', first word, no /1 or /2
+static size_t base_read_id(const char *header, const char **id) {
+    const char *start = header[0] == '@' ? header + 1 : header;
+    size_t len = strcspn(start, " \t\r\n");
+    if (len >= 2 && start[len - 2] == '/' && (start[len - 1] == '1' || start[len - 1] == '2')) len -= 2;
+    *id = start;
+    return len;
+}
+
+static uint64_t fmix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Two independent 64-bit hashes over R1, a separator and R2
+static void fingerprint(const char *seq1, const char *seq2, uint64_t fp[2]) {
+    uint64_t a = 0xcbf29ce484222325ULL, b = 0x9e3779b97f4a7c15ULL;
+    const char *seqs[2] = {seq1, seq2};
+    for (int m = 0; m < 2; m++) {
+        for (const unsigned char *p = (const unsigned char *)seqs[m]; *p && *p != '\n' && *p != '\r'; p++) {
+            a = (a ^ *p) * 0x100000001b3ULL;
+            b = (b + *p) * 0xd6e8feb86659fd93ULL;
+        }
+        a = (a ^ '|') * 0x100000001b3ULL;
+        b = (b + '|') * 0xd6e8feb86659fd93ULL;
+    }
+    fp[0] = fmix64(a);
+    fp[1] = fmix64(b ^ (a >> 7));
+}
+
+static int table_grow(dedup_table_t *t) {
+    size_t slots = (t->slot_mask + 1) * 2;
+    uint32_t *grown = calloc(slots, sizeof(uint32_t));
+    if (!grown) return -1;
+    for (size_t i = 0; i < t->len; i++) {
+        size_t s = (size_t)t->pairs[i].fp[0] & (slots - 1);
+        while (grown[s]) s = (s + 1) & (slots - 1);
+        grown[s] = (uint32_t)(i + 1);
+    }
+    free(t->slots);
+    t->slots = grown;
+    t->slot_mask = slots - 1;
+    return 0;
+}
+
+// Index of the pair, added with a zero count when new; -1 when out of memory
+static int64_t table_find_or_add(dedup_table_t *t, const uint64_t fp[2], const char *id, size_t id_len, int *added) {
+    *added = 0;
+    size_t s = (size_t)fp[0] & t->slot_mask;
+    for (; t->slots[s]; s = (s + 1) & t->slot_mask) {
+        distinct_pair_t *p = &t->pairs[t->slots[s] - 1];
+        if (p->fp[0] == fp[0] && p->fp[1] == fp[1]) return (int64_t)(t->slots[s] - 1);
+    }
+    if (t->len == UINT32_MAX - 1) return -1;
+    if (t->len == t->cap) {
+        size_t cap = t->cap ? 2 * t->cap : 1024;
+        distinct_pair_t *grown = realloc(t->pairs, cap * sizeof(distinct_pair_t));
+        if (!grown) return -1;
+        t->pairs = grown;
+        t->cap = cap;
+    }
+    if (t->ids_len + id_len + 1 > t->ids_cap) {
+        size_t cap = t->ids_cap ? 2 * t->ids_cap : 1 << 16;
+        while (cap < t->ids_len + id_len + 1) cap *= 2;
+        char *grown = realloc(t->ids, cap);
+        if (!grown) return -1;
+        t->ids = grown;
+        t->ids_cap = cap;
+    }
+    distinct_pair_t *p = &t->pairs[t->len];
+    p->fp[0] = fp[0];
+    p->fp[1] = fp[1];
+    p->count = 0;
+    p->id_offset = t->ids_len;
+    memcpy(t->ids + t->ids_len, id, id_len);
+    t->ids[t->ids_len + id_len] = '\0';
+    t->ids_len += id_len + 1;
+    t->slots[s] = (uint32_t)(++t->len);
+    *added = 1;
+    if (2 * t->len > t->slot_mask + 1 && table_grow(t) != 0) return -1;
+    return (int64_t)(t->len - 1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *members_path = NULL;
+
+    int opt;
+    static struct option long_options[] = {
+        {"members", required_argument, 0, 'm'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "m:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                members_path = optarg;
+                break;
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            default:
+                show_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 4 || !members_path) {
+        fprintf(stderr, "Error: --members and four FASTQ paths are required\n");
+        show_usage(argv[0]);
+        return 1;
+    }
+
+    const char *in1 = argv[optind], *in2 = argv[optind + 1];
+    gzFile in[2] = {gzopen(in1, "r"), gzopen(in2, "r")};
+    gzFile out[2] = {gzopen(argv[optind + 2], "w"), gzopen(argv[optind + 3], "w")};
+    FILE *members = fopen(members_path, "w");
+    if (!in[0] || !in[1] || !out[0] || !out[1] || !members) {
+        fprintf(stderr, "Error opening input or output files: %s\n", strerror(errno));
+        return 1;
+    }
+
+    dedup_table_t t;
+    memset(&t, 0, sizeof(t));
+    t.slots = calloc(DEDUP_INITIAL_SLOTS, sizeof(uint32_t));
+    t.slot_mask = DEDUP_INITIAL_SLOTS - 1;
+    fastq_record_t *rec = malloc(2 * sizeof(fastq_record_t));
+    if (!t.slots || !rec) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    fprintf(members, "read_id\trepresentative\tordinal\theader\n");
+    uint64_t ordinal = 0;
+    int status = 0;
+    for (;; ordinal++) {
+        int r1 = read_record(in[0], &rec[0]), r2 = read_record(in[1], &rec[1]);
+        if (r1 == 0 && r2 == 0) break;
+        if (r1 <= 0 || r2 <= 0) {
+            fprintf(stderr, "Error: %s and %s are truncated or out of step\n", in1, in2);
+            status = 1;
+            break;
+        }
+        uint64_t fp[2];
+        fingerprint(rec[0].seq, rec[1].seq, fp);
+        const char *id;
+        size_t id_len = base_read_id(rec[0].header, &id);
+        int added;
+        int64_t p = table_find_or_add(&t, fp, id, id_len, &added);
+        if (p < 0) {
+            fprintf(stderr, "Error: out of memory after %lu distinct pairs\n", (unsigned long)t.len);
+            status = 1;
+            break;
+        }
+        t.pairs[p].count++;
+        if (added) {
+            if (write_record(out[0], &rec[0]) != 0 || write_record(out[1], &rec[1]) != 0) {
+                fprintf(stderr, "Error writing FASTQ output\n");
+                status = 1;
+                break;
+            }
+        } else if (fprintf(members, "%.*s\t%s\t%lu\t%.*s\n", (int)id_len, id, t.ids + t.pairs[p].id_offset,
+                           (unsigned long)ordinal, (int)strcspn(id, "\r\n"), id) < 0) {
+            fprintf(stderr, "Error writing %s\n", members_path);
+            status = 1;
+            break;
+        }
+    }
+
+    for (int m = 0; m < 2; m++) {
+        gzclose(in[m]);
+        if (gzclose(out[m]) != Z_OK) status = 1;
+    }
+    if (fclose(members) != 0) status = 1;
+
+    // Multiplicity histogram in powers of two
+    uint64_t hist[64] = {0}, largest = 0;
+    for (size_t i = 0; i < t.len; i++) {
+        uint64_t c = t.pairs[i].count;
+        int bin = 0;
+        while ((c >> (bin + 1)) != 0) bin++;
+        hist[bin]++;
+        if (c > largest) largest = c;
+    }
+    printf("Dedup: %lu read pairs -> %lu distinct (%.1fx fewer), largest multiplicity %lu\n",
+           (unsigned long)ordinal, (unsigned long)t.len, t.len ? (double)ordinal / (double)t.len : 0.0,
+           (unsigned long)largest);
+    for (int bin = 0; bin < 64; bin++) {
+        if (hist[bin]) {
+            printf("  multiplicity %lu-%lu: %lu distinct pairs\n", (unsigned long)1 << bin,
+                   ((unsigned long)1 << (bin + 1)) - 1, (unsigned long)hist[bin]);
+        }
+    }
+
+    free(rec);
+    free(t.pairs);
+    free(t.slots);
+    free(t.ids);
+    return status;
+}
+
+void show_usage(const char *program_name) {
+    printf("Usage: %s --members FILE IN_1.fq.gz IN_2.fq.gz OUT_1.fq.gz OUT_2.fq.gz\n", program_name);
+    printf("Write each distinct (R1, R2) sequence pair once and list the collapsed copies\n\n");
+    printf("Options:\n");
+    printf("  -m, --members FILE       TSV of collapsed copies: read_id, the representative read\n");
+    printf("                           they share a sequence pair with, input ordinal (0-based) and\n");
+    printf("                           the copy's R1 header without '@'\n");
+    printf("  -h, --help               Show this help message\n");
+}
@@ -0,0 +1,56 @@
+#ifndef DEMUX_H
+#define DEMUX_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "preprocess.h"
+#include "umi_index.h"
+
+#define DEMUX_MAX_BARCODE 32
+#define DEMUX_MAX_NAME 64
+#define DEMUX_NONE 0xFF              // batch->sample of a pair matching no barcode
+
+// Inline sample barcodes at the start of one mate, matched in the
+// classification pass. The table holds every whitelisted barcode and each
+// of its Hamming-1 neighbours; a neighbour shared by two barcodes is
+// ambiguous and assigns nothing. A read with one N is matched by trying
+// the four bases at that position against the exact barcodes.
+typedef struct {
+    int nsamples;                // 0 = off
+    int mate;                    // 1 or 2
+    int len;                     // barcode length, the same for every sample
+    int min_distance;            // smallest Hamming distance between two barcodes
+    char name[MAX_SAMPLES][DEMUX_MAX_NAME];
+    char barcode[MAX_SAMPLES][DEMUX_MAX_BARCODE + 1];
+    uint64_t *slot_keys;
+    uint8_t *slot_values;        // 0 empty, else sample + 1 with DEMUX_SLOT_* flags
+    size_t slot_mask;
+    int umi_index;               // write PREFIX_<sample>.umi.idx
+
+    pthread_mutex_t lock;
+    long pairs[MAX_SAMPLES];
+    long tra_pairs[MAX_SAMPLES];
+    long trb_pairs[MAX_SAMPLES];
+    long corrected;              // pairs assigned through a substitution or an N
+    long unassigned;
+    long ambiguous;              // ... of which matched two barcodes equally well
+    umi_keys_t keys[MAX_SAMPLES];
+} demux_t;
+
+// Read "sample<TAB>barcode" lines (blank lines and # comments skipped)
+int demux_load(demux_t *d, const char *path, int mate);
+
+// Set batch->sample for every pair and trim the barcode off assigned reads
+void demux_assign(demux_t *d, batch_t *batch);
+
+// Fold a processed batch's per-sample counts and UMI keys into the run
+void demux_collect(demux_t *d, const batch_t *batch);
+
+// Write PREFIX.demux.tsv and, with umi_index, PREFIX_<sample>.umi.idx
+int demux_finalize(demux_t *d, const char *output_dir, const char *output_prefix);
+void demux_report(const demux_t *d);
+void demux_free(demux_t *d);
+
+#endif
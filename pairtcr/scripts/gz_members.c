@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "gz_members.h"
+
+int member_stream_open(member_stream_t *stream, const char *path) {
+    memset(stream, 0, sizeof(*stream));
+    strncpy(stream->path, path, sizeof(stream->path) - 1);
+    stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (stream->fd < 0) {
+        fprintf(stderr, "Error opening output file %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    return 0;
+}
+
+long long member_stream_reserve(member_stream_t *stream, size_t len) {
+    return __atomic_fetch_add(&stream->next_offset, (long long)len, __ATOMIC_RELAXED);
+}
+
+int member_stream_write(member_stream_t *stream, long long offset,
+                        const unsigned char *data, size_t len,
+                        size_t uncompressed, long records, long batch) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(stream->fd, data + done, len - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error writing %s: %s\n", stream->path, strerror(errno));
+            return -1;
+        }
+        done += (size_t)n;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    if (stream->count == stream->cap) {
+        size_t new_cap = stream->cap ? stream->cap * 2 : 256;
+        member_entry_t *grown = realloc(stream->entries, new_cap * sizeof(*grown));
+        if (!grown) {
+            pthread_mutex_unlock(&stream->lock);
+            fprintf(stderr, "Error: out of memory recording members of %s\n", stream->path);
+            return -1;
+        }
+        stream->entries = grown;
+        stream->cap = new_cap;
+    }
+    member_entry_t *e = &stream->entries[stream->count++];
+    e->offset = offset;
+    e->compressed = len;
+    e->uncompressed = uncompressed;
+    e->records = records;
+    e->batch = batch;
+    pthread_mutex_unlock(&stream->lock);
+    return 0;
+}
+
+static int compare_members(const void *a, const void *b) {
+    const member_entry_t *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int write_manifest(member_stream_t *stream) {
+    char manifest_path[MAX_PATH_LEN + 16];
+    snprintf(manifest_path, sizeof(manifest_path), "%s.members.tsv", stream->path);
+
+    FILE *fp = fopen(manifest_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error writing member manifest %s: %s\n", manifest_path, strerror(errno));
+        return -1;
+    }
+
+    qsort(stream->entries, stream->count, sizeof(member_entry_t), compare_members);
+    fprintf(fp, "member\toffset\tcompressed_bytes\tuncompressed_bytes\trecords\tbatch\n");
+    for (size_t i = 0; i < stream->count; i++) {
+        const member_entry_t *e = &stream->entries[i];
+        fprintf(fp, "%zu\t%lld\t%zu\t%zu\t%ld\t%ld\n",
+                i, e->offset, e->compressed, e->uncompressed, e->records, e->batch);
+    }
+    fclose(fp);
+    return 0;
+}
+
+int member_stream_close(member_stream_t *stream, int manifest) {
+    int status = 0;
+
+    // Keep empty outputs readable as gzip, like gzopen()/gzclose() would
+    if (stream->count == 0) {
+        member_deflater_t d;
+        size_t len;
+        if (member_deflater_init(&d, Z_DEFAULT_COMPRESSION) == 0 &&
+            member_deflate(&d, "", 0, &len) == 0) {
+            long long offset = member_stream_reserve(stream, len);
+            status = member_stream_write(stream, offset, d.buf, len, 0, 0, -1);
+        } else {
+            status = -1;
+        }
+        member_deflater_free(&d);
+    }
+
+    if (manifest && status == 0) {
+        status = write_manifest(stream);
+    }
+    if (close(stream->fd) != 0) {
+        status = -1;
+    }
+    free(stream->entries);
+    pthread_mutex_destroy(&stream->lock);
+    return status;
+}
+
+int member_deflater_init(member_deflater_t *d, int level) {
+    memset(d, 0, sizeof(*d));
+    // windowBits 15 + 16 selects a gzip wrapper, so every member is a complete gzip file
+    if (deflateInit2(&d->zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+int member_deflate(member_deflater_t *d, const char *in, size_t len, size_t *out_len) {
+    size_t bound = deflateBound(&d->zs, len);
+    if (bound > d->cap) {
+        unsigned char *grown = realloc(d->buf, bound);
+        if (!grown) return -1;
+        d->buf = grown;
+        d->cap = bound;
+    }
+
+    deflateReset(&d->zs);
+    d->zs.next_in = (Bytef *)in;
+    d->zs.avail_in = (uInt)len;
+    d->zs.next_out = d->buf;
+    d->zs.avail_out = (uInt)d->cap;
+    if (deflate(&d->zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    *out_len = d->cap - d->zs.avail_out;
+    return 0;
+}
+
+void member_deflater_free(member_deflater_t *d) {
+    deflateEnd(&d->zs);
+    free(d->buf);
+    d->buf = NULL;
+    d->cap = 0;
+}
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <errno.h>
+#include <zlib.h>
+
+#define FQ_MAX_LINE 4096
+#define MERGE_MAX_READ 1024          // longer pairs are passed through unmerged
+#define MERGE_WORDS (MERGE_MAX_READ / 64 + 2)
+#define DEFAULT_MIN_OVERLAP 20
+#define DEFAULT_MAX_MISMATCH 0.1
+#define MERGE_MAX_QUAL 41
+#define MERGE_MIN_QUAL 2
+
+// Merge overlapping mates of short inserts into one read. R2 is reverse
+// complemented and slid along R1; every candidate offset is scored 64
+// positions at a time as the popcount of the differing bits of two 2-bit
+// planes, leaving out positions where either read has an N. The offset
+// with the fewest mismatches per overlapping base is taken when it is
+// within --max-mismatch and no other offset ties it; the overlap then
+// becomes a quality-aware consensus.
+
+typedef struct {
+    char header[FQ_MAX_LINE];
+    char seq[FQ_MAX_LINE];
+    char plus[FQ_MAX_LINE];
+    char qual[FQ_MAX_LINE];
+} fastq_record_t;
+
+// A read as bit planes: bit i of word i / 64 holds position i
+typedef struct {
+    uint64_t hi[MERGE_WORDS];
+    uint64_t lo[MERGE_WORDS];
+    uint64_t called[MERGE_WORDS];    // 1 for A, C, G and T
+} planes_t;
+
+typedef struct {
+    int min_overlap;
+    double max_mismatch;
+    uint64_t pairs;
+    uint64_t merged;
+    uint64_t ambiguous;              // two offsets scored equally well
+    uint64_t overlap_bases;
+    uint64_t merged_bases;
+    uint64_t disagreements;          // overlap positions where the mates differ
+} merge_stats_t;
+
+void show_usage(const char *program_name);
+
+static int read_record(gzFile fp, fastq_record_t *r) {
+    if (!gzgets(fp, r->header, FQ_MAX_LINE)) return 0;
+    if (!gzgets(fp, r->seq, FQ_MAX_LINE) || !gzgets(fp, r->plus, FQ_MAX_LINE) ||
+        !gzgets(fp, r->qual, FQ_MAX_LINE)) return -1;
+    r->seq[strcspn(r->seq, "\r\n")] = '\0';
+    r->qual[strcspn(r->qual, "\r\n")] = '\0';
+    return 1;
+}
+
+static int write_record(gzFile fp, const char *header, const char *seq, const char *qual) {
+    return gzputs(fp, header) >= 0 && gzputs(fp, seq) >= 0 && gzputs(fp, "\n+\n") >= 0 &&
+           gzputs(fp, qual) >= 0 && gzputs(fp, "\n") >= 0 ? 0 : -1;
+}
+
+static char complement(char c) {
+    switch (c) {
+        case 'A': return 'T';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        case 'T': return 'A';
+        default: return 'N';
+    }
+}
+
+static void encode(const char *seq, int len, planes_t *p) {
+    memset(p, 0, sizeof(*p));
+    for (int i = 0; i < len; i++) {
+        uint64_t bit = 1ULL << (i % 64);
+        int w = i / 64;
+        switch (seq[i]) {
+            case 'A': break;
+            case 'C': p->lo[w] |= bit; break;
+            case 'G': p->hi[w] |= bit; break;
+            case 'T': p->hi[w] |= bit; p->lo[w] |= bit; break;
+            default: continue;
+        }
+        p->called[w] |= bit;
+    }
+}
+
+// 64 bits of a plane starting at position from
+static uint64_t window(const uint64_t *plane, int from) {
+    int w = from / 64, b = from % 64;
+    return b ? plane[w] >> b | plane[w + 1] << (64 - b) : plane[w];
+}
+
+// Mismatches between a[from, from + n) and b[0, n), or limit + 1 once past limit
+static int hamming(const planes_t *a, int from, const planes_t *b, int n, int limit) {
+    int mismatches = 0;
+    for (int k = 0; k * 64 < n; k++) {
+        uint64_t diff = (window(a->hi, from + 64 * k) ^ b->hi[k]) | (window(a->lo, from + 64 * k) ^ b->lo[k]);
+        diff &= window(a->called, from + 64 * k) & b->called[k];
+        if (n - 64 * k < 64) diff &= (1ULL << (n - 64 * k)) - 1;
+        mismatches += __builtin_popcountll(diff);
+        if (mismatches > limit) return limit + 1;
+    }
+    return mismatches;
+}
+
+// Offset of the reverse-complemented R2 in R1, or -1 (-2 when two offsets tie)
+static int find_overlap(const merge_stats_t *st, const planes_t *p1, int len1, const planes_t *p2, int len2) {
+    int best = -1, tied = 0;
+    double best_rate = 2;
+    // R2 must reach the end of R1; an insert shorter than R1 would leave adapter in the merge
+    int first = len1 > len2 ? len1 - len2 : 0;
+    for (int d = first; d <= len1 - st->min_overlap; d++) {
+        int overlap = len1 - d;
+        int limit = (int)(st->max_mismatch * overlap);
+        int mismatches = hamming(p1, d, p2, overlap, limit);
+        if (mismatches > limit) continue;
+        double rate = (double)mismatches / overlap;
+        if (rate < best_rate) {
+            best = d;
+            best_rate = rate;
+            tied = 0;
+        } else if (rate == best_rate) {
+            tied = 1;
+        }
+    }
+    return tied ? -2 : best;
+}
+
+// R1 up to the overlap, the consensus of both mates over it, then the rest of R2
+static void build_merged(const char *s1, const char *q1, int len1, const char *s2, const char *q2, int len2,
+                         int d, char *seq, char *qual, merge_stats_t *st) {
+    memcpy(seq, s1, d);
+    memcpy(qual, q1, d);
+    for (int j = 0; d + j < len1; j++) {
+        char b1 = s1[d + j], b2 = s2[j];
+        int a = q1[d + j] - 33, b = q2[j] - 33, q;
+        char base;
+        if (b1 == b2) {
+            base = b1;
+            q = a + b > MERGE_MAX_QUAL ? MERGE_MAX_QUAL : a + b;
+        } else if (b1 == 'N' || b2 == 'N') {
+            base = b1 == 'N' ? b2 : b1;
+            q = b1 == 'N' ? b : a;
+        } else {
+            st->disagreements++;
+            base = b > a ? b2 : b1;
+            q = a > b ? a - b : b - a;
+            if (q < MERGE_MIN_QUAL) q = MERGE_MIN_QUAL;
+        }
+        seq[d + j] = base;
+        qual[d + j] = (char)(q + 33);
+    }
+    int overlap = len1 - d;
+    memcpy(seq + len1, s2 + overlap, len2 - overlap);
+    memcpy(qual + len1, q2 + overlap, len2 - overlap);
+    seq[d + len2] = qual[d + len2] = '\0';
+}
+
+int main(int argc, char *argv[]) {
+    merge_stats_t st;
+    memset(&st, 0, sizeof(st));
+    st.min_overlap = DEFAULT_MIN_OVERLAP;
+    st.max_mismatch = DEFAULT_MAX_MISMATCH;
+
+    int opt;
+    static struct option long_options[] = {
+        {"min-overlap", required_argument, 0, 'm'},
+        {"max-mismatch", required_argument, 0, 'x'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "m:x:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                st.min_overlap = atoi(optarg);
+                break;
+            case 'x':
+                st.max_mismatch = atof(optarg);
+                break;
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            default:
+                show_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 5) {
+        fprintf(stderr, "Error: two input and three output FASTQ paths are required\n");
+        show_usage(argv[0]);
+        return 1;
+    }
+    if (st.min_overlap < 1 || st.max_mismatch < 0 || st.max_mismatch >= 1) {
+        fprintf(stderr, "Error: --min-overlap must be positive and --max-mismatch in [0, 1)\n");
+        return 1;
+    }
+
+    const char *in1 = argv[optind], *in2 = argv[optind + 1];
+    gzFile in[2] = {gzopen(in1, "r"), gzopen(in2, "r")};
+    gzFile merged_out = gzopen(argv[optind + 2], "w");
+    gzFile out[2] = {gzopen(argv[optind + 3], "w"), gzopen(argv[optind + 4], "w")};
+    if (!in[0] || !in[1] || !merged_out || !out[0] || !out[1]) {
+        fprintf(stderr, "Error opening input or output files: %s\n", strerror(errno));
+        return 1;
+    }
+
+    fastq_record_t *rec = malloc(2 * sizeof(fastq_record_t));
+    planes_t *planes = malloc(2 * sizeof(planes_t));
+    char *rc_seq = malloc(MERGE_MAX_READ + 1), *rc_qual = malloc(MERGE_MAX_READ + 1);
+    char *seq = malloc(2 * MERGE_MAX_READ + 1), *qual = malloc(2 * MERGE_MAX_READ + 1);
+    if (!rec || !planes || !rc_seq || !rc_qual || !seq || !qual) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+
+    int status = 0;
+    for (;; st.pairs++) {
+        int r1 = read_record(in[0], &rec[0]), r2 = read_record(in[1], &rec[1]);
+        if (r1 == 0 && r2 == 0) break;
+        if (r1 <= 0 || r2 <= 0) {
+            fprintf(stderr, "Error: %s and %s are truncated or out of step\n", in1, in2);
+            status = 1;
+            break;
+        }
+        int len1 = (int)strlen(rec[0].seq), len2 = (int)strlen(rec[1].seq);
+        int d = -1;
+        if (len1 <= MERGE_MAX_READ && len2 <= MERGE_MAX_READ && (int)strlen(rec[0].qual) == len1 &&
+            (int)strlen(rec[1].qual) == len2 && len1 >= st.min_overlap && len2 >= st.min_overlap) {
+            for (int i = 0; i < len2; i++) {
+                rc_seq[i] = complement(rec[1].seq[len2 - 1 - i]);
+                rc_qual[i] = rec[1].qual[len2 - 1 - i];
+            }
+            rc_seq[len2] = rc_qual[len2] = '\0';
+            encode(rec[0].seq, len1, &planes[0]);
+            encode(rc_seq, len2, &planes[1]);
+            d = find_overlap(&st, &planes[0], len1, &planes[1], len2);
+        }
+
+        int written;
+        if (d >= 0) {
+            build_merged(rec[0].seq, rec[0].qual, len1, rc_seq, rc_qual, len2, d, seq, qual, &st);
+            st.merged++;
+            st.overlap_bases += len1 - d;
+            st.merged_bases += d + len2;
+            written = write_record(merged_out, rec[0].header, seq, qual);
+        } else {
+            st.ambiguous += d == -2;
+            written = write_record(out[0], rec[0].header, rec[0].seq, rec[0].qual) != 0 ||
+                      write_record(out[1], rec[1].header, rec[1].seq, rec[1].qual) != 0 ? -1 : 0;
+        }
+        if (written != 0) {
+            fprintf(stderr, "Error writing FASTQ output\n");
+            status = 1;
+            break;
+        }
+    }
+
+    for (int m = 0; m < 2; m++) {
+        gzclose(in[m]);
+        if (gzclose(out[m]) != Z_OK) status = 1;
+    }
+    if (gzclose(merged_out) != Z_OK) status = 1;
+
+    printf("Merge: %lu read pairs, %lu merged (%.1f%%), %lu with two equally good overlaps\n",
+           (unsigned long)st.pairs, (unsigned long)st.merged, st.pairs ? 100.0 * st.merged / st.pairs : 0,
+           (unsigned long)st.ambiguous);
+    if (st.merged) {
+        printf("  mean overlap %.1f bases, mean merged length %.1f, mates disagree at %.2f%% of overlap bases\n",
+               (double)st.overlap_bases / st.merged, (double)st.merged_bases / st.merged,
+               100.0 * st.disagreements / st.overlap_bases);
+    }
+
+    free(rec);
+    free(planes);
+    free(rc_seq);
+    free(rc_qual);
+    free(seq);
+    free(qual);
+    return status;
+}
+
+void show_usage(const char *program_name) {
+    printf("Usage: %s [OPTIONS] IN_1.fq.gz IN_2.fq.gz MERGED.fq.gz OUT_1.fq.gz OUT_2.fq.gz\n", program_name);
+    printf("Merge overlapping mates into single reads; pairs without a confident overlap are\n");
+    printf("written unchanged to OUT_1 and OUT_2. Merged reads keep the R1 header\n\n");
+    printf("Options:\n");
+    printf("  -m, --min-overlap N      Shortest overlap to merge on (default: %d)\n", DEFAULT_MIN_OVERLAP);
+    printf("  -x, --max-mismatch F     Most mismatches per overlapping base (default: %.2f)\n",
+           DEFAULT_MAX_MISMATCH);
+    printf("  -h, --help               Show this help message\n");
+    printf("\nIn the overlap, agreeing bases add their qualities (up to %d); where the mates\n", MERGE_MAX_QUAL);
+    printf("disagree the better base is kept with the difference of the two qualities.\n");
+}
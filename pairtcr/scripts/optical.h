@@ -0,0 +1,51 @@
+#ifndef OPTICAL_H
+#define OPTICAL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "preprocess.h"
+
+// Illumina cluster position packed as lane (8 bits), tile (16), x (20) and
+// y (20), highest first, so numeric order is (lane, tile, x, y) order
+#define OPTICAL_NONE UINT64_MAX
+#define OPTICAL_TILE_SHIFT 40
+#define OPTICAL_COORD_BITS 20
+
+// Cluster position of a read, or OPTICAL_NONE when the header is not
+// "...:lane:tile:x:y" (CASAVA 1.8 and older Illumina read names)
+uint64_t optical_coord(const char *header);
+
+typedef struct {
+    uint64_t coord;
+    uint32_t umi_key;
+} optical_entry_t;
+
+// Classified pairs with their UMI pair key and position. A pair is an
+// optical duplicate when an earlier pair of its sweep (same UMI pair, lane
+// and tile, sorted by x) lies within distance pixels in both x and y; each
+// cluster of such pairs keeps its first pair.
+typedef struct {
+    int distance;                // pixels; 0 = off
+    pthread_mutex_t lock;
+    optical_entry_t *entries;
+    size_t len;
+    size_t cap;
+    long no_coord;               // classified pairs without a parsable position
+    long checked[2];             // per chain, filled by optical_finalize
+    long duplicates[2];
+    long families[2];            // UMI pairs holding at least one duplicate
+} optical_t;
+
+void optical_start(optical_t *o, int distance);
+
+// Fold a processed batch's UMI keys and positions into the run
+void optical_collect(optical_t *o, const batch_t *batch);
+
+// Sort and sweep, writing the duplicates to PREFIX.optical_dups.tsv
+int optical_finalize(optical_t *o, const char *output_dir, const char *output_prefix);
+void optical_report(const optical_t *o);
+void optical_free(optical_t *o);
+
+#endif
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "preprocess.h"
+#include "gz_members.h"
+#include "affinity.h"
+
+// Bounded FIFO of batches; a NULL item tells a worker to exit
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    batch_t **items;
+    int cap;
+    int head;
+    int count;
+} batch_queue_t;
+
+// Batches, queues and workers of one NUMA node. Batches never leave their node:
+// they are allocated and first touched there and only that node's workers pop them.
+typedef struct {
+    batch_queue_t work;
+    batch_queue_t free_batches;
+    batch_t **pool;
+    int pool_size;
+    int workers;
+    long long local_bytes;
+    long long cross_bytes;
+} node_state_t;
+
+typedef struct {
+    const preprocess_config_t *cfg;
+    numa_topology_t topo;
+    node_state_t nodes[MAX_NUMA_NODES];
+    int reader_node;
+    member_stream_t streams[MAX_OUT_STREAMS];
+    progress_t *progress;
+
+    // With two inflate threads the reader fills R1 and hands batches here for R2
+    batch_queue_t mate_queue;
+    fastq_input_t *input;
+
+    // Ordered mode: batches reserve their output ranges in sequence order
+    pthread_mutex_t order_lock;
+    pthread_cond_t order_cond;
+    long next_write_seq;
+
+    int failed;
+} engine_t;
+
+typedef struct {
+    engine_t *engine;
+    pthread_t thread;
+    int node;
+    member_deflater_t deflaters[MAX_OUT_STREAMS];
+} worker_t;
+
+static int queue_init(batch_queue_t *q, int cap) {
+    q->items = calloc((size_t)cap, sizeof(batch_t *));
+    if (!q->items) return -1;
+    q->cap = cap;
+    q->head = 0;
+    q->count = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+static void queue_destroy(batch_queue_t *q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+}
+
+static void queue_push(batch_queue_t *q, batch_t *b) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->count) % q->cap] = b;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static batch_t *queue_pop(batch_queue_t *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    batch_t *b = q->items[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return b;
+}
+
+static size_t write_batch(worker_t *w, batch_t *b) {
+    engine_t *e = w->engine;
+    int streams = e->cfg->out_streams;
+    size_t lengths[MAX_OUT_STREAMS] = {0};
+    long long offsets[MAX_OUT_STREAMS] = {0};
+
+    // Compress every stream of the batch into its own gzip member
+    for (int s = 0; s < streams; s++) {
+        if (b->out[s].records == 0) continue;
+        if (member_deflate(&w->deflaters[s], b->out[s].data, b->out[s].len, &lengths[s]) != 0) {
+            fprintf(stderr, "\nError compressing batch %ld\n", b->seq);
+            __atomic_store_n(&e->failed, 1, __ATOMIC_RELAXED);
+            lengths[s] = 0;
+        }
+    }
+
+    if (e->cfg->unordered) {
+        for (int s = 0; s < streams; s++) {
+            if (lengths[s]) offsets[s] = member_stream_reserve(&e->streams[s], lengths[s]);
+        }
+    } else {
+        pthread_mutex_lock(&e->order_lock);
+        while (e->next_write_seq != b->seq) {
+            pthread_cond_wait(&e->order_cond, &e->order_lock);
+        }
+        for (int s = 0; s < streams; s++) {
+            if (lengths[s]) offsets[s] = member_stream_reserve(&e->streams[s], lengths[s]);
+        }
+        e->next_write_seq++;
+        pthread_cond_broadcast(&e->order_cond);
+        pthread_mutex_unlock(&e->order_lock);
+    }
+
+    for (int s = 0; s < streams; s++) {
+        if (!lengths[s]) continue;
+        if (member_stream_write(&e->streams[s], offsets[s], w->deflaters[s].buf, lengths[s],
+                                b->out[s].len, b->out[s].records, b->seq) != 0) {
+            __atomic_store_n(&e->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    size_t compressed = 0;
+    for (int s = 0; s < streams; s++) compressed += lengths[s];
+    return compressed;
+}
+
+// Account the memory traffic of one batch: the reader writes its arena, the
+// worker reads it, fills the output buffers and deflates them on its own node.
+static void account_traffic(engine_t *e, const batch_t *b, size_t compressed) {
+    node_state_t *node = &e->nodes[b->node];
+    long long touched = (long long)b->arena_used + (long long)compressed;
+    for (int s = 0; s < e->cfg->out_streams; s++) touched += (long long)b->out[s].len;
+
+    if (b->node != e->reader_node) {
+        __atomic_add_fetch(&node->cross_bytes, (long long)b->arena_used, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&node->local_bytes, touched, __ATOMIC_RELAXED);
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    engine_t *e = w->engine;
+    node_state_t *node = &e->nodes[w->node];
+    batch_t *b;
+
+    if (e->cfg->numa) {
+        pin_thread_to_node(pthread_self(), &e->topo, w->node);
+    }
+    // Allocated after pinning so the deflate state is node-local too
+    for (int s = 0; s < e->cfg->out_streams; s++) {
+        member_deflater_init(&w->deflaters[s], Z_DEFAULT_COMPRESSION);
+    }
+
+    while ((b = queue_pop(&node->work)) != NULL) {
+        process_batch(b);
+        size_t compressed = write_batch(w, b);
+        if (e->cfg->numa) {
+            account_traffic(e, b, compressed);
+        }
+        __atomic_add_fetch(&e->progress->tra_pairs, b->tra_pairs, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&e->progress->trb_pairs, b->trb_pairs, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&e->progress->distinct_umis, b->new_umis, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&e->progress->finished_pairs, (long)b->count, __ATOMIC_RELAXED);
+        queue_push(&node->free_batches, b);
+    }
+
+    for (int s = 0; s < e->cfg->out_streams; s++) {
+        member_deflater_free(&w->deflaters[s]);
+    }
+    return NULL;
+}
+
+// Second inflate thread: completes each batch with its R2 records, in batch order
+static void *mate_reader_main(void *arg) {
+    engine_t *e = arg;
+    batch_t *b;
+
+    if (e->cfg->numa) {
+        pin_thread_to_node(pthread_self(), &e->topo, e->reader_node);
+    }
+    while ((b = queue_pop(&e->mate_queue)) != NULL) {
+        node_state_t *node = &e->nodes[b->node];
+        b->count = batch_fill_mate(b, 1, e->input, b->count);
+        if (b->count == 0) {
+            queue_push(&node->free_batches, b);
+            continue;
+        }
+        __atomic_add_fetch(&e->progress->processed_pairs, (long)b->count, __ATOMIC_RELAXED);
+        queue_push(&node->work, b);
+    }
+    return NULL;
+}
+
+// Allocate a node's batch pool from a thread running on that node, touching
+// every page so first-touch placement puts the memory there
+static int create_node_pool(engine_t *e, int k) {
+    node_state_t *node = &e->nodes[k];
+    node->pool_size = node->workers + 2;
+    node->pool = calloc((size_t)node->pool_size, sizeof(batch_t *));
+    if (!node->pool) return -1;
+
+    if (e->cfg->numa) {
+        pin_thread_to_node(pthread_self(), &e->topo, k);
+    }
+    for (int i = 0; i < node->pool_size; i++) {
+        batch_t *b = batch_create(e->cfg->batch_size);
+        if (!b) return -1;
+        if (e->cfg->numa) {
+            memset(b->arena[0], 0, b->arena_size[0]);
+            memset(b->arena[1], 0, b->arena_size[1]);
+        }
+        b->node = k;
+        node->pool[i] = b;
+    }
+
+    // Free queue starts full; the work queue also needs room for the exit markers
+    if (queue_init(&node->free_batches, node->pool_size) != 0 ||
+        queue_init(&node->work, node->pool_size + node->workers) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < node->pool_size; i++) {
+        queue_push(&node->free_batches, node->pool[i]);
+    }
+    return 0;
+}
+
+int run_parallel(const preprocess_config_t *cfg, fastq_input_t *in,
+                 char out_paths[MAX_OUT_STREAMS][MAX_PATH_LEN], progress_t *progress,
+                 run_stats_t *stats) {
+    engine_t engine;
+    memset(&engine, 0, sizeof(engine));
+    engine.cfg = cfg;
+    engine.progress = progress;
+    pthread_mutex_init(&engine.order_lock, NULL);
+    pthread_cond_init(&engine.order_cond, NULL);
+
+    int nthreads = cfg->threads > 0 ? cfg->threads : 1;
+    int status = 1, opened = 0, started = 0, ready = 0;
+    worker_t *workers = NULL;
+
+    // Without --numa everything lives on one logical node and nothing is pinned
+    if (cfg->numa) {
+        numa_discover(&engine.topo);
+    } else {
+        engine.topo.count = 1;
+    }
+    int node_count = engine.topo.count;
+    engine.reader_node = 0;
+
+    for (; opened < cfg->out_streams; opened++) {
+        if (member_stream_open(&engine.streams[opened], out_paths[opened]) != 0) goto done;
+    }
+
+    // Spread workers round-robin over the nodes
+    workers = calloc((size_t)nthreads, sizeof(worker_t));
+    if (!workers) {
+        fprintf(stderr, "Error: out of memory allocating workers\n");
+        goto done;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].engine = &engine;
+        workers[i].node = i % node_count;
+        engine.nodes[workers[i].node].workers++;
+    }
+
+    for (int k = 0; k < node_count; k++) {
+        if (engine.nodes[k].workers == 0) continue;
+        if (create_node_pool(&engine, k) != 0) {
+            fprintf(stderr, "Error: out of memory allocating batches\n");
+            goto done;
+        }
+    }
+    if (cfg->numa) {
+        // The reader stays on its node for the rest of the run
+        pin_thread_to_node(pthread_self(), &engine.topo, engine.reader_node);
+    }
+
+    for (; started < nthreads; started++) {
+        if (pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0) {
+            fprintf(stderr, "Error: could not start worker threads\n");
+            goto done;
+        }
+    }
+
+    int split_inflate = cfg->inflate_threads > 1;
+    pthread_t mate_reader;
+    if (split_inflate) {
+        int total_pool = 0;
+        for (int k = 0; k < node_count; k++) total_pool += engine.nodes[k].pool_size;
+        engine.input = in;
+        if (queue_init(&engine.mate_queue, total_pool + 1) != 0) {
+            fprintf(stderr, "Error: out of memory allocating batch queues\n");
+            goto done;
+        }
+        pthread_create(&mate_reader, NULL, mate_reader_main, &engine);
+    }
+    ready = 1;
+
+    // The calling thread is the reader: it inflates and splits the input into batches,
+    // handing them to nodes in proportion to their worker counts. Yield targets
+    // and the early-abort rule are checked against what workers have finished, so
+    // batches in flight still land.
+    long seq = 0;
+    long requested = 0;
+    while (requested < cfg->read_limit && !target_reached(cfg, progress) && !library_failed(cfg, progress)) {
+        node_state_t *node = &engine.nodes[workers[seq % nthreads].node];
+        batch_t *b = queue_pop(&node->free_batches);
+        int n;
+        if (split_inflate) {
+            n = b->count = batch_fill_mate(b, 0, in, cfg->read_limit - requested);
+        } else {
+            n = batch_fill(b, in, cfg->read_limit - requested);
+        }
+        if (n == 0) {
+            queue_push(&node->free_batches, b);
+            break;
+        }
+        b->seq = seq++;
+        b->first_pair = requested;
+        requested += n;
+        if (split_inflate) {
+            queue_push(&engine.mate_queue, b);
+        } else {
+            progress->processed_pairs += n;
+            queue_push(&node->work, b);
+        }
+        update_progress(progress, 0);
+    }
+
+    if (split_inflate) {
+        queue_push(&engine.mate_queue, NULL);
+        pthread_join(mate_reader, NULL);
+        queue_destroy(&engine.mate_queue);
+    }
+    status = engine.failed;
+
+done:
+    // Failed setup lands here too: stop the workers started and close the streams opened
+    for (int i = 0; i < started; i++) {
+        queue_push(&engine.nodes[workers[i].node].work, NULL);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int s = 0; s < opened; s++) {
+        if (member_stream_close(&engine.streams[s], ready) != 0) {
+            status = 1;
+        }
+    }
+
+    // Unpinned, a batch would be allocated, filled, matched and compressed on
+    // arbitrary nodes; each touch then lands remotely with probability (n-1)/n
+    stats->numa_nodes = node_count;
+    for (int k = 0; k < node_count; k++) {
+        node_state_t *node = &engine.nodes[k];
+        stats->node_local_bytes += node->local_bytes;
+        stats->cross_node_bytes += node->cross_bytes;
+        stats->unpinned_cross_bytes += (node->local_bytes + node->cross_bytes) * (node_count - 1) / node_count;
+        if (node->pool) {
+            for (int i = 0; i < node->pool_size; i++) {
+                batch_free(node->pool[i]);
+            }
+            free(node->pool);
+        }
+        if (node->work.items) queue_destroy(&node->work);
+        if (node->free_batches.items) queue_destroy(&node->free_batches);
+    }
+
+    free(workers);
+    pthread_mutex_destroy(&engine.order_lock);
+    pthread_cond_destroy(&engine.order_cond);
+    return status ? 1 : 0;
+}
@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "clonotype.h"
+#include "refindex.h"
+
+#define FQ_MAX_LINE 4096
+#define QL_MAX_READ 512          // longer reads are cut; CDR3s sit well inside
+#define QL_MAX_UMI 64
+#define QL_MAX_CDR3_NT 120
+#define QL_MIN_CDR3_NT 15
+#define QL_MAX_CANDIDATES 64
+#define QL_BATCH 8192
+#define QL_CHUNK 64
+#define DEFAULT_QL_K 15
+#define DEFAULT_MIN_SEEDS 2
+#define DEFAULT_SHOW 20
+
+// Quick-look clonotypes without MiXCR: seeds from the reference V and J
+// genes place each gene on a read diagonal, which puts the V Cys and J
+// Phe/Trp anchors on the read; the bases between them are the CDR3. Reads
+// are called per UMI by majority and TRA and TRB UMIs paired as in step 2.
+
+typedef enum {
+    CALL_OK,
+    CALL_NO_V,
+    CALL_NO_J,
+    CALL_OFF_READ,
+    CALL_OUT_OF_FRAME,
+    CALL_STOP,
+    CALL_NO_UMI,
+    CALL_KINDS
+} call_t;
+
+static const char *call_names[CALL_KINDS] = {
+    "CDR3 called", "no V seed", "no J seed", "anchor off read", "out of frame", "stop codon", "no UMI in header"
+};
+
+typedef struct {
+    char umi[QL_MAX_UMI];
+    char seq[2][QL_MAX_READ];
+    // Filled in by the workers
+    call_t call;
+    int v, j;
+    char cdr3[QL_MAX_CDR3_NT / 3 + 1];
+} ql_pair_t;
+
+typedef struct {
+    const ref_index_t *idx;
+    int chain;
+    int min_seeds;
+    ql_pair_t *pairs;
+    int n;
+    int next;                    // work counter shared by the threads
+} ql_job_t;
+
+typedef struct {
+    uint32_t gene;
+    int diagonal;                // anchor position on the read
+    int seeds;
+} candidate_t;
+
+typedef struct {
+    const char *name;
+    long pairs;
+    long calls[CALL_KINDS];
+    clone_dict_t reads;          // "UMI\tV\tJ\tCDR3" -> reads
+    clone_dict_t umis;           // UMI -> best entry in reads
+    int64_t *best;
+} chain_calls_t;
+
+void show_usage(const char *program_name);
+
+// UMI as step 2 reads it: "UMI:TRA:xxx_yyy" in the header, ":RC" dropped
+static int header_umi(const char *header, char *umi) {
+    const char *p = strstr(header, "UMI:TR");
+    if (!p || (p[6] != 'A' && p[6] != 'B') || p[7] != ':') return -1;
+    p += 8;
+    size_t len = 0;
+    while ((p[len] >= 'A' && p[len] <= 'Z') || (p[len] >= 'a' && p[len] <= 'z') ||
+           (p[len] >= '0' && p[len] <= '9') || p[len] == '_') len++;
+    if (len == 0 || len >= QL_MAX_UMI) return -1;
+    memcpy(umi, p, len);
+    umi[len] = '\0';
+    return 0;
+}
+
+// RC(umi1)_RC(umi2) swapped, the TRB UMI a TRA UMI pairs with
+static int paired_umi(const char *umi, char *out) {
+    const char *bar = strchr(umi, '_');
+    if (!bar || strchr(bar + 1, '_')) return -1;
+    int len1 = (int)(bar - umi), len2 = (int)strlen(bar + 1);
+    ref_revcomp(bar + 1, len2, out);
+    out[len2] = '_';
+    ref_revcomp(umi, len1, out + len2 + 1);
+    return 0;
+}
+
+static void add_seed(candidate_t *cand, int *ncand, uint32_t gene, int diagonal) {
+    for (int c = 0; c < *ncand; c++) {
+        if (cand[c].gene == gene && cand[c].diagonal == diagonal) {
+            cand[c].seeds++;
+            return;
+        }
+    }
+    if (*ncand < QL_MAX_CANDIDATES) cand[(*ncand)++] = (candidate_t){gene, diagonal, 1};
+}
+
+static const candidate_t *best_candidate(const candidate_t *cand, int ncand) {
+    const candidate_t *best = NULL;
+    for (int c = 0; c < ncand; c++) {
+        if (!best || cand[c].seeds > best->seeds) best = &cand[c];
+    }
+    return best;
+}
+
+// Call one read in one orientation; *score is the seeds behind the call
+static call_t call_read(const ql_job_t *job, const char *seq, int len, int *v, int *j, char *cdr3, int *score) {
+    const ref_index_t *idx = job->idx;
+    candidate_t vcand[QL_MAX_CANDIDATES], jcand[QL_MAX_CANDIDATES];
+    int nv = 0, nj = 0, k = idx->k, valid = 0;
+    uint64_t kmer = 0, mask = (1ULL << (2 * k)) - 1;
+    *score = 0;
+    for (int i = 0; i < len; i++) {
+        int code = ref_base_code(seq[i]);
+        if (code < 0) {
+            valid = 0;
+            continue;
+        }
+        kmer = ((kmer << 2) | (uint64_t)code) & mask;
+        if (++valid < k) continue;
+        uint32_t n;
+        uint8_t chains;
+        const ref_hit_t *hits = ref_index_lookup(idx, kmer, &n, &chains);
+        if (!(chains & job->chain)) continue;
+        int start = i - k + 1;
+        for (uint32_t h = 0; h < n; h++) {
+            const ref_gene_t *g = &idx->genes[hits[h].gene];
+            if (g->chain != job->chain || g->anchor < 0) continue;
+            int diagonal = start - (int)hits[h].pos + g->anchor;
+            if (g->segment == 'V') add_seed(vcand, &nv, hits[h].gene, diagonal);
+            if (g->segment == 'J') add_seed(jcand, &nj, hits[h].gene, diagonal);
+        }
+    }
+    const candidate_t *bv = best_candidate(vcand, nv), *bj = best_candidate(jcand, nj);
+    if (!bv || bv->seeds < job->min_seeds) return CALL_NO_V;
+    if (!bj || bj->seeds < job->min_seeds) return CALL_NO_J;
+    *score = bv->seeds + bj->seeds;
+    *v = (int)bv->gene;
+    *j = (int)bj->gene;
+    int from = bv->diagonal, to = bj->diagonal + 3;
+    int cdr3_len = to - from;
+    if (from < 0 || to > len) return CALL_OFF_READ;
+    if (cdr3_len < QL_MIN_CDR3_NT || cdr3_len > QL_MAX_CDR3_NT || cdr3_len % 3) return CALL_OUT_OF_FRAME;
+    return ref_translate(seq + from, cdr3_len, cdr3) == 0 ? CALL_OK : CALL_STOP;
+}
+
+// Best call over both reads and strands: a called CDR3 beats any failure and
+// a failure further along beats an earlier one, then more seeds win
+static void call_pair(const ql_job_t *job, ql_pair_t *pair) {
+    char rc[QL_MAX_READ];
+    char cdr3[sizeof(pair->cdr3)];
+    int best_rank = -1, best_score = -1;
+    call_t best = CALL_NO_V;
+    for (int m = 0; m < 4; m++) {
+        const char *seq = pair->seq[m / 2];
+        int len = (int)strlen(seq), v = -1, j = -1, score;
+        if (m % 2) {
+            ref_revcomp(seq, len, rc);
+            seq = rc;
+        }
+        call_t call = call_read(job, seq, len, &v, &j, cdr3, &score);
+        int rank = call == CALL_OK ? CALL_KINDS : (int)call;
+        if (rank > best_rank || (rank == best_rank && score > best_score)) {
+            best = call;
+            best_rank = rank;
+            best_score = score;
+            pair->v = v;
+            pair->j = j;
+            if (call == CALL_OK) memcpy(pair->cdr3, cdr3, sizeof(cdr3));
+        }
+    }
+    pair->call = best;
+}
+
+static void *call_worker(void *arg) {
+    ql_job_t *job = arg;
+    for (;;) {
+        int start = __atomic_fetch_add(&job->next, QL_CHUNK, __ATOMIC_RELAXED);
+        if (start >= job->n) break;
+        int end = start + QL_CHUNK < job->n ? start + QL_CHUNK : job->n;
+        for (int i = start; i < end; i++) {
+            if (job->pairs[i].call != CALL_NO_UMI) call_pair(job, &job->pairs[i]);
+        }
+    }
+    return NULL;
+}
+
+static void copy_read(char *dst, const char *line) {
+    size_t len = strcspn(line, "\r\n");
+    if (len >= QL_MAX_READ) len = QL_MAX_READ - 1;
+    memcpy(dst, line, len);
+    dst[len] = '\0';
+}
+
+// Read up to QL_BATCH pairs, at most *left; returns the count or -1
+static int read_batch(gzFile in[2], ql_pair_t *pairs, long *left, char *line) {
+    int n = 0;
+    while (n < QL_BATCH && *left != 0) {
+        ql_pair_t *p = &pairs[n];
+        for (int m = 0; m < 2; m++) {
+            if (!gzgets(in[m], line, FQ_MAX_LINE)) return m == 0 ? n : -1;
+            if (m == 0) p->call = header_umi(line, p->umi) == 0 ? CALL_OK : CALL_NO_UMI;
+            if (!gzgets(in[m], line, FQ_MAX_LINE)) return -1;
+            copy_read(p->seq[m], line);
+            if (!gzgets(in[m], line, FQ_MAX_LINE) || !gzgets(in[m], line, FQ_MAX_LINE)) return -1;
+        }
+        n++;
+        if (*left > 0) (*left)--;
+    }
+    return n;
+}
+
+static void gene_label(const ref_index_t *idx, int g, char *out, size_t size) {
+    // MiXCR's -vGene/-jGene drop the allele
+    snprintf(out, size, "%.*s", (int)strcspn(idx->genes[g].name, "*"), idx->genes[g].name);
+}
+
+static int tally_batch(chain_calls_t *cc, const ref_index_t *idx, const ql_pair_t *pairs, int n) {
+    char key[QL_MAX_UMI + 2 * REF_NAME_LEN + sizeof(pairs->cdr3) + 4];
+    char vname[REF_NAME_LEN], jname[REF_NAME_LEN];
+    for (int i = 0; i < n; i++) {
+        const ql_pair_t *p = &pairs[i];
+        cc->calls[p->call]++;
+        if (p->call != CALL_OK) continue;
+        gene_label(idx, p->v, vname, sizeof(vname));
+        gene_label(idx, p->j, jname, sizeof(jname));
+        int len = snprintf(key, sizeof(key), "%s\t%s\t%s\t%s", p->umi, vname, jname, p->cdr3);
+        int64_t id = clone_dict_intern(&cc->reads, key, (size_t)len, clone_hash(key, (size_t)len));
+        if (id < 0) return -1;
+        cc->reads.entries[id].count++;
+    }
+    return 0;
+}
+
+static int call_chain(chain_calls_t *cc, const ref_index_t *idx, int chain, const char *path1, const char *path2,
+                      int threads, int min_seeds, long limit) {
+    gzFile in[2] = {gzopen(path1, "r"), gzopen(path2, "r")};
+    if (!in[0] || !in[1]) {
+        fprintf(stderr, "Error opening %s / %s: %s\n", path1, path2, strerror(errno));
+        if (in[0]) gzclose(in[0]);
+        if (in[1]) gzclose(in[1]);
+        return -1;
+    }
+    ql_pair_t *batch[2] = {malloc(QL_BATCH * sizeof(ql_pair_t)), malloc(QL_BATCH * sizeof(ql_pair_t))};
+    char *line = malloc(FQ_MAX_LINE);
+    int status = batch[0] && batch[1] && line ? 0 : -1;
+    long left = limit;
+
+    // Workers call one batch while this thread inflates the next
+    int n = status == 0 ? read_batch(in, batch[0], &left, line) : 0;
+    int cur = 0;
+    while (status == 0 && n > 0) {
+        ql_job_t job = {idx, chain, min_seeds, batch[cur], n, 0};
+        pthread_t tids[threads];
+        for (int t = 0; t < threads; t++) pthread_create(&tids[t], NULL, call_worker, &job);
+        int next_n = read_batch(in, batch[1 - cur], &left, line);
+        for (int t = 0; t < threads; t++) pthread_join(tids[t], NULL);
+        cc->pairs += n;
+        if (tally_batch(cc, idx, batch[cur], n) != 0) {
+            fprintf(stderr, "Error: out of memory tallying %s calls\n", cc->name);
+            status = -1;
+        }
+        if (next_n < 0) {
+            fprintf(stderr, "Error: %s and %s are truncated or out of step\n", path1, path2);
+            status = -1;
+        }
+        n = next_n;
+        cur = 1 - cur;
+    }
+    if (status == 0 && n < 0) {
+        fprintf(stderr, "Error: %s and %s are truncated or out of step\n", path1, path2);
+        status = -1;
+    }
+    gzclose(in[0]);
+    gzclose(in[1]);
+    free(batch[0]);
+    free(batch[1]);
+    free(line);
+    return status;
+}
+
+// Each UMI's clonotype is the one most of its reads support
+static int call_umis(chain_calls_t *cc) {
+    if (clone_dict_init(&cc->umis, cc->reads.len + 1) != 0) return -1;
+    cc->best = malloc((cc->reads.len + 1) * sizeof(int64_t));
+    if (!cc->best) return -1;
+    for (size_t e = 0; e < cc->reads.len; e++) {
+        const char *key = clone_dict_key(&cc->reads, e);
+        size_t len = strcspn(key, "\t");
+        int64_t u = clone_dict_intern(&cc->umis, key, len, clone_hash(key, len));
+        if (u < 0) return -1;
+        if (cc->umis.entries[u].count == 0 ||
+            cc->reads.entries[e].count > cc->reads.entries[cc->best[u]].count) cc->best[u] = (int64_t)e;
+        cc->umis.entries[u].count += cc->reads.entries[e].count;
+    }
+    return 0;
+}
+
+static const char *umi_clonotype(const chain_calls_t *cc, int64_t u) {
+    const char *key = clone_dict_key(&cc->reads, (size_t)cc->best[u]);
+    return key + strcspn(key, "\t") + 1;
+}
+
+static const clone_dict_t *sort_dict;
+
+static int compare_clones(const void *a, const void *b) {
+    const clone_entry_t *x = &sort_dict->entries[*(const size_t *)a], *y = &sort_dict->entries[*(const size_t *)b];
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return strcmp(sort_dict->arena + x->offset, sort_dict->arena + y->offset);
+}
+
+int main(int argc, char *argv[]) {
+    const char *reference = NULL, *prefix = "quicklook";
+    int threads = 1, k = DEFAULT_QL_K, min_seeds = DEFAULT_MIN_SEEDS, show = DEFAULT_SHOW;
+    long limit = -1;
+
+    int opt;
+    static struct option long_options[] = {
+        {"reference", required_argument, 0, 'r'},
+        {"output", required_argument, 0, 'o'},
+        {"threads", required_argument, 0, 't'},
+        {"reads", required_argument, 0, 'n'},
+        {"kmer", required_argument, 0, 'k'},
+        {"min-seeds", required_argument, 0, 's'},
+        {"top", required_argument, 0, 'N'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "r:o:t:n:k:s:N:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                reference = optarg;
+                break;
+            case 'o':
+                prefix = optarg;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'n':
+                limit = atol(optarg);
+                break;
+            case 'k':
+                k = atoi(optarg);
+                break;
+            case 's':
+                min_seeds = atoi(optarg);
+                break;
+            case 'N':
+                show = atoi(optarg);
+                break;
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            default:
+                show_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 4 || !reference) {
+        fprintf(stderr, "Error: --reference and the TRA and TRB read pairs are required\n");
+        show_usage(argv[0]);
+        return 1;
+    }
+    if (threads < 1 || min_seeds < 1) {
+        fprintf(stderr, "Error: --threads and --min-seeds must be at least 1\n");
+        return 1;
+    }
+
+    ref_index_t idx;
+    memset(&idx, 0, sizeof(idx));
+    if (ref_load_fasta(&idx, reference) != 0 || ref_index_build(&idx, k, 1) != 0) return 1;
+    int anchored[2] = {0, 0};
+    for (int g = 0; g < idx.ngenes; g++) {
+        if (idx.genes[g].anchor >= 0 && idx.genes[g].segment == 'V') anchored[0]++;
+        if (idx.genes[g].anchor >= 0 && idx.genes[g].segment == 'J') anchored[1]++;
+    }
+    if (anchored[0] == 0 || anchored[1] == 0) {
+        fprintf(stderr, "Error: reference %s has no V genes with a Cys anchor or no J genes with an "
+                "F/W-G-x-G motif\n", reference);
+        return 1;
+    }
+
+    chain_calls_t cc[2];
+    memset(cc, 0, sizeof(cc));
+    cc[0].name = "TRA";
+    cc[1].name = "TRB";
+    for (int c = 0; c < 2; c++) {
+        if (clone_dict_init(&cc[c].reads, 1 << 16) != 0 ||
+            call_chain(&cc[c], &idx, c == 0 ? REF_CHAIN_A : REF_CHAIN_B, argv[optind + 2 * c],
+                       argv[optind + 2 * c + 1], threads, min_seeds, limit) != 0) return 1;
+        if (call_umis(&cc[c]) != 0) {
+            fprintf(stderr, "Error: out of memory calling %s UMIs\n", cc[c].name);
+            return 1;
+        }
+    }
+
+    // Pair TRA and TRB UMIs and count UMI pairs per paired clonotype
+    clone_dict_t paired;
+    if (clone_dict_init(&paired, cc[0].umis.len + 1) != 0) return 1;
+    char trb_umi[QL_MAX_UMI], key[2 * (QL_MAX_UMI + 2 * REF_NAME_LEN + QL_MAX_CDR3_NT)];
+    long umi_pairs = 0;
+    for (size_t u = 0; u < cc[0].umis.len; u++) {
+        const char *umi = clone_dict_key(&cc[0].umis, u);
+        if (paired_umi(umi, trb_umi) != 0) continue;
+        size_t len = strlen(trb_umi);
+        int64_t b = clone_dict_find(&cc[1].umis, trb_umi, len, clone_hash(trb_umi, len));
+        if (b < 0) continue;
+        int key_len = snprintf(key, sizeof(key), "%s\t%s", umi_clonotype(&cc[0], (int64_t)u),
+                               umi_clonotype(&cc[1], b));
+        int64_t id = clone_dict_intern(&paired, key, (size_t)key_len, clone_hash(key, (size_t)key_len));
+        if (id < 0) {
+            fprintf(stderr, "Error: out of memory pairing UMIs\n");
+            return 1;
+        }
+        paired.entries[id].count++;
+        umi_pairs++;
+    }
+
+    size_t *order = malloc((paired.len + 1) * sizeof(size_t));
+    if (!order) return 1;
+    for (size_t i = 0; i < paired.len; i++) order[i] = i;
+    sort_dict = &paired;
+    qsort(order, paired.len, sizeof(size_t), compare_clones);
+
+    char path[FQ_MAX_LINE];
+    snprintf(path, sizeof(path), "%s.quicklook.tsv", prefix);
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fprintf(out, "%s\tcount\tfraction\n", clone_level_header(CLONE_PAIRED));
+    for (size_t i = 0; i < paired.len; i++) {
+        const clone_entry_t *e = &paired.entries[order[i]];
+        fprintf(out, "%s\t%lu\t%.6f\n", paired.arena + e->offset, (unsigned long)e->count,
+                (double)e->count / (double)umi_pairs);
+    }
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error writing %s\n", path);
+        return 1;
+    }
+
+    printf("Quick look (%d threads, k=%d):\n", threads, k);
+    for (int c = 0; c < 2; c++) {
+        printf("  %s: %ld read pairs, %lu UMIs with a CDR3\n", cc[c].name, cc[c].pairs,
+               (unsigned long)cc[c].umis.len);
+        for (int call = 0; call < CALL_KINDS; call++) {
+            if (cc[c].calls[call]) {
+                printf("    %-18s %10ld (%.2f%%)\n", call_names[call], cc[c].calls[call],
+                       100.0 * cc[c].calls[call] / cc[c].pairs);
+            }
+        }
+    }
+    printf("  %ld paired UMIs, %lu paired clonotypes -> %s\n", umi_pairs, (unsigned long)paired.len, path);
+    if (show > 0 && paired.len > 0) {
+        printf("\nTop paired clonotypes (UMI pairs):\n");
+        for (size_t i = 0; i < paired.len && i < (size_t)show; i++) {
+            const clone_entry_t *e = &paired.entries[order[i]];
+            printf("  %6lu  %s\n", (unsigned long)e->count, paired.arena + e->offset);
+        }
+    }
+
+    free(order);
+    clone_dict_free(&paired);
+    for (int c = 0; c < 2; c++) {
+        clone_dict_free(&cc[c].reads);
+        clone_dict_free(&cc[c].umis);
+        free(cc[c].best);
+    }
+    ref_index_free(&idx);
+    return 0;
+}
+
+void show_usage(const char *program_name) {
+    printf("Usage: %s --reference REF.fa [OPTIONS] TRA_1.fq.gz TRA_2.fq.gz TRB_1.fq.gz TRB_2.fq.gz\n",
+           program_name);
+    printf("Estimate paired clonotypes from step 1 (or step 2.5) reads without MiXCR\n\n");
+    printf("Options:\n");
+    printf("  -r, --reference FILE     FASTA of TRA and TRB V and J genes (IMGT V-REGION/J-REGION\n");
+    printf("                           or names like TRBV20-1*01), plain or gzip\n");
+    printf("  -o, --output PREFIX      Write PREFIX.quicklook.tsv (default: quicklook)\n");
+    printf("  -t, --threads N          Worker threads (default: 1)\n");
+    printf("  -n, --reads N            Read pairs per chain to use (default: all)\n");
+    printf("  -k, --kmer K             Seed length (default: %d)\n", DEFAULT_QL_K);
+    printf("  -s, --min-seeds N        Seeds needed to place a V or J gene (default: %d)\n", DEFAULT_MIN_SEEDS);
+    printf("  -N, --top N              Paired clonotypes to print (default: %d)\n", DEFAULT_SHOW);
+    printf("  -h, --help               Show this help message\n");
+}
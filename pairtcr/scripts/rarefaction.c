@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "rarefaction.h"
+
+#define RAREFY_FIRST_CHECKPOINT 10000
+#define UMI_SINGLE_KEYS (1 << 15)    // chain bit + one 7-base UMI
+
+// Single-UMI keys carried inside a UMI pair key
+static uint32_t umi1_of(uint32_t key) {
+    return key >> 14;
+}
+
+static uint32_t umi2_of(uint32_t key) {
+    return (key >> 28) << 14 | (key & 0x3FFF);
+}
+
+void rarefaction_start(rarefaction_t *r, int mode) {
+    memset(r, 0, sizeof(*r));
+    r->mode = mode;
+    r->next_checkpoint = RAREFY_FIRST_CHECKPOINT;
+    pthread_mutex_init(&r->lock, NULL);
+}
+
+void rarefaction_add(rarefaction_t *r, uint32_t key) {
+    hll_add(&r->hll[RAREFY_UMI1], sketch_hash(umi1_of(key)));
+    hll_add(&r->hll[RAREFY_UMI2], sketch_hash(umi2_of(key)));
+    hll_add(&r->hll[RAREFY_PAIR], sketch_hash(key));
+}
+
+static void take_point(rarefaction_t *r) {
+    rarefaction_point_t *p = &r->points[r->npoints++];
+    p->pairs = r->pairs;
+    p->classified = r->classified;
+    for (int k = 0; k < RAREFY_KINDS; k++) p->distinct[k] = hll_estimate(&r->hll[k]);
+}
+
+void rarefaction_batch(rarefaction_t *r, long pairs, long classified) {
+    pthread_mutex_lock(&r->lock);
+    r->pairs += pairs;
+    r->classified += classified;
+    // One slot stays free for the final point
+    if (r->pairs >= r->next_checkpoint && r->npoints < RAREFACTION_MAX_POINTS - 1) {
+        take_point(r);
+        while (r->next_checkpoint <= r->pairs) r->next_checkpoint = (long)(r->next_checkpoint * M_SQRT2);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int compare_counts(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Abundance classes of one kind: how many keys were seen exactly count times
+typedef struct {
+    uint32_t count;
+    long keys;
+} abundance_t;
+
+static size_t abundance_classes(uint32_t *counts, size_t n, abundance_t *classes) {
+    qsort(counts, n, sizeof(uint32_t), compare_counts);
+    size_t c = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (c > 0 && classes[c - 1].count == counts[i]) {
+            classes[c - 1].keys++;
+        } else {
+            classes[c].count = counts[i];
+            classes[c++].keys = 1;
+        }
+    }
+    return c;
+}
+
+// Expected distinct keys in a uniform subsample of m of the total pairs:
+// a key seen c times is missed with probability C(total - c, m) / C(total, m)
+static double expected_distinct(const abundance_t *classes, size_t nclasses, long total, long m) {
+    double distinct = 0;
+    double base = lgamma((double)total + 1) - lgamma((double)(total - m) + 1);
+    for (size_t i = 0; i < nclasses; i++) {
+        long rest = total - (long)classes[i].count;
+        double missed = 0;
+        if (rest >= m) {
+            missed = exp(lgamma((double)rest + 1) - lgamma((double)(rest - m) + 1) - base);
+        }
+        distinct += (double)classes[i].keys * (1 - missed);
+    }
+    return distinct;
+}
+
+// Bias-corrected Chao1 richness from the singleton and doubleton classes
+static double chao1(const abundance_t *classes, size_t nclasses) {
+    double observed = 0, f1 = 0, f2 = 0;
+    for (size_t i = 0; i < nclasses; i++) {
+        observed += (double)classes[i].keys;
+        if (classes[i].count == 1) f1 = (double)classes[i].keys;
+        if (classes[i].count == 2) f2 = (double)classes[i].keys;
+    }
+    return observed + f1 * (f1 - 1) / (2 * (f2 + 1));
+}
+
+static void finish_exact(rarefaction_t *r, const umi_entry_t *entries, size_t n, long pairs) {
+    uint32_t *counts = malloc((n ? n : 1) * sizeof(uint32_t));
+    uint32_t *single = calloc(2 * UMI_SINGLE_KEYS, sizeof(uint32_t));
+    abundance_t *classes[RAREFY_KINDS];
+    size_t nclasses[RAREFY_KINDS];
+    for (int k = 0; k < RAREFY_KINDS; k++) {
+        classes[k] = malloc((n > UMI_SINGLE_KEYS ? n : UMI_SINGLE_KEYS) * sizeof(abundance_t));
+    }
+    if (!counts || !single || !classes[0] || !classes[1] || !classes[2]) {
+        fprintf(stderr, "Error: out of memory computing the rarefaction curve\n");
+        r->mode = RAREFY_OFF;
+        goto done;
+    }
+
+    long total = 0;
+    for (size_t i = 0; i < n; i++) {
+        counts[i] = entries[i].count;
+        single[umi1_of(entries[i].key)] += entries[i].count;
+        single[UMI_SINGLE_KEYS + umi2_of(entries[i].key)] += entries[i].count;
+        total += entries[i].count;
+    }
+    nclasses[RAREFY_PAIR] = abundance_classes(counts, n, classes[RAREFY_PAIR]);
+    for (int k = RAREFY_UMI1; k <= RAREFY_UMI2; k++) {
+        uint32_t *seen = single + (size_t)k * UMI_SINGLE_KEYS;
+        size_t m = 0;
+        for (size_t i = 0; i < UMI_SINGLE_KEYS; i++) {
+            if (seen[i]) seen[m++] = seen[i];
+        }
+        nclasses[k] = abundance_classes(seen, m, classes[k]);
+    }
+
+    // Subsample depths in classified pairs, mapped back to read pairs at the run's rate
+    r->npoints = 0;
+    for (int j = 1; j <= RAREFACTION_EXACT_POINTS && total > 0; j++) {
+        rarefaction_point_t *p = &r->points[r->npoints++];
+        p->classified = total * j / RAREFACTION_EXACT_POINTS;
+        p->pairs = (long)((double)pairs * p->classified / total + 0.5);
+        for (int k = 0; k < RAREFY_KINDS; k++) {
+            p->distinct[k] = expected_distinct(classes[k], nclasses[k], total, p->classified);
+        }
+    }
+    for (int k = 0; k < RAREFY_KINDS; k++) r->chao1[k] = chao1(classes[k], nclasses[k]);
+
+done:
+    free(counts);
+    free(single);
+    for (int k = 0; k < RAREFY_KINDS; k++) free(classes[k]);
+}
+
+void rarefaction_finish(rarefaction_t *r, const umi_entry_t *entries, size_t n, long pairs) {
+    if (r->mode == RAREFY_EXACT) {
+        finish_exact(r, entries, n, pairs);
+    } else if (r->mode == RAREFY_HLL && (r->npoints == 0 || r->points[r->npoints - 1].pairs != r->pairs)) {
+        take_point(r);
+    }
+}
+
+int rarefaction_write(const rarefaction_t *r, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error writing rarefaction curve %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "read_pairs\tclassified_pairs\tdistinct_umi1\tdistinct_umi2\tdistinct_umi_pairs\n");
+    for (int i = 0; i < r->npoints; i++) {
+        const rarefaction_point_t *p = &r->points[i];
+        fprintf(fp, "%ld\t%ld\t%.1f\t%.1f\t%.1f\n", p->pairs, p->classified,
+                p->distinct[RAREFY_UMI1], p->distinct[RAREFY_UMI2], p->distinct[RAREFY_PAIR]);
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+void rarefaction_report(const rarefaction_t *r) {
+    if (r->npoints == 0) {
+        printf("Rarefaction: no classified pairs\n");
+        return;
+    }
+    const rarefaction_point_t *last = &r->points[r->npoints - 1];
+    printf("Rarefaction (%s): %.0f distinct UMI pairs, %.0f UMI1, %.0f UMI2 in %ld classified pairs\n",
+           r->mode == RAREFY_EXACT ? "exact" : "HyperLogLog", last->distinct[RAREFY_PAIR],
+           last->distinct[RAREFY_UMI1], last->distinct[RAREFY_UMI2], last->classified);
+    if (last->classified > 0) {
+        // Sketch estimates can exceed the pair count slightly when every pair is new
+        double saturation = 1 - last->distinct[RAREFY_PAIR] / last->classified;
+        printf("  Sequencing saturation (pairs repeating a UMI pair): %.1f%%\n",
+               100.0 * (saturation > 0 ? saturation : 0));
+    }
+    if (r->npoints > 1) {
+        const rarefaction_point_t *prev = &r->points[r->npoints - 2];
+        long step = last->classified - prev->classified;
+        if (step > 0) {
+            printf("  New UMI pairs per 100 further classified pairs at the end of the run: %.1f\n",
+                   100.0 * (last->distinct[RAREFY_PAIR] - prev->distinct[RAREFY_PAIR]) / step);
+        }
+    }
+    if (r->mode == RAREFY_EXACT && r->chao1[RAREFY_PAIR] > 0) {
+        printf("  Chao1 estimate: %.0f UMI pairs in the library (%.1f%% observed)\n",
+               r->chao1[RAREFY_PAIR], 100.0 * last->distinct[RAREFY_PAIR] / r->chao1[RAREFY_PAIR]);
+    }
+}
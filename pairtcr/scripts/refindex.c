@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "refindex.h"
+
+#define REF_MAX_LINE 4096
+
+int ref_base_code(char c) {
+    switch (c) {
+        case 'A': case 'a': return 0;
+        case 'C': case 'c': return 1;
+        case 'G': case 'g': return 2;
+        case 'T': case 't': return 3;
+        default: return -1;
+    }
+}
+
+void ref_revcomp(const char *seq, int len, char *out) {
+    for (int i = 0; i < len; i++) {
+        switch (seq[len - 1 - i]) {
+            case 'A': out[i] = 'T'; break;
+            case 'C': out[i] = 'G'; break;
+            case 'G': out[i] = 'C'; break;
+            case 'T': out[i] = 'A'; break;
+            default: out[i] = 'N'; break;
+        }
+    }
+    out[len] = '\0';
+}
+
+int ref_chain_bit(const char *name, char *segment) {
+    for (const char *p = strstr(name, "TR"); p; p = strstr(p + 1, "TR")) {
+        if (p[2] == '\0' || p[3] == '\0' || !strchr("VDJC", p[3])) continue;
+        int bit = 0;
+        switch (p[2]) {
+            case 'A': bit = REF_CHAIN_A; break;
+            case 'B': bit = REF_CHAIN_B; break;
+            case 'G': bit = REF_CHAIN_G; break;
+            case 'D': bit = REF_CHAIN_D; break;
+        }
+        if (bit) {
+            if (segment) *segment = p[3];
+            return bit;
+        }
+    }
+    return 0;
+}
+
+#define V_ANCHOR_WINDOW 30       // the 2nd-CYS sits this close to a V region's end
+
+static int is_cys_codon(const char *c) {
+    return c[0] == 'T' && c[1] == 'G' && (c[2] == 'T' || c[2] == 'C');
+}
+
+int ref_find_anchor(const char *seq, int len, char segment) {
+    if (segment == 'V') {
+        // V regions start in frame; fall back to any frame for other cuts
+        int start = len > V_ANCHOR_WINDOW ? len - V_ANCHOR_WINDOW : 0;
+        for (int p = (len - 3) / 3 * 3; p >= start; p -= 3) {
+            if (is_cys_codon(seq + p)) return p;
+        }
+        for (int p = len - 3; p >= start; p--) {
+            if (is_cys_codon(seq + p)) return p;
+        }
+        return -1;
+    }
+    if (segment == 'J') {
+        for (int p = 0; p + 11 <= len; p++) {
+            const char *c = seq + p;
+            int phe_trp = (c[0] == 'T' && c[1] == 'T' && (c[2] == 'T' || c[2] == 'C')) ||
+                          (c[0] == 'T' && c[1] == 'G' && c[2] == 'G');
+            if (phe_trp && c[3] == 'G' && c[4] == 'G' && c[9] == 'G' && c[10] == 'G') return p;
+        }
+    }
+    return -1;
+}
+
+char ref_codon(const char *nt) {
+    // Standard code, codons in TCAG order
+    static const char table[] = "FFLLSSSSYY**CC*WLLLLPPPPHHQQRRRRIIIMTTTTNNKKSSRRVVVVAAAADDEEGGGG";
+    static const int tcag[4] = {2, 1, 3, 0};   // ref_base_code order ACGT -> TCAG index
+    int a = ref_base_code(nt[0]), b = ref_base_code(nt[1]), c = ref_base_code(nt[2]);
+    if (a < 0 || b < 0 || c < 0) return 'X';
+    return table[tcag[a] * 16 + tcag[b] * 4 + tcag[c]];
+}
+
+int ref_translate(const char *nt, int len, char *aa) {
+    int n = 0;
+    for (int i = 0; i + 3 <= len; i += 3) {
+        char residue = ref_codon(nt + i);
+        if (residue == '*' || residue == 'X') return -1;
+        aa[n++] = residue;
+    }
+    aa[n] = '\0';
+    return 0;
+}
+
+static void gene_name(const char *header, char *name) {
+    const char *start = header, *bar = strchr(header, '|');
+    if (bar) start = bar + 1;
+    size_t len = strcspn(start, bar ? "|\r\n" : " \t\r\n");
+    if (len >= REF_NAME_LEN) len = REF_NAME_LEN - 1;
+    memcpy(name, start, len);
+    name[len] = '\0';
+}
+
+static int add_gene(ref_index_t *idx, const char *name, char *seq, int len) {
+    char segment = 0;
+    int chain = ref_chain_bit(name, &segment);
+    if (!chain || len == 0) {
+        idx->skipped++;
+        free(seq);
+        return 0;
+    }
+    ref_gene_t *grown = realloc(idx->genes, (size_t)(idx->ngenes + 1) * sizeof(ref_gene_t));
+    if (!grown) {
+        free(seq);
+        return -1;
+    }
+    idx->genes = grown;
+    ref_gene_t *g = &idx->genes[idx->ngenes++];
+    snprintf(g->name, sizeof(g->name), "%s", name);
+    g->chain = chain;
+    g->segment = segment;
+    g->seq = seq;
+    g->len = len;
+    g->anchor = ref_find_anchor(seq, len, segment);
+    return 0;
+}
+
+int ref_load_fasta(ref_index_t *idx, const char *path) {
+    gzFile fp = gzopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening reference %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[REF_MAX_LINE];
+    char name[REF_NAME_LEN] = "";
+    char *seq = NULL;
+    int len = 0, cap = 0, status = 0, in_record = 0;
+    while (status == 0 && gzgets(fp, line, sizeof(line))) {
+        if (line[0] == '>') {
+            if (in_record) status = add_gene(idx, name, seq, len);
+            gene_name(line + 1, name);
+            seq = NULL;
+            len = cap = 0;
+            in_record = 1;
+            continue;
+        }
+        for (char *p = line; *p && status == 0; p++) {
+            if (isspace((unsigned char)*p) || *p == '.') continue;   // IMGT gapped FASTA pads with dots
+            if (len + 2 > cap) {
+                cap = cap ? 2 * cap : 1024;
+                char *grown = realloc(seq, (size_t)cap);
+                if (!grown) {
+                    status = -1;
+                    break;
+                }
+                seq = grown;
+            }
+            seq[len++] = ref_base_code(*p) < 0 ? 'N' : (char)toupper((unsigned char)*p);
+            seq[len] = '\0';
+        }
+    }
+    if (status == 0 && in_record) {
+        status = add_gene(idx, name, seq, len);
+    } else if (status != 0) {
+        free(seq);
+    }
+    gzclose(fp);
+    if (status != 0) {
+        fprintf(stderr, "Error: out of memory loading reference %s\n", path);
+        return -1;
+    }
+    if (idx->ngenes == 0) {
+        fprintf(stderr, "Error: no TRA/TRB/TRG/TRD genes in reference %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Invertible mix so minimiser order does not favour low-complexity k-mers
+static uint64_t kmer_order(uint64_t kmer) {
+    kmer ^= kmer >> 33;
+    kmer *= 0xff51afd7ed558ccdULL;
+    kmer ^= kmer >> 33;
+    kmer *= 0xc4ceb9fe1a85ec53ULL;
+    kmer ^= kmer >> 33;
+    return kmer;
+}
+
+size_t ref_minimisers(const char *seq, int len, int k, int w, uint32_t *pos, uint64_t *kmers, size_t max) {
+    uint64_t mask = k == 32 ? ~0ULL : (1ULL << (2 * k)) - 1;
+    uint64_t window_kmer[REF_MAX_W], window_order[REF_MAX_W];
+    int window_pos[REF_MAX_W];
+    uint64_t kmer = 0;
+    int valid = 0, filled = 0, last = -1;
+    size_t n = 0;
+    for (int i = 0; i < len && n < max; i++) {
+        int code = ref_base_code(seq[i]);
+        if (code < 0) {
+            valid = filled = 0;
+            continue;
+        }
+        kmer = ((kmer << 2) | (uint64_t)code) & mask;
+        if (++valid < k) continue;
+
+        // Ring of the last w k-mers; the minimiser is the lowest order in it
+        int slot = filled % w;
+        window_kmer[slot] = kmer;
+        window_order[slot] = kmer_order(kmer);
+        window_pos[slot] = i - k + 1;
+        if (++filled < w) continue;
+        int best = 0;
+        for (int j = 1; j < w; j++) {
+            if (window_order[j] < window_order[best] ||
+                (window_order[j] == window_order[best] && window_pos[j] < window_pos[best])) best = j;
+        }
+        if (window_pos[best] != last) {
+            last = window_pos[best];
+            pos[n] = (uint32_t)last;
+            kmers[n++] = window_kmer[best];
+        }
+    }
+    return n;
+}
+
+typedef struct {
+    uint64_t kmer;
+    ref_hit_t hit;
+} ref_entry_t;
+
+static int compare_entries(const void *a, const void *b) {
+    const ref_entry_t *x = a, *y = b;
+    if (x->kmer != y->kmer) return (x->kmer > y->kmer) - (x->kmer < y->kmer);
+    if (x->hit.gene != y->hit.gene) return (x->hit.gene > y->hit.gene) - (x->hit.gene < y->hit.gene);
+    return (x->hit.pos > y->hit.pos) - (x->hit.pos < y->hit.pos);
+}
+
+static size_t slot_of(const ref_index_t *idx, uint64_t kmer) {
+    return (size_t)kmer_order(kmer) & idx->slot_mask;
+}
+
+int ref_index_build(ref_index_t *idx, int k, int w) {
+    if (k < 5 || k > REF_MAX_K || w < 1 || w > REF_MAX_W) {
+        fprintf(stderr, "Error: k must be 5-%d and w 1-%d\n", REF_MAX_K, REF_MAX_W);
+        return -1;
+    }
+    idx->k = k;
+    idx->w = w;
+
+    size_t total = 0;
+    for (int g = 0; g < idx->ngenes; g++) total += (size_t)idx->genes[g].len;
+    ref_entry_t *entries = malloc((total ? total : 1) * sizeof(ref_entry_t));
+    uint32_t *pos = malloc((total ? total : 1) * sizeof(uint32_t));
+    uint64_t *kmers = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!entries || !pos || !kmers) goto oom;
+
+    size_t n = 0;
+    for (int g = 0; g < idx->ngenes; g++) {
+        const ref_gene_t *gene = &idx->genes[g];
+        size_t m = ref_minimisers(gene->seq, gene->len, k, w, pos, kmers, total);
+        for (size_t i = 0; i < m; i++) {
+            entries[n].kmer = kmers[i];
+            entries[n].hit.gene = (uint32_t)g;
+            entries[n++].hit.pos = pos[i];
+        }
+    }
+    free(pos);
+    free(kmers);
+    pos = NULL;
+    kmers = NULL;
+    qsort(entries, n, sizeof(ref_entry_t), compare_entries);
+
+    size_t distinct = 0;
+    for (size_t i = 0; i < n; i++) distinct += i == 0 || entries[i].kmer != entries[i - 1].kmer;
+    size_t slots = 1024;
+    while (slots < 2 * distinct) slots *= 2;
+    idx->slot_mask = slots - 1;
+    idx->slot_kmer = calloc(slots, sizeof(uint64_t));
+    idx->slot_start = malloc(slots * sizeof(uint32_t));
+    idx->slot_count = malloc(slots * sizeof(uint32_t));
+    idx->slot_chains = malloc(slots);
+    idx->hits = malloc((n ? n : 1) * sizeof(ref_hit_t));
+    if (!idx->slot_kmer || !idx->slot_start || !idx->slot_count || !idx->slot_chains || !idx->hits) goto oom;
+
+    for (size_t i = 0; i < n; i++) {
+        idx->hits[i] = entries[i].hit;
+        if (i > 0 && entries[i].kmer == entries[i - 1].kmer) continue;
+        size_t s = slot_of(idx, entries[i].kmer);
+        while (idx->slot_kmer[s]) s = (s + 1) & idx->slot_mask;
+        size_t j = i;
+        uint8_t chains = 0;
+        while (j < n && entries[j].kmer == entries[i].kmer) chains |= (uint8_t)idx->genes[entries[j++].hit.gene].chain;
+        idx->slot_kmer[s] = entries[i].kmer + 1;
+        idx->slot_start[s] = (uint32_t)i;
+        idx->slot_count[s] = (uint32_t)(j - i);
+        idx->slot_chains[s] = chains;
+    }
+    idx->nhits = n;
+    free(entries);
+    return 0;
+
+oom:
+    free(entries);
+    free(pos);
+    free(kmers);
+    fprintf(stderr, "Error: out of memory indexing the reference\n");
+    return -1;
+}
+
+const ref_hit_t *ref_index_lookup(const ref_index_t *idx, uint64_t kmer, uint32_t *n, uint8_t *chains) {
+    for (size_t s = slot_of(idx, kmer); idx->slot_kmer[s]; s = (s + 1) & idx->slot_mask) {
+        if (idx->slot_kmer[s] == kmer + 1) {
+            *n = idx->slot_count[s];
+            if (chains) *chains = idx->slot_chains[s];
+            return idx->hits + idx->slot_start[s];
+        }
+    }
+    *n = 0;
+    if (chains) *chains = 0;
+    return NULL;
+}
+
+void ref_index_free(ref_index_t *idx) {
+    for (int g = 0; g < idx->ngenes; g++) free(idx->genes[g].seq);
+    free(idx->genes);
+    free(idx->slot_kmer);
+    free(idx->slot_start);
+    free(idx->slot_count);
+    free(idx->slot_chains);
+    free(idx->hits);
+    memset(idx, 0, sizeof(*idx));
+}
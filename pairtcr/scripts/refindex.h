@@ -0,0 +1,77 @@
+#ifndef REFINDEX_H
+#define REFINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REF_MAX_K 31
+#define REF_MAX_W 32
+#define REF_NAME_LEN 64
+
+// Chains as bits, from the letter after "TR" in a gene name
+#define REF_CHAIN_A 1
+#define REF_CHAIN_B 2
+#define REF_CHAIN_G 4
+#define REF_CHAIN_D 8
+
+// A reference gene from an IMGT-style FASTA: the name is the second
+// |-separated header field when there is one (">M12345|TRAV1-1*01|Homo
+// sapiens|..."), else the first word (">TRBC1*01")
+typedef struct {
+    char name[REF_NAME_LEN];     // gene*allele
+    int chain;                   // REF_CHAIN_*
+    char segment;                // 'V', 'D', 'J' or 'C'
+    char *seq;                   // upper case; bases other than ACGT are N
+    int len;
+    int anchor;                  // V: Cys codon start, J: Phe/Trp codon start; -1 if not found
+} ref_gene_t;
+
+typedef struct {
+    uint32_t gene;
+    uint32_t pos;                // k-mer start in the gene
+} ref_hit_t;
+
+// (w, k) minimisers of the forward strand of every gene (each k-mer when w
+// is 1), with the genes and offsets that hold them
+typedef struct {
+    ref_gene_t *genes;
+    int ngenes;
+    int skipped;                 // records whose name carries no TR chain
+    int k;
+    int w;
+    uint64_t *slot_kmer;         // k-mer + 1, 0 for an empty slot
+    uint32_t *slot_start;        // first hit
+    uint32_t *slot_count;
+    uint8_t *slot_chains;        // union of the hits' chains
+    size_t slot_mask;
+    ref_hit_t *hits;
+    size_t nhits;
+} ref_index_t;
+
+// Load genes from a FASTA file (plain or gzip)
+int ref_load_fasta(ref_index_t *idx, const char *path);
+int ref_index_build(ref_index_t *idx, int k, int w);
+void ref_index_free(ref_index_t *idx);
+
+// Hits of one k-mer, NULL when it is absent; chains may be NULL
+const ref_hit_t *ref_index_lookup(const ref_index_t *idx, uint64_t kmer, uint32_t *n, uint8_t *chains);
+
+// (w, k) minimisers of seq in position order; returns how many were stored,
+// at most max
+size_t ref_minimisers(const char *seq, int len, int k, int w, uint32_t *pos, uint64_t *kmers, size_t max);
+
+int ref_base_code(char c);       // 0-3 for ACGT, -1 otherwise
+void ref_revcomp(const char *seq, int len, char *out);
+int ref_chain_bit(const char *name, char *segment);   // 0 when not a TR gene
+
+// CDR3 anchor of a V or J gene: the 2nd-CYS codon near the end of a V
+// region, or the first codon of the J region's F/W-G-x-G motif
+int ref_find_anchor(const char *seq, int len, char segment);
+
+// Amino acid of one codon: '*' for a stop, 'X' when it holds an N
+char ref_codon(const char *nt);
+
+// Translate len (a multiple of 3) bases into aa; -1 on a stop codon or N
+int ref_translate(const char *nt, int len, char *aa);
+
+#endif
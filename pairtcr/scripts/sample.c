@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sample.h"
+#include "bgzf.h"
+
+// One pair held by the reservoir; both records' lines share one allocation
+typedef struct {
+    long index;
+    char *data;
+    fastq_record_t rec[2];
+} reservoir_entry_t;
+
+struct reservoir {
+    reservoir_entry_t *entries;
+    long size;                   // entries held
+    long next;                   // next entry to hand out
+    long pairs_read;
+};
+
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+double sample_uniform(uint64_t seed, uint64_t index) {
+    return (splitmix64(seed ^ splitmix64(index)) >> 11) * 0x1.0p-53;
+}
+
+int sample_keep(const fastq_input_t *in, long index) {
+    return sample_uniform(in->seed, (uint64_t)index) < in->fraction;
+}
+
+int input_open(fastq_input_t *in, const char *r1_file, const char *r2_file, const preprocess_config_t *cfg) {
+    memset(in, 0, sizeof(*in));
+    in->mode = cfg->sample_mode;
+    in->fraction = cfg->sample_fraction;
+    in->seed = cfg->sample_seed;
+    in->reservoir_size = cfg->read_limit;
+
+    in->fp[0] = gzopen(r1_file, "r");
+    in->fp[1] = gzopen(r2_file, "r");
+    if (!in->fp[0] || !in->fp[1]) {
+        fprintf(stderr, "Error opening input files\n");
+        return -1;
+    }
+
+    if (in->mode == SAMPLE_STRIDE) {
+        if (!bgzf_detect(r1_file) || !bgzf_detect(r2_file)) {
+            fprintf(stderr, "Warning: block-stride sampling needs BGZF input (bgzip); "
+                            "falling back to Bernoulli sampling\n");
+            in->mode = SAMPLE_BERNOULLI;
+        } else if ((in->stride = bgzf_stride_open(r1_file, r2_file, in->fraction, in->seed)) == NULL) {
+            fprintf(stderr, "Error indexing BGZF blocks\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int input_rewind(fastq_input_t *in) {
+    in->next_index[0] = in->next_index[1] = 0;
+    if (in->stride) bgzf_stride_rewind(in->stride);
+    return gzrewind(in->fp[0]) == 0 && gzrewind(in->fp[1]) == 0 ? 0 : -1;
+}
+
+static void reservoir_free(reservoir_t *r) {
+    if (!r) return;
+    for (long i = 0; i < r->size; i++) free(r->entries[i].data);
+    free(r->entries);
+    free(r);
+}
+
+void input_close(fastq_input_t *in) {
+    if (in->fp[0]) gzclose(in->fp[0]);
+    if (in->fp[1]) gzclose(in->fp[1]);
+    reservoir_free(in->reservoir);
+    if (in->stride) bgzf_stride_close(in->stride);
+}
+
+// Copy a pair read into scratch storage into one allocation owned by the entry
+static int reservoir_store(reservoir_entry_t *entry, long index, const fastq_record_t rec[2]) {
+    size_t total = 0;
+    for (int m = 0; m < 2; m++) {
+        total += strlen(rec[m].header) + strlen(rec[m].sequence) +
+                 strlen(rec[m].plus) + strlen(rec[m].quality) + 4;
+    }
+    char *data = malloc(total);
+    if (!data) return -1;
+
+    char *p = data;
+    for (int m = 0; m < 2; m++) {
+        const char *src[4] = {rec[m].header, rec[m].sequence, rec[m].plus, rec[m].quality};
+        char **dst[4] = {&entry->rec[m].header, &entry->rec[m].sequence,
+                         &entry->rec[m].plus, &entry->rec[m].quality};
+        for (int f = 0; f < 4; f++) {
+            size_t len = strlen(src[f]) + 1;
+            memcpy(p, src[f], len);
+            *dst[f] = p;
+            p += len;
+        }
+    }
+    free(entry->data);
+    entry->data = data;
+    entry->index = index;
+    return 0;
+}
+
+static int compare_entry_index(const void *a, const void *b) {
+    long ia = ((const reservoir_entry_t *)a)->index;
+    long ib = ((const reservoir_entry_t *)b)->index;
+    return (ia > ib) - (ia < ib);
+}
+
+// Algorithm R over the whole input: pair i replaces a random slot with probability k/(i+1)
+static reservoir_t *reservoir_collect(fastq_input_t *in) {
+    reservoir_t *r = calloc(1, sizeof(reservoir_t));
+    if (!r) return NULL;
+    long k = in->reservoir_size;
+    r->entries = calloc((size_t)(k > 0 ? k : 1), sizeof(reservoir_entry_t));
+    if (!r->entries) {
+        free(r);
+        return NULL;
+    }
+
+    char scratch[2][2 * (MAX_LINE_LEN + MAX_SEQ_LEN)];
+    fastq_record_t rec[2];
+    for (long i = 0;; i++) {
+        char *pos[2] = {scratch[0], scratch[1]};
+        if (read_fastq_record(in->fp[0], &rec[0], &pos[0], scratch[0] + sizeof(scratch[0])) != 0 ||
+            read_fastq_record(in->fp[1], &rec[1], &pos[1], scratch[1] + sizeof(scratch[1])) != 0) {
+            break;
+        }
+        r->pairs_read++;
+
+        long slot = i;
+        if (i >= k) {
+            slot = (long)(sample_uniform(in->seed, (uint64_t)i) * (double)(i + 1));
+            if (slot >= k) continue;
+        }
+        if (reservoir_store(&r->entries[slot], i, rec) != 0) {
+            reservoir_free(r);
+            return NULL;
+        }
+        if (slot == r->size) r->size++;
+    }
+
+    qsort(r->entries, (size_t)r->size, sizeof(reservoir_entry_t), compare_entry_index);
+    return r;
+}
+
+int reservoir_fill(fastq_input_t *in, batch_t *batch, long max_pairs) {
+    if (!in->reservoir && (in->reservoir = reservoir_collect(in)) == NULL) {
+        fprintf(stderr, "\nError: out of memory holding the reservoir sample\n");
+        exit(1);
+    }
+
+    reservoir_t *r = in->reservoir;
+    char *pos[2] = {batch->arena[0], batch->arena[1]};
+    int n = 0;
+    while (n < batch->capacity && n < max_pairs && r->next < r->size) {
+        reservoir_entry_t *entry = &r->entries[r->next++];
+        if (batch_copy_record(batch, 0, n, &pos[0], &entry->rec[0]) != 0 ||
+            batch_copy_record(batch, 1, n, &pos[1], &entry->rec[1]) != 0) {
+            fprintf(stderr, "\nError: out of memory reading batch\n");
+            exit(1);
+        }
+        n++;
+    }
+    batch->arena_used = (size_t)(pos[0] - batch->arena[0]) + (size_t)(pos[1] - batch->arena[1]);
+    batch->count = n;
+    return n;
+}
+
+void sample_describe(const fastq_input_t *in, char *buf, size_t size) {
+    switch (in->mode) {
+        case SAMPLE_BERNOULLI:
+            snprintf(buf, size, "Bernoulli, fraction %g, seed %llu; %ld pairs read",
+                     in->fraction, (unsigned long long)in->seed, in->next_index[0]);
+            break;
+        case SAMPLE_RESERVOIR:
+            snprintf(buf, size, "reservoir of %ld pairs, seed %llu; %ld pairs read",
+                     in->reservoir_size, (unsigned long long)in->seed,
+                     in->reservoir ? in->reservoir->pairs_read : 0);
+            break;
+        case SAMPLE_STRIDE:
+            bgzf_stride_describe(in->stride, buf, size);
+            break;
+        default:
+            snprintf(buf, size, "first pairs");
+            break;
+    }
+}
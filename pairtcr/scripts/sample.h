@@ -0,0 +1,42 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <stdint.h>
+#include <zlib.h>
+
+#include "preprocess.h"
+
+typedef struct reservoir reservoir_t;
+typedef struct bgzf_stride bgzf_stride_t;
+
+// Paired FASTQ input with the sampling mode applied while reading
+struct fastq_input {
+    gzFile fp[2];
+    int mode;                    // SAMPLE_*
+    double fraction;
+    uint64_t seed;
+    long next_index[2];          // records read so far from each mate file
+    long reservoir_size;
+    reservoir_t *reservoir;      // filled on the first batch_fill in reservoir mode
+    bgzf_stride_t *stride;
+};
+
+// Uniform value in [0, 1) derived from (seed, index); the same pair index gives
+// the same value in every thread and on every run with the same seed
+double sample_uniform(uint64_t seed, uint64_t index);
+
+int input_open(fastq_input_t *in, const char *r1_file, const char *r2_file, const preprocess_config_t *cfg);
+int input_rewind(fastq_input_t *in);
+void input_close(fastq_input_t *in);
+
+// Whether the pair at this input index is kept in Bernoulli mode
+int sample_keep(const fastq_input_t *in, long index);
+
+// Reservoir mode: one pass over both files keeps a uniform sample of
+// reservoir_size pairs, which is then handed out in input order
+int reservoir_fill(fastq_input_t *in, batch_t *batch, long max_pairs);
+
+// One summary line describing the sample taken
+void sample_describe(const fastq_input_t *in, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+
+// HyperLogLog with 2^14 one-byte registers (16 KB, ~0.8% standard error)
+#define HLL_P 14
+#define HLL_REGISTERS (1 << HLL_P)
+
+typedef struct {
+    unsigned char reg[HLL_REGISTERS];
+} hll_t;
+
+// Count-min sketch: 4 rows of 2048 counters (32 KB). An estimate never
+// undercounts and overcounts by more than e/width of the total with
+// probability 1 - e^-depth (about 98%)
+#define CMS_DEPTH 4
+#define CMS_WIDTH 2048
+
+typedef struct {
+    uint32_t cell[CMS_DEPTH][CMS_WIDTH];
+    uint64_t total;
+} cms_t;
+
+// 64-bit mix of a packed key; the same key always hashes the same
+uint64_t sketch_hash(uint64_t key);
+
+// Safe to call from several threads on the same sketch
+void hll_add(hll_t *h, uint64_t hash);
+void hll_merge(hll_t *dst, const hll_t *src);
+double hll_estimate(const hll_t *h);
+
+// Not thread-safe: each thread updates its own sketch and they are merged
+uint32_t cms_add(cms_t *c, uint64_t hash);       // returns the updated estimate
+uint32_t cms_estimate(const cms_t *c, uint64_t hash);
+void cms_merge(cms_t *dst, const cms_t *src);
+double cms_error_bound(const cms_t *c);
+
+#endif
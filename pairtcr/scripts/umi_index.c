@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "umi_index.h"
+#include "preprocess.h"
+
+static int base_bits(char c) {
+    switch (c) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return -1;
+    }
+}
+
+int64_t umi_key(int trb, const char *umi1, const char *umi2) {
+    uint32_t key = 0;
+    const char *parts[2] = {umi1, umi2};
+    const int lens[2] = {UMI1_LEN, UMI2_LEN};
+    for (int p = 0; p < 2; p++) {
+        for (int i = 0; i < lens[p]; i++) {
+            int bits = base_bits(parts[p][i]);
+            if (bits < 0) return -1;
+            key = key << 2 | (uint32_t)bits;
+        }
+    }
+    return (int64_t)(trb ? key | UMI_KEY_TRB : key);
+}
+
+void umi_key_decode(uint32_t key, int *trb, char *umi1, char *umi2) {
+    static const char bases[4] = {'A', 'C', 'G', 'T'};
+    *trb = (key & UMI_KEY_TRB) != 0;
+    for (int i = 0; i < UMI2_LEN; i++) umi2[UMI2_LEN - 1 - i] = bases[(key >> (2 * i)) & 3];
+    for (int i = 0; i < UMI1_LEN; i++) umi1[UMI1_LEN - 1 - i] = bases[(key >> (2 * (UMI2_LEN + i))) & 3];
+    umi1[UMI1_LEN] = '\0';
+    umi2[UMI2_LEN] = '\0';
+}
+
+int umi_seen_init(umi_seen_t *seen) {
+    seen->bits = calloc((size_t)1 << (UMI_KEY_BITS - 6), sizeof(uint64_t));
+    return seen->bits ? 0 : -1;
+}
+
+int umi_seen_add(umi_seen_t *seen, uint32_t key) {
+    uint64_t mask = 1ULL << (key & 63);
+    uint64_t *word = &seen->bits[key >> 6];
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) return 0;
+    return (__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask) == 0;
+}
+
+void umi_seen_free(umi_seen_t *seen) {
+    free(seen->bits);
+    seen->bits = NULL;
+}
+
+int umi_keys_append(umi_keys_t *v, const uint32_t *keys, size_t n) {
+    if (v->len + n > v->cap) {
+        size_t cap = v->cap ? v->cap : 4096;
+        while (cap < v->len + n) cap *= 2;
+        uint32_t *grown = realloc(v->keys, cap * sizeof(uint32_t));
+        if (!grown) return -1;
+        v->keys = grown;
+        v->cap = cap;
+    }
+    memcpy(v->keys + v->len, keys, n * sizeof(uint32_t));
+    v->len += n;
+    return 0;
+}
+
+void umi_keys_free(umi_keys_t *v) {
+    free(v->keys);
+    memset(v, 0, sizeof(*v));
+}
+
+static int compare_keys(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+size_t umi_keys_collapse(umi_keys_t *v, umi_entry_t **entries) {
+    qsort(v->keys, v->len, sizeof(uint32_t), compare_keys);
+
+    umi_entry_t *out = malloc((v->len ? v->len : 1) * sizeof(umi_entry_t));
+    size_t n = 0;
+    if (out) {
+        for (size_t i = 0; i < v->len; i++) {
+            if (n > 0 && out[n - 1].key == v->keys[i]) {
+                out[n - 1].count++;
+            } else {
+                out[n].key = v->keys[i];
+                out[n].count = 1;
+                n++;
+            }
+        }
+    }
+    umi_keys_free(v);
+    *entries = out;
+    return out ? n : 0;
+}
+
+size_t umi_entries_merge(const umi_entry_t *a, size_t na, const umi_entry_t *b, size_t nb,
+                         umi_entry_t **merged) {
+    umi_entry_t *out = malloc((na + nb ? na + nb : 1) * sizeof(umi_entry_t));
+    if (!out) {
+        *merged = NULL;
+        return 0;
+    }
+    size_t i = 0, j = 0, n = 0;
+    while (i < na || j < nb) {
+        if (j == nb || (i < na && a[i].key < b[j].key)) {
+            out[n++] = a[i++];
+        } else if (i == na || b[j].key < a[i].key) {
+            out[n++] = b[j++];
+        } else {
+            out[n] = a[i++];
+            out[n++].count += b[j++].count;
+        }
+    }
+    *merged = out;
+    return n;
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+int umi_index_write(const char *path, const umi_entry_t *entries, size_t n) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error writing UMI index %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    uint64_t pairs = 0;
+    for (size_t i = 0; i < n; i++) pairs += entries[i].count;
+    unsigned char header[24];
+    memcpy(header, UMI_INDEX_MAGIC, 8);
+    put_le32(header + 8, (uint32_t)n);
+    put_le32(header + 12, (uint32_t)((uint64_t)n >> 32));
+    put_le32(header + 16, (uint32_t)pairs);
+    put_le32(header + 20, (uint32_t)(pairs >> 32));
+    int status = fwrite(header, sizeof(header), 1, fp) == 1 ? 0 : -1;
+
+    unsigned char buf[8 * 1024];
+    size_t fill = 0;
+    for (size_t i = 0; i < n && status == 0; i++) {
+        put_le32(buf + fill, entries[i].key);
+        put_le32(buf + fill + 4, entries[i].count);
+        fill += 8;
+        if (fill == sizeof(buf) || i + 1 == n) {
+            if (fwrite(buf, 1, fill, fp) != fill) status = -1;
+            fill = 0;
+        }
+    }
+    if (fclose(fp) != 0) status = -1;
+    return status;
+}
+
+int umi_index_read(const char *path, umi_entry_t **entries, size_t *n) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error reading UMI index %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    unsigned char header[24];
+    if (fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, UMI_INDEX_MAGIC, 8) != 0) {
+        fprintf(stderr, "Error: %s is not a UMI index\n", path);
+        fclose(fp);
+        return -1;
+    }
+    uint64_t count = get_le32(header + 8) | (uint64_t)get_le32(header + 12) << 32;
+    umi_entry_t *out = malloc((count ? count : 1) * sizeof(umi_entry_t));
+    if (!out) {
+        fclose(fp);
+        return -1;
+    }
+
+    unsigned char rec[8];
+    for (uint64_t i = 0; i < count; i++) {
+        if (fread(rec, sizeof(rec), 1, fp) != 1) {
+            fprintf(stderr, "Error: %s is truncated\n", path);
+            free(out);
+            fclose(fp);
+            return -1;
+        }
+        out[i].key = get_le32(rec);
+        out[i].count = get_le32(rec + 4);
+    }
+    fclose(fp);
+    *entries = out;
+    *n = (size_t)count;
+    return 0;
+}
+
+int umi_index_open(umi_index_cursor_t *c, const char *path) {
+    c->fp = fopen(path, "rb");
+    if (!c->fp) {
+        fprintf(stderr, "Error reading UMI index %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    unsigned char header[24];
+    if (fread(header, sizeof(header), 1, c->fp) != 1 || memcmp(header, UMI_INDEX_MAGIC, 8) != 0) {
+        fprintf(stderr, "Error: %s is not a UMI index\n", path);
+        fclose(c->fp);
+        c->fp = NULL;
+        return -1;
+    }
+    c->remaining = get_le32(header + 8) | (uint64_t)get_le32(header + 12) << 32;
+    c->pairs = get_le32(header + 16) | (uint64_t)get_le32(header + 20) << 32;
+    return 0;
+}
+
+int umi_index_next(umi_index_cursor_t *c, umi_entry_t *entry) {
+    if (c->remaining == 0) return 0;
+    unsigned char rec[8];
+    if (fread(rec, sizeof(rec), 1, c->fp) != 1) return -1;
+    entry->key = get_le32(rec);
+    entry->count = get_le32(rec + 4);
+    c->remaining--;
+    return 1;
+}
+
+void umi_index_close(umi_index_cursor_t *c) {
+    if (c->fp) fclose(c->fp);
+    c->fp = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef UMI_SKETCH_H
+#define UMI_SKETCH_H
+
+#include <stdint.h>
+
+#include "sketch.h"
+
+#define UMI_HEAVY_CANDIDATES 64
+#define UMI_HEAVY_REPORT 20
+
+// UMI pair seen often enough to be a heavy-hitter candidate
+typedef struct {
+    uint32_t key;
+    uint32_t estimate;
+} umi_heavy_t;
+
+// Fixed-size UMI statistics (about 66 KB, whatever the depth): distinct UMI
+// pairs per chain and over-amplified UMI pairs. Each worker thread owns one
+// and updates it without locks; umi_sketch_merge_all combines them.
+typedef struct umi_sketch {
+    hll_t hll[2];                // TRA, TRB
+    cms_t cms;
+    umi_heavy_t heavy[UMI_HEAVY_CANDIDATES];
+    int heavy_count;
+    uint32_t heavy_floor;        // smallest candidate estimate once the table is full
+    struct umi_sketch *next;
+} umi_sketch_t;
+
+// The calling thread's sketch, created and registered on first use
+umi_sketch_t *umi_sketch_thread(void);
+void umi_sketch_add(umi_sketch_t *s, const uint32_t *keys, int n);
+
+// Merge every thread's sketch into a new one, heaviest candidates first
+umi_sketch_t *umi_sketch_merge_all(void);
+void umi_sketch_free_all(void);
+
+void umi_sketch_report(const umi_sketch_t *s);
+int umi_sketch_write(const umi_sketch_t *s, const char *path);
+
+#endif
@@ -0,0 +1,491 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "refindex.h"
+
+#define FQ_MAX_LINE 4096
+#define VJ_MAX_HEADER 512
+#define VJ_MAX_READ 512          // longer reads are cut
+#define VJ_MAX_CDR3_NT 120
+#define VJ_MIN_CDR3_NT 6
+#define VJ_MAX_CANDIDATES 64
+#define VJ_ALIGNED_CANDIDATES 8  // best-seeded diagonals checked by alignment
+#define VJ_MAX_BAND 32
+#define VJ_BATCH 8192
+#define VJ_CHUNK 64
+#define DEFAULT_VJ_K 15
+#define DEFAULT_VJ_W 10
+#define DEFAULT_BAND 8
+#define DEFAULT_MIN_V_SCORE 40
+#define DEFAULT_MIN_J_SCORE 24
+
+// Alignment scores
+#define SCORE_MATCH 2
+#define SCORE_MISMATCH -3
+#define SCORE_GAP -5
+
+// Native stand-in for MiXCR align + exportAlignments: minimiser seeds
+// propose V and J genes on read diagonals, a banded local alignment around
+// each diagonal picks the best gene and maps its CDR3 anchor onto the read,
+// and the rows carry the columns step 4 reads from the MiXCR export.
+
+typedef struct {
+    char header[VJ_MAX_HEADER];  // R1 header without '@', as descrsR1
+    char seq[2][VJ_MAX_READ];
+    // Filled in by the workers
+    int v, j;                    // gene indexes, -1 when not assigned
+    char nt[VJ_MAX_CDR3_NT + 1];
+    char aa[VJ_MAX_CDR3_NT / 3 + 3];
+} vj_pair_t;
+
+typedef struct {
+    const ref_index_t *idx;
+    int chains;                  // REF_CHAIN_* bits to assign from
+    int band;
+    int min_v_score;
+    int min_j_score;
+    vj_pair_t *pairs;
+    int n;
+    int next;                    // work counter shared by the threads
+} vj_job_t;
+
+typedef struct {
+    uint32_t gene;
+    int diagonal;                // read position minus gene position
+    int seeds;
+} candidate_t;
+
+typedef struct {
+    int candidates;
+    candidate_t v[VJ_MAX_CANDIDATES];
+    int nv;
+    candidate_t j[VJ_MAX_CANDIDATES];
+    int nj;
+} seeds_t;
+
+typedef struct {
+    long pairs;
+    long v;
+    long j;
+    long cdr3;
+    long in_frame;
+} assign_stats_t;
+
+void show_usage(const char *program_name);
+
+static void add_seed(candidate_t *cand, int *ncand, uint32_t gene, int diagonal) {
+    for (int c = 0; c < *ncand; c++) {
+        if (cand[c].gene == gene && cand[c].diagonal == diagonal) {
+            cand[c].seeds++;
+            return;
+        }
+    }
+    if (*ncand < VJ_MAX_CANDIDATES) cand[(*ncand)++] = (candidate_t){gene, diagonal, 1};
+}
+
+static int compare_candidates(const void *a, const void *b) {
+    const candidate_t *x = a, *y = b;
+    if (x->seeds != y->seeds) return y->seeds - x->seeds;
+    return (x->gene > y->gene) - (x->gene < y->gene);
+}
+
+static void collect_seeds(const vj_job_t *job, const char *seq, int len, seeds_t *s) {
+    const ref_index_t *idx = job->idx;
+    uint32_t pos[VJ_MAX_READ];
+    uint64_t kmers[VJ_MAX_READ];
+    size_t m = ref_minimisers(seq, len, idx->k, idx->w, pos, kmers, VJ_MAX_READ);
+    s->nv = s->nj = 0;
+    for (size_t i = 0; i < m; i++) {
+        uint32_t n;
+        uint8_t chains;
+        const ref_hit_t *hits = ref_index_lookup(idx, kmers[i], &n, &chains);
+        if (!(chains & job->chains)) continue;
+        for (uint32_t h = 0; h < n; h++) {
+            const ref_gene_t *g = &idx->genes[hits[h].gene];
+            if (!(g->chain & job->chains)) continue;
+            int diagonal = (int)pos[i] - (int)hits[h].pos;
+            if (g->segment == 'V') add_seed(s->v, &s->nv, hits[h].gene, diagonal);
+            if (g->segment == 'J') add_seed(s->j, &s->nj, hits[h].gene, diagonal);
+        }
+    }
+    qsort(s->v, (size_t)s->nv, sizeof(candidate_t), compare_candidates);
+    qsort(s->j, (size_t)s->nj, sizeof(candidate_t), compare_candidates);
+    s->candidates = (s->nv ? s->v[0].seeds : 0) + (s->nj ? s->j[0].seeds : 0);
+}
+
+// Local alignment of the read to gene g within band of a diagonal. Returns
+// the score; *anchor is the read position aligned to the gene's anchor,
+// extrapolated from the nearest aligned base, or -1.
+static int banded_align(const char *read, int n, const ref_gene_t *g, int diagonal, int band, int *anchor) {
+    enum { TB_STOP, TB_DIAG, TB_UP, TB_LEFT };
+    int width = 2 * band + 1;
+    int lo = diagonal - band > 0 ? diagonal - band : 0;
+    int hi = diagonal + g->len + band < n ? diagonal + g->len + band : n;
+    *anchor = -1;
+    if (hi <= lo) return 0;
+
+    int rows[2][2 * VJ_MAX_BAND + 1];
+    uint8_t tb[VJ_MAX_READ][2 * VJ_MAX_BAND + 1];
+    int *prev = rows[0], *cur = rows[1];
+    memset(prev, 0, (size_t)width * sizeof(int));
+    int best = 0, bi = -1, bo = -1;
+    for (int i = lo; i < hi; i++) {
+        for (int o = 0; o < width; o++) {
+            int j = i - diagonal + o - band;
+            int h = 0;
+            uint8_t from = TB_STOP;
+            if (j >= 0 && j < g->len) {
+                int diag = (i > lo ? prev[o] : 0) + (read[i] == g->seq[j] && read[i] != 'N' ? SCORE_MATCH : SCORE_MISMATCH);
+                int up = o + 1 < width && i > lo ? prev[o + 1] + SCORE_GAP : 0;
+                int left = o > 0 ? cur[o - 1] + SCORE_GAP : 0;
+                if (diag > h) { h = diag; from = TB_DIAG; }
+                if (up > h) { h = up; from = TB_UP; }
+                if (left > h) { h = left; from = TB_LEFT; }
+            }
+            cur[o] = h;
+            tb[i - lo][o] = from;
+            if (h > best) {
+                best = h;
+                bi = i;
+                bo = o;
+            }
+        }
+        int *swap = prev;
+        prev = cur;
+        cur = swap;
+    }
+    if (bi < 0 || g->anchor < 0) return best;
+
+    int nearest = -1;
+    for (int i = bi, o = bo; i >= lo && tb[i - lo][o] != TB_STOP;) {
+        uint8_t from = tb[i - lo][o];
+        if (from == TB_DIAG) {
+            int j = i - diagonal + o - band;
+            int distance = abs(j - g->anchor);
+            if (nearest < 0 || distance < nearest) {
+                nearest = distance;
+                *anchor = i + (g->anchor - j);
+            }
+            i--;
+        } else if (from == TB_UP) {
+            i--;
+            o++;
+        } else {
+            o--;
+        }
+    }
+    return best;
+}
+
+// Best-scoring gene among the best-seeded diagonals; chain_mask limits genes
+static int best_gene(const vj_job_t *job, const char *seq, int len, const candidate_t *cand, int ncand,
+                     int chain_mask, int *score, int *anchor) {
+    int best = -1, tried = 0;
+    *score = 0;
+    *anchor = -1;
+    for (int c = 0; c < ncand && tried < VJ_ALIGNED_CANDIDATES; c++) {
+        const ref_gene_t *g = &job->idx->genes[cand[c].gene];
+        if (!(g->chain & chain_mask)) continue;
+        tried++;
+        int a, s = banded_align(seq, len, g, cand[c].diagonal, job->band, &a);
+        if (s > *score) {
+            *score = s;
+            *anchor = a;
+            best = (int)cand[c].gene;
+        }
+    }
+    return best;
+}
+
+// MiXCR writes an out-of-frame CDR3 as codons read in from both ends
+// around a '_'
+static void translate_cdr3(const char *nt, int len, char *aa) {
+    int codons = len / 3, n = 0;
+    if (len % 3 == 0) {
+        for (int c = 0; c < codons; c++) aa[n++] = ref_codon(nt + 3 * c);
+    } else {
+        int left = (codons + 1) / 2;
+        for (int c = 0; c < left; c++) aa[n++] = ref_codon(nt + 3 * c);
+        aa[n++] = '_';
+        for (int c = codons - left; c > 0; c--) aa[n++] = ref_codon(nt + len - 3 * c);
+    }
+    aa[n] = '\0';
+}
+
+static void assign_pair(const vj_job_t *job, vj_pair_t *pair) {
+    char rc[2][VJ_MAX_READ];
+    seeds_t seeds[4];
+    const char *seqs[4];
+    int lens[4], pick = 0;
+
+    // Align in the read and strand with the most seed support only
+    for (int m = 0; m < 4; m++) {
+        lens[m] = (int)strlen(pair->seq[m / 2]);
+        seqs[m] = pair->seq[m / 2];
+        if (m % 2) {
+            ref_revcomp(seqs[m], lens[m], rc[m / 2]);
+            seqs[m] = rc[m / 2];
+        }
+        collect_seeds(job, seqs[m], lens[m], &seeds[m]);
+        if (seeds[m].candidates > seeds[pick].candidates) pick = m;
+    }
+    const seeds_t *s = &seeds[pick];
+    const char *seq = seqs[pick];
+    int len = lens[pick];
+
+    int v_score, j_score, v_anchor, j_anchor;
+    pair->v = best_gene(job, seq, len, s->v, s->nv, job->chains, &v_score, &v_anchor);
+    if (v_score < job->min_v_score) pair->v = -1;
+    int j_chains = pair->v >= 0 ? job->idx->genes[pair->v].chain : job->chains;
+    pair->j = best_gene(job, seq, len, s->j, s->nj, j_chains, &j_score, &j_anchor);
+    if (j_score < job->min_j_score) pair->j = -1;
+
+    pair->nt[0] = pair->aa[0] = '\0';
+    if (pair->v < 0 || pair->j < 0 || v_anchor < 0 || j_anchor < 0) return;
+    int from = v_anchor, to = j_anchor + 3;
+    if (from < 0 || to > len || to - from < VJ_MIN_CDR3_NT || to - from > VJ_MAX_CDR3_NT) return;
+    memcpy(pair->nt, seq + from, (size_t)(to - from));
+    pair->nt[to - from] = '\0';
+    translate_cdr3(pair->nt, to - from, pair->aa);
+}
+
+static void *assign_worker(void *arg) {
+    vj_job_t *job = arg;
+    for (;;) {
+        int start = __atomic_fetch_add(&job->next, VJ_CHUNK, __ATOMIC_RELAXED);
+        if (start >= job->n) break;
+        int end = start + VJ_CHUNK < job->n ? start + VJ_CHUNK : job->n;
+        for (int i = start; i < end; i++) assign_pair(job, &job->pairs[i]);
+    }
+    return NULL;
+}
+
+static void copy_line(char *dst, const char *line, size_t size) {
+    size_t len = strcspn(line, "\r\n");
+    if (len >= size) len = size - 1;
+    memcpy(dst, line, len);
+    dst[len] = '\0';
+}
+
+// Read up to VJ_BATCH pairs, or single reads when in[1] is NULL; returns the count or -1
+static int read_batch(gzFile in[2], vj_pair_t *pairs, char *line) {
+    int n = 0;
+    while (n < VJ_BATCH) {
+        vj_pair_t *p = &pairs[n];
+        p->seq[1][0] = '\0';
+        for (int m = 0; m < (in[1] ? 2 : 1); m++) {
+            if (!gzgets(in[m], line, FQ_MAX_LINE)) return m == 0 ? n : -1;
+            if (m == 0) copy_line(p->header, line[0] == '@' ? line + 1 : line, VJ_MAX_HEADER);
+            if (!gzgets(in[m], line, FQ_MAX_LINE)) return -1;
+            copy_line(p->seq[m], line, VJ_MAX_READ);
+            if (!gzgets(in[m], line, FQ_MAX_LINE) || !gzgets(in[m], line, FQ_MAX_LINE)) return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+static void gene_label(const ref_index_t *idx, int g, char *out, size_t size) {
+    // MiXCR's -vGene/-jGene drop the allele
+    if (g < 0) {
+        out[0] = '\0';
+        return;
+    }
+    snprintf(out, size, "%.*s", (int)strcspn(idx->genes[g].name, "*"), idx->genes[g].name);
+}
+
+// MiXCR exports only reads it aligned; so do we
+static int write_batch(FILE *out, const ref_index_t *idx, const vj_pair_t *pairs, int n, assign_stats_t *stats) {
+    char vname[REF_NAME_LEN], jname[REF_NAME_LEN];
+    for (int i = 0; i < n; i++) {
+        const vj_pair_t *p = &pairs[i];
+        stats->pairs++;
+        stats->v += p->v >= 0;
+        stats->j += p->j >= 0;
+        if (p->v < 0 && p->j < 0) continue;
+        if (p->nt[0]) {
+            stats->cdr3++;
+            stats->in_frame += strpbrk(p->aa, "_*") == NULL;
+        }
+        gene_label(idx, p->v, vname, sizeof(vname));
+        gene_label(idx, p->j, jname, sizeof(jname));
+        if (fprintf(out, "%s\t%s\t%s\t%s\t%s\n", p->header, vname, jname, p->nt, p->aa) < 0) return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *reference = NULL;
+    int chains = REF_CHAIN_A | REF_CHAIN_B | REF_CHAIN_G | REF_CHAIN_D;
+    int threads = 1, k = DEFAULT_VJ_K, w = DEFAULT_VJ_W, band = DEFAULT_BAND;
+    int min_v_score = DEFAULT_MIN_V_SCORE, min_j_score = DEFAULT_MIN_J_SCORE;
+
+    int opt;
+    static struct option long_options[] = {
+        {"reference", required_argument, 0, 'r'},
+        {"chain", required_argument, 0, 'c'},
+        {"threads", required_argument, 0, 't'},
+        {"kmer", required_argument, 0, 'k'},
+        {"window", required_argument, 0, 'w'},
+        {"band", required_argument, 0, 'b'},
+        {"min-v-score", required_argument, 0, 'V'},
+        {"min-j-score", required_argument, 0, 'J'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "r:c:t:k:w:b:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                reference = optarg;
+                break;
+            case 'c':
+                chains = 0;
+                if (strcmp(optarg, "TRA") == 0) chains = REF_CHAIN_A;
+                if (strcmp(optarg, "TRB") == 0) chains = REF_CHAIN_B;
+                if (strcmp(optarg, "TRG") == 0) chains = REF_CHAIN_G;
+                if (strcmp(optarg, "TRD") == 0) chains = REF_CHAIN_D;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'k':
+                k = atoi(optarg);
+                break;
+            case 'w':
+                w = atoi(optarg);
+                break;
+            case 'b':
+                band = atoi(optarg);
+                break;
+            case 'V':
+                min_v_score = atoi(optarg);
+                break;
+            case 'J':
+                min_j_score = atoi(optarg);
+                break;
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            default:
+                show_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 3 || !reference) {
+        fprintf(stderr, "Error: --reference, two FASTQ files and an output path are required\n");
+        show_usage(argv[0]);
+        return 1;
+    }
+    if (!chains) {
+        fprintf(stderr, "Error: --chain must be TRA, TRB, TRG or TRD\n");
+        return 1;
+    }
+    if (threads < 1 || band < 0 || band > VJ_MAX_BAND) {
+        fprintf(stderr, "Error: --threads must be at least 1 and --band 0-%d\n", VJ_MAX_BAND);
+        return 1;
+    }
+
+    ref_index_t idx;
+    memset(&idx, 0, sizeof(idx));
+    if (ref_load_fasta(&idx, reference) != 0 || ref_index_build(&idx, k, w) != 0) return 1;
+    int genes[2] = {0, 0};
+    for (int g = 0; g < idx.ngenes; g++) {
+        if (!(idx.genes[g].chain & chains)) continue;
+        if (idx.genes[g].segment == 'V') genes[0]++;
+        if (idx.genes[g].segment == 'J') genes[1]++;
+    }
+    if (genes[0] == 0 || genes[1] == 0) {
+        fprintf(stderr, "Error: reference %s has no V or no J genes for the chosen chain\n", reference);
+        return 1;
+    }
+
+    const char *path1 = argv[optind], *path2 = argv[optind + 1], *out_path = argv[optind + 2];
+    // "-" for R2 reads single-end input, such as overlap-merged pairs
+    int single = strcmp(path2, "-") == 0;
+    gzFile in[2] = {gzopen(path1, "r"), single ? NULL : gzopen(path2, "r")};
+    if (!in[0] || (!single && !in[1])) {
+        fprintf(stderr, "Error opening %s / %s: %s\n", path1, path2, strerror(errno));
+        return 1;
+    }
+    FILE *out = fopen(out_path, "w");
+    if (!out) {
+        fprintf(stderr, "Error opening %s: %s\n", out_path, strerror(errno));
+        return 1;
+    }
+    vj_pair_t *batch[2] = {malloc(VJ_BATCH * sizeof(vj_pair_t)), malloc(VJ_BATCH * sizeof(vj_pair_t))};
+    char *line = malloc(FQ_MAX_LINE);
+    if (!batch[0] || !batch[1] || !line) {
+        fprintf(stderr, "Error: out of memory for read batches\n");
+        return 1;
+    }
+
+    // Same columns, in the same order, as exportAlignments -descrsR1 -vGene
+    // -jGene -nFeature CDR3 -aaFeature CDR3
+    fprintf(out, "descrsR1\tbestVGene\tbestJGene\tnSeqCDR3\taaSeqCDR3\n");
+    assign_stats_t stats = {0, 0, 0, 0, 0};
+    int status = 0, cur = 0;
+
+    // Workers assign one batch while this thread inflates the next
+    int n = read_batch(in, batch[0], line);
+    while (n > 0) {
+        vj_job_t job = {&idx, chains, band, min_v_score, min_j_score, batch[cur], n, 0};
+        pthread_t tids[threads];
+        for (int t = 0; t < threads; t++) pthread_create(&tids[t], NULL, assign_worker, &job);
+        int next_n = read_batch(in, batch[1 - cur], line);
+        for (int t = 0; t < threads; t++) pthread_join(tids[t], NULL);
+        if (write_batch(out, &idx, batch[cur], n, &stats) != 0) {
+            fprintf(stderr, "Error writing %s\n", out_path);
+            status = 1;
+            break;
+        }
+        n = next_n;
+        cur = 1 - cur;
+    }
+    if (n < 0) {
+        fprintf(stderr, "Error: %s and %s are truncated or out of step\n", path1, path2);
+        status = 1;
+    }
+    if (fclose(out) != 0) status = 1;
+    gzclose(in[0]);
+    if (in[1]) gzclose(in[1]);
+    free(batch[0]);
+    free(batch[1]);
+    free(line);
+    ref_index_free(&idx);
+
+    double pairs = stats.pairs ? (double)stats.pairs : 1;
+    printf("V/J assignment (%d V / %d J genes, k=%d, w=%d, band %d, %d threads):\n",
+           genes[0], genes[1], k, w, band, threads);
+    printf("  %ld read pairs: V %ld (%.2f%%), J %ld (%.2f%%), CDR3 %ld (%.2f%%, %ld in frame)\n",
+           stats.pairs, stats.v, 100.0 * stats.v / pairs, stats.j, 100.0 * stats.j / pairs,
+           stats.cdr3, 100.0 * stats.cdr3 / pairs, stats.in_frame);
+    return status;
+}
+
+void show_usage(const char *program_name) {
+    printf("Usage: %s --reference REF.fa [OPTIONS] R1.fq.gz R2.fq.gz OUT.tsv\n", program_name);
+    printf("Assign V and J genes and the CDR3 per read pair, or per read when R2 is \"-\"; writes the\n");
+    printf("columns step 4 reads from MiXCR exportAlignments (descrsR1, bestVGene, bestJGene,\n");
+    printf("nSeqCDR3, aaSeqCDR3)\n\n");
+    printf("Options:\n");
+    printf("  -r, --reference FILE     FASTA of V and J genes (IMGT V-REGION/J-REGION or names like\n");
+    printf("                           TRBV20-1*01), plain or gzip\n");
+    printf("  -c, --chain CHAIN        Only assign genes of TRA, TRB, TRG or TRD (default: all)\n");
+    printf("  -t, --threads N          Worker threads (default: 1)\n");
+    printf("  -k, --kmer K             Minimiser length (default: %d)\n", DEFAULT_VJ_K);
+    printf("  -w, --window W           Minimiser window (default: %d)\n", DEFAULT_VJ_W);
+    printf("  -b, --band N             Alignment band around a seeded diagonal (default: %d, max %d)\n",
+           DEFAULT_BAND, VJ_MAX_BAND);
+    printf("      --min-v-score N      Alignment score to assign a V gene (default: %d; match %+d,\n",
+           DEFAULT_MIN_V_SCORE, SCORE_MATCH);
+    printf("                           mismatch %d, gap %d)\n", SCORE_MISMATCH, SCORE_GAP);
+    printf("      --min-j-score N      Alignment score to assign a J gene (default: %d)\n", DEFAULT_MIN_J_SCORE);
+    printf("  -h, --help               Show this help message\n");
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,12 +10,17 @@
 #include <errno.h>
 #include <time.h>
 
-// Configuration constants
-#define UMI1_LEN 7
-#define UMI2_LEN 7
-#define MAX_LINE_LEN 1024
-#define MAX_SEQ_LEN 512
-#define MAX_PATH_LEN 512
+#include "preprocess.h"
+#include "autotune.h"
+#include "batch_match.h"
+#include "sample.h"
+#include "bgzf.h"
+#include "depth.h"
+#include "umi_index.h"
+#include "rarefaction.h"
+#include "umi_sketch.h"
+#include "optical.h"
+#include "demux.h"
 
 // TRA/TRB structure patterns
 #define PRE_UMI1_TRA "GACTCTGATGACGACGCACA"
@@ -25,39 +31,60 @@
 #define LINKER_REV_TRB "TCTACAAGTCGGATCCAGCGTGTAC"
 #define FLANK_TRB_SEQ "TGTGCGTCGTCATCAGAGTC"
 
-// Progress tracking
-typedef struct {
-    long processed_pairs;
-    long tra_pairs;
-    long trb_pairs;
-    long read_limit;
-    time_t start_time;
-} progress_t;
-
-// FASTQ record structure
-typedef struct {
-    char header[MAX_LINE_LEN];
-    char sequence[MAX_SEQ_LEN];
-    char plus[MAX_LINE_LEN];
-    char quality[MAX_SEQ_LEN];
-} fastq_record_t;
+// Anchor search windows, learned per anchor when --anchor-window is given
+static anchor_window_t tra_window, trb_window;
+
+// Depth tiers and UMI key collection; inactive until the real run starts
+static depth_plan_t depth_plan;
+
+// UMI pairs seen so far, kept only for --target-umis
+static umi_seen_t umi_seen;
+
+// Distinct-UMI curve for --rarefaction
+static rarefaction_t rarefaction;
+
+// Per-thread HLL and count-min UMI statistics for --umi-sketch
+static int umi_sketch_on;
+
+// UMI keys and cluster positions for --optical-dups
+static optical_t optical;
+
+// Inline sample barcodes for --barcodes; loaded with the options, applied from the real run on
+static demux_t demux;
+static int demux_on;
 
 // Function prototypes
 void show_usage(const char *program_name);
 int find_fastq_pair(const char *directory, char *r1_file, char *r2_file, char *base_name);
-void reverse_complement(const char *seq, char *rc_seq);
-int read_fastq_record(gzFile fp, fastq_record_t *record);
-char *find_pattern(const char *sequence, const char *pattern);
 int extract_umi_and_trim(const char *sequence, const char *pre_umi, const char *linker, 
                         const char *flank, char *umi1, char *umi2, char *trimmed_seq, int *found_rc);
-void update_progress(progress_t *prog, int force_update);
+int extract_at_anchor(const char *sequence, const anchor_hit_t *hit, const char *pre_umi, const char *linker,
+                      const char *flank, char *umi1, char *umi2, char *trimmed_seq);
 int create_directory(const char *path);
+static int run_serial(const preprocess_config_t *cfg, fastq_input_t *in,
+                      char out_paths[MAX_OUT_STREAMS][MAX_PATH_LEN], progress_t *progress);
+static void print_anchor_window(const char *chain, const anchor_window_t *window, long learn_pairs);
+static void write_abort_report(const char *path, const preprocess_config_t *cfg, const progress_t *progress,
+                               const char *r1_file, const char *r2_file);
 
 int main(int argc, char *argv[]) {
     char input_dir[MAX_PATH_LEN] = "";
-    char output_dir[MAX_PATH_LEN] = "PairTCR_results/1_preprocess_and_trim_output";
-    char output_prefix[256] = "";
-    long read_limit = 100000;
+    preprocess_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    strcpy(cfg.output_dir, "PairTCR_results/1_preprocess_and_trim_output");
+    cfg.read_limit = 100000;
+    cfg.threads = 1;
+    cfg.inflate_threads = 1;
+    cfg.batch_size = DEFAULT_BATCH_SIZE;
+    cfg.sample_seed = 1;
+    cfg.out_streams = NUM_STREAMS;
+    cfg.abort_after = 200000;
+    int rarefy_mode = RAREFY_OFF;
+    int want_umi_sketch = 0;
+    int optical_distance = 0;
+    const char *barcodes_path = NULL;
+    int barcode_mate = 1;
+    long total_pairs = 0;
     
     // Parse command line arguments
     int opt;
@@ -65,20 +92,135 @@ int main(int argc, char *argv[]) {
         {"limit", required_argument, 0, 'n'},
         {"output_prefix", required_argument, 0, 'o'},
         {"outdir", required_argument, 0, 'd'},
+        {"threads", required_argument, 0, 't'},
+        {"batch-size", required_argument, 0, 'b'},
+        {"unordered", no_argument, 0, 'u'},
+        {"numa", no_argument, 0, 'N'},
+        {"autotune", no_argument, 0, 'A'},
+        {"inflate-threads", required_argument, 0, 'I'},
+        {"anchor-window", required_argument, 0, 'W'},
+        {"sample", required_argument, 0, 'S'},
+        {"fraction", required_argument, 0, 'F'},
+        {"seed", required_argument, 0, 's'},
+        {"depths", required_argument, 0, 'D'},
+        {"total-pairs", required_argument, 0, 'T'},
+        {"umi-index", no_argument, 0, 'U'},
+        {"target-classified", required_argument, 0, 'C'},
+        {"target-umis", required_argument, 0, 'M'},
+        {"abort-below", required_argument, 0, 'X'},
+        {"abort-after", required_argument, 0, 'Y'},
+        {"rarefaction", required_argument, 0, 'R'},
+        {"umi-sketch", no_argument, 0, 'K'},
+        {"optical-dups", required_argument, 0, 'O'},
+        {"barcodes", required_argument, 0, 'B'},
+        {"barcode-read", required_argument, 0, 'E'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
     
-    while ((opt = getopt_long(argc, argv, "n:o:d:h", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "n:o:d:t:b:uh", long_options, NULL)) != -1) {
         switch (opt) {
             case 'n':
-                read_limit = atol(optarg);
+                cfg.read_limit = atol(optarg);
                 break;
             case 'o':
-                strncpy(output_prefix, optarg, sizeof(output_prefix) - 1);
+                strncpy(cfg.output_prefix, optarg, sizeof(cfg.output_prefix) - 1);
                 break;
             case 'd':
-                strncpy(output_dir, optarg, sizeof(output_dir) - 1);
+                strncpy(cfg.output_dir, optarg, sizeof(cfg.output_dir) - 1);
+                break;
+            case 't':
+                if (strcmp(optarg, "auto") == 0) {
+                    cfg.threads = 0;
+                    cfg.autotune = 1;
+                } else {
+                    cfg.threads = atoi(optarg);
+                }
+                break;
+            case 'b':
+                cfg.batch_size = atoi(optarg);
+                break;
+            case 'u':
+                cfg.unordered = 1;
+                break;
+            case 'N':
+                cfg.numa = 1;
+                break;
+            case 'A':
+                cfg.autotune = 1;
+                break;
+            case 'I':
+                cfg.inflate_threads = atoi(optarg) > 1 ? 2 : 1;
+                break;
+            case 'W':
+                cfg.anchor_window_pairs = atol(optarg);
+                break;
+            case 'S':
+                if (strcmp(optarg, "first") == 0) {
+                    cfg.sample_mode = SAMPLE_FIRST;
+                } else if (strcmp(optarg, "bernoulli") == 0) {
+                    cfg.sample_mode = SAMPLE_BERNOULLI;
+                } else if (strcmp(optarg, "reservoir") == 0) {
+                    cfg.sample_mode = SAMPLE_RESERVOIR;
+                } else if (strcmp(optarg, "stride") == 0) {
+                    cfg.sample_mode = SAMPLE_STRIDE;
+                } else {
+                    fprintf(stderr, "Error: --sample must be first, bernoulli, reservoir or stride\n");
+                    return 1;
+                }
+                break;
+            case 'F':
+                cfg.sample_fraction = atof(optarg);
+                break;
+            case 's':
+                cfg.sample_seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'D':
+                if (depth_parse(&depth_plan, optarg) != 0) {
+                    return 1;
+                }
+                break;
+            case 'T':
+                total_pairs = atol(optarg);
+                break;
+            case 'U':
+                depth_plan.umi_index = 1;
+                break;
+            case 'C':
+                cfg.target_classified = atol(optarg);
+                break;
+            case 'M':
+                cfg.target_umis = atol(optarg);
+                break;
+            case 'X':
+                cfg.abort_min_rate = atof(optarg);
+                break;
+            case 'Y':
+                cfg.abort_after = atol(optarg);
+                break;
+            case 'K':
+                want_umi_sketch = 1;
+                break;
+            case 'O':
+                optical_distance = atoi(optarg);
+                break;
+            case 'B':
+                barcodes_path = optarg;
+                break;
+            case 'E':
+                barcode_mate = atoi(optarg);
+                break;
+            case 'R':
+                if (strcmp(optarg, "exact") == 0) {
+                    rarefy_mode = RAREFY_EXACT;
+                } else if (strcmp(optarg, "hll") == 0) {
+                    rarefy_mode = RAREFY_HLL;
+                } else if (strcmp(optarg, "auto") == 0) {
+                    rarefy_mode = RAREFY_AUTO;
+                } else {
+                    fprintf(stderr, "Error: --rarefaction must be exact, hll or auto\n");
+                    return 1;
+                }
                 break;
             case 'h':
                 show_usage(argv[0]);
@@ -95,6 +237,58 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+    if ((cfg.threads < 1 && !cfg.autotune) || cfg.threads > MAX_THREADS) {
+        fprintf(stderr, "Error: --threads must be between 1 and %d\n", MAX_THREADS);
+        return 1;
+    }
+    if (cfg.batch_size < 1) {
+        fprintf(stderr, "Error: --batch-size must be positive\n");
+        return 1;
+    }
+    if (cfg.anchor_window_pairs < 0) {
+        fprintf(stderr, "Error: --anchor-window must not be negative\n");
+        return 1;
+    }
+    if ((cfg.sample_mode == SAMPLE_BERNOULLI || cfg.sample_mode == SAMPLE_STRIDE) &&
+        (cfg.sample_fraction <= 0 || cfg.sample_fraction > 1)) {
+        fprintf(stderr, "Error: --sample %s needs --fraction in (0, 1]\n",
+                cfg.sample_mode == SAMPLE_STRIDE ? "stride" : "bernoulli");
+        return 1;
+    }
+    
+    if (cfg.target_classified < 0 || cfg.target_umis < 0) {
+        fprintf(stderr, "Error: --target-classified and --target-umis must not be negative\n");
+        return 1;
+    }
+    if (cfg.abort_min_rate < 0 || cfg.abort_min_rate > 100 || cfg.abort_after < 1) {
+        fprintf(stderr, "Error: --abort-below must be a percentage and --abort-after positive\n");
+        return 1;
+    }
+    if (optical_distance < 0 || optical_distance >= 1 << OPTICAL_COORD_BITS) {
+        fprintf(stderr, "Error: --optical-dups must be a pixel distance below %d\n", 1 << OPTICAL_COORD_BITS);
+        return 1;
+    }
+    if (barcode_mate != 1 && barcode_mate != 2) {
+        fprintf(stderr, "Error: --barcode-read must be 1 or 2\n");
+        return 1;
+    }
+    if (barcodes_path && depth_plan.tiers > 0) {
+        fprintf(stderr, "Error: --barcodes and --depths both split the output; use one of them\n");
+        return 1;
+    }
+    if (depth_plan.tiers > 0) {
+        depth_plan.umi_index = 1;
+    }
+    
+    // Per-sample indexes replace the run-wide one unless --rarefaction exact needs it
+    if (barcodes_path) {
+        if (demux_load(&demux, barcodes_path, barcode_mate) != 0) {
+            return 1;
+        }
+        demux.umi_index = depth_plan.umi_index;
+        depth_plan.umi_index = 0;
+    }
+    
     strncpy(input_dir, argv[optind], sizeof(input_dir) - 1);
     
     // Find FASTQ pair
@@ -104,163 +298,673 @@ int main(int argc, char *argv[]) {
     }
     
     // Set output prefix if not provided
-    if (strlen(output_prefix) == 0) {
-        strncpy(output_prefix, base_name, sizeof(output_prefix) - 1);
+    if (strlen(cfg.output_prefix) == 0) {
+        strncpy(cfg.output_prefix, base_name, sizeof(cfg.output_prefix) - 1);
         printf("Using '%s' as output prefix.\n", base_name);
     }
     
     // Create output directory
-    if (create_directory(output_dir) != 0) {
-        fprintf(stderr, "Error creating output directory: %s\n", output_dir);
+    if (create_directory(cfg.output_dir) != 0) {
+        fprintf(stderr, "Error creating output directory: %s\n", cfg.output_dir);
         return 1;
     }
     
     // Construct output file paths
-    char tra_r1_out[MAX_PATH_LEN], tra_r2_out[MAX_PATH_LEN];
-    char trb_r1_out[MAX_PATH_LEN], trb_r2_out[MAX_PATH_LEN];
+    char out_paths[MAX_OUT_STREAMS][MAX_PATH_LEN];
+    snprintf(out_paths[STREAM_TRA_1], MAX_PATH_LEN, "%s/%s_TRA_1.fq.gz", cfg.output_dir, cfg.output_prefix);
+    snprintf(out_paths[STREAM_TRA_2], MAX_PATH_LEN, "%s/%s_TRA_2.fq.gz", cfg.output_dir, cfg.output_prefix);
+    snprintf(out_paths[STREAM_TRB_1], MAX_PATH_LEN, "%s/%s_TRB_1.fq.gz", cfg.output_dir, cfg.output_prefix);
+    snprintf(out_paths[STREAM_TRB_2], MAX_PATH_LEN, "%s/%s_TRB_2.fq.gz", cfg.output_dir, cfg.output_prefix);
+    for (int t = 0; t < depth_plan.tiers; t++) {
+        static const char *stream_names[NUM_STREAMS] = {"TRA_1", "TRA_2", "TRB_1", "TRB_2"};
+        for (int s = 0; s < NUM_STREAMS; s++) {
+            snprintf(out_paths[(t + 1) * NUM_STREAMS + s], MAX_PATH_LEN, "%s/%s_%s_%s.fq.gz",
+                     cfg.output_dir, cfg.output_prefix, depth_plan.label[t], stream_names[s]);
+        }
+    }
+    cfg.out_streams = NUM_STREAMS * (depth_plan.tiers + 1);
     
-    snprintf(tra_r1_out, sizeof(tra_r1_out), "%s/%s_TRA_1.fq.gz", output_dir, output_prefix);
-    snprintf(tra_r2_out, sizeof(tra_r2_out), "%s/%s_TRA_2.fq.gz", output_dir, output_prefix);
-    snprintf(trb_r1_out, sizeof(trb_r1_out), "%s/%s_TRB_1.fq.gz", output_dir, output_prefix);
-    snprintf(trb_r2_out, sizeof(trb_r2_out), "%s/%s_TRB_2.fq.gz", output_dir, output_prefix);
+    // A demultiplexed run writes only the per-sample streams: PREFIX_<sample>_TRA_1.fq.gz and so on
+    for (int g = 0; g < demux.nsamples; g++) {
+        static const char *stream_names[NUM_STREAMS] = {"TRA_1", "TRA_2", "TRB_1", "TRB_2"};
+        for (int s = 0; s < NUM_STREAMS; s++) {
+            snprintf(out_paths[g * NUM_STREAMS + s], MAX_PATH_LEN, "%s/%s_%s_%s.fq.gz",
+                     cfg.output_dir, cfg.output_prefix, demux.name[g], stream_names[s]);
+        }
+    }
+    if (demux.nsamples > 0) {
+        cfg.out_streams = NUM_STREAMS * demux.nsamples;
+    }
     
     // Open input files
-    gzFile r1_in = gzopen(r1_file, "r");
-    gzFile r2_in = gzopen(r2_file, "r");
-    if (!r1_in || !r2_in) {
-        fprintf(stderr, "Error opening input files\n");
+    fastq_input_t input;
+    if (input_open(&input, r1_file, r2_file, &cfg) != 0) {
+        input_close(&input);
         return 1;
     }
     
-    // Open output files
-    gzFile tra_r1_out_fp = gzopen(tra_r1_out, "w");
-    gzFile tra_r2_out_fp = gzopen(tra_r2_out, "w");
-    gzFile trb_r1_out_fp = gzopen(trb_r1_out, "w");
-    gzFile trb_r2_out_fp = gzopen(trb_r2_out, "w");
+    // Split the thread budget between stages from a short calibration run
+    int use_parallel = cfg.threads > 1 || cfg.inflate_threads > 1;
+    if (cfg.autotune) {
+        autotune_result_t tuned;
+        if (autotune(&cfg, &input, &tuned) != 0) {
+            return 1;
+        }
+        printf("Autotune: %d CPU(s) allowed, %.0f MB memory limit; calibrated on %ld pairs\n",
+               tuned.cpu_limit, tuned.memory_limit / 1e6, tuned.calibration_pairs);
+        printf("Autotune: per pair inflate R1 %.2f us, R2 %.2f us, match %.2f us, deflate %.2f us\n",
+               tuned.inflate_us[0], tuned.inflate_us[1], tuned.match_us, tuned.deflate_us);
+        printf("Autotune: %d inflate thread(s), %d worker thread(s), batch size %d\n",
+               cfg.inflate_threads, cfg.threads, cfg.batch_size);
+        use_parallel = tuned.thread_budget > 1;
+    }
+    
+    // Reservoir and stride sampling read both mates together in one thread
+    if (input.mode == SAMPLE_RESERVOIR || input.mode == SAMPLE_STRIDE) {
+        cfg.inflate_threads = 1;
+    }
+    
+    // Learning starts after calibration so it only sees batches of the real run
+    long learn_batches = (cfg.anchor_window_pairs + cfg.batch_size - 1) / cfg.batch_size;
+    anchor_window_init(&tra_window, learn_batches);
+    anchor_window_init(&trb_window, learn_batches);
     
-    if (!tra_r1_out_fp || !tra_r2_out_fp || !trb_r1_out_fp || !trb_r2_out_fp) {
-        fprintf(stderr, "Error opening output files\n");
+    // Depth tiers are drawn against the pairs this run will process
+    if ((depth_plan.tiers > 0 || rarefy_mode == RAREFY_AUTO) && total_pairs <= 0) {
+        total_pairs = depth_estimate_pairs(r1_file, &cfg);
+    }
+    
+    // The exact curve needs every UMI key held until the end (4 bytes per classified
+    // pair, twice while sorting); past a quarter of the memory limit use sketches
+    if (rarefy_mode == RAREFY_AUTO) {
+        long long need = (long long)total_pairs * 2 * (long long)sizeof(uint32_t);
+        rarefy_mode = need > detect_memory_limit() / 4 ? RAREFY_HLL : RAREFY_EXACT;
+    }
+    if (rarefy_mode == RAREFY_EXACT) {
+        depth_plan.umi_index = 1;
+    }
+    rarefaction_start(&rarefaction, rarefy_mode);
+    umi_sketch_on = want_umi_sketch;
+    optical_start(&optical, optical_distance);
+    demux_on = demux.nsamples > 0;
+    depth_start(&depth_plan, total_pairs, cfg.sample_seed);
+    if (cfg.target_umis > 0 && umi_seen_init(&umi_seen) != 0) {
+        fprintf(stderr, "Error: out of memory allocating the UMI bitmap\n");
         return 1;
     }
     
     // Initialize progress tracking
-    progress_t progress = {0, 0, 0, read_limit, time(NULL)};
+    progress_t progress = {0, 0, 0, 0, 0, cfg.read_limit, time(NULL)};
+    run_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
     
     printf("Starting processing...\n");
     printf("Input R1: %s\n", r1_file);
     printf("Input R2: %s\n", r2_file);
-    printf("Read limit: %ld\n", read_limit);
-    printf("Output directory: %s\n", output_dir);
+    printf("Read limit: %ld\n", cfg.read_limit);
+    printf("Output directory: %s\n", cfg.output_dir);
+    if (use_parallel) {
+        printf("Threads: %d inflate + %d workers (batch size %d, %s output)\n",
+               cfg.inflate_threads, cfg.threads, cfg.batch_size,
+               cfg.unordered ? "unordered" : "ordered");
+    }
     printf("Processing...\n");
     
-    // Main processing loop
-    fastq_record_t r1_record, r2_record;
-    char r1_rc[MAX_SEQ_LEN], r2_rc[MAX_SEQ_LEN];
-    char umi1[UMI1_LEN + 1], umi2[UMI2_LEN + 1];
-    char trimmed_seq[MAX_SEQ_LEN], trimmed_qual[MAX_SEQ_LEN];
+    // Threaded runs write one gzip member per batch; a single thread keeps one gzip stream per file
+    int status;
+    if (use_parallel) {
+        status = run_parallel(&cfg, &input, out_paths, &progress, &stats);
+    } else {
+        status = run_serial(&cfg, &input, out_paths, &progress);
+    }
+    
+    // Final progress update
+    update_progress(&progress, 1);
+    
+    char sample_line[256];
+    sample_describe(&input, sample_line, sizeof(sample_line));
+    
+    // Close files
+    input_close(&input);
+    umi_seen_free(&umi_seen);
+    
+    if (status == 0 && depth_finalize(&depth_plan, cfg.output_dir, cfg.output_prefix) != 0) {
+        status = 1;
+    }
+    if (status == 0 && rarefaction.mode != RAREFY_OFF) {
+        char curve_path[MAX_PATH_LEN];
+        snprintf(curve_path, sizeof(curve_path), "%s/%s.rarefaction.tsv", cfg.output_dir, cfg.output_prefix);
+        rarefaction_finish(&rarefaction, depth_plan.full, depth_plan.full_len, progress.processed_pairs);
+        if (rarefaction_write(&rarefaction, curve_path) != 0) {
+            status = 1;
+        }
+    }
+    umi_sketch_t *umi_stats = NULL;
+    if (status == 0 && umi_sketch_on) {
+        char sketch_path[MAX_PATH_LEN];
+        snprintf(sketch_path, sizeof(sketch_path), "%s/%s.umi_sketch.tsv", cfg.output_dir, cfg.output_prefix);
+        if ((umi_stats = umi_sketch_merge_all()) == NULL || umi_sketch_write(umi_stats, sketch_path) != 0) {
+            status = 1;
+        }
+    }
+    if (status == 0 && optical_finalize(&optical, cfg.output_dir, cfg.output_prefix) != 0) {
+        status = 1;
+    }
+    if (status == 0 && demux_on && demux_finalize(&demux, cfg.output_dir, cfg.output_prefix) != 0) {
+        status = 1;
+    }
+    umi_sketch_free_all();
+    depth_free(&depth_plan);
+    optical_free(&optical);
+    demux_free(&demux);
+    if (status != 0) {
+        fprintf(stderr, "\nError writing output files\n");
+        return 1;
+    }
+    
+    // Print summary
+    printf("\n--- Processing Summary ---\n");
+    printf("Processed %ld read pairs (limit was %ld).\n", progress.processed_pairs, cfg.read_limit);
+    printf("TRA pairs identified (UMI added, R1 trimmed to downstream): %ld\n", progress.tra_pairs);
+    printf("TRB pairs identified (UMI added, R2 trimmed to downstream): %ld\n", progress.trb_pairs);
+    if (cfg.target_umis > 0) {
+        printf("Distinct UMI pairs seen: %ld\n", progress.distinct_umis);
+    }
+    if (target_reached(&cfg, &progress)) {
+        printf("Stopped early at the yield target; batches already in flight were kept.\n");
+    }
+    if (cfg.sample_mode != SAMPLE_FIRST) {
+        printf("Sampling: %s\n", sample_line);
+    }
+    printf("Output files written to directory: %s\n", cfg.output_dir);
+    if (use_parallel) {
+        printf("Gzip member manifests written alongside outputs (*.members.tsv).\n");
+    }
+    if (cfg.numa) {
+        printf("NUMA placement: %d node(s); %.1f MB node-local, %.1f MB cross-node "
+               "(~%.1f MB expected unpinned, ~%.1f MB avoided)\n",
+               stats.numa_nodes, stats.node_local_bytes / 1e6, stats.cross_node_bytes / 1e6,
+               stats.unpinned_cross_bytes / 1e6,
+               (stats.unpinned_cross_bytes - stats.cross_node_bytes) / 1e6);
+    }
+    if (cfg.anchor_window_pairs > 0) {
+        print_anchor_window("TRA", &tra_window, learn_batches * cfg.batch_size);
+        print_anchor_window("TRB", &trb_window, learn_batches * cfg.batch_size);
+    }
+    if (depth_plan.active) {
+        depth_report(&depth_plan);
+    }
+    if (rarefaction.mode != RAREFY_OFF) {
+        rarefaction_report(&rarefaction);
+    }
+    if (umi_stats) {
+        umi_sketch_report(umi_stats);
+        free(umi_stats);
+    }
+    if (optical.distance) {
+        optical_report(&optical);
+    }
+    if (demux_on) {
+        demux_report(&demux);
+    }
+    
+    if (library_failed(&cfg, &progress)) {
+        char report_path[MAX_PATH_LEN];
+        snprintf(report_path, sizeof(report_path), "%s/%s.abort.json", cfg.output_dir, cfg.output_prefix);
+        write_abort_report(report_path, &cfg, &progress, r1_file, r2_file);
+        printf("\nAborted: classified rate below %.2f%% after %ld pairs; library looks failed.\n",
+               cfg.abort_min_rate, cfg.abort_after);
+        printf("Diagnostic report: %s\n", report_path);
+        return EXIT_LIBRARY_FAILED;
+    }
+    
+    return 0;
+}
+
+static int run_serial(const preprocess_config_t *cfg, fastq_input_t *in,
+                      char out_paths[MAX_OUT_STREAMS][MAX_PATH_LEN], progress_t *progress) {
+    gzFile out_fp[MAX_OUT_STREAMS];
+    for (int s = 0; s < cfg->out_streams; s++) {
+        out_fp[s] = gzopen(out_paths[s], "w");
+        if (!out_fp[s]) {
+            fprintf(stderr, "Error opening output files\n");
+            return 1;
+        }
+    }
+    
+    batch_t *batch = batch_create(cfg->batch_size);
+    if (!batch) {
+        fprintf(stderr, "Error: out of memory allocating batch\n");
+        return 1;
+    }
     
-    while (progress.processed_pairs < read_limit) {
-        // Read records
-        if (read_fastq_record(r1_in, &r1_record) != 0 || 
-            read_fastq_record(r2_in, &r2_record) != 0) {
+    int status = 0;
+    long seq = 0;
+    while (progress->processed_pairs < cfg->read_limit && !target_reached(cfg, progress) &&
+           !library_failed(cfg, progress)) {
+        int n = batch_fill(batch, in, cfg->read_limit - progress->processed_pairs);
+        if (n == 0) {
             break;
         }
+        batch->seq = seq++;
+        batch->first_pair = progress->processed_pairs;
+        process_batch(batch);
         
-        progress.processed_pairs++;
-        update_progress(&progress, 0);
-        
-        int read_type = 0; // 0=none, 1=TRA, 2=TRB
-        int found_rc = 0;
-        
-        // Check R1 for TRA pattern
-        if (extract_umi_and_trim(r1_record.sequence, PRE_UMI1_TRA, LINKER_FWD_TRA, 
-                                FLANK_TRA_SEQ, umi1, umi2, trimmed_seq, &found_rc)) {
-            read_type = 1; // TRA
-            
-            // Create modified headers
-            char r1_header_mod[MAX_LINE_LEN], r2_header_mod[MAX_LINE_LEN];
-            snprintf(r1_header_mod, sizeof(r1_header_mod), "%s UMI:TRA:%s_%s%s", 
-                    r1_record.header, umi1, umi2, found_rc ? ":RC" : "");
-            snprintf(r2_header_mod, sizeof(r2_header_mod), "%s UMI:TRA:%s_%s%s", 
-                    r2_record.header, umi1, umi2, found_rc ? ":RC" : "");
-            
-            // Calculate trimmed quality
-            int trim_pos = strlen(r1_record.sequence) - strlen(trimmed_seq);
-            if (found_rc) {
-                trim_pos = strlen(trimmed_seq);
-                strncpy(trimmed_qual, r1_record.quality, trim_pos);
-                trimmed_qual[trim_pos] = '\0';
-            } else {
-                strcpy(trimmed_qual, r1_record.quality + trim_pos);
-            }
-            
-            // Write TRA output
-            if (strlen(trimmed_seq) > 0 && strlen(r2_record.sequence) > 0) {
-                gzprintf(tra_r1_out_fp, "%s\n%s\n%s\n%s\n", 
-                        r1_header_mod, trimmed_seq, r1_record.plus, trimmed_qual);
-                gzprintf(tra_r2_out_fp, "%s\n%s\n%s\n%s\n", 
-                        r2_header_mod, r2_record.sequence, r2_record.plus, r2_record.quality);
-                progress.tra_pairs++;
+        for (int s = 0; s < cfg->out_streams; s++) {
+            out_buf_t *buf = &batch->out[s];
+            if (buf->len > 0 && gzwrite(out_fp[s], buf->data, (unsigned)buf->len) != (int)buf->len) {
+                status = 1;
             }
         }
         
-        // Check R2 for TRB pattern (only if not TRA)
-        if (read_type == 0) {
-            found_rc = 0;
-            if (extract_umi_and_trim(r2_record.sequence, PRE_UMI1_TRB, LINKER_REV_TRB, 
-                                    FLANK_TRB_SEQ, umi1, umi2, trimmed_seq, &found_rc)) {
-                read_type = 2; // TRB
-                
-                // Create modified headers
-                char r1_header_mod[MAX_LINE_LEN], r2_header_mod[MAX_LINE_LEN];
-                snprintf(r1_header_mod, sizeof(r1_header_mod), "%s UMI:TRB:%s_%s%s", 
-                        r1_record.header, umi1, umi2, found_rc ? ":RC" : "");
-                snprintf(r2_header_mod, sizeof(r2_header_mod), "%s UMI:TRB:%s_%s%s", 
-                        r2_record.header, umi1, umi2, found_rc ? ":RC" : "");
-                
-                // Calculate trimmed quality
-                int trim_pos = strlen(r2_record.sequence) - strlen(trimmed_seq);
-                if (found_rc) {
-                    trim_pos = strlen(trimmed_seq);
-                    strncpy(trimmed_qual, r2_record.quality, trim_pos);
-                    trimmed_qual[trim_pos] = '\0';
-                } else {
-                    strcpy(trimmed_qual, r2_record.quality + trim_pos);
-                }
-                
-                // Write TRB output
-                if (strlen(r1_record.sequence) > 0 && strlen(trimmed_seq) > 0) {
-                    gzprintf(trb_r1_out_fp, "%s\n%s\n%s\n%s\n", 
-                            r1_header_mod, r1_record.sequence, r1_record.plus, r1_record.quality);
-                    gzprintf(trb_r2_out_fp, "%s\n%s\n%s\n%s\n", 
-                            r2_header_mod, trimmed_seq, r2_record.plus, trimmed_qual);
-                    progress.trb_pairs++;
-                }
-            }
+        progress->processed_pairs += n;
+        progress->tra_pairs += batch->tra_pairs;
+        progress->trb_pairs += batch->trb_pairs;
+        progress->distinct_umis += batch->new_umis;
+        progress->finished_pairs += n;
+        update_progress(progress, 0);
+    }
+    
+    batch_free(batch);
+    for (int s = 0; s < cfg->out_streams; s++) {
+        if (gzclose(out_fp[s]) != Z_OK) {
+            status = 1;
+        }
+    }
+    return status;
+}
+
+static void print_anchor_window(const char *chain, const anchor_window_t *window, long learn_pairs) {
+    if (!window->ready) {
+        printf("Anchor window %s: not learned (input shorter than %ld pairs)\n", chain, learn_pairs);
+        return;
+    }
+    printf("Anchor window %s: forward ", chain);
+    if (window->hi[0] >= 0) printf("%d-%d", window->lo[0], window->hi[0]); else printf("none");
+    printf(", RC ");
+    if (window->hi[1] >= 0) printf("%d-%d", window->lo[1], window->hi[1]); else printf("none");
+    printf(" (learned from first %ld pairs); %ld in window, %ld full scans, %ld found outside window\n",
+           learn_pairs, window->window_hits, window->fallback_scans, window->fallback_hits);
+}
+
+// s as a quoted JSON string: quotes, backslashes and control characters escaped
+static void write_json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(fp, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(fp, "\\u%04x", *p);
+        } else {
+            fputc(*p, fp);
         }
     }
+    fputc('"', fp);
+}
+
+// Everything needed to tell a failed library from a bad run without the logs
+static void write_abort_report(const char *path, const preprocess_config_t *cfg, const progress_t *progress,
+                               const char *r1_file, const char *r2_file) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error writing abort report %s: %s\n", path, strerror(errno));
+        return;
+    }
+    long pairs = progress->finished_pairs;
+    double rate = pairs > 0 ? 100.0 * (progress->tra_pairs + progress->trb_pairs) / pairs : 0;
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"status\": \"aborted\",\n");
+    fprintf(fp, "  \"reason\": \"classified rate below threshold\",\n");
+    fprintf(fp, "  \"exit_code\": %d,\n", EXIT_LIBRARY_FAILED);
+    fprintf(fp, "  \"input_r1\": ");
+    write_json_string(fp, r1_file);
+    fprintf(fp, ",\n");
+    fprintf(fp, "  \"input_r2\": ");
+    write_json_string(fp, r2_file);
+    fprintf(fp, ",\n");
+    fprintf(fp, "  \"abort_below_percent\": %.4f,\n", cfg->abort_min_rate);
+    fprintf(fp, "  \"abort_after_pairs\": %ld,\n", cfg->abort_after);
+    fprintf(fp, "  \"pairs_classified_over\": %ld,\n", pairs);
+    fprintf(fp, "  \"tra_pairs\": %ld,\n", progress->tra_pairs);
+    fprintf(fp, "  \"trb_pairs\": %ld,\n", progress->trb_pairs);
+    fprintf(fp, "  \"tra_percent\": %.4f,\n", pairs > 0 ? 100.0 * progress->tra_pairs / pairs : 0);
+    fprintf(fp, "  \"trb_percent\": %.4f,\n", pairs > 0 ? 100.0 * progress->trb_pairs / pairs : 0);
+    fprintf(fp, "  \"classified_percent\": %.4f,\n", rate);
+    fprintf(fp, "  \"elapsed_seconds\": %.0f\n", difftime(time(NULL), progress->start_time));
+    fprintf(fp, "}\n");
+    fclose(fp);
+}
+
+batch_t *batch_create(int capacity) {
+    batch_t *batch = calloc(1, sizeof(batch_t));
+    if (!batch) return NULL;
+    batch->capacity = capacity;
+    batch->r1 = calloc(capacity, sizeof(fastq_record_t));
+    batch->r2 = calloc(capacity, sizeof(fastq_record_t));
+    batch->hits = calloc(capacity, sizeof(anchor_hit_t));
+    batch->matched = calloc(capacity, 1);
+    batch->tier = calloc(capacity, 1);
+    batch->umi_keys = calloc(capacity, sizeof(uint32_t));
+    batch->umi_coords = calloc(capacity, sizeof(uint64_t));
+    batch->umi_tier = calloc(capacity, 1);
+    batch->sample = calloc(capacity, 1);
+    batch->umi_sample = calloc(capacity, 1);
+    // Sized for typical short reads; batch_fill_mate grows an arena when a record may not fit
+    for (int m = 0; m < 2; m++) {
+        batch->arena_size[m] = (size_t)capacity * 512 + 2 * (MAX_LINE_LEN + MAX_SEQ_LEN);
+        batch->arena[m] = malloc(batch->arena_size[m]);
+    }
+    if (!batch->r1 || !batch->r2 || !batch->hits || !batch->matched || !batch->tier ||
+        !batch->umi_keys || !batch->umi_coords || !batch->umi_tier || !batch->sample || !batch->umi_sample ||
+        !batch->arena[0] || !batch->arena[1]) {
+        batch_free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+void batch_free(batch_t *batch) {
+    if (!batch) return;
+    for (int s = 0; s < MAX_OUT_STREAMS; s++) {
+        free(batch->out[s].data);
+    }
+    free(batch->r1);
+    free(batch->r2);
+    free(batch->hits);
+    free(batch->matched);
+    free(batch->tier);
+    free(batch->umi_keys);
+    free(batch->umi_coords);
+    free(batch->umi_tier);
+    free(batch->sample);
+    free(batch->umi_sample);
+    free(batch->arena[0]);
+    free(batch->arena[1]);
+    free(batch);
+}
+
+// Double a mate's arena and re-point the records already read into it
+static int grow_arena(batch_t *batch, int mate, int filled, char **pos) {
+    size_t used = (size_t)(*pos - batch->arena[mate]);
+    size_t new_size = batch->arena_size[mate] * 2;
+    char *grown = malloc(new_size);
+    if (!grown) return -1;
+    memcpy(grown, batch->arena[mate], used);
+
+    fastq_record_t *records = mate == 0 ? batch->r1 : batch->r2;
+    char *old = batch->arena[mate];
+    for (int i = 0; i < filled; i++) {
+        records[i].header = grown + (records[i].header - old);
+        records[i].sequence = grown + (records[i].sequence - old);
+        records[i].plus = grown + (records[i].plus - old);
+        records[i].quality = grown + (records[i].quality - old);
+    }
+    free(old);
+    batch->arena[mate] = grown;
+    batch->arena_size[mate] = new_size;
+    *pos = grown + used;
+    return 0;
+}
+
+// Read up to max_records records of one mate into the batch. In Bernoulli mode
+// records are dropped by input index, so R1 and R2 readers keep the same pairs.
+int batch_fill_mate(batch_t *batch, int mate, fastq_input_t *in, long max_records) {
+    fastq_record_t *records = mate == 0 ? batch->r1 : batch->r2;
+    const size_t record_max = 2 * (MAX_LINE_LEN + MAX_SEQ_LEN);
+    char *pos = batch->arena[mate];
+    int filled = 0;
     
-    // Final progress update
-    update_progress(&progress, 1);
+    while (filled < batch->capacity && filled < max_records) {
+        if ((size_t)(batch->arena[mate] + batch->arena_size[mate] - pos) < record_max &&
+            grow_arena(batch, mate, filled, &pos) != 0) {
+            fprintf(stderr, "\nError: out of memory reading batch\n");
+            exit(1);
+        }
+        char *record_start = pos;
+        if (read_fastq_record(in->fp[mate], &records[filled], &pos,
+                              batch->arena[mate] + batch->arena_size[mate]) != 0) {
+            break;
+        }
+        long index = in->next_index[mate]++;
+        if (in->mode == SAMPLE_BERNOULLI && !sample_keep(in, index)) {
+            pos = record_start;
+            continue;
+        }
+        filled++;
+    }
     
-    // Close files
-    gzclose(r1_in);
-    gzclose(r2_in);
-    gzclose(tra_r1_out_fp);
-    gzclose(tra_r2_out_fp);
-    gzclose(trb_r1_out_fp);
-    gzclose(trb_r2_out_fp);
+    if (mate == 0) {
+        batch->arena_used = 0;
+    }
+    batch->arena_used += (size_t)(pos - batch->arena[mate]);
+    return filled;
+}
+
+int batch_fill(batch_t *batch, fastq_input_t *in, long max_pairs) {
+    if (in->mode == SAMPLE_RESERVOIR) {
+        return reservoir_fill(in, batch, max_pairs);
+    }
+    if (in->mode == SAMPLE_STRIDE) {
+        return bgzf_stride_fill(in->stride, batch, max_pairs);
+    }
     
-    // Print summary
-    printf("\n--- Processing Summary ---\n");
-    printf("Processed %ld read pairs (limit was %ld).\n", progress.processed_pairs, read_limit);
-    printf("TRA pairs identified (UMI added, R1 trimmed to downstream): %ld\n", progress.tra_pairs);
-    printf("TRB pairs identified (UMI added, R2 trimmed to downstream): %ld\n", progress.trb_pairs);
-    printf("Output files written to directory: %s\n", output_dir);
+    // Both files must yield a record for a pair to count
+    int n = batch_fill_mate(batch, 0, in, max_pairs);
+    batch->count = n > 0 ? batch_fill_mate(batch, 1, in, n) : 0;
+    return batch->count;
+}
+
+// Append a copy of a record read elsewhere (sampling sources) to a mate's arena.
+// Lines are cut to the lengths the gzgets reader allows.
+int batch_copy_record(batch_t *batch, int mate, int index, char **pos, const fastq_record_t *src) {
+    fastq_record_t *dst = (mate == 0 ? batch->r1 : batch->r2) + index;
+    const char *lines[4] = {src->header, src->sequence, src->plus, src->quality};
+    char **fields[4] = {&dst->header, &dst->sequence, &dst->plus, &dst->quality};
+    const size_t limits[4] = {MAX_LINE_LEN, MAX_SEQ_LEN, MAX_LINE_LEN, MAX_SEQ_LEN};
     
+    for (int f = 0; f < 4; f++) {
+        size_t len = strnlen(lines[f], limits[f] - 1);
+        while ((size_t)(batch->arena[mate] + batch->arena_size[mate] - *pos) < len + 1) {
+            if (grow_arena(batch, mate, index, pos) != 0) return -1;
+        }
+        memcpy(*pos, lines[f], len);
+        (*pos)[len] = '\0';
+        *fields[f] = *pos;
+        *pos += len + 1;
+    }
     return 0;
 }
 
+static int out_buf_reserve(out_buf_t *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 0;
+    size_t new_cap = buf->cap ? buf->cap : 65536;
+    while (new_cap < buf->len + extra) new_cap *= 2;
+    char *grown = realloc(buf->data, new_cap);
+    if (!grown) return -1;
+    buf->data = grown;
+    buf->cap = new_cap;
+    return 0;
+}
+
+// Append one FASTQ record to an output stream
+static void emit_record(out_buf_t *buf, const char *header, const char *sequence,
+                        const char *plus, const char *quality) {
+    const char *fields[4] = {header, sequence, plus, quality};
+    size_t lens[4];
+    size_t total = 0;
+    for (int i = 0; i < 4; i++) {
+        lens[i] = strlen(fields[i]);
+        total += lens[i] + 1;
+    }
+    if (out_buf_reserve(buf, total) != 0) {
+        fprintf(stderr, "\nError: out of memory buffering output\n");
+        exit(1);
+    }
+    for (int i = 0; i < 4; i++) {
+        memcpy(buf->data + buf->len, fields[i], lens[i]);
+        buf->len += lens[i];
+        buf->data[buf->len++] = '\n';
+    }
+    buf->records++;
+}
+
+// Append a classified pair to its streams in the full output, or its sample's
+// output, and in every depth tier holding it; stream1 is STREAM_TRA_1 or STREAM_TRB_1
+static void emit_pair(batch_t *batch, int i, int stream1, int trb, const char *umi1, const char *umi2,
+                      const fastq_record_t *rec1, const fastq_record_t *rec2) {
+    int group = demux_on ? batch->sample[i] : 0;
+    for (int t = -1; t < depth_plan.tiers; t++) {
+        if (t >= 0 && t < batch->tier[i]) continue;
+        out_buf_t *out = &batch->out[(t + 1 + group) * NUM_STREAMS + stream1];
+        emit_record(&out[0], rec1->header, rec1->sequence, rec1->plus, rec1->quality);
+        emit_record(&out[1], rec2->header, rec2->sequence, rec2->plus, rec2->quality);
+    }
+    
+    if (depth_plan.umi_index || umi_seen.bits || rarefaction.mode == RAREFY_HLL || umi_sketch_on ||
+        optical.distance || demux.umi_index) {
+        int64_t key = umi_key(trb, umi1, umi2);
+        if (key >= 0) {
+            batch->umi_keys[batch->umi_count] = (uint32_t)key;
+            batch->umi_coords[batch->umi_count] = optical.distance ? optical_coord(rec1->header) : OPTICAL_NONE;
+            batch->umi_sample[batch->umi_count] = (unsigned char)group;
+            batch->umi_tier[batch->umi_count++] = batch->tier[i];
+        }
+        if (key >= 0 && umi_seen.bits) {
+            batch->new_umis += umi_seen_add(&umi_seen, (uint32_t)key);
+        }
+        if (key >= 0 && rarefaction.mode == RAREFY_HLL) {
+            rarefaction_add(&rarefaction, (uint32_t)key);
+            batch->hll_keys++;
+        }
+    }
+}
+
+// Slice the quality string to match a trimmed sequence
+static void trim_quality(const char *sequence, const char *quality, const char *trimmed_seq,
+                         int found_rc, char *trimmed_qual) {
+    int qual_len = strlen(quality);
+    int trim_pos;
+    if (found_rc) {
+        trim_pos = strlen(trimmed_seq);
+        if (trim_pos > qual_len) trim_pos = qual_len;
+        strncpy(trimmed_qual, quality, trim_pos);
+        trimmed_qual[trim_pos] = '\0';
+    } else {
+        trim_pos = strlen(sequence) - strlen(trimmed_seq);
+        if (trim_pos > qual_len) trim_pos = qual_len;
+        strcpy(trimmed_qual, quality + trim_pos);
+    }
+}
+
+void process_batch(batch_t *batch) {
+    char umi1[UMI1_LEN + 1], umi2[UMI2_LEN + 1];
+    char trimmed_seq[MAX_SEQ_LEN], trimmed_qual[MAX_SEQ_LEN];
+    char r1_header_mod[MAX_LINE_LEN], r2_header_mod[MAX_LINE_LEN];
+    
+    for (int s = 0; s < MAX_OUT_STREAMS; s++) {
+        batch->out[s].len = 0;
+        batch->out[s].records = 0;
+    }
+    batch->tra_pairs = 0;
+    batch->trb_pairs = 0;
+    batch->umi_count = 0;
+    batch->new_umis = 0;
+    batch->hll_keys = 0;
+    for (int i = 0; i < batch->count; i++) {
+        batch->tier[i] = (unsigned char)depth_tier(&depth_plan, batch->first_pair + i);
+    }
+    
+    // Match and trim sample barcodes; unassigned pairs are marked so neither anchor search sees them
+    const unsigned char *unassigned = NULL;
+    if (demux_on) {
+        demux_assign(&demux, batch);
+        for (int i = 0; i < batch->count; i++) {
+            batch->matched[i] = batch->sample[i] == DEMUX_NONE;
+        }
+        unassigned = batch->matched;
+    }
+    
+    // Check R1 for TRA pattern; the anchor is located for the whole batch at once
+    batch_find_anchor(batch->r1, batch->count, PRE_UMI1_TRA, unassigned, &tra_window, batch->hits);
+    anchor_window_learn(&tra_window, batch->seq, batch->hits, batch->count);
+    for (int i = 0; i < batch->count; i++) {
+        const fastq_record_t *r1_record = &batch->r1[i];
+        const fastq_record_t *r2_record = &batch->r2[i];
+        const anchor_hit_t *hit = &batch->hits[i];
+        
+        if (unassigned && batch->sample[i] == DEMUX_NONE) continue;
+        batch->matched[i] = hit->pos != ANCHOR_NONE &&
+                            extract_at_anchor(r1_record->sequence, hit, PRE_UMI1_TRA, LINKER_FWD_TRA,
+                                              FLANK_TRA_SEQ, umi1, umi2, trimmed_seq);
+        if (!batch->matched[i]) continue;
+        
+        // Create modified headers
+        snprintf(r1_header_mod, sizeof(r1_header_mod), "%s UMI:TRA:%s_%s%s", 
+                r1_record->header, umi1, umi2, hit->rc ? ":RC" : "");
+        snprintf(r2_header_mod, sizeof(r2_header_mod), "%s UMI:TRA:%s_%s%s", 
+                r2_record->header, umi1, umi2, hit->rc ? ":RC" : "");
+        
+        // Calculate trimmed quality
+        trim_quality(r1_record->sequence, r1_record->quality, trimmed_seq, hit->rc, trimmed_qual);
+        
+        // Write TRA output
+        if (strlen(trimmed_seq) > 0 && strlen(r2_record->sequence) > 0) {
+            fastq_record_t out1 = {r1_header_mod, trimmed_seq, r1_record->plus, trimmed_qual};
+            fastq_record_t out2 = {r2_header_mod, r2_record->sequence, r2_record->plus, r2_record->quality};
+            emit_pair(batch, i, STREAM_TRA_1, 0, umi1, umi2, &out1, &out2);
+            batch->tra_pairs++;
+        }
+    }
+    
+    // Check R2 for TRB pattern (only if not TRA)
+    batch_find_anchor(batch->r2, batch->count, PRE_UMI1_TRB, batch->matched, &trb_window, batch->hits);
+    anchor_window_learn(&trb_window, batch->seq, batch->hits, batch->count);
+    for (int i = 0; i < batch->count; i++) {
+        const fastq_record_t *r1_record = &batch->r1[i];
+        const fastq_record_t *r2_record = &batch->r2[i];
+        const anchor_hit_t *hit = &batch->hits[i];
+        
+        if (hit->pos == ANCHOR_NONE ||
+            !extract_at_anchor(r2_record->sequence, hit, PRE_UMI1_TRB, LINKER_REV_TRB,
+                               FLANK_TRB_SEQ, umi1, umi2, trimmed_seq)) {
+            continue;
+        }
+        
+        // Create modified headers
+        snprintf(r1_header_mod, sizeof(r1_header_mod), "%s UMI:TRB:%s_%s%s", 
+                r1_record->header, umi1, umi2, hit->rc ? ":RC" : "");
+        snprintf(r2_header_mod, sizeof(r2_header_mod), "%s UMI:TRB:%s_%s%s", 
+                r2_record->header, umi1, umi2, hit->rc ? ":RC" : "");
+        
+        // Calculate trimmed quality
+        trim_quality(r2_record->sequence, r2_record->quality, trimmed_seq, hit->rc, trimmed_qual);
+        
+        // Write TRB output
+        if (strlen(r1_record->sequence) > 0 && strlen(trimmed_seq) > 0) {
+            fastq_record_t out1 = {r1_header_mod, r1_record->sequence, r1_record->plus, r1_record->quality};
+            fastq_record_t out2 = {r2_header_mod, trimmed_seq, r2_record->plus, trimmed_qual};
+            emit_pair(batch, i, STREAM_TRB_1, 1, umi1, umi2, &out1, &out2);
+            batch->trb_pairs++;
+        }
+    }
+    
+    if (depth_plan.active) {
+        depth_collect(&depth_plan, batch);
+    }
+    if (rarefaction.mode == RAREFY_HLL) {
+        rarefaction_batch(&rarefaction, batch->count, batch->hll_keys);
+    }
+    if (umi_sketch_on) {
+        umi_sketch_add(umi_sketch_thread(), batch->umi_keys, batch->umi_count);
+    }
+    if (optical.distance) {
+        optical_collect(&optical, batch);
+    }
+    if (demux_on) {
+        demux_collect(&demux, batch);
+    }
+}
+
 void show_usage(const char *program_name) {
     printf("Usage: %s [OPTIONS] input_dir\n", program_name);
     printf("Process paired-end FASTQ files to identify TRA/TRB structures\n\n");
@@ -268,6 +972,52 @@ void show_usage(const char *program_name) {
     printf("  -n, --limit LIMIT        Maximum number of read pairs to process (default: 100000)\n");
     printf("  -o, --output_prefix PREFIX  Prefix for output files\n");
     printf("  -d, --outdir DIR         Output directory (default: PairTCR_results/1_preprocess_and_trim_output)\n");
+    printf("  -t, --threads N          Worker threads; N > 1 writes one gzip member per batch (default: 1)\n");
+    printf("  -b, --batch-size N       Read pairs per batch (default: %d)\n", DEFAULT_BATCH_SIZE);
+    printf("  -u, --unordered          With --threads, append members as workers finish instead of in\n");
+    printf("                           input order (faster; record order depends on scheduling)\n");
+    printf("      --autotune           Calibrate on the first batches and split the --threads budget\n");
+    printf("                           between inflate and worker threads, choosing the batch size;\n");
+    printf("                           honours cgroup CPU and memory limits (--threads auto: all CPUs)\n");
+    printf("      --inflate-threads N  1, or 2 to inflate R1 and R2 in separate threads (default: 1)\n");
+    printf("      --numa               With --threads, pin threads per NUMA node and keep each batch\n");
+    printf("                           in node-local memory from parsing to compression\n");
+    printf("      --anchor-window N    Learn anchor offsets from the first N pairs, then search that\n");
+    printf("                           window first and scan the whole read only on a miss. A read\n");
+    printf("                           with an RC anchor in its window is not checked for a forward\n");
+    printf("                           anchor further along (default: off)\n");
+    printf("      --sample MODE        Which pairs --limit takes: first (default), bernoulli (each pair\n");
+    printf("                           with probability --fraction), reservoir (exactly --limit pairs,\n");
+    printf("                           uniformly from the whole input) or stride (whole BGZF blocks with\n");
+    printf("                           probability --fraction; unsampled blocks are not inflated)\n");
+    printf("      --fraction F         Sampling probability for bernoulli and stride, in (0, 1]\n");
+    printf("      --seed N             Sampling seed; the same seed picks the same pairs (default: 1)\n");
+    printf("      --depths LIST        Also write nested subsamples at these depths from the same pass,\n");
+    printf("                           e.g. 1M,5M,10M, as PREFIX_<depth>_TRA_1.fq.gz and so on; each\n");
+    printf("                           tier holds every smaller one (implies --umi-index)\n");
+    printf("      --total-pairs N      Pairs the depths are drawn against (default: estimated from the\n");
+    printf("                           R1 file size, capped at --limit)\n");
+    printf("      --umi-index          Write sorted UMI pair indexes (PREFIX.umi.idx, one per depth tier)\n");
+    printf("      --target-classified N  Stop reading once N TRA + TRB pairs are found (default: off)\n");
+    printf("      --target-umis N      Stop reading once N distinct UMI pairs are seen (default: off)\n");
+    printf("      --abort-below PCT    Stop if fewer than PCT%% of pairs are TRA/TRB after --abort-after\n");
+    printf("                           pairs; writes PREFIX.abort.json and exits with status %d\n", EXIT_LIBRARY_FAILED);
+    printf("      --abort-after N      Pairs to process before judging the library (default: 200000)\n");
+    printf("      --rarefaction MODE   Distinct UMI / UMI pair curve and saturation in the summary and\n");
+    printf("                           PREFIX.rarefaction.tsv: exact (from the UMI pair index), hll\n");
+    printf("                           (HyperLogLog, fixed memory) or auto (exact if it fits in memory)\n");
+    printf("      --umi-sketch         Distinct UMI pairs per chain (HyperLogLog) and the most amplified\n");
+    printf("                           UMI pairs (count-min) in ~66 KB per thread; PREFIX.umi_sketch.tsv\n");
+    printf("      --optical-dups PX    Flag classified pairs within PX pixels of an earlier pair with the\n");
+    printf("                           same UMI pair on the same tile (from lane:tile:x:y read names) as\n");
+    printf("                           optical duplicates in PREFIX.optical_dups.tsv; 100 suits unpatterned,\n");
+    printf("                           2500 patterned flow cells (default: off)\n");
+    printf("      --barcodes FILE      Demultiplex on inline sample barcodes (lines of \"sample barcode\",\n");
+    printf("                           up to %d samples) matched at the start of --barcode-read, correcting\n", MAX_SAMPLES);
+    printf("                           one mismatch or N; writes PREFIX_<sample>_TRA_1.fq.gz and so on,\n");
+    printf("                           PREFIX.demux.tsv and with --umi-index PREFIX_<sample>.umi.idx.\n");
+    printf("                           Unassigned pairs are counted but not written\n");
+    printf("      --barcode-read N     Read carrying the barcode, 1 or 2 (default: 1)\n");
     printf("  -h, --help               Show this help message\n");
 }
 
@@ -324,53 +1074,59 @@ void reverse_complement(const char *seq, char *rc_seq) {
     rc_seq[len] = '\0';
 }
 
-int read_fastq_record(gzFile fp, fastq_record_t *record) {
-    if (gzgets(fp, record->header, sizeof(record->header)) == NULL) return 1;
-    if (gzgets(fp, record->sequence, sizeof(record->sequence)) == NULL) return 1;
-    if (gzgets(fp, record->plus, sizeof(record->plus)) == NULL) return 1;
-    if (gzgets(fp, record->quality, sizeof(record->quality)) == NULL) return 1;
-    
-    // Remove newlines
-    record->header[strcspn(record->header, "\n")] = '\0';
-    record->sequence[strcspn(record->sequence, "\n")] = '\0';
-    record->plus[strcspn(record->plus, "\n")] = '\0';
-    record->quality[strcspn(record->quality, "\n")] = '\0';
+// Read one line into the batch arena; returns NULL at EOF
+static char *read_line(gzFile fp, int max_len, char **arena, const char *arena_end) {
+    char *line = *arena;
+    if (arena_end - line < max_len) return NULL;
+    if (gzgets(fp, line, max_len) == NULL) return NULL;
     
-    return 0;
+    // Remove newline
+    size_t len = strcspn(line, "\n");
+    line[len] = '\0';
+    *arena = line + len + 1;
+    return line;
 }
 
-char *find_pattern(const char *sequence, const char *pattern) {
-    return strstr(sequence, pattern);
+int read_fastq_record(gzFile fp, fastq_record_t *record, char **arena, const char *arena_end) {
+    if ((record->header = read_line(fp, MAX_LINE_LEN, arena, arena_end)) == NULL) return 1;
+    if ((record->sequence = read_line(fp, MAX_SEQ_LEN, arena, arena_end)) == NULL) return 1;
+    if ((record->plus = read_line(fp, MAX_LINE_LEN, arena, arena_end)) == NULL) return 1;
+    if ((record->quality = read_line(fp, MAX_SEQ_LEN, arena, arena_end)) == NULL) return 1;
+    return 0;
 }
 
 int extract_umi_and_trim(const char *sequence, const char *pre_umi, const char *linker, 
                         const char *flank, char *umi1, char *umi2, char *trimmed_seq, int *found_rc) {
+    anchor_hit_t hit;
+    find_anchor(sequence, pre_umi, &hit);
+    *found_rc = hit.rc;
+    if (hit.pos == ANCHOR_NONE) {
+        return 0; // Pattern not found
+    }
+    return extract_at_anchor(sequence, &hit, pre_umi, linker, flank, umi1, umi2, trimmed_seq);
+}
+
+// Validate linker, flank and A/T after an anchor found by find_anchor or batch_find_anchor
+int extract_at_anchor(const char *sequence, const anchor_hit_t *hit, const char *pre_umi, const char *linker,
+                      const char *flank, char *umi1, char *umi2, char *trimmed_seq) {
     char rc_sequence[MAX_SEQ_LEN];
     const char *search_seq = sequence;
-    *found_rc = 0;
-    
-    // Build pattern to search for
-    char pattern[256];
-    snprintf(pattern, sizeof(pattern), "%s", pre_umi);
-    
-    char *match_pos = find_pattern(search_seq, pattern);
     
-    if (!match_pos) {
-        // Try reverse complement
+    if (hit->rc) {
         reverse_complement(sequence, rc_sequence);
         search_seq = rc_sequence;
-        match_pos = find_pattern(search_seq, pattern);
-        if (match_pos) {
-            *found_rc = 1;
-        }
     }
+    const char *match_pos = search_seq + hit->pos;
     
-    if (!match_pos) {
-        return 0; // Pattern not found
+    // The whole construct must lie inside the read; a read ending inside a UMI
+    // would otherwise step past its terminator before the linker compare
+    size_t construct_len = strlen(pre_umi) + UMI1_LEN + strlen(linker) + UMI2_LEN + strlen(flank) + 1;
+    if (strlen(match_pos) < construct_len) {
+        return 0;
     }
     
     // Extract UMIs and find complete pattern
-    char *pos = match_pos + strlen(pre_umi);
+    const char *pos = match_pos + strlen(pre_umi);
     
     // Extract UMI1
     strncpy(umi1, pos, UMI1_LEN);
@@ -401,7 +1157,7 @@ int extract_umi_and_trim(const char *sequence, const char *pre_umi, const char *
     pos++;
     
     // Extract trimmed sequence
-    if (*found_rc) {
+    if (hit->rc) {
         // For RC, take sequence before the pattern start in original sequence
         int pattern_start = strlen(sequence) - (pos - search_seq);
         strncpy(trimmed_seq, sequence, pattern_start);
@@ -433,6 +1189,26 @@ void update_progress(progress_t *prog, int force_update) {
     }
 }
 
+// Whether a yield target is met; workers update the counters concurrently
+int target_reached(const preprocess_config_t *cfg, const progress_t *progress) {
+    long classified = __atomic_load_n(&progress->tra_pairs, __ATOMIC_RELAXED) +
+                      __atomic_load_n(&progress->trb_pairs, __ATOMIC_RELAXED);
+    long umis = __atomic_load_n(&progress->distinct_umis, __ATOMIC_RELAXED);
+    return (cfg->target_classified > 0 && classified >= cfg->target_classified) ||
+           (cfg->target_umis > 0 && umis >= cfg->target_umis);
+}
+
+// Early-abort rule: the classified rate is still below --abort-below once
+// --abort-after pairs have gone through the workers
+int library_failed(const preprocess_config_t *cfg, const progress_t *progress) {
+    if (cfg->abort_min_rate <= 0) return 0;
+    long pairs = __atomic_load_n(&progress->finished_pairs, __ATOMIC_RELAXED);
+    if (pairs < cfg->abort_after) return 0;
+    long classified = __atomic_load_n(&progress->tra_pairs, __ATOMIC_RELAXED) +
+                      __atomic_load_n(&progress->trb_pairs, __ATOMIC_RELAXED);
+    return 100.0 * classified < cfg->abort_min_rate * pairs;
+}
+
 int create_directory(const char *path) {
     char temp_path[MAX_PATH_LEN];
     char *p = NULL;
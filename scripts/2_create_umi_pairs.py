@@ -5,7 +5,7 @@ import argparse
 import sys
 import os
 # No longer need glob as prefix is defaulted or provided
-from collections import defaultdict
+from collections import defaultdict, Counter
 from tqdm import tqdm
 
 # --- Configuration ---
@@ -15,6 +15,8 @@ DEFAULT_INPUT_DIR = os.path.join("PairTCR_results", "1_preprocess_and_trim_outpu
 DEFAULT_PREFIX = "TCR_TSO_18"
 # Default output TSV placed inside the common results folder
 DEFAULT_OUTPUT_FILE = os.path.join("PairTCR_results", "2_create_umi_pairs_output", "umi_pairs.tsv")
+# Reads a UMI family needs on each chain before its pairs are written (1 keeps every family)
+DEFAULT_MIN_FAMILY_SIZE = 1
 
 # --- Helper Functions --- (Keep these as they are)
 def read_fastq_record(handle):
@@ -53,8 +55,45 @@ def reverse_complement_umi(umi_seq):
     if rc_umi1 is None or rc_umi2 is None: return None
     return f"{rc_umi2}_{rc_umi1}"
 
+def read_cluster_position(read_id):
+    """Lane, tile, x and y at the end of an Illumina read name, as step 1 --optical-dups reads them."""
+    match = re.search(r':(\d+):(\d+):(\d+):(\d+)(?:[#/].*)?$', read_id)
+    return tuple(int(v) for v in match.groups()) if match else None
+
+def load_optical_duplicates(path):
+    """Positions of the step 1 optical duplicates, per chain."""
+    flagged = {"TRA": set(), "TRB": set()}
+    try:
+        with open(path) as in_f:
+            in_f.readline()
+            for line in in_f:
+                chain, _umi, lane, tile, x, y = line.rstrip('\n').split('\t')
+                flagged[chain].add((int(lane), int(tile), int(x), int(y)))
+    except (IOError, ValueError, KeyError) as e: print(f"Error reading optical duplicates from {path}: {e}", file=sys.stderr); sys.exit(1)
+    print(f"Loaded {len(flagged['TRA'])} TRA and {len(flagged['TRB'])} TRB optical duplicates from {os.path.basename(path)}.")
+    return flagged
+
+def family_sizes_path(output_file):
+    return f"{os.path.splitext(output_file)[0]}_family_sizes.tsv"
+
+def write_family_sizes(tra_sizes, trb_sizes, path):
+    """Write the per-chain UMI family-size histogram and print a short summary of it."""
+    try:
+        with open(path, 'w') as out_f:
+            out_f.write("chain\tfamily_size\tumis\treads\n")
+            for chain, sizes in (("TRA", tra_sizes), ("TRB", trb_sizes)):
+                histogram = Counter(sizes)
+                for size in sorted(histogram):
+                    out_f.write(f"{chain}\t{size}\t{histogram[size]}\t{size * histogram[size]}\n")
+                umis = len(sizes); reads = sum(sizes)
+                singletons = histogram.get(1, 0)
+                print(f"{chain} families: {umis} UMIs, {reads} reads, mean size {reads / umis if umis else 0:.2f}, "
+                      f"{singletons} singletons ({100.0 * singletons / umis if umis else 0:.1f}% of UMIs)")
+    except IOError as e: print(f"Error writing family sizes to {path}: {e}", file=sys.stderr); sys.exit(1)
+    print(f"Family-size histogram written to: {os.path.abspath(path)}")
+
 # --- Main Processing Function --- (Keep as is)
-def find_umi_pairs(input_dir, prefix, output_file):
+def find_umi_pairs(input_dir, prefix, output_file, min_family_size=DEFAULT_MIN_FAMILY_SIZE, optical_dups_file=None):
     # This function now assumes prefix is correctly determined *before* calling it
     tra_r1_file = os.path.join(input_dir, f"{prefix}_TRA_1.fq.gz")
     trb_r1_file = os.path.join(input_dir, f"{prefix}_TRB_1.fq.gz")
@@ -75,6 +114,10 @@ def find_umi_pairs(input_dir, prefix, output_file):
         print(f"Please ensure files exist or specify the correct directory/prefix using -i / -p.", file=sys.stderr)
         sys.exit(1)
 
+    # Optical duplicates are the same molecule read twice; they join neither families nor pairs
+    optical = load_optical_duplicates(optical_dups_file) if optical_dups_file else None
+    optical_skipped = {"TRA": 0, "TRB": 0}
+
     # --- Steps 1, 2, 3: Read TRA, RC, Read TRB, Find Pairs ---
     # (Code for these steps remains unchanged - shortened for brevity)
     # Step 1: Read TRA Data
@@ -87,6 +130,8 @@ def find_umi_pairs(input_dir, prefix, output_file):
                 if record is None: break
                 pbar.update(1); processed_tra_count += 1
                 umi = extract_umi_from_header(record[0]); read_id = get_base_read_id(record[0])
+                if optical and read_id and read_cluster_position(read_id) in optical["TRA"]:
+                    optical_skipped["TRA"] += 1; continue
                 if umi and read_id: tra_data[umi].add(read_id); extracted_tra_umi_count += 1
     except Exception as e: print(f"\nError reading/processing {tra_r1_file}: {e}", file=sys.stderr); sys.exit(1)
     if not tra_data: print(f"Warning: No TRA UMIs extracted from {processed_tra_count} records. Cannot find pairs.", file=sys.stderr); sys.exit(0) # Exit gracefully
@@ -104,31 +149,51 @@ def find_umi_pairs(input_dir, prefix, output_file):
     print(f"Generated reverse complements for {len(tra_rc_map)} unique TRA UMI patterns.")
 
     # Step 3: Read TRB Data and Find Pairs
+    # TRB family sizes are only known once the file is read, so matched records are kept in
+    # file order and written after the family-size filter.
     print(f"Reading TRB UMIs from {os.path.basename(trb_r1_file)} and finding pairs...")
-    pairs_found = 0; processed_trb_count = 0; extracted_trb_umi_count = 0; matched_trb_umi_count = 0
+    processed_trb_count = 0; extracted_trb_umi_count = 0; matched_trb_umi_count = 0
+    trb_family_sizes = Counter(); matched_trb_records = []
+    try:
+        with gzip.open(trb_r1_file, 'rt') as trb_in, tqdm(desc="Processing TRB R1", unit="record", ascii=True, mininterval=1.0, leave=False) as pbar:
+            while True:
+                record = read_fastq_record(trb_in)
+                if record is None: break
+                pbar.update(1); processed_trb_count += 1
+                trb_umi = extract_umi_from_header(record[0]); trb_read_id = get_base_read_id(record[0])
+                if optical and trb_read_id and read_cluster_position(trb_read_id) in optical["TRB"]:
+                    optical_skipped["TRB"] += 1; continue
+                if trb_umi and trb_read_id:
+                    extracted_trb_umi_count += 1; trb_family_sizes[trb_umi] += 1
+                    if trb_umi in tra_rc_to_ids:
+                        matched_trb_umi_count += 1; matched_trb_records.append((trb_umi, trb_read_id))
+    except Exception as e: print(f"\nError reading/processing {trb_r1_file}: {e}", file=sys.stderr); sys.exit(1)
+
+    # Step 4: Family sizes and minimum-support filter
+    write_family_sizes([len(ids) for ids in tra_data.values()], list(trb_family_sizes.values()),
+                       family_sizes_path(output_file))
+    pairs_found = 0; unsupported_trb_count = 0
     try:
-        with gzip.open(trb_r1_file, 'rt') as trb_in, open(output_file, 'w') as out_f:
+        with open(output_file, 'w') as out_f:
             out_f.write("TRA_UMI\tTRB_UMI\tTRA_Read_ID_Base\tTRB_Read_ID_Base\n")
-            with tqdm(desc="Processing TRB R1", unit="record", ascii=True, mininterval=1.0, leave=False) as pbar:
-                while True:
-                    record = read_fastq_record(trb_in)
-                    if record is None: break
-                    pbar.update(1); processed_trb_count += 1
-                    trb_umi = extract_umi_from_header(record[0]); trb_read_id = get_base_read_id(record[0])
-                    if trb_umi and trb_read_id:
-                        extracted_trb_umi_count += 1
-                        if trb_umi in tra_rc_to_ids:
-                            matched_trb_umi_count +=1; original_tra_umi = tra_rc_map[trb_umi]
-                            associated_tra_read_ids = tra_rc_to_ids[trb_umi]
-                            for tra_id in associated_tra_read_ids:
-                                out_f.write(f"{original_tra_umi}\t{trb_umi}\t{tra_id}\t{trb_read_id}\n")
-                                pairs_found += 1
+            for trb_umi, trb_read_id in matched_trb_records:
+                associated_tra_read_ids = tra_rc_to_ids[trb_umi]
+                if len(associated_tra_read_ids) < min_family_size or trb_family_sizes[trb_umi] < min_family_size:
+                    unsupported_trb_count += 1
+                    continue
+                original_tra_umi = tra_rc_map[trb_umi]
+                for tra_id in associated_tra_read_ids:
+                    out_f.write(f"{original_tra_umi}\t{trb_umi}\t{tra_id}\t{trb_read_id}\n")
+                    pairs_found += 1
     except IOError as e: print(f"Error writing to output file {output_file}: {e}", file=sys.stderr); sys.exit(1)
-    except Exception as e: print(f"\nError reading/processing {trb_r1_file}: {e}", file=sys.stderr); sys.exit(1)
 
     print(f"\n--- Pairing Summary ---")
     print(f"Processed {processed_trb_count} TRB records, extracted {extracted_trb_umi_count} UMIs.")
     print(f"Found {matched_trb_umi_count} TRB records with UMIs matching a reverse-complemented TRA UMI.")
+    if min_family_size > 1:
+        print(f"Dropped {unsupported_trb_count} of them whose TRA or TRB UMI family has fewer than {min_family_size} reads.")
+    if optical:
+        print(f"Left out {optical_skipped['TRA']} TRA and {optical_skipped['TRB']} TRB optical duplicate reads.")
     print(f"Wrote {pairs_found} total TRA-TRB UMI pairing lines (combinations of read IDs).")
     print(f"Output written to: {os.path.abspath(output_file)}")
 
@@ -151,9 +216,19 @@ if __name__ == "__main__":
     # Output file has a default
     parser.add_argument("-o", "--output-file", default=DEFAULT_OUTPUT_FILE,
                         help="Path to the output TSV file containing the matched UMI pairs.")
+    parser.add_argument("--min-family-size", type=int, default=DEFAULT_MIN_FAMILY_SIZE,
+                        help="Only pair UMIs seen in at least this many reads on both TRA and TRB. "
+                             "The family-size histogram goes to <output>_family_sizes.tsv.")
+    parser.add_argument("--optical-dups", default=None,
+                        help="PREFIX.optical_dups.tsv from step 1 --optical-dups; those reads are left out of "
+                             "family sizes and pairs.")
 
     args = parser.parse_args()
 
+    if args.min_family_size < 1:
+        print("Error: --min-family-size must be at least 1.", file=sys.stderr)
+        sys.exit(1)
+
     # No more prefix auto-detection needed, just use args.prefix directly
 
     # Validate output directory
@@ -174,6 +249,6 @@ if __name__ == "__main__":
     print("-" * 20)
 
     # Pass the arguments directly to the function
-    find_umi_pairs(args.input_dir, args.prefix, args.output_file)
+    find_umi_pairs(args.input_dir, args.prefix, args.output_file, args.min_family_size, args.optical_dups)
 
     print("\nPairing finished.")
@@ -4,6 +4,8 @@ import argparse
 import sys
 import os
 import re
+import numpy as np
+from concurrent.futures import ProcessPoolExecutor
 from tqdm import tqdm
 
 # --- 配置 ---
@@ -11,6 +13,18 @@ DEFAULT_UMI_PAIRS_FILE = os.path.join("PairTCR_results", "2_create_umi_pairs_out
 DEFAULT_TRA_EXPORT_FILE = os.path.join("PairTCR_results", "3_run_mixcr_and_export_output", "TRA_alignments_export_with_headers.tsv")
 DEFAULT_TRB_EXPORT_FILE = os.path.join("PairTCR_results", "3_run_mixcr_and_export_output", "TRB_alignments_export_with_headers.tsv")
 DEFAULT_OUTPUT_FILE = os.path.join("PairTCR_results", "4_pair_and_filter_clones_output", "final_paired_clones_filtered.tsv") # Changed output name
+DEFAULT_TOP_K = 200
+DEFAULT_BOOTSTRAP = 200
+BOOTSTRAP_MIN_PER_WORKER = 25 # 每个进程至少承担的重抽样次数, 避免为少量重抽样启动大量进程
+DEFAULT_SEED = 42
+DEFAULT_CHIMERA_RATIO = 0 # 0 表示不做嵌合体过滤
+DEFAULT_CHIMERA_MIN_SUPPORT = 3
+CLONOTYPE_COLUMNS = {
+    'paired': ['TRA_VGene', 'TRA_JGene', 'TRA_aCDR3', 'TRB_VGene', 'TRB_JGene', 'TRB_aCDR3'],
+    'TRA': ['TRA_VGene', 'TRA_JGene', 'TRA_aCDR3'],
+    'TRB': ['TRB_VGene', 'TRB_JGene', 'TRB_aCDR3'],
+}
+DIVERSITY_METRICS = ['clonotypes', 'shannon', 'simpson', 'inverse_simpson', 'gini', 'chao1']
 
 # --- 辅助函数 ---
 def get_base_read_id(header):
@@ -26,7 +40,191 @@ def get_base_read_id(header):
     base_id_part = re.sub(r'/[12]$', '', base_id_part)
     return base_id_part
 
-def perform_pairing(umi_pairs_file, tra_export_file, trb_export_file, output_file):
+def expand_duplicates(df, dups_file):
+    """
+    按 dedup_pairs 的成员表还原被折叠的重复读段对。
+    每个副本复制其代表读段的比对结果, 并换上自己的 Read ID 和头部,
+    使配对和计数与未去重时一致。
+    """
+    dups_df = pd.read_csv(dups_file, sep='\t', usecols=['read_id', 'representative', 'header'], dtype=str,
+                          keep_default_na=False, quoting=3)
+    if dups_df.empty:
+        return df
+    copies = dups_df.merge(df, left_on='representative', right_on='base_read_id', how='inner')
+    copies['base_read_id'] = copies['read_id']
+    copies['descrsR1'] = copies['header']
+    copies = copies.drop(columns=['read_id', 'representative', 'header'])
+    print(f"从 {dups_file} 还原了 {len(copies)} 条重复读段 (成员表共 {len(dups_df)} 条)。")
+    return pd.concat([df, copies], ignore_index=True)
+
+def write_top_clonotypes(final_paired_df, top_k, topk_file):
+    """
+    按配对及单链克隆型精确计数, 输出各层级前 K 个克隆型。
+    克隆型按 (V 基因, J 基因, CDR3 氨基酸序列) 定义; 计数相同时按克隆型排序, 保证输出稳定。
+    """
+    header = ['level', 'rank', 'TRA_VGene', 'TRA_JGene', 'TRA_aCDR3', 'TRB_VGene', 'TRB_JGene', 'TRB_aCDR3',
+              'count']
+    try:
+        with open(topk_file, 'w') as f_out:
+            f_out.write('\t'.join(header) + '\n')
+            for level, columns in CLONOTYPE_COLUMNS.items():
+                counts = final_paired_df[columns].fillna('').astype(str).groupby(columns).size()
+                top = counts.sort_values(ascending=False, kind='stable').head(top_k)
+                for rank, (key, count) in enumerate(top.items(), 1):
+                    fields = list(key)
+                    if level == 'TRA':
+                        fields = fields + [''] * 3
+                    elif level == 'TRB':
+                        fields = [''] * 3 + fields
+                    f_out.write('\t'.join([level, str(rank)] + fields + [str(count)]) + '\n')
+        print(f"Top-{top_k} 克隆型已写入: {topk_file}")
+    except Exception as e:
+        print(f"错误: 写入 top-K 文件 '{topk_file}' 时出错: {e}", file=sys.stderr)
+        sys.exit(1)
+
+def diversity_metrics(counts):
+    """
+    由克隆型大小计算多样性指标, 顺序同 DIVERSITY_METRICS。
+    Shannon 取自然对数; Simpson 为 sum(p^2) (两条记录属同一克隆型的概率);
+    Gini 为克隆大小分布的基尼系数; Chao1 为偏差校正形式。
+    """
+    counts = counts[counts > 0]
+    n = counts.sum()
+    if n == 0:
+        return [0.0] * len(DIVERSITY_METRICS)
+    p = counts / n
+    shannon = float(-(p * np.log(p)).sum())
+    simpson = float((p * p).sum())
+    sizes = np.sort(counts)
+    ranks = np.arange(1, len(sizes) + 1)
+    gini = float(2 * (ranks * sizes).sum() / (len(sizes) * n) - (len(sizes) + 1) / len(sizes))
+    f1 = float((counts == 1).sum())
+    f2 = float((counts == 2).sum())
+    chao1 = len(counts) + f1 * (f1 - 1) / (2 * (f2 + 1))
+    return [float(len(counts)), shannon, simpson, 1 / simpson, gini, chao1]
+
+def bootstrap_replicates(counts, replicates, seed):
+    """对记录做多项式重抽样, 返回每次重抽样的指标 (在子进程中运行)。"""
+    rng = np.random.default_rng(seed)
+    p = counts / counts.sum()
+    return [diversity_metrics(rng.multinomial(int(counts.sum()), p)) for _ in range(replicates)]
+
+def bootstrap_intervals(counts, replicates, workers, seed):
+    """
+    并行 bootstrap, 返回每个指标的 95% 置信区间 (估计值 ± 1.96 倍 bootstrap 标准误)。
+    重抽样会丢失稀有克隆型, 使丰富度类指标整体偏低, 故不用百分位区间。
+    重抽样按每块 BOOTSTRAP_MIN_PER_WORKER 次分块, 每块有自己的种子, 结果与进程数无关;
+    进程数不超过 CPU 核数和块数。
+    """
+    blocks = max(1, replicates // BOOTSTRAP_MIN_PER_WORKER)
+    chunks = [replicates // blocks + (1 if i < replicates % blocks else 0) for i in range(blocks)]
+    seeds = np.random.SeedSequence(seed).spawn(blocks)
+    workers = max(1, min(workers, os.cpu_count() or 1, blocks))
+    if workers == 1:
+        results = [bootstrap_replicates(counts, n, s) for n, s in zip(chunks, seeds)]
+    else:
+        with ProcessPoolExecutor(max_workers=workers) as pool:
+            results = list(pool.map(bootstrap_replicates, [counts] * blocks, chunks, seeds))
+    samples = np.array([row for chunk in results for row in chunk])
+    values = np.array(diversity_metrics(counts))
+    spread = 1.96 * samples.std(axis=0, ddof=1)
+    return values - spread, values + spread
+
+def write_diversity_report(final_paired_df, replicates, workers, seed, report_file):
+    """
+    按配对及单链克隆型汇总克隆大小, 计算多样性指标及 bootstrap 置信区间,
+    写入多样性报告 TSV 并打印到日志。
+    """
+    rows = []
+    for level, columns in CLONOTYPE_COLUMNS.items():
+        counts = final_paired_df[columns].fillna('').astype(str).groupby(columns).size().to_numpy()
+        values = diversity_metrics(counts)
+        if replicates > 1 and counts.sum() > 0:
+            low, high = bootstrap_intervals(counts, replicates, workers, seed)
+        else:
+            low = high = [float('nan')] * len(values)
+        for i, metric in enumerate(DIVERSITY_METRICS):
+            rows.append((level, metric, values[i], low[i], high[i]))
+
+    print(f"多样性指标 (95% 置信区间基于 {replicates} 次 bootstrap):")
+    for level, metric, value, low, high in rows:
+        print(f"  {level:<7} {metric:<16} {value:12.4f}  [{low:.4f}, {high:.4f}]")
+    try:
+        with open(report_file, 'w') as f_out:
+            f_out.write('level\tmetric\tvalue\tci_low\tci_high\n')
+            for row in rows:
+                f_out.write('\t'.join([row[0], row[1]] + [f"{v:.6g}" for v in row[2:]]) + '\n')
+        print(f"多样性报告已写入: {report_file}")
+    except Exception as e:
+        print(f"错误: 写入多样性报告 '{report_file}' 时出错: {e}", file=sys.stderr)
+        sys.exit(1)
+
+def filter_chimeras(final_paired_df, ratio, min_support, report_file):
+    """
+    标记并移除 PCR 嵌合体 / 模板转换产生的配对。
+    TRA 和 TRB 克隆型各自分组编号 (驻留), 再按 (TRA, TRB) 哈希聚合出每个配对的 UMI 支持数。
+    若某配对的 TRA (或 TRB) 克隆型在别处与另一伴侣配对, 且该主导配对的 UMI 支持数
+    不少于 min_support 并达到本配对的 ratio 倍, 则判为嵌合配对。
+    被移除的配对及原因写入 report_file, 返回过滤后的记录。
+    """
+    tra_columns, trb_columns = CLONOTYPE_COLUMNS['TRA'], CLONOTYPE_COLUMNS['TRB']
+    clonotypes = final_paired_df[tra_columns + trb_columns].fillna('').astype(str)
+    codes = pd.DataFrame({
+        'tra': clonotypes.groupby(tra_columns, sort=False).ngroup().to_numpy(),
+        'trb': clonotypes.groupby(trb_columns, sort=False).ngroup().to_numpy(),
+        'umi': final_paired_df['TRA_UMI'].to_numpy(),
+        'row': np.arange(len(final_paired_df))
+    })
+    pair_code = codes.groupby(['tra', 'trb'], sort=False).ngroup().to_numpy()
+    pairs = codes.groupby(['tra', 'trb'], sort=False).agg(
+        umis=('umi', 'nunique'), reads=('umi', 'size'), row=('row', 'first')).reset_index()
+
+    # 每个克隆型的主导伴侣: UMI 支持数最高的配对, 平局时取读段数多者
+    ranked = pairs.sort_values(['umis', 'reads'], ascending=False, kind='stable')
+    tra_dominant = ranked.drop_duplicates('tra').set_index('tra')
+    trb_dominant = ranked.drop_duplicates('trb').set_index('trb')
+    pairs['tra_partner_row'] = pairs['tra'].map(tra_dominant['row'])
+    pairs['tra_partner_umis'] = pairs['tra'].map(tra_dominant['umis'])
+    pairs['trb_partner_row'] = pairs['trb'].map(trb_dominant['row'])
+    pairs['trb_partner_umis'] = pairs['trb'].map(trb_dominant['umis'])
+    by_tra = ((pairs['tra'].map(tra_dominant['trb']) != pairs['trb']) &
+              (pairs['tra_partner_umis'] >= min_support) & (pairs['tra_partner_umis'] >= ratio * pairs['umis']))
+    by_trb = ((pairs['trb'].map(trb_dominant['tra']) != pairs['tra']) &
+              (pairs['trb_partner_umis'] >= min_support) & (pairs['trb_partner_umis'] >= ratio * pairs['umis']))
+
+    chimeras = pairs[by_tra | by_trb]
+    tra_side = by_tra[chimeras.index].to_numpy()
+    trb_side = by_trb[chimeras.index].to_numpy()
+    report = clonotypes.iloc[chimeras['row']].reset_index(drop=True)
+    report['umis'] = chimeras['umis'].to_numpy()
+    report['reads'] = chimeras['reads'].to_numpy()
+    report['reason'] = np.where(tra_side & trb_side, 'TRA_and_TRB_dominated',
+                                np.where(tra_side, 'TRA_dominated', 'TRB_dominated'))
+    # 主导配对中的另一条链: TRA 被支配时为其主导 TRB 伴侣, 反之为 TRB 的主导 TRA 伴侣
+    partners = clonotypes.iloc[np.where(tra_side, chimeras['tra_partner_row'], chimeras['trb_partner_row'])]
+    partners = partners.reset_index(drop=True)
+    tra_partner = partners[trb_columns[0]].str.cat([partners[c] for c in trb_columns[1:]], sep=' ')
+    trb_partner = partners[tra_columns[0]].str.cat([partners[c] for c in tra_columns[1:]], sep=' ')
+    report['dominant_partner'] = np.where(tra_side, tra_partner, trb_partner)
+    report['dominant_umis'] = np.where(tra_side, chimeras['tra_partner_umis'], chimeras['trb_partner_umis'])
+    try:
+        report.sort_values(['dominant_umis', 'umis'], ascending=[False, True], kind='stable').to_csv(
+            report_file, sep='\t', index=False)
+    except Exception as e:
+        print(f"错误: 写入嵌合体报告 '{report_file}' 时出错: {e}", file=sys.stderr)
+        sys.exit(1)
+
+    keep = ~(by_tra | by_trb).to_numpy()[pair_code]
+    print(f"嵌合体过滤 (ratio={ratio}, min_support={min_support}): {len(pairs)} 个配对克隆型中标记 "
+          f"{len(chimeras)} 个 (TRA 被支配 {int(by_tra.sum())}, TRB 被支配 {int(by_trb.sum())}), "
+          f"移除 {int((~keep).sum())} 条配对记录, {int(chimeras['umis'].sum())} 个 UMI。")
+    print(f"嵌合体报告已写入: {report_file}")
+    return final_paired_df[keep].reset_index(drop=True)
+
+def perform_pairing(umi_pairs_file, tra_export_file, trb_export_file, output_file, top_k=DEFAULT_TOP_K,
+                    bootstrap=DEFAULT_BOOTSTRAP, threads=1, seed=DEFAULT_SEED, tra_dups_file=None,
+                    trb_dups_file=None, chimera_ratio=DEFAULT_CHIMERA_RATIO,
+                    chimera_min_support=DEFAULT_CHIMERA_MIN_SUPPORT):
     """
     读取输入文件, 过滤交叉比对, 并执行配对。
 
@@ -35,11 +233,20 @@ def perform_pairing(umi_pairs_file, tra_export_file, trb_export_file, output_fil
         tra_export_file (str): TRA 导出文件路径。
         trb_export_file (str): TRB 导出文件路径。
         output_file (str): 输出配对结果的文件路径。
+        top_k (int): 输出的 top-K 克隆型数量, 0 表示不输出。
+        bootstrap (int): 多样性置信区间的 bootstrap 次数, 0 表示不计算区间。
+        threads (int): 并行 bootstrap 的进程数。
+        seed (int): bootstrap 随机种子。
+        tra_dups_file (str): TRA 重复读段成员表 (dedup_pairs --members), None 表示未去重。
+        trb_dups_file (str): TRB 重复读段成员表, None 表示未去重。
+        chimera_ratio (float): 嵌合体过滤的主导倍数, 0 表示不过滤。
+        chimera_min_support (int): 主导配对至少需要的 UMI 数。
     """
     print("--- 开始执行外部配对 (带过滤) ---")
 
     # --- 1. 输入文件验证 ---
     required_files = [umi_pairs_file, tra_export_file, trb_export_file]
+    required_files += [f for f in (tra_dups_file, trb_dups_file) if f]
     missing_files = []
     for f in required_files:
         if not os.path.exists(f):
@@ -51,7 +258,8 @@ def perform_pairing(umi_pairs_file, tra_export_file, trb_export_file, output_fil
     # --- 2. 读取 UMI 配对文件 ---
     try:
         print(f"读取 UMI 配对文件: {umi_pairs_file}")
-        umi_pairs_df = pd.read_csv(umi_pairs_file, sep='\t', usecols=['TRA_Read_ID_Base', 'TRB_Read_ID_Base'])
+        umi_columns = ['TRA_Read_ID_Base', 'TRB_Read_ID_Base'] + (['TRA_UMI'] if chimera_ratio > 0 else [])
+        umi_pairs_df = pd.read_csv(umi_pairs_file, sep='\t', usecols=umi_columns)
         umi_pairs_df = umi_pairs_df.drop_duplicates().reset_index(drop=True)
         print(f"读取了 {len(umi_pairs_df)} 条唯一的 TRA-TRB Read ID 配对关系。")
     except Exception as e:
@@ -82,6 +290,8 @@ def perform_pairing(umi_pairs_file, tra_export_file, trb_export_file, output_fil
         tqdm.pandas(desc="处理 TRA Headers")
         tra_df_filtered['base_read_id'] = tra_df_filtered['descrsR1'].progress_apply(get_base_read_id)
         tra_df_filtered = tra_df_filtered.dropna(subset=['base_read_id'])
+        if tra_dups_file:
+            tra_df_filtered = expand_duplicates(tra_df_filtered, tra_dups_file)
 
         # 为合并做准备：重命名列
         tra_df_renamed = tra_df_filtered.rename(columns={
@@ -123,6 +333,8 @@ def perform_pairing(umi_pairs_file, tra_export_file, trb_export_file, output_fil
         tqdm.pandas(desc="处理 TRB Headers")
         trb_df_filtered['base_read_id'] = trb_df_filtered['descrsR1'].progress_apply(get_base_read_id)
         trb_df_filtered = trb_df_filtered.dropna(subset=['base_read_id'])
+        if trb_dups_file:
+            trb_df_filtered = expand_duplicates(trb_df_filtered, trb_dups_file)
 
         # 重命名列
         trb_df_renamed = trb_df_filtered.rename(columns={
@@ -168,6 +380,10 @@ def perform_pairing(umi_pairs_file, tra_export_file, trb_export_file, output_fil
     print(f"与过滤后的 TRB 数据合并后，最终得到 {len(final_paired_df)} 条完整的 TRA-TRB 配对记录。")
     del paired_df, trb_df_unique # 释放内存
 
+    if chimera_ratio > 0:
+        final_paired_df = filter_chimeras(final_paired_df, chimera_ratio, chimera_min_support,
+                                          os.path.splitext(output_file)[0] + "_chimeras.tsv")
+
     # --- 6. 输出结果 ---
     if not final_paired_df.empty:
         output_columns = [
@@ -185,6 +401,11 @@ def perform_pairing(umi_pairs_file, tra_export_file, trb_export_file, output_fil
         except Exception as e:
             print(f"错误: 写入输出文件 '{output_file}' 时出错: {e}", file=sys.stderr)
             sys.exit(1)
+
+        if top_k > 0:
+            write_top_clonotypes(final_paired_df, top_k, os.path.splitext(output_file)[0] + "_topk.tsv")
+        write_diversity_report(final_paired_df, bootstrap, threads, seed,
+                               os.path.splitext(output_file)[0] + "_diversity.tsv")
     else:
         print("警告: 过滤后未找到任何可以配对的记录，输出文件将为空或不创建。")
         try:
@@ -212,6 +433,23 @@ if __name__ == "__main__":
                         help="包含 TRB 比对信息和 descrsR1 列的 TSV 文件路径 (由 exportAlignments 生成)。")
     parser.add_argument("-o", "--output", default=DEFAULT_OUTPUT_FILE,
                         help="输出最终过滤后配对结果的 TSV 文件路径。")
+    parser.add_argument("--top-k", type=int, default=DEFAULT_TOP_K,
+                        help="输出前 K 个配对及单链克隆型 (<输出>_topk.tsv), 0 表示关闭。")
+    parser.add_argument("--bootstrap", type=int, default=DEFAULT_BOOTSTRAP,
+                        help="多样性指标 (<输出>_diversity.tsv) 置信区间的 bootstrap 次数, 0 表示只计算点估计, 否则至少为 2。")
+    parser.add_argument("-t", "--threads", type=int, default=os.cpu_count() or 1,
+                        help="并行 bootstrap 的进程数。")
+    parser.add_argument("--seed", type=int, default=DEFAULT_SEED,
+                        help="bootstrap 随机种子。")
+    parser.add_argument("--tra-dups", default=None,
+                        help="TRA 重复读段成员表 (dedup_pairs --members 生成), 用于还原比对前折叠的重复读段对。")
+    parser.add_argument("--trb-dups", default=None,
+                        help="TRB 重复读段成员表 (dedup_pairs --members 生成)。")
+    parser.add_argument("--chimera-ratio", type=float, default=DEFAULT_CHIMERA_RATIO,
+                        help="嵌合体过滤: 若配对的 TRA 或 TRB 克隆型与另一伴侣的配对 UMI 数达到本配对的该倍数, "
+                             "则移除本配对并写入 <输出>_chimeras.tsv; 0 表示关闭, 否则须大于 1。")
+    parser.add_argument("--chimera-min-support", type=int, default=DEFAULT_CHIMERA_MIN_SUPPORT,
+                        help="主导配对至少需要的 UMI 数, 低于此数的克隆型不据以判断嵌合体。")
 
     args = parser.parse_args()
 
@@ -224,5 +462,14 @@ if __name__ == "__main__":
             print(f"错误: 无法创建输出目录 '{output_dir}': {e}", file=sys.stderr)
             sys.exit(1)
 
-    perform_pairing(args.umi_pairs, args.tra_export, args.trb_export, args.output)
+    if args.top_k < 0 or args.bootstrap < 0 or args.bootstrap == 1 or args.threads < 1:
+        print("错误: --top-k 不能为负数, --bootstrap 须为 0 或至少为 2, --threads 至少为 1。", file=sys.stderr)
+        sys.exit(1)
+    if args.chimera_ratio != 0 and args.chimera_ratio <= 1:
+        print("错误: --chimera-ratio 须为 0 (关闭) 或大于 1。", file=sys.stderr)
+        sys.exit(1)
+
+    perform_pairing(args.umi_pairs, args.tra_export, args.trb_export, args.output, args.top_k,
+                    args.bootstrap, args.threads, args.seed, args.tra_dups, args.trb_dups,
+                    args.chimera_ratio, args.chimera_min_support)
 
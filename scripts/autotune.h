@@ -0,0 +1,28 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <zlib.h>
+
+#include "preprocess.h"
+
+// Resource limits and per-stage costs measured by the calibration run
+typedef struct {
+    int cpu_limit;               // CPUs allowed by the affinity mask and cgroup quota
+    long long memory_limit;      // bytes allowed by the cgroup or currently available
+    int thread_budget;           // threads the tuner was allowed to hand out
+    long calibration_pairs;
+    double inflate_us[2];        // per read pair, for R1 and R2
+    double match_us;
+    double deflate_us;
+    double bytes_per_pair;       // input arena plus formatted output
+} autotune_result_t;
+
+int detect_cpu_limit(void);
+long long detect_memory_limit(void);
+
+// Calibrate on the first batches, rewind the inputs and rewrite cfg's
+// thread split and batch size. cfg->threads is the total thread budget
+// (0 = every CPU the container allows).
+int autotune(preprocess_config_t *cfg, fastq_input_t *in, autotune_result_t *result);
+
+#endif
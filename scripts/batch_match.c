@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+
+#include "batch_match.h"
+
+// Bit-sliced block of reads: bit i of each word belongs to lane (read) i.
+// A base is 2 bits (A=00 C=01 G=10 T=11) split over lo/hi, and valid marks
+// uppercase ACGT so N and anything else never matches a pattern base.
+typedef struct {
+    uint64_t lo[MAX_SEQ_LEN];
+    uint64_t hi[MAX_SEQ_LEN];
+    uint64_t valid[MAX_SEQ_LEN];
+} bitplanes_t;
+
+// Learned windows cover all but this share of hits on each side
+#define WINDOW_TAIL 0.005
+#define WINDOW_MIN_HITS 32
+
+// Window outcomes counted locally and merged once per call
+typedef struct {
+    long window_hits;
+    long fallback_scans;
+    long fallback_hits;
+} window_tally_t;
+
+// Pattern base broadcast to all lanes, so a compare is one XOR per plane
+typedef struct {
+    int len;
+    uint64_t lo[MAX_SEQ_LEN];
+    uint64_t hi[MAX_SEQ_LEN];
+} lane_pattern_t;
+
+static int base_code(char c) {
+    switch (c) {
+        case 'A': return 4 | 0;
+        case 'C': return 4 | 1;
+        case 'G': return 4 | 2;
+        case 'T': return 4 | 3;
+        default: return 0;
+    }
+}
+
+// Broadcast the anchor, or its reverse complement, into lane masks; -1 if it holds a non-ACGT base
+static int build_pattern(const char *anchor, int rc, lane_pattern_t *pat) {
+    pat->len = strlen(anchor);
+    for (int k = 0; k < pat->len; k++) {
+        int code = base_code(anchor[rc ? pat->len - 1 - k : k]);
+        if (!code) return -1;
+        if (rc) code ^= 3;
+        pat->lo[k] = (code & 1) ? ~0ULL : 0;
+        pat->hi[k] = (code & 2) ? ~0ULL : 0;
+    }
+    return 0;
+}
+
+static void transpose_block(const fastq_record_t *reads, uint64_t lanes, int len, bitplanes_t *planes) {
+    memset(planes->lo, 0, len * sizeof(uint64_t));
+    memset(planes->hi, 0, len * sizeof(uint64_t));
+    memset(planes->valid, 0, len * sizeof(uint64_t));
+    for (int i = 0; i < MATCH_LANES; i++) {
+        if (!(lanes >> i & 1)) continue;
+        const char *seq = reads[i].sequence;
+        for (int j = 0; j < len; j++) {
+            uint64_t code = base_code(seq[j]);
+            planes->lo[j] |= (code & 1) << i;
+            planes->hi[j] |= (code >> 1 & 1) << i;
+            planes->valid[j] |= (code >> 2) << i;
+        }
+    }
+}
+
+// Lanes in which the pattern occurs at offset; stops as soon as no lane is left
+static uint64_t match_at(const bitplanes_t *planes, int offset, const lane_pattern_t *pat, uint64_t lanes) {
+    for (int k = 0; k < pat->len && lanes; k++) {
+        int j = offset + k;
+        lanes &= planes->valid[j] & ~(planes->lo[j] ^ pat->lo[k]) & ~(planes->hi[j] ^ pat->hi[k]);
+    }
+    return lanes;
+}
+
+static void set_hits(anchor_hit_t *hits, uint64_t found, int pos, int rc) {
+    while (found) {
+        int i = __builtin_ctzll(found);
+        hits[i].pos = pos;
+        hits[i].rc = rc;
+        found &= found - 1;
+    }
+}
+
+void find_anchor(const char *sequence, const char *anchor, anchor_hit_t *hit) {
+    char rc_sequence[MAX_SEQ_LEN];
+    const char *match_pos = strstr(sequence, anchor);
+    hit->rc = 0;
+    if (!match_pos) {
+        reverse_complement(sequence, rc_sequence);
+        match_pos = strstr(rc_sequence, anchor);
+        hit->rc = 1;
+        hit->pos = match_pos ? (int)(match_pos - rc_sequence) : ANCHOR_NONE;
+        return;
+    }
+    hit->pos = match_pos - sequence;
+}
+
+// Forward strand offsets from..to in increasing order, so the lowest offset wins as with strstr
+static uint64_t scan_forward(const bitplanes_t *planes, const lane_pattern_t *fwd, uint64_t pending,
+                             int from, int to, anchor_hit_t *hits) {
+    for (int offset = from; offset <= to && pending; offset++) {
+        uint64_t found = match_at(planes, offset, fwd, pending);
+        set_hits(hits, found, offset, 0);
+        pending &= ~found;
+    }
+    return pending;
+}
+
+// Reverse complement offsets from..to: the anchor at offset q of the RC read is
+// the reversed anchor starting at len - anchor_len - q in the read
+static uint64_t scan_reverse(const bitplanes_t *planes, int len, const lane_pattern_t *rev, uint64_t pending,
+                             int from, int to, anchor_hit_t *hits) {
+    for (int q = from; q <= to && pending; q++) {
+        uint64_t found = match_at(planes, len - rev->len - q, rev, pending);
+        set_hits(hits, found, q, 1);
+        pending &= ~found;
+    }
+    return pending;
+}
+
+// One block of up to 64 reads of the same length
+static void match_block(const bitplanes_t *planes, int len, uint64_t lanes,
+                        const lane_pattern_t *fwd, const lane_pattern_t *rev,
+                        const anchor_window_t *window, anchor_hit_t *hits, window_tally_t *tally) {
+    int last = len - fwd->len;
+    if (!window) {
+        uint64_t pending = scan_forward(planes, fwd, lanes, 0, last, hits);
+        scan_reverse(planes, len, rev, pending, 0, last, hits);
+        return;
+    }
+
+    int fwd_end = window->hi[0] < last ? window->hi[0] : last;
+    int rev_end = window->hi[1] < last ? window->hi[1] : last;
+    uint64_t pending = scan_forward(planes, fwd, lanes, 0, fwd_end, hits);
+    pending = scan_reverse(planes, len, rev, pending, 0, rev_end, hits);
+    tally->window_hits += __builtin_popcountll(lanes & ~pending);
+    tally->fallback_scans += __builtin_popcountll(pending);
+
+    uint64_t missed = pending;
+    pending = scan_forward(planes, fwd, pending, fwd_end + 1, last, hits);
+    pending = scan_reverse(planes, len, rev, pending, rev_end + 1, last, hits);
+    tally->fallback_hits += __builtin_popcountll(missed & ~pending);
+}
+
+// Scalar counterpart of match_block for a read outside the block length
+static void find_anchor_windowed(const char *sequence, const char *anchor, const anchor_window_t *window,
+                                 anchor_hit_t *hit, window_tally_t *tally) {
+    if (!window) {
+        find_anchor(sequence, anchor, hit);
+        return;
+    }
+
+    int anchor_len = strlen(anchor);
+    int last = (int)strlen(sequence) - anchor_len;
+    hit->pos = ANCHOR_NONE;
+    hit->rc = 0;
+    if (last < 0) return;
+
+    char rc_sequence[MAX_SEQ_LEN];
+    reverse_complement(sequence, rc_sequence);
+    int fwd_end = window->hi[0] < last ? window->hi[0] : last;
+    int rev_end = window->hi[1] < last ? window->hi[1] : last;
+    const char *match_pos;
+
+    if (fwd_end >= 0 && (match_pos = memmem(sequence, fwd_end + anchor_len, anchor, anchor_len))) {
+        hit->pos = match_pos - sequence;
+    } else if (rev_end >= 0 && (match_pos = memmem(rc_sequence, rev_end + anchor_len, anchor, anchor_len))) {
+        hit->pos = match_pos - rc_sequence;
+        hit->rc = 1;
+    }
+    if (hit->pos != ANCHOR_NONE) {
+        tally->window_hits++;
+        return;
+    }
+
+    tally->fallback_scans++;
+    if ((match_pos = strstr(sequence + fwd_end + 1, anchor))) {
+        hit->pos = match_pos - sequence;
+    } else if ((match_pos = strstr(rc_sequence + rev_end + 1, anchor))) {
+        hit->pos = match_pos - rc_sequence;
+        hit->rc = 1;
+    }
+    if (hit->pos != ANCHOR_NONE) tally->fallback_hits++;
+}
+
+void anchor_window_init(anchor_window_t *window, long learn_batches) {
+    memset(window, 0, sizeof(*window));
+    window->learn_batches = learn_batches;
+    window->lo[0] = window->lo[1] = -1;
+    window->hi[0] = window->hi[1] = -1;
+}
+
+// Runs once, in whichever thread merges the last learning batch
+static void anchor_window_finalize(anchor_window_t *window) {
+    for (int strand = 0; strand < 2; strand++) {
+        long total = 0;
+        for (int pos = 0; pos < MAX_SEQ_LEN; pos++) total += window->hist[strand][pos];
+        if (total < WINDOW_MIN_HITS) continue;
+
+        long cumulative = 0;
+        for (int pos = 0; pos < MAX_SEQ_LEN; pos++) {
+            cumulative += window->hist[strand][pos];
+            if (window->lo[strand] < 0 && cumulative > total * WINDOW_TAIL) window->lo[strand] = pos;
+            if (cumulative >= total * (1.0 - WINDOW_TAIL)) {
+                window->hi[strand] = pos;
+                break;
+            }
+        }
+    }
+    __atomic_store_n(&window->ready, 1, __ATOMIC_RELEASE);
+}
+
+void anchor_window_learn(anchor_window_t *window, long batch_seq, const anchor_hit_t *hits, int count) {
+    if (batch_seq >= window->learn_batches) return;
+    for (int i = 0; i < count; i++) {
+        if (hits[i].pos != ANCHOR_NONE) {
+            __atomic_add_fetch(&window->hist[hits[i].rc][hits[i].pos], 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (__atomic_add_fetch(&window->learned, 1, __ATOMIC_ACQ_REL) == window->learn_batches) {
+        anchor_window_finalize(window);
+    }
+}
+
+void batch_find_anchor(const fastq_record_t *reads, int count, const char *anchor,
+                       const unsigned char *skip, anchor_window_t *window, anchor_hit_t *hits) {
+    static __thread bitplanes_t planes;
+    const anchor_window_t *active = window && __atomic_load_n(&window->ready, __ATOMIC_ACQUIRE) ? window : NULL;
+    window_tally_t tally = {0, 0, 0};
+    lane_pattern_t fwd, rev;
+    int fwd_ok = build_pattern(anchor, 0, &fwd);
+    int rev_ok = build_pattern(anchor, 1, &rev);
+    int sliced = fwd_ok == 0 && rev_ok == 0;
+
+    for (int base = 0; base < count; base += MATCH_LANES) {
+        int n = count - base < MATCH_LANES ? count - base : MATCH_LANES;
+        uint64_t lanes = 0;
+        int block_len = -1;
+
+        // Lanes share the first read's length; reads of any other length go scalar
+        for (int i = 0; i < n; i++) {
+            anchor_hit_t *hit = &hits[base + i];
+            hit->pos = ANCHOR_NONE;
+            hit->rc = 0;
+            if (skip && skip[base + i]) continue;
+
+            int len = strlen(reads[base + i].sequence);
+            if (block_len < 0 && sliced) block_len = len;
+            if (len == block_len) {
+                lanes |= 1ULL << i;
+            } else {
+                find_anchor_windowed(reads[base + i].sequence, anchor, active, hit, &tally);
+            }
+        }
+        if (!lanes || block_len < fwd.len) continue;
+
+        transpose_block(&reads[base], lanes, block_len, &planes);
+        match_block(&planes, block_len, lanes, &fwd, &rev, active, &hits[base], &tally);
+    }
+
+    if (active) {
+        __atomic_add_fetch(&window->window_hits, tally.window_hits, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&window->fallback_scans, tally.fallback_scans, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&window->fallback_hits, tally.fallback_hits, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef BGZF_H
+#define BGZF_H
+
+#include <stdint.h>
+
+#include "sample.h"
+
+// 1 when the file starts with a BGZF block (a gzip member whose BC extra field holds its size)
+int bgzf_detect(const char *path);
+
+// Block-stride sampling. The block headers of both files are indexed without
+// inflating anything; R1 blocks are then picked with probability fraction and
+// only those are inflated. R2 is entered near the proportional uncompressed
+// offset and aligned to R1 by read ID, so unsampled blocks cost one header read.
+bgzf_stride_t *bgzf_stride_open(const char *r1_file, const char *r2_file, double fraction, uint64_t seed);
+int bgzf_stride_fill(bgzf_stride_t *st, batch_t *batch, long max_pairs);
+void bgzf_stride_rewind(bgzf_stride_t *st);
+void bgzf_stride_describe(const bgzf_stride_t *st, char *buf, size_t size);
+void bgzf_stride_close(bgzf_stride_t *st);
+
+#endif
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "clonotype.h"
+#include "refindex.h"
+
+#define FQ_MAX_LINE 4096
+#define DEFAULT_CHAIN_K 17
+#define DEFAULT_MIN_HITS 3
+
+// Matched-read extraction for step 2.5 with a chain check on the way: a
+// pair is kept when its read ID is in the UMI pairs and the reference
+// k-mers it carries do not point to the other chain. Pairs whose k-mers
+// are too few or split between chains are kept for MiXCR to judge.
+
+typedef struct {
+    char header[FQ_MAX_LINE];
+    char seq[FQ_MAX_LINE];
+    char plus[FQ_MAX_LINE];
+    char qual[FQ_MAX_LINE];
+} fastq_record_t;
+
+typedef struct {
+    long pairs;
+    long unmatched;              // read ID not in the UMI pairs
+    long kept;                   // k-mers agree with the construct
+    long no_call;
+    long cross_chain;
+} filter_stats_t;
+
+void show_usage(const char *program_name);
+
+static int read_record(gzFile fp, fastq_record_t *r) {
+    if (!gzgets(fp, r->header, FQ_MAX_LINE)) return 0;
+    if (!gzgets(fp, r->seq, FQ_MAX_LINE) || !gzgets(fp, r->plus, FQ_MAX_LINE) ||
+        !gzgets(fp, r->qual, FQ_MAX_LINE)) return -1;
+    return 1;
+}
+
+static int write_record(gzFile fp, const fastq_record_t *r) {
+    return gzputs(fp, r->header) >= 0 && gzputs(fp, r->seq) >= 0 && gzputs(fp, r->plus) >= 0 &&
+           gzputs(fp, r->qual) >= 0 ? 0 : -1;
+}
+
+// Read ID as step 2 and step 4 see it: no '@', first word, no /1 or /2
+static size_t base_read_id(const char *header, const char **id) {
+    const char *start = header[0] == '@' ? header + 1 : header;
+    size_t len = strcspn(start, " \t\r\n");
+    if (len >= 2 && start[len - 2] == '/' && (start[len - 1] == '1' || start[len - 1] == '2')) len -= 2;
+    *id = start;
+    return len;
+}
+
+static int load_read_ids(const char *path, clone_dict_t *ids) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening read ID list %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[FQ_MAX_LINE];
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strcspn(line, "\r\n");
+        if (len == 0) continue;
+        if (clone_dict_intern(ids, line, len, clone_hash(line, len)) < 0) {
+            fclose(fp);
+            fprintf(stderr, "Error: out of memory loading %s\n", path);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Add the chains of every reference k-mer in seq, on either strand
+static void count_chain_hits(const ref_index_t *idx, const char *seq, long hits[2]) {
+    int k = idx->k;
+    uint64_t mask = (1ULL << (2 * k)) - 1, fwd = 0, rev = 0;
+    int valid = 0;
+    for (const char *p = seq; *p && *p != '\n' && *p != '\r'; p++) {
+        int code = ref_base_code(*p);
+        if (code < 0) {
+            valid = 0;
+            continue;
+        }
+        fwd = ((fwd << 2) | (uint64_t)code) & mask;
+        rev = (rev >> 2) | ((uint64_t)(3 - code) << (2 * (k - 1)));
+        if (++valid < k) continue;
+        uint32_t n;
+        uint8_t chains, rc_chains;
+        ref_index_lookup(idx, fwd, &n, &chains);
+        ref_index_lookup(idx, rev, &n, &rc_chains);
+        chains |= rc_chains;
+        // k-mers shared between chains say nothing
+        if (chains == REF_CHAIN_A) hits[0]++;
+        if (chains == REF_CHAIN_B) hits[1]++;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *reference = NULL, *ids_path = NULL, *rejected_prefix = NULL;
+    int construct = 0, k = DEFAULT_CHAIN_K;
+    long min_hits = DEFAULT_MIN_HITS;
+
+    int opt;
+    static struct option long_options[] = {
+        {"reference", required_argument, 0, 'r'},
+        {"chain", required_argument, 0, 'c'},
+        {"ids", required_argument, 0, 'i'},
+        {"kmer", required_argument, 0, 'k'},
+        {"min-hits", required_argument, 0, 'm'},
+        {"rejected", required_argument, 0, 'R'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "r:c:i:k:m:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                reference = optarg;
+                break;
+            case 'c':
+                if (strcmp(optarg, "TRA") == 0) construct = REF_CHAIN_A;
+                if (strcmp(optarg, "TRB") == 0) construct = REF_CHAIN_B;
+                break;
+            case 'i':
+                ids_path = optarg;
+                break;
+            case 'k':
+                k = atoi(optarg);
+                break;
+            case 'm':
+                min_hits = atol(optarg);
+                break;
+            case 'R':
+                rejected_prefix = optarg;
+                break;
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            default:
+                show_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 4 || !reference || !construct) {
+        fprintf(stderr, "Error: --reference, --chain TRA|TRB and four FASTQ paths are required\n");
+        show_usage(argv[0]);
+        return 1;
+    }
+    if (min_hits < 1) {
+        fprintf(stderr, "Error: --min-hits must be at least 1\n");
+        return 1;
+    }
+
+    ref_index_t idx;
+    memset(&idx, 0, sizeof(idx));
+    if (ref_load_fasta(&idx, reference) != 0 || ref_index_build(&idx, k, 1) != 0) return 1;
+    int genes[2] = {0, 0};
+    for (int g = 0; g < idx.ngenes; g++) {
+        if (idx.genes[g].chain == REF_CHAIN_A) genes[0]++;
+        if (idx.genes[g].chain == REF_CHAIN_B) genes[1]++;
+    }
+    if (genes[0] == 0 || genes[1] == 0) {
+        fprintf(stderr, "Error: reference %s needs both TRA and TRB genes to tell the chains apart\n", reference);
+        return 1;
+    }
+
+    clone_dict_t ids;
+    if (clone_dict_init(&ids, 1 << 16) != 0 || (ids_path && load_read_ids(ids_path, &ids) != 0)) return 1;
+
+    const char *in1 = argv[optind], *in2 = argv[optind + 1];
+    const char *out1 = argv[optind + 2], *out2 = argv[optind + 3];
+    gzFile in[2] = {gzopen(in1, "r"), gzopen(in2, "r")};
+    gzFile out[2] = {gzopen(out1, "w"), gzopen(out2, "w")};
+    gzFile rejected[2] = {NULL, NULL};
+    if (rejected_prefix) {
+        char path[FQ_MAX_LINE];
+        for (int m = 0; m < 2; m++) {
+            snprintf(path, sizeof(path), "%s_%d.fq.gz", rejected_prefix, m + 1);
+            rejected[m] = gzopen(path, "w");
+            if (!rejected[m]) {
+                fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+                return 1;
+            }
+        }
+    }
+    if (!in[0] || !in[1] || !out[0] || !out[1]) {
+        fprintf(stderr, "Error opening FASTQ files: %s\n", strerror(errno));
+        return 1;
+    }
+
+    fastq_record_t *rec = malloc(2 * sizeof(fastq_record_t));
+    if (!rec) return 1;
+    filter_stats_t stats = {0, 0, 0, 0, 0};
+    int other = construct == REF_CHAIN_A ? 1 : 0, own = 1 - other;
+    int status = 0;
+    for (;;) {
+        int r1 = read_record(in[0], &rec[0]), r2 = read_record(in[1], &rec[1]);
+        if (r1 == 0 && r2 == 0) break;
+        if (r1 <= 0 || r2 <= 0) {
+            fprintf(stderr, "Error: %s and %s are truncated or out of step\n", in1, in2);
+            status = 1;
+            break;
+        }
+        stats.pairs++;
+        const char *id;
+        size_t id_len = base_read_id(rec[0].header, &id);
+        if (ids_path && clone_dict_find(&ids, id, id_len, clone_hash(id, id_len)) < 0) {
+            stats.unmatched++;
+            continue;
+        }
+
+        long hits[2] = {0, 0};
+        count_chain_hits(&idx, rec[0].seq, hits);
+        count_chain_hits(&idx, rec[1].seq, hits);
+        gzFile *dest = out;
+        if (hits[other] >= min_hits && hits[other] > 2 * hits[own]) {
+            stats.cross_chain++;
+            dest = rejected_prefix ? rejected : NULL;
+        } else if (hits[own] >= min_hits && hits[own] > 2 * hits[other]) {
+            stats.kept++;
+        } else {
+            stats.no_call++;
+        }
+        if (dest && (write_record(dest[0], &rec[0]) != 0 || write_record(dest[1], &rec[1]) != 0)) {
+            fprintf(stderr, "Error writing FASTQ output\n");
+            status = 1;
+            break;
+        }
+    }
+
+    for (int m = 0; m < 2; m++) {
+        gzclose(in[m]);
+        if (gzclose(out[m]) != Z_OK) status = 1;
+        if (rejected[m] && gzclose(rejected[m]) != Z_OK) status = 1;
+    }
+    free(rec);
+    clone_dict_free(&ids);
+    ref_index_free(&idx);
+
+    long considered = stats.pairs - stats.unmatched;
+    printf("Chain filter (%s construct, %d TRA / %d TRB reference genes, k=%d):\n",
+           construct == REF_CHAIN_A ? "TRA" : "TRB", genes[0], genes[1], k);
+    printf("  %ld read pairs, %ld in the UMI pairs\n", stats.pairs, considered);
+    printf("  %ld confirmed, %ld without a chain call (kept), %ld cross-chain (%s, %.2f%%)\n",
+           stats.kept, stats.no_call, stats.cross_chain, rejected_prefix ? "set aside" : "dropped",
+           considered ? 100.0 * stats.cross_chain / considered : 0);
+    return status;
+}
+
+void show_usage(const char *program_name) {
+    printf("Usage: %s --reference REF.fa --chain TRA|TRB [OPTIONS] IN_1.fq.gz IN_2.fq.gz OUT_1.fq.gz OUT_2.fq.gz\n",
+           program_name);
+    printf("Copy read pairs whose reference k-mers do not contradict their construct's chain\n\n");
+    printf("Options:\n");
+    printf("  -r, --reference FILE     FASTA of TRA and TRB genes (V, J and/or C; IMGT headers or\n");
+    printf("                           names like TRBC1*01), plain or gzip\n");
+    printf("  -c, --chain CHAIN        Chain of the construct the reads come from: TRA or TRB\n");
+    printf("  -i, --ids FILE           Only pairs whose read ID is listed (one per line), as step 2.5\n");
+    printf("                           does with the UMI pairs\n");
+    printf("  -k, --kmer K             k-mer length (default: %d)\n", DEFAULT_CHAIN_K);
+    printf("  -m, --min-hits N         Chain-specific k-mers needed for a call (default: %d); a pair is\n",
+           DEFAULT_MIN_HITS);
+    printf("                           cross-chain when the other chain has N and over twice its own\n");
+    printf("      --rejected PREFIX    Write cross-chain pairs to PREFIX_1.fq.gz and PREFIX_2.fq.gz\n");
+    printf("                           instead of dropping them\n");
+    printf("  -h, --help               Show this help message\n");
+}
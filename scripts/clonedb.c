@@ -0,0 +1,712 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "clonotype.h"
+
+#define MAX_PATH_LEN 1024
+#define CLONEDB_MAGIC "PTCLDB1"
+#define CLONEDB_BYTE_ORDER 0x01020304u
+#define CDR3_ALPHABET "ACDEFGHIKLMNPQRSTVWY*_"
+#define CLONEDB_OPEN_RETRIES 16       // listings retried when a compaction races a reader
+
+// A clonotype database is a directory of immutable segments, seg-NNNNNN.ctdb.
+// Each ingest appends one segment; queries mmap every segment and probe its
+// hash table of "TRA_aCDR3<tab>TRB_aCDR3" keys for a posting list of
+// (sample, count). compact merges the segments into one, which records the
+// last segment it replaces so readers skip the old ones until they go.
+//
+// Segment layout, in host byte order (checked through byte_order):
+//   header, uint32 slots (key id + 1, 0 empty), seg_key_t keys,
+//   seg_post_t postings grouped by key, seg_sample_t samples, then the key
+//   strings and sample names, each NUL-terminated
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t compacts_through;   // highest segment number this one replaces
+    uint64_t nslots;
+    uint64_t nkeys;
+    uint64_t nposts;
+    uint64_t nsamples;
+    uint64_t slots_off;
+    uint64_t keys_off;
+    uint64_t posts_off;
+    uint64_t samples_off;
+    uint64_t strings_off;
+    uint64_t file_size;
+} seg_header_t;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t str_off;            // into the strings
+    uint64_t post_off;           // first posting
+    uint32_t str_len;
+    uint32_t npost;
+} seg_key_t;
+
+typedef struct {
+    uint32_t sample;
+    uint32_t count;
+} seg_post_t;
+
+typedef struct {
+    uint64_t name_off;
+    uint32_t id;
+    uint32_t name_len;
+} seg_sample_t;
+
+typedef struct {
+    int number;
+    unsigned char *base;
+    size_t size;
+    const seg_header_t *h;
+    const uint32_t *slots;
+    const seg_key_t *keys;
+    const seg_post_t *posts;
+    const seg_sample_t *samples;
+    const char *strings;
+} segment_t;
+
+typedef struct {
+    char dir[MAX_PATH_LEN];
+    segment_t *segs;
+    int nsegs;
+    const char **names;          // by sample id
+    uint32_t nsample_ids;        // highest sample id + 1
+    int next_segment;
+    uint32_t compacts_through;
+} clonedb_t;
+
+// Keys and (key, sample, count) postings of a segment being written
+typedef struct {
+    uint32_t key;
+    uint32_t sample;
+    uint32_t count;
+} triple_t;
+
+typedef struct {
+    clone_dict_t keys;
+    triple_t *triples;
+    size_t ntriples;
+    size_t cap;
+    seg_sample_t *samples;       // name_off indexes names until written
+    size_t nsamples;
+    clone_dict_t names;
+} builder_t;
+
+void show_usage(const char *program_name);
+
+static int segment_number(const char *path) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    return atoi(base + 4);
+}
+
+// 0 when mapped, 1 when the segment has gone, -1 on error
+static int map_segment(segment_t *seg, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        // A compaction removed it after the listing
+        if (errno == ENOENT) return 1;
+        fprintf(stderr, "Error opening segment %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(seg_header_t)) {
+        fprintf(stderr, "Error: segment %s is truncated\n", path);
+        close(fd);
+        return -1;
+    }
+    seg->size = (size_t)st.st_size;
+    seg->base = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg->base == MAP_FAILED) {
+        fprintf(stderr, "Error mapping segment %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    const seg_header_t *h = (const seg_header_t *)seg->base;
+    if (memcmp(h->magic, CLONEDB_MAGIC, 8) != 0 || h->byte_order != CLONEDB_BYTE_ORDER ||
+        h->file_size != seg->size || h->strings_off > h->file_size ||
+        h->slots_off + h->nslots * sizeof(uint32_t) > h->keys_off ||
+        h->keys_off + h->nkeys * sizeof(seg_key_t) > h->posts_off ||
+        h->posts_off + h->nposts * sizeof(seg_post_t) > h->samples_off ||
+        h->samples_off + h->nsamples * sizeof(seg_sample_t) > h->strings_off ||
+        h->nslots == 0 || (h->nslots & (h->nslots - 1)) != 0) {
+        fprintf(stderr, "Error: %s is not a clonotype database segment for this host\n", path);
+        munmap(seg->base, seg->size);
+        return -1;
+    }
+    seg->number = segment_number(path);
+    seg->h = h;
+    seg->slots = (const uint32_t *)(seg->base + h->slots_off);
+    seg->keys = (const seg_key_t *)(seg->base + h->keys_off);
+    seg->posts = (const seg_post_t *)(seg->base + h->posts_off);
+    seg->samples = (const seg_sample_t *)(seg->base + h->samples_off);
+    seg->strings = (const char *)(seg->base + h->strings_off);
+    return 0;
+}
+
+static void db_close(clonedb_t *db) {
+    for (int i = 0; i < db->nsegs; i++) munmap(db->segs[i].base, db->segs[i].size);
+    free(db->segs);
+    free(db->names);
+    db->segs = NULL;
+    db->names = NULL;
+    db->nsegs = 0;
+}
+
+// Map every listed segment: 0 when all mapped, 1 when one vanished, -1 on error
+static int db_map_listing(clonedb_t *db, const char *dir) {
+    memset(db, 0, sizeof(*db));
+    snprintf(db->dir, sizeof(db->dir), "%s", dir);
+    db->next_segment = 1;
+
+    char pattern[MAX_PATH_LEN + 32];
+    snprintf(pattern, sizeof(pattern), "%s/seg-*.ctdb", dir);
+    glob_t g;
+    int rc = glob(pattern, 0, NULL, &g);
+    if (rc == GLOB_NOMATCH) return 0;
+    if (rc != 0) {
+        fprintf(stderr, "Error listing segments in %s\n", dir);
+        return -1;
+    }
+
+    db->segs = calloc(g.gl_pathc, sizeof(segment_t));
+    if (!db->segs) {
+        globfree(&g);
+        return -1;
+    }
+    for (size_t i = 0; i < g.gl_pathc; i++) {
+        int rc = map_segment(&db->segs[db->nsegs], g.gl_pathv[i]);
+        if (rc != 0) {
+            globfree(&g);
+            db_close(db);
+            return rc;
+        }
+        segment_t *seg = &db->segs[db->nsegs++];
+        if (seg->number >= db->next_segment) db->next_segment = seg->number + 1;
+        if (seg->h->compacts_through > db->compacts_through) db->compacts_through = seg->h->compacts_through;
+    }
+    globfree(&g);
+    return 0;
+}
+
+static int db_open(clonedb_t *db, const char *dir) {
+    // A compaction writes its segment before unlinking the ones it replaces, so
+    // a segment that vanished means the listing is stale and a fresh one holds
+    // the compacted segment; skipping the missing ones alone would lose keys
+    int rc = 1;
+    for (int attempt = 0; rc > 0 && attempt < CLONEDB_OPEN_RETRIES; attempt++) rc = db_map_listing(db, dir);
+    if (rc > 0) fprintf(stderr, "Error: segments in %s kept changing while opening it\n", dir);
+    if (rc != 0) return -1;
+
+    // Drop segments a compaction has replaced but not yet removed
+    int kept = 0;
+    for (int i = 0; i < db->nsegs; i++) {
+        if ((uint32_t)db->segs[i].number <= db->compacts_through) {
+            munmap(db->segs[i].base, db->segs[i].size);
+        } else {
+            db->segs[kept++] = db->segs[i];
+        }
+    }
+    db->nsegs = kept;
+
+    for (int i = 0; i < db->nsegs; i++) {
+        for (uint64_t s = 0; s < db->segs[i].h->nsamples; s++) {
+            uint32_t id = db->segs[i].samples[s].id;
+            if (id + 1 > db->nsample_ids) db->nsample_ids = id + 1;
+        }
+    }
+    db->names = calloc(db->nsample_ids ? db->nsample_ids : 1, sizeof(char *));
+    if (!db->names) {
+        db_close(db);
+        return -1;
+    }
+    for (int i = 0; i < db->nsegs; i++) {
+        for (uint64_t s = 0; s < db->segs[i].h->nsamples; s++) {
+            const seg_sample_t *sample = &db->segs[i].samples[s];
+            db->names[sample->id] = db->segs[i].strings + sample->name_off;
+        }
+    }
+    return 0;
+}
+
+// Writers hold an exclusive lock on DIR/.lock; readers need none
+static int db_lock(const char *dir) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error creating database directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    char path[MAX_PATH_LEN + 16];
+    snprintf(path, sizeof(path), "%s/.lock", dir);
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+        fprintf(stderr, "Error locking database %s: %s\n", dir, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int builder_init(builder_t *b) {
+    memset(b, 0, sizeof(*b));
+    if (clone_dict_init(&b->keys, 1 << 16) != 0) return -1;
+    return clone_dict_init(&b->names, 64);
+}
+
+static void builder_free(builder_t *b) {
+    clone_dict_free(&b->keys);
+    clone_dict_free(&b->names);
+    free(b->triples);
+    free(b->samples);
+}
+
+static int builder_add(builder_t *b, const char *key, size_t len, uint64_t hash, uint32_t sample, uint64_t count) {
+    int64_t id = clone_dict_intern(&b->keys, key, len, hash);
+    if (id < 0) return -1;
+    if (b->ntriples == b->cap) {
+        size_t cap = b->cap ? 2 * b->cap : 1 << 16;
+        triple_t *grown = realloc(b->triples, cap * sizeof(triple_t));
+        if (!grown) return -1;
+        b->triples = grown;
+        b->cap = cap;
+    }
+    triple_t *t = &b->triples[b->ntriples++];
+    t->key = (uint32_t)id;
+    t->sample = sample;
+    t->count = count > UINT32_MAX ? UINT32_MAX : (uint32_t)count;
+    return 0;
+}
+
+static int builder_add_sample(builder_t *b, uint32_t id, const char *name) {
+    size_t len = strlen(name);
+    int64_t name_id = clone_dict_intern(&b->names, name, len, clone_hash(name, len));
+    seg_sample_t *grown = realloc(b->samples, (b->nsamples + 1) * sizeof(seg_sample_t));
+    if (name_id < 0 || !grown) return -1;
+    b->samples = grown;
+    b->samples[b->nsamples].id = id;
+    b->samples[b->nsamples].name_off = (uint64_t)name_id;
+    b->samples[b->nsamples++].name_len = (uint32_t)len;
+    return 0;
+}
+
+static int compare_triples(const void *a, const void *b) {
+    const triple_t *x = a, *y = b;
+    if (x->key != y->key) return (x->key > y->key) - (x->key < y->key);
+    return (x->sample > y->sample) - (x->sample < y->sample);
+}
+
+static uint64_t align8(uint64_t off) {
+    return (off + 7) & ~(uint64_t)7;
+}
+
+static int write_all(FILE *fp, const void *data, size_t size) {
+    return size == 0 || fwrite(data, size, 1, fp) == 1 ? 0 : -1;
+}
+
+static int write_padding(FILE *fp, uint64_t *off) {
+    static const char zeros[8] = {0};
+    uint64_t aligned = align8(*off);
+    int status = write_all(fp, zeros, (size_t)(aligned - *off));
+    *off = aligned;
+    return status;
+}
+
+static int write_segment(const clonedb_t *db, builder_t *b, uint32_t compacts_through, char *path) {
+    qsort(b->triples, b->ntriples, sizeof(triple_t), compare_triples);
+
+    size_t nkeys = b->keys.len;
+    seg_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CLONEDB_MAGIC, 8);
+    h.byte_order = CLONEDB_BYTE_ORDER;
+    h.compacts_through = compacts_through;
+    h.nslots = 16;
+    while (h.nslots < 2 * nkeys) h.nslots *= 2;
+    h.nkeys = nkeys;
+    h.nposts = b->ntriples;
+    h.nsamples = b->nsamples;
+    h.slots_off = sizeof(seg_header_t);
+    h.keys_off = align8(h.slots_off + h.nslots * sizeof(uint32_t));
+    h.posts_off = h.keys_off + h.nkeys * sizeof(seg_key_t);
+    h.samples_off = h.posts_off + h.nposts * sizeof(seg_post_t);
+    h.strings_off = h.samples_off + h.nsamples * sizeof(seg_sample_t);
+    h.file_size = h.strings_off + b->keys.arena_len + b->names.arena_len;
+
+    uint32_t *slots = calloc(h.nslots, sizeof(uint32_t));
+    seg_key_t *keys = calloc(nkeys ? nkeys : 1, sizeof(seg_key_t));
+    if (!slots || !keys) {
+        free(slots);
+        free(keys);
+        fprintf(stderr, "Error: out of memory writing a segment\n");
+        return -1;
+    }
+    for (size_t i = 0; i < nkeys; i++) {
+        const clone_entry_t *e = &b->keys.entries[i];
+        keys[i].hash = e->hash;
+        keys[i].str_off = e->offset;
+        keys[i].str_len = e->len;
+        size_t s = e->hash & (h.nslots - 1);
+        while (slots[s]) s = (s + 1) & (h.nslots - 1);
+        slots[s] = (uint32_t)i + 1;
+    }
+    for (size_t t = 0; t < b->ntriples; t++) {
+        seg_key_t *k = &keys[b->triples[t].key];
+        if (k->npost++ == 0) k->post_off = t;
+    }
+
+    char tmp[MAX_PATH_LEN + 32];
+    snprintf(path, MAX_PATH_LEN + 32, "%s/seg-%06d.ctdb", db->dir, db->next_segment);
+    snprintf(tmp, sizeof(tmp), "%s/.seg-%06d.tmp", db->dir, db->next_segment);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error writing segment %s: %s\n", tmp, strerror(errno));
+        free(slots);
+        free(keys);
+        return -1;
+    }
+    uint64_t off = sizeof(h);
+    int status = write_all(fp, &h, sizeof(h));
+    status |= write_all(fp, slots, h.nslots * sizeof(uint32_t));
+    off += h.nslots * sizeof(uint32_t);
+    status |= write_padding(fp, &off);
+    status |= write_all(fp, keys, nkeys * sizeof(seg_key_t));
+    for (size_t t = 0; t < b->ntriples && status == 0; t++) {
+        seg_post_t p = {b->triples[t].sample, b->triples[t].count};
+        status |= write_all(fp, &p, sizeof(p));
+    }
+    for (size_t s = 0; s < b->nsamples && status == 0; s++) {
+        seg_sample_t sample = b->samples[s];
+        sample.name_off = b->keys.arena_len + b->names.entries[sample.name_off].offset;
+        status |= write_all(fp, &sample, sizeof(sample));
+    }
+    status |= write_all(fp, b->keys.arena, b->keys.arena_len);
+    status |= write_all(fp, b->names.arena, b->names.arena_len);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) status = -1;
+    if (fclose(fp) != 0) status = -1;
+    free(slots);
+    free(keys);
+
+    if (status != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "Error writing segment %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int cmd_ingest(const char *dir, int argc, char **argv) {
+    int lock = db_lock(dir);
+    if (lock < 0) return 1;
+    clonedb_t db;
+    builder_t b;
+    if (db_open(&db, dir) != 0) {
+        close(lock);
+        return 1;
+    }
+    if (builder_init(&b) != 0) {
+        fprintf(stderr, "Error: out of memory opening %s\n", dir);
+        builder_free(&b);
+        db_close(&db);
+        close(lock);
+        return 1;
+    }
+
+    int status = 1;
+    uint32_t next_id = db.nsample_ids;
+    for (int i = 0; i < argc; i++) {
+        // NAME=TABLE, or the table path itself as the name
+        char name[MAX_PATH_LEN];
+        const char *path = argv[i];
+        const char *eq = strchr(argv[i], '=');
+        if (eq) {
+            snprintf(name, sizeof(name), "%.*s", (int)(eq - argv[i]), argv[i]);
+            path = eq + 1;
+        } else {
+            snprintf(name, sizeof(name), "%s", path);
+        }
+        int duplicate = clone_dict_find(&b.names, name, strlen(name), clone_hash(name, strlen(name))) >= 0;
+        for (uint32_t id = 0; id < db.nsample_ids && !duplicate; id++) {
+            duplicate = db.names[id] && strcmp(db.names[id], name) == 0;
+        }
+        if (duplicate) {
+            fprintf(stderr, "Error: sample %s is already in %s\n", name, dir);
+            goto done;
+        }
+
+        clone_dict_t clones;
+        if (clone_dict_init(&clones, 4096) != 0 || clone_read_table(path, CLONE_CDR3, &clones) != 0) {
+            clone_dict_free(&clones);
+            goto done;
+        }
+        int failed = builder_add_sample(&b, next_id, name) != 0;
+        for (size_t k = 0; k < clones.len && !failed; k++) {
+            const clone_entry_t *e = &clones.entries[k];
+            failed = builder_add(&b, clone_dict_key(&clones, k), e->len, e->hash, next_id, e->count) != 0;
+        }
+        printf("  %s: %zu CDR3 pairs from %s\n", name, clones.len, path);
+        clone_dict_free(&clones);
+        if (failed) {
+            fprintf(stderr, "Error: out of memory ingesting %s\n", path);
+            goto done;
+        }
+        next_id++;
+    }
+
+    char path[MAX_PATH_LEN + 32];
+    if (write_segment(&db, &b, 0, path) != 0) goto done;
+    printf("Ingested %zu samples (%zu distinct CDR3 pairs) into %s\n", b.nsamples, b.keys.len, path);
+    status = 0;
+
+done:
+    builder_free(&b);
+    db_close(&db);
+    close(lock);
+    return status;
+}
+
+static int cmd_compact(const char *dir) {
+    int lock = db_lock(dir);
+    if (lock < 0) return 1;
+    clonedb_t db;
+    builder_t b;
+    if (db_open(&db, dir) != 0) {
+        close(lock);
+        return 1;
+    }
+    if (builder_init(&b) != 0) {
+        fprintf(stderr, "Error: out of memory opening %s\n", dir);
+        builder_free(&b);
+        db_close(&db);
+        close(lock);
+        return 1;
+    }
+
+    int status = 1;
+    if (db.nsegs < 2) {
+        printf("%s has %d segment(s); nothing to compact\n", dir, db.nsegs);
+        status = 0;
+        goto done;
+    }
+    int last = 0;
+    for (int i = 0; i < db.nsegs; i++) {
+        const segment_t *seg = &db.segs[i];
+        if (seg->number > last) last = seg->number;
+        for (uint64_t s = 0; s < seg->h->nsamples; s++) {
+            if (builder_add_sample(&b, seg->samples[s].id, seg->strings + seg->samples[s].name_off) != 0) goto oom;
+        }
+        for (uint64_t k = 0; k < seg->h->nkeys; k++) {
+            const seg_key_t *key = &seg->keys[k];
+            for (uint32_t p = 0; p < key->npost; p++) {
+                const seg_post_t *post = &seg->posts[key->post_off + p];
+                if (builder_add(&b, seg->strings + key->str_off, key->str_len, key->hash, post->sample,
+                                post->count) != 0) goto oom;
+            }
+        }
+    }
+
+    char path[MAX_PATH_LEN + 32];
+    if (write_segment(&db, &b, (uint32_t)last, path) != 0) goto done;
+    printf("Compacted %d segments into %s (%zu samples, %zu distinct CDR3 pairs)\n",
+           db.nsegs, path, b.nsamples, b.keys.len);
+    // Also clears segments left behind by an interrupted earlier compaction
+    for (int number = 1; number <= last; number++) {
+        char old[MAX_PATH_LEN + 32];
+        snprintf(old, sizeof(old), "%s/seg-%06d.ctdb", dir, number);
+        if (unlink(old) != 0 && errno != ENOENT) {
+            fprintf(stderr, "Warning: could not remove %s: %s\n", old, strerror(errno));
+        }
+    }
+    status = 0;
+    goto done;
+
+oom:
+    fprintf(stderr, "Error: out of memory compacting %s\n", dir);
+done:
+    builder_free(&b);
+    db_close(&db);
+    close(lock);
+    return status;
+}
+
+// Print the postings of an exact key from every segment; returns the hits
+static size_t lookup(const clonedb_t *db, const char *key, size_t len, const char *query, int mismatches) {
+    uint64_t hash = clone_hash(key, len);
+    size_t hits = 0;
+    for (int i = 0; i < db->nsegs; i++) {
+        const segment_t *seg = &db->segs[i];
+        uint64_t mask = seg->h->nslots - 1;
+        for (uint64_t s = hash & mask; seg->slots[s]; s = (s + 1) & mask) {
+            const seg_key_t *k = &seg->keys[seg->slots[s] - 1];
+            if (k->hash != hash || k->str_len != len || memcmp(seg->strings + k->str_off, key, len) != 0) continue;
+            for (uint32_t p = 0; p < k->npost; p++) {
+                const seg_post_t *post = &seg->posts[k->post_off + p];
+                const char *name = post->sample < db->nsample_ids ? db->names[post->sample] : NULL;
+                printf("%s\t%s\t%d\t%s\t%u\n", query, key, mismatches, name ? name : "?", post->count);
+            }
+            hits += k->npost;
+            break;
+        }
+    }
+    return hits;
+}
+
+// The exact pair, then with mismatches set every single-residue substitution
+// of either CDR3
+static size_t query_pair(const clonedb_t *db, const char *tra, const char *trb, int mismatches) {
+    char key[2 * 256 + 2], query[2 * 256 + 2];
+    size_t la = strlen(tra), lb = strlen(trb);
+    if (la > 256 || lb > 256) return 0;
+    snprintf(key, sizeof(key), "%s\t%s", tra, trb);
+    memcpy(query, key, la + lb + 2);
+    size_t len = la + 1 + lb;
+    size_t hits = lookup(db, key, len, query, 0);
+    if (mismatches < 1) return hits;
+
+    for (size_t pos = 0; pos < len; pos++) {
+        if (pos == la) continue;
+        char original = key[pos];
+        for (const char *aa = CDR3_ALPHABET; *aa; aa++) {
+            if (*aa == original) continue;
+            key[pos] = *aa;
+            hits += lookup(db, key, len, query, 1);
+        }
+        key[pos] = original;
+    }
+    return hits;
+}
+
+static int cmd_query(const char *dir, int argc, char **argv, const char *batch, int mismatches) {
+    clonedb_t db;
+    if (db_open(&db, dir) != 0) return 1;
+    if (db.nsegs == 0) {
+        fprintf(stderr, "Error: %s holds no segments; run ingest first\n", dir);
+        return 1;
+    }
+
+    printf("query_TRA_aCDR3\tquery_TRB_aCDR3\tTRA_aCDR3\tTRB_aCDR3\tmismatches\tsample\tcount\n");
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    size_t queries = 0, hits = 0;
+    for (int i = 0; i + 1 < argc; i += 2) {
+        hits += query_pair(&db, argv[i], argv[i + 1], mismatches);
+        queries++;
+    }
+    if (batch) {
+        FILE *fp = strcmp(batch, "-") == 0 ? stdin : fopen(batch, "r");
+        if (!fp) {
+            fprintf(stderr, "Error opening query file %s: %s\n", batch, strerror(errno));
+            db_close(&db);
+            return 1;
+        }
+        char line[1024];
+        while (fgets(line, sizeof(line), fp)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            char *tab = strchr(line, '\t');
+            if (!tab || strcmp(line, "TRA_aCDR3\tTRB_aCDR3") == 0) continue;
+            *tab = '\0';
+            char *rest = strchr(tab + 1, '\t');
+            if (rest) *rest = '\0';
+            hits += query_pair(&db, line, tab + 1, mismatches);
+            queries++;
+        }
+        if (fp != stdin) fclose(fp);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double us = (double)(t1.tv_sec - t0.tv_sec) * 1e6 + (double)(t1.tv_nsec - t0.tv_nsec) / 1e3;
+    fprintf(stderr, "%zu queries, %zu hits across %d segment(s), %.1f us per query\n", queries, hits, db.nsegs,
+            queries ? us / (double)queries : 0);
+    db_close(&db);
+    return 0;
+}
+
+static int cmd_stats(const char *dir) {
+    clonedb_t db;
+    if (db_open(&db, dir) != 0) return 1;
+    uint64_t keys = 0, posts = 0, samples = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < db.nsegs; i++) {
+        keys += db.segs[i].h->nkeys;
+        posts += db.segs[i].h->nposts;
+        samples += db.segs[i].h->nsamples;
+        bytes += db.segs[i].size;
+    }
+    printf("%s: %d segment(s), %llu samples, %llu CDR3 pair keys, %llu postings, %.1f MB\n", dir, db.nsegs,
+           (unsigned long long)samples, (unsigned long long)keys, (unsigned long long)posts, bytes / 1e6);
+    if (db.nsegs > 1) printf("Keys shared between segments are counted once per segment; compact merges them\n");
+    db_close(&db);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+        show_usage(argv[0]);
+        return argc < 2 ? 1 : 0;
+    }
+    const char *command = argv[1];
+    const char *dir = argv[2];
+
+    if (strcmp(command, "ingest") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Error: ingest needs at least one step 4 table\n");
+            return 1;
+        }
+        return cmd_ingest(dir, argc - 3, argv + 3);
+    }
+    if (strcmp(command, "compact") == 0) return cmd_compact(dir);
+    if (strcmp(command, "stats") == 0) return cmd_stats(dir);
+    if (strcmp(command, "query") == 0) {
+        const char *batch = NULL;
+        int mismatches = 0;
+        char *pairs[argc];
+        int npairs = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+                batch = argv[++i];
+            } else if (strcmp(argv[i], "--hamming") == 0 && i + 1 < argc) {
+                mismatches = atoi(argv[++i]);
+            } else {
+                pairs[npairs++] = argv[i];
+            }
+        }
+        if (mismatches < 0 || mismatches > 1) {
+            fprintf(stderr, "Error: --hamming must be 0 or 1\n");
+            return 1;
+        }
+        if ((npairs == 0 && !batch) || npairs % 2 != 0) {
+            fprintf(stderr, "Error: query takes TRA_CDR3 TRB_CDR3 pairs or -f FILE\n");
+            return 1;
+        }
+        return cmd_query(dir, npairs, pairs, batch, mismatches);
+    }
+    fprintf(stderr, "Error: unknown command '%s'\n", command);
+    show_usage(argv[0]);
+    return 1;
+}
+
+void show_usage(const char *program_name) {
+    printf("Usage: %s COMMAND DB_DIR [ARGS]\n", program_name);
+    printf("Append-only index of TRA/TRB CDR3 pairs across step 4 outputs\n\n");
+    printf("Commands:\n");
+    printf("  ingest DB [NAME=]TABLE.tsv ...  Add step 4 tables (final_paired_clones_filtered.tsv,\n");
+    printf("                           plain or gzip) as new samples, in one new segment\n");
+    printf("  query DB [--hamming 1] [-f FILE] [TRA_CDR3 TRB_CDR3 ...]\n");
+    printf("                           Samples holding each CDR3 pair, with read-pair counts;\n");
+    printf("                           FILE (- for stdin) holds TRA<tab>TRB per line. --hamming 1\n");
+    printf("                           also matches pairs with one substitution in either CDR3\n");
+    printf("  compact DB               Merge all segments into one\n");
+    printf("  stats DB                 Segment, sample and key counts\n");
+    printf("\nSamples are named after the table path unless NAME= is given; names must be unique.\n");
+    printf("Segments are mapped read-only, so queries can run while another process ingests.\n");
+}
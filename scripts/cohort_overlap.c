@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include "clonotype.h"
+
+#define MAX_PATH_LEN 1024
+#define MAX_NAME_LEN 256
+
+// Clone sharing across a cohort of step 4 tables. Every table's clonotypes
+// are interned into one dictionary, each sample becomes a list of
+// (clone, count) sorted by key, and the overlap is accumulated from the
+// inverted lists: only clones seen in two or more samples cost anything.
+
+typedef struct {
+    char name[MAX_NAME_LEN];
+    char path[MAX_PATH_LEN];
+    clone_dict_t clones;         // the table's own clonotypes, until interned
+    uint32_t *rank;              // cohort key rank of each clone, ascending
+    uint64_t *count;
+    size_t n;
+    uint64_t total;
+    double sum_squares;          // sum of count^2, for Morisita-Horn
+    int failed;
+} sample_t;
+
+typedef struct {
+    uint32_t sample;
+    uint32_t count;
+} posting_t;
+
+typedef struct {
+    sample_t *samples;
+    int nsamples;
+    clone_level_t level;
+    clone_dict_t dict;           // cohort keys; count = samples holding the key
+    uint32_t *rank_of;           // dictionary id -> key rank
+    size_t *post_start;          // by rank, nclones + 1 offsets into posts
+    posting_t *posts;
+    int next;                    // work counter shared by the threads
+    int threads;
+    uint64_t *shared;            // upper triangle, per thread during the scan
+    double *cross;
+} cohort_t;
+
+void show_usage(const char *program_name);
+
+static void parse_sample(sample_t *s, const char *spec) {
+    const char *sep = strpbrk(spec, "=\t");
+    const char *path = sep ? sep + 1 : spec;
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    if (sep) {
+        snprintf(s->name, sizeof(s->name), "%.*s", (int)(sep - spec), spec);
+    } else {
+        snprintf(s->name, sizeof(s->name), "%s", path);
+        char *ext = strstr(s->name, ".tsv");
+        if (ext && (ext[4] == '\0' || strcmp(ext + 4, ".gz") == 0)) *ext = '\0';
+    }
+}
+
+static int add_sample(sample_t **samples, int *n, int *cap, const char *spec) {
+    if (*n == *cap) {
+        *cap = *cap ? 2 * *cap : 64;
+        sample_t *grown = realloc(*samples, (size_t)*cap * sizeof(sample_t));
+        if (!grown) return -1;
+        *samples = grown;
+    }
+    memset(&(*samples)[*n], 0, sizeof(sample_t));
+    parse_sample(&(*samples)[(*n)++], spec);
+    return 0;
+}
+
+static int read_sample_list(const char *list, sample_t **samples, int *n, int *cap) {
+    FILE *fp = fopen(list, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening sample list %s: %s\n", list, strerror(errno));
+        return -1;
+    }
+    char line[MAX_PATH_LEN + MAX_NAME_LEN];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (add_sample(samples, n, cap, line) != 0) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int take_work(cohort_t *c) {
+    return __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED);
+}
+
+static void *load_worker(void *arg) {
+    cohort_t *c = arg;
+    for (int i = take_work(c); i < c->nsamples; i = take_work(c)) {
+        sample_t *s = &c->samples[i];
+        s->failed = clone_dict_init(&s->clones, 4096) != 0 ||
+                    clone_read_table(s->path, c->level, &s->clones) != 0;
+    }
+    return NULL;
+}
+
+// Move a sample's clonotypes into the cohort dictionary; rank holds the
+// dictionary ids until the keys are ranked
+static int intern_sample(cohort_t *c, sample_t *s) {
+    s->n = s->clones.len;
+    s->rank = malloc((s->n ? s->n : 1) * sizeof(uint32_t));
+    s->count = malloc((s->n ? s->n : 1) * sizeof(uint64_t));
+    if (!s->rank || !s->count) return -1;
+    for (size_t i = 0; i < s->n; i++) {
+        const clone_entry_t *e = &s->clones.entries[i];
+        int64_t id = clone_dict_intern(&c->dict, clone_dict_key(&s->clones, i), e->len, e->hash);
+        if (id < 0) return -1;
+        c->dict.entries[id].count++;
+        s->rank[i] = (uint32_t)id;
+        s->count[i] = e->count;
+        s->total += e->count;
+        s->sum_squares += (double)e->count * (double)e->count;
+    }
+    clone_dict_free(&s->clones);
+    return 0;
+}
+
+static const clone_dict_t *sort_dict;
+
+static int compare_keys(const void *a, const void *b) {
+    return strcmp(clone_dict_key(sort_dict, *(const uint32_t *)a), clone_dict_key(sort_dict, *(const uint32_t *)b));
+}
+
+typedef struct {
+    uint32_t rank;
+    uint64_t count;
+} ranked_t;
+
+static int compare_ranked(const void *a, const void *b) {
+    uint32_t x = ((const ranked_t *)a)->rank, y = ((const ranked_t *)b)->rank;
+    return (x > y) - (x < y);
+}
+
+static void *rank_worker(void *arg) {
+    cohort_t *c = arg;
+    for (int i = take_work(c); i < c->nsamples; i = take_work(c)) {
+        sample_t *s = &c->samples[i];
+        ranked_t *tmp = malloc((s->n ? s->n : 1) * sizeof(ranked_t));
+        if (!tmp) {
+            s->failed = 1;
+            continue;
+        }
+        for (size_t j = 0; j < s->n; j++) {
+            tmp[j].rank = c->rank_of[s->rank[j]];
+            tmp[j].count = s->count[j];
+        }
+        qsort(tmp, s->n, sizeof(ranked_t), compare_ranked);
+        for (size_t j = 0; j < s->n; j++) {
+            s->rank[j] = tmp[j].rank;
+            s->count[j] = tmp[j].count;
+        }
+        free(tmp);
+    }
+    return NULL;
+}
+
+// Upper-triangle index of the pair a < b
+static size_t pair_index(int n, int a, int b) {
+    return (size_t)a * (size_t)(2 * n - a - 1) / 2 + (size_t)(b - a - 1);
+}
+
+#define OVERLAP_CHUNK 4096
+
+typedef struct {
+    cohort_t *cohort;
+    int id;
+} overlap_arg_t;
+
+static void *overlap_worker(void *arg) {
+    overlap_arg_t *a = arg;
+    cohort_t *c = a->cohort;
+    size_t pairs = (size_t)c->nsamples * (size_t)(c->nsamples - 1) / 2;
+    uint64_t *shared = c->shared + (size_t)a->id * pairs;
+    double *cross = c->cross + (size_t)a->id * pairs;
+    size_t nclones = c->dict.len;
+    for (size_t start = (size_t)take_work(c) * OVERLAP_CHUNK; start < nclones;
+         start = (size_t)take_work(c) * OVERLAP_CHUNK) {
+        size_t end = start + OVERLAP_CHUNK < nclones ? start + OVERLAP_CHUNK : nclones;
+        for (size_t r = start; r < end; r++) {
+            const posting_t *p = c->posts + c->post_start[r];
+            size_t np = c->post_start[r + 1] - c->post_start[r];
+            for (size_t i = 0; i < np; i++) {
+                for (size_t j = i + 1; j < np; j++) {
+                    size_t k = pair_index(c->nsamples, (int)p[i].sample, (int)p[j].sample);
+                    shared[k]++;
+                    cross[k] += (double)p[i].count * (double)p[j].count;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static void run_workers(cohort_t *c, void *(*worker)(void *)) {
+    pthread_t tids[c->threads];
+    overlap_arg_t args[c->threads];
+    c->next = 0;
+    for (int t = 0; t < c->threads; t++) {
+        args[t].cohort = c;
+        args[t].id = t;
+        pthread_create(&tids[t], NULL, worker, worker == overlap_worker ? (void *)&args[t] : (void *)c);
+    }
+    for (int t = 0; t < c->threads; t++) pthread_join(tids[t], NULL);
+}
+
+static int write_overlap(const cohort_t *c, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error writing overlap matrix %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "sample_a\tsample_b\tclones_a\tclones_b\tshared\tjaccard\tmorisita_horn\n");
+    for (int a = 0; a < c->nsamples; a++) {
+        const sample_t *x = &c->samples[a];
+        for (int b = a + 1; b < c->nsamples; b++) {
+            const sample_t *y = &c->samples[b];
+            size_t k = pair_index(c->nsamples, a, b);
+            uint64_t shared = c->shared[k];
+            uint64_t either = x->n + y->n - shared;
+            double dx = x->total ? x->sum_squares / ((double)x->total * (double)x->total) : 0;
+            double dy = y->total ? y->sum_squares / ((double)y->total * (double)y->total) : 0;
+            double horn = dx + dy > 0 ? 2 * c->cross[k] / ((dx + dy) * (double)x->total * (double)y->total) : 0;
+            fprintf(fp, "%s\t%s\t%zu\t%zu\t%llu\t%.6f\t%.6f\n", x->name, y->name, x->n, y->n,
+                    (unsigned long long)shared, either ? (double)shared / (double)either : 0, horn);
+        }
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+// k-way merge of the key-sorted sample lists into one row per clonotype
+static int write_cohort_table(const cohort_t *c, const uint32_t *by_rank, int min_samples, const char *path,
+                              size_t *rows) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error writing cohort clone table %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int n = c->nsamples;
+    size_t *cursor = calloc((size_t)n, sizeof(size_t));
+    int *heap = malloc((size_t)n * sizeof(int));
+    uint64_t *row = calloc((size_t)n, sizeof(uint64_t));
+    if (!cursor || !heap || !row) {
+        fprintf(stderr, "Error: out of memory merging the cohort table\n");
+        fclose(fp);
+        free(cursor);
+        free(heap);
+        free(row);
+        return -1;
+    }
+
+    fprintf(fp, "%s\tsamples\ttotal", clone_level_header(c->level));
+    for (int s = 0; s < n; s++) fprintf(fp, "\t%s", c->samples[s].name);
+    fprintf(fp, "\n");
+
+    // Min-heap of samples by the rank under their cursor
+#define HEAD(s) (c->samples[s].rank[cursor[s]])
+    int len = 0;
+    for (int s = 0; s < n; s++) {
+        if (c->samples[s].n == 0) continue;
+        int i = len++;
+        while (i > 0 && HEAD(heap[(i - 1) / 2]) > HEAD(s)) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = s;
+    }
+    *rows = 0;
+    while (len > 0) {
+        uint32_t rank = HEAD(heap[0]);
+        int holders = 0;
+        uint64_t total = 0;
+        memset(row, 0, (size_t)n * sizeof(uint64_t));
+        while (len > 0 && HEAD(heap[0]) == rank) {
+            int s = heap[0];
+            row[s] = c->samples[s].count[cursor[s]];
+            total += row[s];
+            holders++;
+            // Advance the sample, or replace the root with the last entry
+            if (++cursor[s] == c->samples[s].n) s = heap[--len];
+            if (len == 0) break;
+            int i = 0;
+            for (;;) {
+                int child = 2 * i + 1;
+                if (child >= len) break;
+                if (child + 1 < len && HEAD(heap[child + 1]) < HEAD(heap[child])) child++;
+                if (HEAD(heap[child]) >= HEAD(s)) break;
+                heap[i] = heap[child];
+                i = child;
+            }
+            heap[i] = s;
+        }
+        if (holders < min_samples) continue;
+        fprintf(fp, "%s\t%d\t%llu", clone_dict_key(&c->dict, by_rank[rank]), holders, (unsigned long long)total);
+        for (int s = 0; s < n; s++) fprintf(fp, "\t%llu", (unsigned long long)row[s]);
+        fprintf(fp, "\n");
+        (*rows)++;
+    }
+#undef HEAD
+
+    free(cursor);
+    free(heap);
+    free(row);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    char output_prefix[MAX_PATH_LEN] = "cohort";
+    const char *level_name = "paired";
+    int threads = 1;
+    int min_samples = 1;
+    sample_t *samples = NULL;
+    int nsamples = 0, cap = 0;
+
+    int opt;
+    static struct option long_options[] = {
+        {"output_prefix", required_argument, 0, 'o'},
+        {"list", required_argument, 0, 'l'},
+        {"level", required_argument, 0, 'L'},
+        {"threads", required_argument, 0, 't'},
+        {"min-samples", required_argument, 0, 'm'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "o:l:L:t:m:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                snprintf(output_prefix, sizeof(output_prefix), "%s", optarg);
+                break;
+            case 'l':
+                if (read_sample_list(optarg, &samples, &nsamples, &cap) != 0) return 1;
+                break;
+            case 'L':
+                level_name = optarg;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'm':
+                min_samples = atoi(optarg);
+                break;
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            default:
+                show_usage(argv[0]);
+                return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (add_sample(&samples, &nsamples, &cap, argv[i]) != 0) {
+            fprintf(stderr, "Error: out of memory\n");
+            return 1;
+        }
+    }
+    if (nsamples < 2) {
+        fprintf(stderr, "Error: at least two clone tables are needed\n");
+        show_usage(argv[0]);
+        return 1;
+    }
+    if (threads < 1 || min_samples < 1) {
+        fprintf(stderr, "Error: --threads and --min-samples must be at least 1\n");
+        return 1;
+    }
+
+    cohort_t c;
+    memset(&c, 0, sizeof(c));
+    c.samples = samples;
+    c.nsamples = nsamples;
+    c.threads = threads < nsamples ? threads : nsamples;
+    if (clone_level_parse(level_name, &c.level) != 0) return 1;
+    time_t start = time(NULL);
+
+    // 1. Aggregate every table in parallel, then intern the keys in sample order
+    run_workers(&c, load_worker);
+    if (clone_dict_init(&c.dict, 1 << 16) != 0) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < nsamples; i++) {
+        if (samples[i].failed) return 1;
+        if (intern_sample(&c, &samples[i]) != 0) {
+            fprintf(stderr, "Error: out of memory interning %s\n", samples[i].path);
+            return 1;
+        }
+    }
+    size_t nclones = c.dict.len;
+
+    // 2. Rank the keys and sort each sample by rank
+    uint32_t *by_rank = malloc((nclones ? nclones : 1) * sizeof(uint32_t));
+    c.rank_of = malloc((nclones ? nclones : 1) * sizeof(uint32_t));
+    c.post_start = calloc(nclones + 1, sizeof(size_t));
+    if (!by_rank || !c.rank_of || !c.post_start) {
+        fprintf(stderr, "Error: out of memory ranking %zu clonotypes\n", nclones);
+        return 1;
+    }
+    for (size_t id = 0; id < nclones; id++) by_rank[id] = (uint32_t)id;
+    sort_dict = &c.dict;
+    qsort(by_rank, nclones, sizeof(uint32_t), compare_keys);
+    for (size_t r = 0; r < nclones; r++) c.rank_of[by_rank[r]] = (uint32_t)r;
+    run_workers(&c, rank_worker);
+    for (int i = 0; i < nsamples; i++) {
+        if (samples[i].failed) {
+            fprintf(stderr, "Error: out of memory sorting %s\n", samples[i].path);
+            return 1;
+        }
+    }
+
+    // 3. Inverted lists: the samples holding each clone, in sample order
+    for (size_t r = 0; r < nclones; r++) c.post_start[r + 1] = c.post_start[r] + c.dict.entries[by_rank[r]].count;
+    c.posts = malloc((c.post_start[nclones] ? c.post_start[nclones] : 1) * sizeof(posting_t));
+    size_t *fill = malloc((nclones ? nclones : 1) * sizeof(size_t));
+    if (!c.posts || !fill) {
+        fprintf(stderr, "Error: out of memory building inverted lists\n");
+        return 1;
+    }
+    memcpy(fill, c.post_start, nclones * sizeof(size_t));
+    for (int i = 0; i < nsamples; i++) {
+        for (size_t j = 0; j < samples[i].n; j++) {
+            posting_t *p = &c.posts[fill[samples[i].rank[j]]++];
+            p->sample = (uint32_t)i;
+            p->count = samples[i].count[j] > UINT32_MAX ? UINT32_MAX : (uint32_t)samples[i].count[j];
+        }
+    }
+    free(fill);
+
+    // 4. Pairwise sharing, each thread on its own triangle, then summed
+    size_t pairs = (size_t)nsamples * (size_t)(nsamples - 1) / 2;
+    c.threads = threads;
+    c.shared = calloc(pairs * (size_t)threads, sizeof(uint64_t));
+    c.cross = calloc(pairs * (size_t)threads, sizeof(double));
+    if (!c.shared || !c.cross) {
+        fprintf(stderr, "Error: out of memory for %d x %d overlap matrices\n", threads, nsamples);
+        return 1;
+    }
+    run_workers(&c, overlap_worker);
+    for (int t = 1; t < threads; t++) {
+        for (size_t k = 0; k < pairs; k++) {
+            c.shared[k] += c.shared[(size_t)t * pairs + k];
+            c.cross[k] += c.cross[(size_t)t * pairs + k];
+        }
+    }
+
+    char path[MAX_PATH_LEN + 32];
+    size_t rows = 0, in_two = 0;
+    for (size_t r = 0; r < nclones; r++) in_two += c.dict.entries[r].count >= 2;
+    snprintf(path, sizeof(path), "%s.overlap.tsv", output_prefix);
+    int status = write_overlap(&c, path);
+    snprintf(path, sizeof(path), "%s.clones.tsv", output_prefix);
+    if (write_cohort_table(&c, by_rank, min_samples, path, &rows) != 0) status = -1;
+
+    printf("Cohort of %d samples (%s clonotypes): %zu distinct, %zu in two or more samples\n",
+           nsamples, level_name, nclones, in_two);
+    printf("Wrote %s.overlap.tsv (%zu sample pairs) and %s.clones.tsv (%zu clonotypes) in %lds\n",
+           output_prefix, pairs, output_prefix, rows, (long)(time(NULL) - start));
+
+    for (int i = 0; i < nsamples; i++) {
+        free(samples[i].rank);
+        free(samples[i].count);
+    }
+    free(samples);
+    free(by_rank);
+    free(c.rank_of);
+    free(c.post_start);
+    free(c.posts);
+    free(c.shared);
+    free(c.cross);
+    clone_dict_free(&c.dict);
+    return status == 0 ? 0 : 1;
+}
+
+void show_usage(const char *program_name) {
+    printf("Usage: %s [OPTIONS] [NAME=]TABLE.tsv ...\n", program_name);
+    printf("Clone sharing across step 4 tables (final_paired_clones_filtered.tsv, plain or gzip)\n\n");
+    printf("Options:\n");
+    printf("  -o, --output_prefix PREFIX  Writes PREFIX.overlap.tsv and PREFIX.clones.tsv (default: cohort)\n");
+    printf("  -l, --list FILE          More tables, one [NAME=]TABLE or NAME<tab>TABLE per line\n");
+    printf("  -L, --level LEVEL        Clonotype key: paired, TRA, TRB or cdr3 (the two CDR3s\n");
+    printf("                           alone) (default: paired)\n");
+    printf("  -t, --threads N          Threads for loading and the overlap scan (default: 1)\n");
+    printf("  -m, --min-samples N      Keep clonotypes found in at least N samples in the\n");
+    printf("                           cohort table (default: 1)\n");
+    printf("  -h, --help               Show this help message\n");
+    printf("\nA table with a count column is read as one row per clonotype; otherwise each row\n");
+    printf("is one read pair. Samples are named after the table path unless NAME= is given.\n");
+}
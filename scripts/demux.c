@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "demux.h"
+
+#define DEMUX_SLOT_CORRECTED 0x40    // reached through one substitution
+#define DEMUX_SLOT_AMBIGUOUS 0x80    // one substitution away from two barcodes
+#define DEMUX_LINE_LEN 1024
+
+static int base_code(char c) {
+    switch (c) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return -1;
+    }
+}
+
+static size_t slot_of(uint64_t key, size_t mask) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (size_t)key & mask;
+}
+
+// Value stored for key, 0 when absent
+static uint8_t table_get(const demux_t *d, uint64_t key) {
+    for (size_t s = slot_of(key, d->slot_mask); d->slot_values[s]; s = (s + 1) & d->slot_mask) {
+        if (d->slot_keys[s] == key) return d->slot_values[s];
+    }
+    return 0;
+}
+
+// Exact barcodes are added first and are never displaced by a neighbour;
+// a neighbour reached from two samples becomes ambiguous
+static void table_put(demux_t *d, uint64_t key, uint8_t value) {
+    size_t s = slot_of(key, d->slot_mask);
+    while (d->slot_values[s] && d->slot_keys[s] != key) s = (s + 1) & d->slot_mask;
+    if (!d->slot_values[s]) {
+        d->slot_keys[s] = key;
+        d->slot_values[s] = value;
+    } else if ((d->slot_values[s] & DEMUX_SLOT_CORRECTED) && d->slot_values[s] != value) {
+        d->slot_values[s] = DEMUX_SLOT_CORRECTED | DEMUX_SLOT_AMBIGUOUS;
+    }
+}
+
+static int valid_sample_name(const char *name) {
+    if (!*name || strlen(name) >= DEMUX_MAX_NAME) return 0;
+    for (const char *p = name; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '_' && *p != '-' && *p != '.') return 0;
+    }
+    return 1;
+}
+
+int demux_load(demux_t *d, const char *path, int mate) {
+    memset(d, 0, sizeof(*d));
+    d->mate = mate;
+    pthread_mutex_init(&d->lock, NULL);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[DEMUX_LINE_LEN];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        char *name = strtok(line, " \t\r\n");
+        if (!name || name[0] == '#') continue;
+        char *barcode = strtok(NULL, " \t\r\n");
+        if (!barcode) {
+            fprintf(stderr, "Error: %s:%d: expected a sample name and a barcode\n", path, line_no);
+            fclose(fp);
+            return -1;
+        }
+        if (!valid_sample_name(name)) {
+            fprintf(stderr, "Error: %s:%d: sample names may only hold letters, digits, '_', '-' and '.'\n",
+                    path, line_no);
+            fclose(fp);
+            return -1;
+        }
+        int len = (int)strlen(barcode);
+        for (int j = 0; j < len; j++) barcode[j] = (char)toupper((unsigned char)barcode[j]);
+        if (len == 0 || len > DEMUX_MAX_BARCODE || (int)strspn(barcode, "ACGT") != len) {
+            fprintf(stderr, "Error: %s:%d: barcodes must be 1-%d bases of ACGT\n", path, line_no, DEMUX_MAX_BARCODE);
+            fclose(fp);
+            return -1;
+        }
+        if (d->nsamples > 0 && len != d->len) {
+            fprintf(stderr, "Error: %s:%d: all barcodes must have the same length (%d)\n", path, line_no, d->len);
+            fclose(fp);
+            return -1;
+        }
+        if (d->nsamples == MAX_SAMPLES) {
+            fprintf(stderr, "Error: %s: at most %d samples per run\n", path, MAX_SAMPLES);
+            fclose(fp);
+            return -1;
+        }
+        for (int s = 0; s < d->nsamples; s++) {
+            if (strcmp(d->name[s], name) == 0 || strcmp(d->barcode[s], barcode) == 0) {
+                fprintf(stderr, "Error: %s:%d: sample %s or barcode %s is listed twice\n", path, line_no, name, barcode);
+                fclose(fp);
+                return -1;
+            }
+        }
+        strcpy(d->name[d->nsamples], name);
+        strcpy(d->barcode[d->nsamples], barcode);
+        d->len = len;
+        d->nsamples++;
+    }
+    fclose(fp);
+    if (d->nsamples == 0) {
+        fprintf(stderr, "Error: %s lists no barcodes\n", path);
+        return -1;
+    }
+
+    // Every barcode and its 3 * len neighbours, at most a quarter full
+    size_t slots = 64;
+    while (slots < (size_t)d->nsamples * (1 + 3 * d->len) * 4) slots *= 2;
+    d->slot_keys = calloc(slots, sizeof(uint64_t));
+    d->slot_values = calloc(slots, 1);
+    if (!d->slot_keys || !d->slot_values) {
+        fprintf(stderr, "Error: out of memory building the barcode table\n");
+        return -1;
+    }
+    d->slot_mask = slots - 1;
+
+    uint64_t keys[MAX_SAMPLES];
+    for (int s = 0; s < d->nsamples; s++) {
+        keys[s] = 0;
+        for (int j = 0; j < d->len; j++) keys[s] = keys[s] << 2 | (uint64_t)base_code(d->barcode[s][j]);
+        table_put(d, keys[s], (uint8_t)(s + 1));
+    }
+    for (int s = 0; s < d->nsamples; s++) {
+        for (int j = 0; j < d->len; j++) {
+            int shift = 2 * (d->len - 1 - j);
+            for (uint64_t b = 1; b < 4; b++) {
+                table_put(d, keys[s] ^ (b << shift), (uint8_t)((s + 1) | DEMUX_SLOT_CORRECTED));
+            }
+        }
+    }
+
+    d->min_distance = d->len;
+    for (int a = 0; a < d->nsamples; a++) {
+        for (int b = a + 1; b < d->nsamples; b++) {
+            int dist = 0;
+            for (int j = 0; j < d->len; j++) dist += d->barcode[a][j] != d->barcode[b][j];
+            if (dist < d->min_distance) d->min_distance = dist;
+        }
+    }
+    if (d->nsamples > 1 && d->min_distance < 3) {
+        fprintf(stderr, "Warning: some barcodes differ at only %d position(s); reads between them are "
+                "left unassigned\n", d->min_distance);
+    }
+    return 0;
+}
+
+void demux_assign(demux_t *d, batch_t *batch) {
+    batch->barcodes_corrected = 0;
+    batch->barcodes_ambiguous = 0;
+    for (int i = 0; i < batch->count; i++) {
+        fastq_record_t *rec = d->mate == 1 ? &batch->r1[i] : &batch->r2[i];
+        const char *seq = rec->sequence;
+        batch->sample[i] = DEMUX_NONE;
+
+        uint64_t key = 0;
+        int j, n_pos = -1;
+        for (j = 0; j < d->len && seq[j]; j++) {
+            int code = base_code(seq[j]);
+            if (code < 0) {
+                if (n_pos >= 0) break;
+                n_pos = j;
+                code = 0;
+            }
+            key = key << 2 | (uint64_t)code;
+        }
+        if (j < d->len) continue;
+
+        uint8_t value = 0;
+        if (n_pos < 0) {
+            value = table_get(d, key);
+        } else {
+            // One unknown base: it must complete exactly one barcode
+            int shift = 2 * (d->len - 1 - n_pos);
+            for (uint64_t b = 0; b < 4; b++) {
+                uint8_t v = table_get(d, key | b << shift);
+                if (!v || (v & DEMUX_SLOT_CORRECTED)) continue;
+                value = value ? DEMUX_SLOT_CORRECTED | DEMUX_SLOT_AMBIGUOUS : (uint8_t)(v | DEMUX_SLOT_CORRECTED);
+            }
+        }
+        if (!value) continue;
+        if (value & DEMUX_SLOT_AMBIGUOUS) {
+            batch->barcodes_ambiguous++;
+            continue;
+        }
+
+        batch->sample[i] = (unsigned char)((value & ~DEMUX_SLOT_CORRECTED) - 1);
+        batch->barcodes_corrected += (value & DEMUX_SLOT_CORRECTED) != 0;
+        rec->sequence += d->len;
+        if ((int)strlen(rec->quality) >= d->len) rec->quality += d->len;
+    }
+}
+
+void demux_collect(demux_t *d, const batch_t *batch) {
+    pthread_mutex_lock(&d->lock);
+    long assigned = 0;
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->sample[i] != DEMUX_NONE) {
+            d->pairs[batch->sample[i]]++;
+            assigned++;
+        }
+    }
+    d->unassigned += batch->count - assigned;
+    d->ambiguous += batch->barcodes_ambiguous;
+    d->corrected += batch->barcodes_corrected;
+    for (int s = 0; s < d->nsamples; s++) {
+        d->tra_pairs[s] += batch->out[s * NUM_STREAMS + STREAM_TRA_1].records;
+        d->trb_pairs[s] += batch->out[s * NUM_STREAMS + STREAM_TRB_1].records;
+    }
+    if (d->umi_index) {
+        for (int k = 0; k < batch->umi_count; k++) {
+            if (umi_keys_append(&d->keys[batch->umi_sample[k]], &batch->umi_keys[k], 1) != 0) {
+                fprintf(stderr, "\nError: out of memory collecting UMI keys\n");
+                exit(1);
+            }
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+int demux_finalize(demux_t *d, const char *output_dir, const char *output_prefix) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s.demux.tsv", output_dir, output_prefix);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "sample\tbarcode\tpairs\ttra_pairs\ttrb_pairs\n");
+    for (int s = 0; s < d->nsamples; s++) {
+        fprintf(fp, "%s\t%s\t%ld\t%ld\t%ld\n", d->name[s], d->barcode[s], d->pairs[s], d->tra_pairs[s],
+                d->trb_pairs[s]);
+    }
+    fprintf(fp, "unassigned\t-\t%ld\t0\t0\n", d->unassigned);
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Error writing %s\n", path);
+        return -1;
+    }
+
+    if (!d->umi_index) return 0;
+    for (int s = 0; s < d->nsamples; s++) {
+        umi_entry_t *entries = NULL;
+        size_t n = umi_keys_collapse(&d->keys[s], &entries);
+        snprintf(path, sizeof(path), "%s/%s_%s.umi.idx", output_dir, output_prefix, d->name[s]);
+        int status = umi_index_write(path, entries, n);
+        free(entries);
+        if (status != 0) return -1;
+    }
+    return 0;
+}
+
+void demux_report(const demux_t *d) {
+    long total = d->unassigned;
+    for (int s = 0; s < d->nsamples; s++) total += d->pairs[s];
+    printf("Demultiplexing (%d samples, %d nt barcodes at the start of R%d, %ld corrected):\n",
+           d->nsamples, d->len, d->mate, d->corrected);
+    for (int s = 0; s < d->nsamples; s++) {
+        printf("  %s (%s): %ld pairs (%.2f%%); TRA %ld, TRB %ld\n", d->name[s], d->barcode[s], d->pairs[s],
+               total ? 100.0 * d->pairs[s] / total : 0, d->tra_pairs[s], d->trb_pairs[s]);
+    }
+    printf("  unassigned: %ld pairs (%.2f%%), %ld of them one substitution from two barcodes\n",
+           d->unassigned, total ? 100.0 * d->unassigned / total : 0, d->ambiguous);
+}
+
+void demux_free(demux_t *d) {
+    free(d->slot_keys);
+    free(d->slot_values);
+    d->slot_keys = NULL;
+    d->slot_values = NULL;
+    for (int s = 0; s < d->nsamples; s++) umi_keys_free(&d->keys[s]);
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "depth.h"
+#include "sample.h"
+
+// Separates the tier draw from the Bernoulli draw of the same pair index
+#define DEPTH_SEED_SALT 0x6465707468ULL
+#define DEPTH_PROBE_RECORDS 20000
+
+int depth_parse(depth_plan_t *plan, const char *spec) {
+    char buf[512];
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    plan->tiers = 0;
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        char *end;
+        double value = strtod(tok, &end);
+        switch (*end) {
+            case 'k': case 'K': value *= 1e3; end++; break;
+            case 'm': case 'M': value *= 1e6; end++; break;
+            case 'g': case 'G': value *= 1e9; end++; break;
+        }
+        if (end == tok || *end != '\0' || value < 1) {
+            fprintf(stderr, "Error: bad depth '%s' in --depths\n", tok);
+            return -1;
+        }
+        if (plan->tiers == MAX_DEPTH_TIERS) {
+            fprintf(stderr, "Error: --depths takes at most %d tiers\n", MAX_DEPTH_TIERS);
+            return -1;
+        }
+        long depth = (long)value;
+        if (plan->tiers > 0 && depth <= plan->depth[plan->tiers - 1]) {
+            fprintf(stderr, "Error: --depths must be ascending\n");
+            return -1;
+        }
+        plan->depth[plan->tiers] = depth;
+        snprintf(plan->label[plan->tiers], sizeof(plan->label[0]), "%s", tok);
+        plan->tiers++;
+    }
+    return 0;
+}
+
+long depth_estimate_pairs(const char *r1_file, const preprocess_config_t *cfg) {
+    if (cfg->sample_mode == SAMPLE_RESERVOIR) {
+        return cfg->read_limit;
+    }
+
+    gzFile fp = gzopen(r1_file, "r");
+    if (!fp) return cfg->read_limit;
+    char line[MAX_LINE_LEN];
+    long lines = 0;
+    int eof = 0;
+    while (lines < 4L * DEPTH_PROBE_RECORDS) {
+        if (gzgets(fp, line, sizeof(line)) == NULL) {
+            eof = 1;
+            break;
+        }
+        if (strchr(line, '\n')) lines++;
+    }
+
+    double pairs = (double)(lines / 4);
+    struct stat st;
+    long consumed = (long)gzoffset(fp);
+    if (!eof && consumed > 0 && stat(r1_file, &st) == 0) {
+        pairs *= (double)st.st_size / (double)consumed;
+    }
+    gzclose(fp);
+
+    if (cfg->sample_mode == SAMPLE_BERNOULLI || cfg->sample_mode == SAMPLE_STRIDE) {
+        pairs *= cfg->sample_fraction;
+    }
+    return pairs < (double)cfg->read_limit ? (long)pairs : cfg->read_limit;
+}
+
+void depth_start(depth_plan_t *plan, long total_pairs, uint64_t seed) {
+    plan->total_pairs = total_pairs > 0 ? total_pairs : 1;
+    plan->seed = seed ^ DEPTH_SEED_SALT;
+    for (int t = 0; t < plan->tiers; t++) {
+        plan->rate[t] = (double)plan->depth[t] / (double)plan->total_pairs;
+    }
+    pthread_mutex_init(&plan->lock, NULL);
+    plan->active = plan->tiers > 0 || plan->umi_index;
+}
+
+int depth_tier(const depth_plan_t *plan, long pair_index) {
+    if (plan->tiers == 0) return 0;
+    double u = sample_uniform(plan->seed, (uint64_t)pair_index);
+    int t = 0;
+    while (t < plan->tiers && u >= plan->rate[t]) t++;
+    return t;
+}
+
+void depth_collect(depth_plan_t *plan, const batch_t *batch) {
+    long pairs[MAX_DEPTH_TIERS + 1] = {0};
+    for (int i = 0; i < batch->count; i++) pairs[batch->tier[i]]++;
+
+    pthread_mutex_lock(&plan->lock);
+    for (int k = 0; k <= plan->tiers; k++) plan->pairs[k] += pairs[k];
+    for (int t = 0; t < plan->tiers; t++) {
+        plan->tra_pairs[t] += batch->out[(t + 1) * NUM_STREAMS + STREAM_TRA_1].records;
+        plan->trb_pairs[t] += batch->out[(t + 1) * NUM_STREAMS + STREAM_TRB_1].records;
+    }
+    plan->tra_pairs[plan->tiers] += batch->tra_pairs;
+    plan->trb_pairs[plan->tiers] += batch->trb_pairs;
+    if (plan->umi_index) {
+        plan->skipped_keys += batch->tra_pairs + batch->trb_pairs - batch->umi_count;
+        for (int i = 0; i < batch->umi_count; i++) {
+            if (umi_keys_append(&plan->keys[batch->umi_tier[i]], &batch->umi_keys[i], 1) != 0) {
+                fprintf(stderr, "\nError: out of memory collecting UMI keys\n");
+                exit(1);
+            }
+        }
+    }
+    pthread_mutex_unlock(&plan->lock);
+}
+
+int depth_finalize(depth_plan_t *plan, const char *output_dir, const char *output_prefix) {
+    if (!plan->umi_index) return 0;
+
+    // Tier t holds increments 0..t, so its index is the running merge
+    umi_entry_t *acc = NULL;
+    size_t acc_len = 0;
+    int status = 0;
+    for (int k = 0; k <= plan->tiers; k++) {
+        umi_entry_t *part, *merged;
+        size_t part_len = umi_keys_collapse(&plan->keys[k], &part);
+        size_t merged_len = umi_entries_merge(acc, acc_len, part, part_len, &merged);
+        free(part);
+        free(acc);
+        if (!merged) {
+            fprintf(stderr, "Error: out of memory building UMI indexes\n");
+            return -1;
+        }
+        acc = merged;
+        acc_len = merged_len;
+        plan->distinct[k] = acc_len;
+
+        char path[MAX_PATH_LEN];
+        if (k < plan->tiers) {
+            snprintf(path, sizeof(path), "%s/%s_%s.umi.idx", output_dir, output_prefix, plan->label[k]);
+        } else {
+            snprintf(path, sizeof(path), "%s/%s.umi.idx", output_dir, output_prefix);
+        }
+        if (umi_index_write(path, acc, acc_len) != 0) status = -1;
+    }
+    plan->full = acc;
+    plan->full_len = acc_len;
+    return status;
+}
+
+void depth_free(depth_plan_t *plan) {
+    for (int k = 0; k <= plan->tiers; k++) umi_keys_free(&plan->keys[k]);
+    free(plan->full);
+    plan->full = NULL;
+}
+
+void depth_report(const depth_plan_t *plan) {
+    if (plan->tiers > 0) {
+        printf("Depth tiers drawn against %ld pairs:\n", plan->total_pairs);
+    }
+    long pairs = 0;
+    for (int k = 0; k <= plan->tiers; k++) {
+        pairs += plan->pairs[k];
+        // The full output is in the main summary; it is listed only for its UMI count
+        if (k == plan->tiers && !plan->umi_index) break;
+
+        printf("  %-8s %ld pairs, TRA %ld, TRB %ld", k < plan->tiers ? plan->label[k] : "full",
+               pairs, plan->tra_pairs[k], plan->trb_pairs[k]);
+        if (plan->umi_index) printf(", %zu distinct UMI pairs", plan->distinct[k]);
+        if (k < plan->tiers && plan->rate[k] >= 1) printf(" (target exceeds input; tier is the full set)");
+        printf("\n");
+    }
+    if (plan->umi_index && plan->skipped_keys > 0) {
+        printf("  %ld classified pairs with non-ACGT UMI bases left out of the UMI indexes\n",
+               plan->skipped_keys);
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef DEPTH_H
+#define DEPTH_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "preprocess.h"
+#include "umi_index.h"
+
+// Nested subsamples at several target depths, drawn in the same pass as the
+// full output. Pair i belongs to tier t when sample_uniform(seed, i) falls
+// below depth[t] / total_pairs, so every tier contains all smaller ones.
+typedef struct {
+    int tiers;                   // 0 = no --depths
+    long depth[MAX_DEPTH_TIERS];
+    char label[MAX_DEPTH_TIERS][32];
+    double rate[MAX_DEPTH_TIERS];
+    long total_pairs;            // pairs the depths are drawn against
+    uint64_t seed;
+    int umi_index;               // collect UMI keys for .umi.idx files
+    int active;                  // set once calibration is over
+
+    // pairs and keys are indexed by increment: the smallest tier holding a
+    // pair, or tiers for pairs in the full output only. The other counts are
+    // per tier, with the full output last.
+    pthread_mutex_t lock;
+    long pairs[MAX_DEPTH_TIERS + 1];
+    umi_keys_t keys[MAX_DEPTH_TIERS + 1];
+    long tra_pairs[MAX_DEPTH_TIERS + 1];
+    long trb_pairs[MAX_DEPTH_TIERS + 1];
+    size_t distinct[MAX_DEPTH_TIERS + 1];   // filled by depth_finalize
+    long skipped_keys;           // classified pairs whose UMIs hold a non-ACGT base
+    umi_entry_t *full;           // full-output index, kept by depth_finalize
+    size_t full_len;
+} depth_plan_t;
+
+// Parse "1M,5M,10M" (k, M and G suffixes) into ascending tiers
+int depth_parse(depth_plan_t *plan, const char *spec);
+
+// Pairs the run will process: counted from a probe of R1 when the file is
+// short, else extrapolated from the compressed bytes the probe consumed
+long depth_estimate_pairs(const char *r1_file, const preprocess_config_t *cfg);
+
+void depth_start(depth_plan_t *plan, long total_pairs, uint64_t seed);
+int depth_tier(const depth_plan_t *plan, long pair_index);
+
+// Fold a processed batch's tier counts and UMI keys into the plan
+void depth_collect(depth_plan_t *plan, const batch_t *batch);
+
+// Write <prefix>_<label>.umi.idx per tier and <prefix>.umi.idx
+int depth_finalize(depth_plan_t *plan, const char *output_dir, const char *output_prefix);
+void depth_report(const depth_plan_t *plan);
+void depth_free(depth_plan_t *plan);
+
+#endif
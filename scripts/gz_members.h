@@ -0,0 +1,50 @@
+#ifndef GZ_MEMBERS_H
+#define GZ_MEMBERS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <zlib.h>
+
+#include "preprocess.h"
+
+// One gzip member appended to an output stream
+typedef struct {
+    long long offset;
+    size_t compressed;
+    size_t uncompressed;
+    long records;
+    long batch;
+} member_entry_t;
+
+// Output file built from independently compressed gzip members.
+// Writers reserve a byte range with an atomic add on next_offset and
+// pwrite() into it, so compression never has to be serialised.
+typedef struct {
+    int fd;
+    char path[MAX_PATH_LEN];
+    long long next_offset;
+    pthread_mutex_t lock;        // guards entries
+    member_entry_t *entries;
+    size_t count;
+    size_t cap;
+} member_stream_t;
+
+// Per-thread deflate state reused across members
+typedef struct {
+    z_stream zs;
+    unsigned char *buf;
+    size_t cap;
+} member_deflater_t;
+
+int member_stream_open(member_stream_t *stream, const char *path);
+long long member_stream_reserve(member_stream_t *stream, size_t len);
+int member_stream_write(member_stream_t *stream, long long offset,
+                        const unsigned char *data, size_t len,
+                        size_t uncompressed, long records, long batch);
+int member_stream_close(member_stream_t *stream, int write_manifest);
+
+int member_deflater_init(member_deflater_t *d, int level);
+int member_deflate(member_deflater_t *d, const char *in, size_t len, size_t *out_len);
+void member_deflater_free(member_deflater_t *d);
+
+#endif
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "optical.h"
+#include "umi_index.h"
+
+#define OPTICAL_X(c) (((c) >> OPTICAL_COORD_BITS) & ((1ULL << OPTICAL_COORD_BITS) - 1))
+#define OPTICAL_Y(c) ((c) & ((1ULL << OPTICAL_COORD_BITS) - 1))
+
+uint64_t optical_coord(const char *header) {
+    // The read name is the first word; its last four ':' fields are lane, tile, x and y
+    const char *start = header[0] == '@' ? header + 1 : header;
+    const char *end = start + strcspn(start, " \t\r\n");
+    unsigned long field[4];
+    const char *p = end;
+    for (int f = 3; f >= 0; f--) {
+        const char *field_end = p;
+        while (p > start && p[-1] != ':') p--;
+        if (p == field_end || (f > 0 && p == start)) return OPTICAL_NONE;
+        // y may carry an old-style "#0/1" or "/1" suffix
+        char *parsed;
+        field[f] = strtoul(p, &parsed, 10);
+        if (parsed == p || (parsed != field_end && (f != 3 || (*parsed != '#' && *parsed != '/')))) {
+            return OPTICAL_NONE;
+        }
+        if (f > 0) p--;
+    }
+    if (field[0] > 0xFF || field[1] > 0xFFFF || field[2] >> OPTICAL_COORD_BITS || field[3] >> OPTICAL_COORD_BITS) {
+        return OPTICAL_NONE;
+    }
+    return (uint64_t)field[0] << 56 | (uint64_t)field[1] << OPTICAL_TILE_SHIFT |
+           (uint64_t)field[2] << OPTICAL_COORD_BITS | (uint64_t)field[3];
+}
+
+void optical_start(optical_t *o, int distance) {
+    memset(o, 0, sizeof(*o));
+    o->distance = distance;
+    pthread_mutex_init(&o->lock, NULL);
+}
+
+void optical_collect(optical_t *o, const batch_t *batch) {
+    pthread_mutex_lock(&o->lock);
+    for (int i = 0; i < batch->umi_count; i++) {
+        if (batch->umi_coords[i] == OPTICAL_NONE) {
+            o->no_coord++;
+            continue;
+        }
+        if (o->len == o->cap) {
+            size_t cap = o->cap ? 2 * o->cap : 1 << 16;
+            optical_entry_t *grown = realloc(o->entries, cap * sizeof(optical_entry_t));
+            if (!grown) {
+                fprintf(stderr, "\nError: out of memory collecting read positions\n");
+                exit(1);
+            }
+            o->entries = grown;
+            o->cap = cap;
+        }
+        o->entries[o->len].coord = batch->umi_coords[i];
+        o->entries[o->len++].umi_key = batch->umi_keys[i];
+    }
+    pthread_mutex_unlock(&o->lock);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const optical_entry_t *x = a, *y = b;
+    if (x->umi_key != y->umi_key) return x->umi_key < y->umi_key ? -1 : 1;
+    return (x->coord > y->coord) - (x->coord < y->coord);
+}
+
+int optical_finalize(optical_t *o, const char *output_dir, const char *output_prefix) {
+    if (!o->distance) return 0;
+
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s.optical_dups.tsv", output_dir, output_prefix);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "chain\tumi\tlane\ttile\tx\ty\n");
+
+    qsort(o->entries, o->len, sizeof(optical_entry_t), compare_entries);
+    const optical_entry_t *e = o->entries;
+    uint64_t d = (uint64_t)o->distance;
+    int64_t counted_family = -1;
+    for (size_t g = 0, end; g < o->len; g = end) {
+        // One sweep per UMI pair and tile, in x order
+        uint64_t tile = e[g].coord >> OPTICAL_TILE_SHIFT;
+        for (end = g; end < o->len && e[end].umi_key == e[g].umi_key &&
+                      e[end].coord >> OPTICAL_TILE_SHIFT == tile; end++) {}
+        int trb = (e[g].umi_key & UMI_KEY_TRB) != 0;
+        o->checked[trb] += end - g;
+
+        size_t lo = g;
+        for (size_t j = g + 1; j < end; j++) {
+            uint64_t x = OPTICAL_X(e[j].coord), y = OPTICAL_Y(e[j].coord);
+            while (x - OPTICAL_X(e[lo].coord) > d) lo++;
+            size_t i = lo;
+            for (; i < j; i++) {
+                uint64_t yi = OPTICAL_Y(e[i].coord);
+                if ((yi > y ? yi - y : y - yi) <= d) break;
+            }
+            if (i == j) continue;
+
+            o->duplicates[trb]++;
+            if (counted_family != (int64_t)e[j].umi_key) {
+                o->families[trb]++;
+                counted_family = e[j].umi_key;
+            }
+            char umi1[UMI1_LEN + 1], umi2[UMI2_LEN + 1];
+            int chain;
+            umi_key_decode(e[j].umi_key, &chain, umi1, umi2);
+            fprintf(fp, "%s\t%s_%s\t%lu\t%lu\t%lu\t%lu\n", trb ? "TRB" : "TRA", umi1, umi2,
+                    (unsigned long)(e[j].coord >> 56), (unsigned long)(tile & 0xFFFF),
+                    (unsigned long)x, (unsigned long)y);
+        }
+    }
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Error writing %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+void optical_report(const optical_t *o) {
+    printf("Optical duplicates (within %d pixels on a tile, same UMI pair):\n", o->distance);
+    const char *chains[2] = {"TRA", "TRB"};
+    for (int c = 0; c < 2; c++) {
+        printf("  %s: %ld of %ld pairs (%.2f%%) in %ld UMI pairs\n", chains[c], o->duplicates[c], o->checked[c],
+               o->checked[c] ? 100.0 * o->duplicates[c] / o->checked[c] : 0, o->families[c]);
+    }
+    if (o->no_coord > 0) {
+        printf("  %ld classified pairs without lane:tile:x:y in the read name were not checked\n", o->no_coord);
+    }
+}
+
+void optical_free(optical_t *o) {
+    free(o->entries);
+    o->entries = NULL;
+    o->len = o->cap = 0;
+}
@@ -0,0 +1,162 @@
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
+
+// Configuration constants
+#define UMI1_LEN 7
+#define UMI2_LEN 7
+#define MAX_LINE_LEN 1024
+#define MAX_SEQ_LEN 512
+#define MAX_PATH_LEN 512
+
+// Exit status when the early-abort rule judges the library failed
+#define EXIT_LIBRARY_FAILED 3
+
+// Batch engine defaults
+#define DEFAULT_BATCH_SIZE 4096
+#define MAX_THREADS 256
+
+// Output streams written by step 1, in file order
+enum {
+    STREAM_TRA_1 = 0,
+    STREAM_TRA_2,
+    STREAM_TRB_1,
+    STREAM_TRB_2,
+    NUM_STREAMS
+};
+
+// Depth tiers each get their own set of streams after the full output:
+// stream s of tier t is (t + 1) * NUM_STREAMS + s. A demultiplexed run
+// has no full output; stream s of sample g is g * NUM_STREAMS + s.
+#define MAX_DEPTH_TIERS 8
+#define MAX_SAMPLES 32
+#define MAX_OUT_STREAMS (NUM_STREAMS * (MAX_SAMPLES > MAX_DEPTH_TIERS + 1 ? MAX_SAMPLES : MAX_DEPTH_TIERS + 1))
+
+// How --limit pairs are chosen from the input
+enum {
+    SAMPLE_FIRST = 0,            // the first N pairs
+    SAMPLE_BERNOULLI,            // each pair with probability --fraction
+    SAMPLE_RESERVOIR,            // exactly N pairs, uniformly from the whole input
+    SAMPLE_STRIDE                // whole BGZF blocks with probability --fraction
+};
+
+// Run configuration shared by the serial and threaded engines
+typedef struct {
+    char output_dir[MAX_PATH_LEN];
+    char output_prefix[256];
+    long read_limit;
+    int threads;
+    int batch_size;
+    int unordered;
+    int numa;
+    int inflate_threads;         // 1, or 2 to inflate R1 and R2 concurrently
+    int autotune;
+    long anchor_window_pairs;    // learn anchor offsets from this many leading pairs; 0 = full scans
+    int sample_mode;             // SAMPLE_*
+    double sample_fraction;
+    unsigned long long sample_seed;
+    int out_streams;             // NUM_STREAMS per depth tier plus the full output, or per sample
+    long target_classified;      // stop once this many TRA + TRB pairs are found; 0 = off
+    long target_umis;            // stop once this many distinct UMI pairs are seen; 0 = off
+    double abort_min_rate;       // abort when the classified percentage is below this; 0 = off
+    long abort_after;            // ... once this many pairs have been processed
+} preprocess_config_t;
+
+// Progress tracking
+typedef struct {
+    long processed_pairs;
+    long tra_pairs;
+    long trb_pairs;
+    long distinct_umis;
+    long finished_pairs;         // pairs whose batches have been classified
+    long read_limit;
+    time_t start_time;
+} progress_t;
+
+// Engine statistics reported in the processing summary
+typedef struct {
+    int numa_nodes;
+    long long node_local_bytes;      // batch bytes touched only on the owning node
+    long long cross_node_bytes;      // batch bytes the reader wrote to a remote node
+    long long unpinned_cross_bytes;  // expected cross-node bytes without placement
+} run_stats_t;
+
+// Paired input with sampling; defined in sample.h
+typedef struct fastq_input fastq_input_t;
+
+// FASTQ record; fields point into the owning batch arena
+typedef struct {
+    char *header;
+    char *sequence;
+    char *plus;
+    char *quality;
+} fastq_record_t;
+
+// Anchor located in a read, at pos in the read or in its reverse complement
+#define ANCHOR_NONE -1
+typedef struct {
+    int pos;                     // ANCHOR_NONE when neither strand holds the anchor
+    int rc;
+} anchor_hit_t;
+
+// Growable text buffer holding the formatted records of one output stream
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    long records;
+} out_buf_t;
+
+// A batch of read pairs and the output it produces
+typedef struct {
+    long seq;                    // batch sequence number, in input order
+    long first_pair;             // run-wide index of the first pair held
+    int count;                   // read pairs held
+    int capacity;
+    fastq_record_t *r1;
+    fastq_record_t *r2;
+    char *arena[2];              // line storage for r1 and r2
+    size_t arena_size[2];
+    size_t arena_used;           // bytes held by both arenas
+    int node;                    // NUMA node owning this batch
+    anchor_hit_t *hits;          // per-pair anchor scratch for process_batch
+    unsigned char *matched;
+    unsigned char *tier;         // per-pair depth increment
+    unsigned char *sample;       // per-pair --barcodes sample, DEMUX_NONE when unassigned
+    uint32_t *umi_keys;          // keys of classified pairs with ACGT UMIs, and their increments
+    uint64_t *umi_coords;        // ... and cluster positions, for --optical-dups
+    unsigned char *umi_tier;
+    unsigned char *umi_sample;
+    int umi_count;
+    out_buf_t out[MAX_OUT_STREAMS];
+    long tra_pairs;
+    long trb_pairs;
+    long new_umis;               // UMI pairs first seen in this batch
+    long hll_keys;               // classified pairs added to the rarefaction sketches
+    long barcodes_corrected;     // pairs assigned through a Hamming-1 or N correction
+    long barcodes_ambiguous;     // pairs whose barcode corrects to two samples
+} batch_t;
+
+// 1_preprocess_and_trim.c
+batch_t *batch_create(int capacity);
+void batch_free(batch_t *batch);
+int batch_fill(batch_t *batch, fastq_input_t *in, long max_pairs);
+int batch_fill_mate(batch_t *batch, int mate, fastq_input_t *in, long max_records);
+int batch_copy_record(batch_t *batch, int mate, int index, char **pos, const fastq_record_t *src);
+void process_batch(batch_t *batch);
+int read_fastq_record(gzFile fp, fastq_record_t *record, char **arena, const char *arena_end);
+void reverse_complement(const char *seq, char *rc_seq);
+void update_progress(progress_t *prog, int force_update);
+int target_reached(const preprocess_config_t *cfg, const progress_t *progress);
+int library_failed(const preprocess_config_t *cfg, const progress_t *progress);
+
+// parallel.c
+int run_parallel(const preprocess_config_t *cfg, fastq_input_t *in,
+                 char out_paths[MAX_OUT_STREAMS][MAX_PATH_LEN], progress_t *progress,
+                 run_stats_t *stats);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef RAREFACTION_H
+#define RAREFACTION_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sketch.h"
+#include "umi_index.h"
+
+#define RAREFACTION_MAX_POINTS 64
+#define RAREFACTION_EXACT_POINTS 20
+
+// How distinct UMIs are counted along the run
+enum {
+    RAREFY_OFF = 0,
+    RAREFY_EXACT,                // expected curve from the full UMI pair index
+    RAREFY_HLL,                  // HyperLogLog snapshots as batches finish
+    RAREFY_AUTO                  // exact unless the index would not fit in memory
+};
+
+// Curve columns: UMI1 and UMI2 alone (per chain) and the UMI pair
+enum {
+    RAREFY_UMI1 = 0,
+    RAREFY_UMI2,
+    RAREFY_PAIR,
+    RAREFY_KINDS
+};
+
+typedef struct {
+    long pairs;                  // read pairs processed
+    long classified;             // TRA + TRB pairs among them with ACGT UMIs
+    double distinct[RAREFY_KINDS];
+} rarefaction_point_t;
+
+typedef struct {
+    int mode;
+
+    // HLL mode: workers add keys; a point is taken each time the pair count
+    // passes a checkpoint, which grows by sqrt(2)
+    hll_t hll[RAREFY_KINDS];
+    pthread_mutex_t lock;
+    long pairs;
+    long classified;
+    long next_checkpoint;
+
+    rarefaction_point_t points[RAREFACTION_MAX_POINTS];
+    int npoints;
+    double chao1[RAREFY_KINDS];  // exact mode only
+} rarefaction_t;
+
+void rarefaction_start(rarefaction_t *r, int mode);
+void rarefaction_add(rarefaction_t *r, uint32_t key);
+void rarefaction_batch(rarefaction_t *r, long pairs, long classified);
+
+// Close the curve: in exact mode it is computed from the sorted full index,
+// in HLL mode the last point is taken at the run totals
+void rarefaction_finish(rarefaction_t *r, const umi_entry_t *entries, size_t n, long pairs);
+
+int rarefaction_write(const rarefaction_t *r, const char *path);
+void rarefaction_report(const rarefaction_t *r);
+
+#endif
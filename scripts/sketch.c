@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stddef.h>
+
+#include "sketch.h"
+
+uint64_t sketch_hash(uint64_t key) {
+    key += 0x9E3779B97F4A7C15ULL;
+    key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+    return key ^ (key >> 31);
+}
+
+void hll_add(hll_t *h, uint64_t hash) {
+    uint32_t index = (uint32_t)(hash >> (64 - HLL_P));
+    uint64_t rest = hash << HLL_P;
+    unsigned char rank = rest ? (unsigned char)(__builtin_clzll(rest) + 1) : (unsigned char)(64 - HLL_P + 1);
+
+    // Registers only grow, so a relaxed compare-and-swap loop is enough
+    unsigned char cur = __atomic_load_n(&h->reg[index], __ATOMIC_RELAXED);
+    while (rank > cur &&
+           !__atomic_compare_exchange_n(&h->reg[index], &cur, rank, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void hll_merge(hll_t *dst, const hll_t *src) {
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        if (src->reg[i] > dst->reg[i]) dst->reg[i] = src->reg[i];
+    }
+}
+
+double hll_estimate(const hll_t *h) {
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        unsigned char r = __atomic_load_n(&h->reg[i], __ATOMIC_RELAXED);
+        sum += ldexp(1.0, -r);
+        if (r == 0) zeros++;
+    }
+    double m = HLL_REGISTERS;
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+    // Linear counting is more accurate while many registers are still empty
+    if (estimate <= 2.5 * m && zeros > 0) {
+        estimate = m * log(m / zeros);
+    }
+    return estimate;
+}
+
+// Row i uses h1 + i * h2, so one 64-bit hash serves every row
+static size_t cms_cell(uint64_t hash, int row) {
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+    return (size_t)((h1 + (uint32_t)row * h2) & (CMS_WIDTH - 1));
+}
+
+uint32_t cms_estimate(const cms_t *c, uint64_t hash) {
+    uint32_t estimate = UINT32_MAX;
+    for (int row = 0; row < CMS_DEPTH; row++) {
+        uint32_t v = c->cell[row][cms_cell(hash, row)];
+        if (v < estimate) estimate = v;
+    }
+    return estimate;
+}
+
+// Conservative update: only counters at the current minimum are raised, which
+// keeps the estimate an upper bound while cutting collision overcounts
+uint32_t cms_add(cms_t *c, uint64_t hash) {
+    uint32_t estimate = cms_estimate(c, hash) + 1;
+    for (int row = 0; row < CMS_DEPTH; row++) {
+        uint32_t *v = &c->cell[row][cms_cell(hash, row)];
+        if (*v < estimate) *v = estimate;
+    }
+    c->total++;
+    return estimate;
+}
+
+void cms_merge(cms_t *dst, const cms_t *src) {
+    for (int row = 0; row < CMS_DEPTH; row++) {
+        for (int i = 0; i < CMS_WIDTH; i++) dst->cell[row][i] += src->cell[row][i];
+    }
+    dst->total += src->total;
+}
+
+double cms_error_bound(const cms_t *c) {
+    return M_E / CMS_WIDTH * (double)c->total;
+}
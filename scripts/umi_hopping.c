@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include "preprocess.h"
+#include "umi_index.h"
+
+#define MAX_NAME_LEN 256
+#define DEFAULT_RATIO 10.0
+#define DEFAULT_MIN_READS 3
+
+// Index hopping across samples sequenced together. The step 1 UMI pair
+// indexes (PREFIX.umi.idx, sorted by key) are merged through a heap of
+// per-sample cursors, so each key's holders arrive together and only the
+// current entry of every sample is in memory. A UMI pair found in several
+// samples is attributed to the one holding most of its reads when that
+// sample has at least ratio times the reads of each other holder.
+
+typedef struct {
+    char name[MAX_NAME_LEN];
+    char path[MAX_PATH_LEN];
+    umi_index_cursor_t cursor;
+    umi_entry_t head;            // next entry, while the sample is in the heap
+    uint64_t umi_pairs[2];       // per chain
+    uint64_t reads;
+    uint64_t shared;             // UMI pairs also found in another sample
+    uint64_t hopped;             // ... attributed to another sample
+    uint64_t hopped_reads;
+    uint64_t donated_reads;      // reads of this sample's UMI pairs found elsewhere
+    uint64_t unresolved;         // shared without a dominant sample
+} sample_t;
+
+typedef struct {
+    sample_t *samples;
+    int *heap;                   // sample indices, smallest (key, index) first
+    int len;
+} merge_t;
+
+void show_usage(const char *program_name);
+
+static void parse_sample(sample_t *s, const char *spec) {
+    const char *sep = strpbrk(spec, "=\t");
+    const char *path = sep ? sep + 1 : spec;
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    if (sep) {
+        snprintf(s->name, sizeof(s->name), "%.*s", (int)(sep - spec), spec);
+    } else {
+        const char *base = strrchr(path, '/');
+        snprintf(s->name, sizeof(s->name), "%s", base ? base + 1 : path);
+        char *ext = strstr(s->name, ".umi.idx");
+        if (ext && ext[8] == '\0') *ext = '\0';
+    }
+}
+
+static int add_sample(sample_t **samples, int *n, int *cap, const char *spec) {
+    if (*n == *cap) {
+        *cap = *cap ? 2 * *cap : 64;
+        sample_t *grown = realloc(*samples, (size_t)*cap * sizeof(sample_t));
+        if (!grown) return -1;
+        *samples = grown;
+    }
+    memset(&(*samples)[*n], 0, sizeof(sample_t));
+    parse_sample(&(*samples)[(*n)++], spec);
+    return 0;
+}
+
+static int read_sample_list(const char *list, sample_t **samples, int *n, int *cap) {
+    FILE *fp = fopen(list, "r");
+    if (!fp) {
+        fprintf(stderr, "Error opening sample list %s: %s\n", list, strerror(errno));
+        return -1;
+    }
+    char line[MAX_PATH_LEN + MAX_NAME_LEN];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (add_sample(samples, n, cap, line) != 0) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int heap_less(const merge_t *m, int a, int b) {
+    uint32_t ka = m->samples[a].head.key, kb = m->samples[b].head.key;
+    return ka != kb ? ka < kb : a < b;
+}
+
+static void sift_down(merge_t *m, int i) {
+    for (;;) {
+        int least = i, l = 2 * i + 1, r = l + 1;
+        if (l < m->len && heap_less(m, m->heap[l], m->heap[least])) least = l;
+        if (r < m->len && heap_less(m, m->heap[r], m->heap[least])) least = r;
+        if (least == i) return;
+        int t = m->heap[i];
+        m->heap[i] = m->heap[least];
+        m->heap[least] = t;
+        i = least;
+    }
+}
+
+// Load the sample's next entry and count it; 0 at the end of its index.
+// Keys must strictly increase: a repeated key would put the sample into one
+// group twice, overrunning the per-group arrays sized to the sample count
+static int advance(sample_t *s) {
+    uint32_t prev = s->head.key;
+    int first = s->umi_pairs[0] + s->umi_pairs[1] == 0;
+    int r = umi_index_next(&s->cursor, &s->head);
+    if (r < 0) {
+        fprintf(stderr, "Error: %s is truncated\n", s->path);
+        exit(1);
+    }
+    if (r > 0 && !first && s->head.key <= prev) {
+        fprintf(stderr, "Error: %s is not sorted by UMI pair (key %u after %u)\n", s->path, s->head.key, prev);
+        exit(1);
+    }
+    if (r > 0) {
+        s->umi_pairs[(s->head.key & UMI_KEY_TRB) != 0]++;
+        s->reads += s->head.count;
+    }
+    return r;
+}
+
+int main(int argc, char *argv[]) {
+    char output_prefix[MAX_PATH_LEN] = "hopping";
+    double ratio = DEFAULT_RATIO;
+    long min_reads = DEFAULT_MIN_READS;
+    sample_t *samples = NULL;
+    int nsamples = 0, cap = 0;
+
+    int opt;
+    static struct option long_options[] = {
+        {"output_prefix", required_argument, 0, 'o'},
+        {"list", required_argument, 0, 'l'},
+        {"ratio", required_argument, 0, 'r'},
+        {"min-reads", required_argument, 0, 'm'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "o:l:r:m:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                snprintf(output_prefix, sizeof(output_prefix), "%s", optarg);
+                break;
+            case 'l':
+                if (read_sample_list(optarg, &samples, &nsamples, &cap) != 0) return 1;
+                break;
+            case 'r':
+                ratio = atof(optarg);
+                break;
+            case 'm':
+                min_reads = atol(optarg);
+                break;
+            case 'h':
+                show_usage(argv[0]);
+                return 0;
+            default:
+                show_usage(argv[0]);
+                return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (add_sample(&samples, &nsamples, &cap, argv[i]) != 0) {
+            fprintf(stderr, "Error: out of memory\n");
+            return 1;
+        }
+    }
+    if (nsamples < 2) {
+        fprintf(stderr, "Error: at least two UMI indexes are needed\n");
+        show_usage(argv[0]);
+        return 1;
+    }
+    if (ratio <= 1 || min_reads < 1) {
+        fprintf(stderr, "Error: --ratio must be above 1 and --min-reads at least 1\n");
+        return 1;
+    }
+
+    merge_t m = {samples, malloc((size_t)nsamples * sizeof(int)), 0};
+    int *group = malloc((size_t)nsamples * sizeof(int));
+    uint32_t *group_reads = malloc((size_t)nsamples * sizeof(uint32_t));
+    if (!m.heap || !group || !group_reads) {
+        fprintf(stderr, "Error: out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < nsamples; i++) {
+        if (umi_index_open(&samples[i].cursor, samples[i].path) != 0) return 1;
+        if (advance(&samples[i])) m.heap[m.len++] = i;
+    }
+    for (int i = m.len / 2 - 1; i >= 0; i--) sift_down(&m, i);
+
+    char path[MAX_PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s.hopping.tsv", output_prefix);
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fprintf(out, "chain\tumi\tsample\treads\tsource\tsource_reads\n");
+
+    uint64_t shared_keys = 0, hopped_keys = 0, unresolved_keys = 0, hopped_reads = 0;
+    while (m.len > 0) {
+        // Take every sample holding the smallest key, advancing each in place
+        uint32_t key = samples[m.heap[0]].head.key;
+        int n = 0;
+        while (m.len > 0 && samples[m.heap[0]].head.key == key) {
+            int s = m.heap[0];
+            group[n] = s;
+            group_reads[n++] = samples[s].head.count;
+            if (!advance(&samples[s])) m.heap[0] = m.heap[--m.len];
+            sift_down(&m, 0);
+        }
+        if (n < 2) continue;
+
+        shared_keys++;
+        int dom = 0;
+        for (int g = 1; g < n; g++) {
+            if (group_reads[g] > group_reads[dom]) dom = g;
+        }
+        int hopped = 0, unresolved = 0;
+        for (int g = 0; g < n; g++) {
+            sample_t *s = &samples[group[g]];
+            s->shared++;
+            if (g == dom) continue;
+            if (group_reads[dom] < min_reads || group_reads[dom] < ratio * group_reads[g]) {
+                s->unresolved++;
+                unresolved = 1;
+                continue;
+            }
+            s->hopped++;
+            s->hopped_reads += group_reads[g];
+            samples[group[dom]].donated_reads += group_reads[g];
+            hopped_reads += group_reads[g];
+            hopped = 1;
+
+            char umi1[UMI1_LEN + 1], umi2[UMI2_LEN + 1];
+            int trb;
+            umi_key_decode(key, &trb, umi1, umi2);
+            fprintf(out, "%s\t%s_%s\t%s\t%u\t%s\t%u\n", trb ? "TRB" : "TRA", umi1, umi2, s->name,
+                    group_reads[g], samples[group[dom]].name, group_reads[dom]);
+        }
+        hopped_keys += hopped;
+        unresolved_keys += unresolved;
+    }
+    int status = fclose(out) == 0 ? 0 : 1;
+
+    snprintf(path, sizeof(path), "%s.hopping_samples.tsv", output_prefix);
+    out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fprintf(out, "sample\tumi_pairs\treads\tshared_umi_pairs\thopped_umi_pairs\thopped_reads\t"
+                 "donated_reads\tunresolved_umi_pairs\n");
+    // UMI pairs two samples would share by chance, per chain: n_a * n_b / 4^14 over sample pairs
+    double sum[2] = {0, 0}, sum_squares[2] = {0, 0};
+    for (int i = 0; i < nsamples; i++) {
+        sample_t *s = &samples[i];
+        fprintf(out, "%s\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n", s->name,
+                (unsigned long)(s->umi_pairs[0] + s->umi_pairs[1]), (unsigned long)s->reads,
+                (unsigned long)s->shared, (unsigned long)s->hopped, (unsigned long)s->hopped_reads,
+                (unsigned long)s->donated_reads, (unsigned long)s->unresolved);
+        for (int c = 0; c < 2; c++) {
+            sum[c] += (double)s->umi_pairs[c];
+            sum_squares[c] += (double)s->umi_pairs[c] * (double)s->umi_pairs[c];
+        }
+        umi_index_close(&s->cursor);
+    }
+    if (fclose(out) != 0) status = 1;
+    double space = (double)(1u << 28);
+    double expected = ((sum[0] * sum[0] - sum_squares[0]) + (sum[1] * sum[1] - sum_squares[1])) / 2 / space;
+
+    printf("UMI pairs in more than one of %d samples: %lu (about %.0f expected by chance)\n", nsamples,
+           (unsigned long)shared_keys, expected);
+    printf("  attributed to a dominant sample (>= %.1fx the reads, >= %ld reads): %lu UMI pairs, %lu reads\n",
+           ratio, min_reads, (unsigned long)hopped_keys, (unsigned long)hopped_reads);
+    printf("  without a dominant sample: %lu UMI pairs\n", (unsigned long)unresolved_keys);
+    for (int i = 0; i < nsamples; i++) {
+        const sample_t *s = &samples[i];
+        if (s->hopped == 0) continue;
+        printf("  %s: %lu of %lu reads (%.3f%%) hopped in from other samples\n", s->name,
+               (unsigned long)s->hopped_reads, (unsigned long)s->reads,
+               s->reads ? 100.0 * s->hopped_reads / s->reads : 0);
+    }
+    printf("Written %s.hopping.tsv and %s.hopping_samples.tsv\n", output_prefix, output_prefix);
+
+    free(m.heap);
+    free(group);
+    free(group_reads);
+    free(samples);
+    return status;
+}
+
+void show_usage(const char *program_name) {
+    printf("Usage: %s [OPTIONS] [NAME=]PREFIX.umi.idx ...\n", program_name);
+    printf("Index hopping between samples sequenced together, from their step 1 UMI pair indexes\n");
+    printf("(1_preprocess_and_trim --umi-index)\n\n");
+    printf("Options:\n");
+    printf("  -o, --output_prefix PREFIX  Writes PREFIX.hopping.tsv (one line per hopped UMI pair and\n");
+    printf("                           sample) and PREFIX.hopping_samples.tsv (default: hopping)\n");
+    printf("  -l, --list FILE          More indexes, one [NAME=]INDEX or NAME<tab>INDEX per line\n");
+    printf("  -r, --ratio R            A shared UMI pair hopped from the sample with the most reads when\n");
+    printf("                           it has at least R times the reads of the other (default: %.0f)\n",
+           DEFAULT_RATIO);
+    printf("  -m, --min-reads N        ... and at least N reads (default: %d)\n", DEFAULT_MIN_READS);
+    printf("  -h, --help               Show this help message\n");
+    printf("\nSamples are named after the index path unless NAME= is given.\n");
+}
@@ -0,0 +1,68 @@
+#ifndef UMI_INDEX_H
+#define UMI_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A UMI pair (UMI1 + UMI2, 14 bases) packed 2 bits per base, first base
+// highest, with the chain in bit 28; numeric order is (chain, UMI) order
+#define UMI_KEY_BITS 29
+#define UMI_KEY_TRB (1u << 28)
+#define UMI_INDEX_MAGIC "PTUMIDX1"
+
+// Key for a UMI pair, or -1 when it holds a base other than ACGT
+int64_t umi_key(int trb, const char *umi1, const char *umi2);
+void umi_key_decode(uint32_t key, int *trb, char *umi1, char *umi2);
+
+// Growable list of keys, one per classified pair
+typedef struct {
+    uint32_t *keys;
+    size_t len;
+    size_t cap;
+} umi_keys_t;
+
+// One distinct key of an index and the pairs carrying it
+typedef struct {
+    uint32_t key;
+    uint32_t count;
+} umi_entry_t;
+
+// Keys seen so far, one bit per possible key (64 MB, zero pages until
+// touched); threads add keys concurrently with atomic bit sets
+typedef struct {
+    uint64_t *bits;
+} umi_seen_t;
+
+int umi_seen_init(umi_seen_t *seen);
+int umi_seen_add(umi_seen_t *seen, uint32_t key);    // 1 when the key is new
+void umi_seen_free(umi_seen_t *seen);
+
+int umi_keys_append(umi_keys_t *v, const uint32_t *keys, size_t n);
+void umi_keys_free(umi_keys_t *v);
+
+// Sort the keys and collapse them into entries; the keys are consumed
+size_t umi_keys_collapse(umi_keys_t *v, umi_entry_t **entries);
+
+// Merge two sorted entry lists, adding counts of shared keys
+size_t umi_entries_merge(const umi_entry_t *a, size_t na, const umi_entry_t *b, size_t nb,
+                         umi_entry_t **merged);
+
+// File layout: magic, uint64 entry count, uint64 pair count, then
+// little-endian (uint32 key, uint32 count) entries in key order
+int umi_index_write(const char *path, const umi_entry_t *entries, size_t n);
+int umi_index_read(const char *path, umi_entry_t **entries, size_t *n);
+
+// Sequential reader over one index, for merging many indexes without
+// holding any of them in memory
+typedef struct {
+    FILE *fp;
+    uint64_t remaining;          // entries not yet returned
+    uint64_t pairs;              // pair count from the header
+} umi_index_cursor_t;
+
+int umi_index_open(umi_index_cursor_t *c, const char *path);
+int umi_index_next(umi_index_cursor_t *c, umi_entry_t *entry);   // 1, 0 at the end, -1 when truncated
+void umi_index_close(umi_index_cursor_t *c);
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "umi_sketch.h"
+#include "umi_index.h"
+#include "preprocess.h"
+
+#define UMI_SKETCH_CHUNK 256
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static umi_sketch_t *registry;
+static __thread umi_sketch_t *local_sketch;
+
+umi_sketch_t *umi_sketch_thread(void) {
+    if (!local_sketch) {
+        local_sketch = calloc(1, sizeof(umi_sketch_t));
+        if (!local_sketch) {
+            fprintf(stderr, "\nError: out of memory allocating UMI sketches\n");
+            exit(1);
+        }
+        pthread_mutex_lock(&registry_lock);
+        local_sketch->next = registry;
+        registry = local_sketch;
+        pthread_mutex_unlock(&registry_lock);
+    }
+    return local_sketch;
+}
+
+// Track a key whose count-min estimate beats the weakest candidate
+static void heavy_offer(umi_sketch_t *s, uint32_t key, uint32_t estimate) {
+    for (int i = 0; i < s->heavy_count; i++) {
+        if (s->heavy[i].key == key) {
+            s->heavy[i].estimate = estimate;
+            goto refloor;
+        }
+    }
+    if (s->heavy_count < UMI_HEAVY_CANDIDATES) {
+        s->heavy[s->heavy_count].key = key;
+        s->heavy[s->heavy_count++].estimate = estimate;
+    } else {
+        int weakest = 0;
+        for (int i = 1; i < s->heavy_count; i++) {
+            if (s->heavy[i].estimate < s->heavy[weakest].estimate) weakest = i;
+        }
+        s->heavy[weakest].key = key;
+        s->heavy[weakest].estimate = estimate;
+    }
+
+refloor:
+    if (s->heavy_count == UMI_HEAVY_CANDIDATES) {
+        uint32_t floor = UINT32_MAX;
+        for (int i = 0; i < s->heavy_count; i++) {
+            if (s->heavy[i].estimate < floor) floor = s->heavy[i].estimate;
+        }
+        s->heavy_floor = floor;
+    }
+}
+
+void umi_sketch_add(umi_sketch_t *s, const uint32_t *keys, int n) {
+    uint64_t hashes[UMI_SKETCH_CHUNK];
+    for (int start = 0; start < n; start += UMI_SKETCH_CHUNK) {
+        int len = n - start < UMI_SKETCH_CHUNK ? n - start : UMI_SKETCH_CHUNK;
+
+        // Hash a chunk in one branch-free loop the compiler can vectorise,
+        // then scatter into the registers and counters
+        for (int i = 0; i < len; i++) hashes[i] = sketch_hash(keys[start + i]);
+        for (int i = 0; i < len; i++) {
+            uint32_t key = keys[start + i];
+            hll_add(&s->hll[(key & UMI_KEY_TRB) != 0], hashes[i]);
+            uint32_t estimate = cms_add(&s->cms, hashes[i]);
+            if (s->heavy_count < UMI_HEAVY_CANDIDATES || estimate > s->heavy_floor) {
+                heavy_offer(s, key, estimate);
+            }
+        }
+    }
+}
+
+static int compare_heavy(const void *a, const void *b) {
+    const umi_heavy_t *x = a, *y = b;
+    if (x->estimate != y->estimate) return x->estimate < y->estimate ? 1 : -1;
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+umi_sketch_t *umi_sketch_merge_all(void) {
+    umi_sketch_t *merged = calloc(1, sizeof(umi_sketch_t));
+    if (!merged) return NULL;
+
+    size_t cap = UMI_HEAVY_CANDIDATES, count = 0;
+    umi_heavy_t *candidates = malloc(cap * sizeof(umi_heavy_t));
+    for (umi_sketch_t *s = registry; s && candidates; s = s->next) {
+        hll_merge(&merged->hll[0], &s->hll[0]);
+        hll_merge(&merged->hll[1], &s->hll[1]);
+        cms_merge(&merged->cms, &s->cms);
+        if (count + (size_t)s->heavy_count > cap) {
+            cap = 2 * (count + (size_t)s->heavy_count);
+            umi_heavy_t *grown = realloc(candidates, cap * sizeof(umi_heavy_t));
+            if (!grown) {
+                free(candidates);
+                candidates = NULL;
+                break;
+            }
+            candidates = grown;
+        }
+        memcpy(candidates + count, s->heavy, (size_t)s->heavy_count * sizeof(umi_heavy_t));
+        count += (size_t)s->heavy_count;
+    }
+    if (!candidates) {
+        free(merged);
+        return NULL;
+    }
+
+    // A key may be a candidate in several threads; re-estimate it once from
+    // the merged counters and keep the heaviest
+    for (size_t i = 0; i < count; i++) {
+        candidates[i].estimate = cms_estimate(&merged->cms, sketch_hash(candidates[i].key));
+    }
+    qsort(candidates, count, sizeof(umi_heavy_t), compare_heavy);
+    for (size_t i = 0; i < count && merged->heavy_count < UMI_HEAVY_CANDIDATES; i++) {
+        if (i > 0 && candidates[i].key == candidates[i - 1].key) continue;
+        merged->heavy[merged->heavy_count++] = candidates[i];
+    }
+    free(candidates);
+    return merged;
+}
+
+void umi_sketch_free_all(void) {
+    pthread_mutex_lock(&registry_lock);
+    while (registry) {
+        umi_sketch_t *next = registry->next;
+        free(registry);
+        registry = next;
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void umi_sketch_report(const umi_sketch_t *s) {
+    printf("UMI sketch: ~%.0f distinct TRA UMI pairs, ~%.0f distinct TRB UMI pairs in %llu classified pairs\n",
+           hll_estimate(&s->hll[0]), hll_estimate(&s->hll[1]), (unsigned long long)s->cms.total);
+    int shown = s->heavy_count < 5 ? s->heavy_count : 5;
+    if (shown == 0) return;
+    printf("  Most amplified UMI pairs (count-min, overcount <= %.0f at 98%%):", cms_error_bound(&s->cms));
+    for (int i = 0; i < shown; i++) {
+        int trb;
+        char umi1[UMI1_LEN + 1], umi2[UMI2_LEN + 1];
+        umi_key_decode(s->heavy[i].key, &trb, umi1, umi2);
+        printf(" %s:%s_%s=%u", trb ? "TRB" : "TRA", umi1, umi2, s->heavy[i].estimate);
+    }
+    printf("\n");
+}
+
+int umi_sketch_write(const umi_sketch_t *s, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Error writing UMI sketch report %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    double bound = cms_error_bound(&s->cms);
+    fprintf(fp, "# distinct_umi_pairs_TRA\t%.0f\n", hll_estimate(&s->hll[0]));
+    fprintf(fp, "# distinct_umi_pairs_TRB\t%.0f\n", hll_estimate(&s->hll[1]));
+    fprintf(fp, "# classified_pairs\t%llu\n", (unsigned long long)s->cms.total);
+    fprintf(fp, "chain\tumi1\tumi2\testimated_pairs\tlower_bound\tfraction\n");
+    int shown = s->heavy_count < UMI_HEAVY_REPORT ? s->heavy_count : UMI_HEAVY_REPORT;
+    for (int i = 0; i < shown; i++) {
+        int trb;
+        char umi1[UMI1_LEN + 1], umi2[UMI2_LEN + 1];
+        umi_key_decode(s->heavy[i].key, &trb, umi1, umi2);
+        double lower = s->heavy[i].estimate - bound;
+        fprintf(fp, "%s\t%s\t%s\t%u\t%.0f\t%.6f\n", trb ? "TRB" : "TRA", umi1, umi2, s->heavy[i].estimate,
+                lower > 0 ? lower : 0, s->cms.total ? (double)s->heavy[i].estimate / s->cms.total : 0);
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
@@ -6,8 +6,10 @@ A high-performance toolkit for processing paired TCR sequencing data
 
 from setuptools import setup, find_packages
 from setuptools.command.build_py import build_py
+from setuptools.command.develop import develop
 import os
 import shutil
+import subprocess
 
 # Read the contents of README file
 def read_file(fname):
@@ -31,9 +33,16 @@ def get_version():
         pass
     return "0.1.0"
 
+def build_c_tools():
+    """Build the C preprocessor and tools; the binaries are not tracked"""
+    package_scripts = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'pairtcr', 'scripts')
+    subprocess.check_call(['make', '-C', package_scripts])
+
 class CustomBuildPy(build_py):
     """Custom build command to copy scripts into package directory"""
     def run(self):
+        build_c_tools()
+        
         # Copy scripts directory into pairtcr package if it doesn't exist
         source_scripts = os.path.join(self.build_lib, '..', '..', 'scripts')
         target_scripts = os.path.join(self.build_lib, 'pairtcr', 'scripts')
@@ -49,6 +58,12 @@ class CustomBuildPy(build_py):
         # Run the standard build
         build_py.run(self)
 
+class CustomDevelop(develop):
+    """Editable installs use pairtcr/scripts in place, so build the C tools there"""
+    def run(self):
+        build_c_tools()
+        develop.run(self)
+
 # Requirements
 install_requires = [
     "pandas>=1.0.0",
@@ -77,6 +92,11 @@ entry_points = {
         'pairtcr-preprocess=pairtcr.cli:run_preprocess',
         'pairtcr-umi-pairs=pairtcr.cli:run_umi_pairs',
         'pairtcr-pair-filter=pairtcr.cli:run_pair_filter',
+        'pairtcr-cohort-overlap=pairtcr.cli:run_cohort_overlap',
+        'pairtcr-clonedb=pairtcr.cli:run_clonedb',
+        'pairtcr-quicklook=pairtcr.cli:run_quicklook',
+        'pairtcr-vjassign=pairtcr.cli:run_vjassign',
+        'pairtcr-umi-hopping=pairtcr.cli:run_umi_hopping',
         'pairtcr=pairtcr.cli:main',
     ],
 }
@@ -121,14 +141,24 @@ setup(
             'scripts/*.py',
             'scripts/*.sh',
             'scripts/*.c',
+            'scripts/*.h',
             'scripts/Makefile',
             'scripts/mixcr',
             'scripts/mixcr.jar',
             'scripts/1_preprocess_and_trim',
+            'scripts/cohort_overlap',
+            'scripts/clonedb',
+            'scripts/chain_filter',
+            'scripts/quicklook',
+            'scripts/vjassign',
+            'scripts/dedup_pairs',
+            'scripts/umi_hopping',
+            'scripts/merge_pairs',
         ],
     },
     cmdclass={
         'build_py': CustomBuildPy,
+        'develop': CustomDevelop,
     },
     zip_safe=False,
     keywords=['tcr', 'sequencing', 'bioinformatics', 'immunology', 'paired-end'],